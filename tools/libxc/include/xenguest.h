@@ -29,6 +29,9 @@
 #define XCFLAGS_HVM       (1 << 2)
 #define XCFLAGS_STDVGA    (1 << 3)
 #define XCFLAGS_CHECKPOINT_COMPRESS    (1 << 4)
+#define XCFLAGS_STREAM_COMPRESS        (1 << 5)
+#define XCFLAGS_POSTCOPY               (1 << 6)
+#define XCFLAGS_STREAM_ZERO_PAGES      (1 << 7)
 
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
@@ -98,6 +101,9 @@ typedef enum {
  * @parm dom the id of the domain
  * @param stream_type XC_MIG_STREAM_NONE if the far end of the stream
  *        doesn't use checkpointing
+ * @param recv_fd the file descriptor to read from the far end of the stream,
+ *        for COLO, and with XCFLAGS_POSTCOPY to receive the pfns the guest
+ *        faults on.  May be -1 for post-copy.
  * @return 0 on success, -1 on failure
  */
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iters,
@@ -114,6 +120,10 @@ struct restore_callbacks {
     /* Called after the secondary vm is ready to resume.
      * Callback function resumes the guest & the device model,
      * returns to xc_domain_restore.
+     *
+     * Also called on a post-copy migration stream, once everything but the
+     * remaining memory has been restored.  Without it, the remaining memory
+     * is received before xc_domain_restore returns.
      */
     int (*postcopy)(void* data);
 
@@ -38,6 +38,11 @@ static const char *mandatory_rec_types[] =
     [REC_TYPE_VERIFY]                       = "Verify",
     [REC_TYPE_CHECKPOINT]                   = "Checkpoint",
     [REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST]    = "Checkpoint dirty pfn list",
+    [REC_TYPE_PAGE_DATA_COMPRESSED]         = "Page data compressed",
+    [REC_TYPE_PAGE_DATA_ZERO]               = "Page data zero",
+    [REC_TYPE_POSTCOPY_PFNS]                = "Postcopy pfns",
+    [REC_TYPE_POSTCOPY_TRANSITION]          = "Postcopy transition",
+    [REC_TYPE_POSTCOPY_FAULT]               = "Postcopy fault",
 };
 
 const char *rec_type_to_str(uint32_t type)
@@ -140,6 +145,145 @@ int read_record(struct xc_sr_context *ctx, int fd, struct xc_sr_record *rec)
     return 0;
 };
 
+static void *worker_thread(void *arg)
+{
+    struct xc_sr_workers *w = arg;
+    struct xc_sr_job *job;
+
+    pthread_mutex_lock(&w->lock);
+    for ( ;; )
+    {
+        while ( !w->head && !w->stop )
+            pthread_cond_wait(&w->queued, &w->lock);
+
+        if ( !w->head )
+            break;
+
+        job = w->head;
+        w->head = job->next;
+        if ( !w->head )
+            w->tail = &w->head;
+
+        pthread_mutex_unlock(&w->lock);
+        job->fn(job);
+        pthread_mutex_lock(&w->lock);
+
+        job->done = true;
+        pthread_cond_broadcast(&w->done);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+int start_workers(struct xc_sr_context *ctx, unsigned nr)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_workers *w = &ctx->workers;
+    long cpus;
+    int rc;
+
+    if ( nr == 0 )
+    {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nr = cpus > 1 ? min_t(long, cpus, MAX_WORKERS) : 0;
+    }
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->queued, NULL);
+    pthread_cond_init(&w->done, NULL);
+    w->head = NULL;
+    w->tail = &w->head;
+    w->nr_threads = 0;
+    w->stop = false;
+
+    if ( nr == 0 )
+        return 0;
+
+    w->threads = malloc(nr * sizeof(*w->threads));
+    if ( !w->threads )
+    {
+        ERROR("Unable to allocate memory for %u worker threads", nr);
+        return -1;
+    }
+
+    for ( ; w->nr_threads < nr; w->nr_threads++ )
+    {
+        rc = pthread_create(&w->threads[w->nr_threads], NULL,
+                            worker_thread, w);
+        if ( rc )
+        {
+            /* Fine, as long as there is one. */
+            if ( w->nr_threads )
+                break;
+            errno = rc;
+            PERROR("Unable to create worker thread");
+            free(w->threads);
+            w->threads = NULL;
+            return -1;
+        }
+    }
+
+    DPRINTF("Using %u worker threads", w->nr_threads);
+
+    return 0;
+}
+
+void stop_workers(struct xc_sr_context *ctx)
+{
+    struct xc_sr_workers *w = &ctx->workers;
+    unsigned i;
+
+    if ( !w->nr_threads )
+        return;
+
+    pthread_mutex_lock(&w->lock);
+    w->stop = true;
+    pthread_cond_broadcast(&w->queued);
+    pthread_mutex_unlock(&w->lock);
+
+    for ( i = 0; i < w->nr_threads; i++ )
+        pthread_join(w->threads[i], NULL);
+
+    free(w->threads);
+    w->threads = NULL;
+    w->nr_threads = 0;
+}
+
+void queue_job(struct xc_sr_context *ctx, struct xc_sr_job *job)
+{
+    struct xc_sr_workers *w = &ctx->workers;
+
+    job->next = NULL;
+    job->done = false;
+
+    if ( !w->nr_threads )
+    {
+        job->fn(job);
+        job->done = true;
+        return;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    *w->tail = job;
+    w->tail = &job->next;
+    pthread_cond_signal(&w->queued);
+    pthread_mutex_unlock(&w->lock);
+}
+
+void wait_job(struct xc_sr_context *ctx, struct xc_sr_job *job)
+{
+    struct xc_sr_workers *w = &ctx->workers;
+
+    if ( !w->nr_threads )
+        return;
+
+    pthread_mutex_lock(&w->lock);
+    while ( !job->done )
+        pthread_cond_wait(&w->done, &w->lock);
+    pthread_mutex_unlock(&w->lock);
+}
+
 static void __attribute__((unused)) build_assertions(void)
 {
     BUILD_BUG_ON(sizeof(struct xc_sr_ihdr) != 24);
@@ -147,6 +291,10 @@ static void __attribute__((unused)) build_assertions(void)
     BUILD_BUG_ON(sizeof(struct xc_sr_rhdr) != 8);
 
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_page_data_header)  != 8);
+    BUILD_BUG_ON(sizeof(struct xc_sr_rec_page_data_compressed_header) != 8);
+    BUILD_BUG_ON(sizeof(struct xc_sr_rec_page_data_zero_header) != 8);
+    BUILD_BUG_ON(sizeof(struct xc_sr_rec_postcopy_pfns_header)  != 8);
+    BUILD_BUG_ON(sizeof(struct xc_sr_rec_postcopy_fault)        != 8);
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_x86_pv_info)       != 8);
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_x86_pv_p2m_frames) != 8);
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_x86_pv_vcpu_hdr)   != 8);
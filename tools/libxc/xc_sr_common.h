@@ -2,6 +2,7 @@
 #define __COMMON__H
 
 #include <stdbool.h>
+#include <pthread.h>
 
 #include "xg_private.h"
 #include "xg_save_restore.h"
@@ -18,6 +19,8 @@ const char *rec_type_to_str(uint32_t type);
 
 struct xc_sr_context;
 struct xc_sr_record;
+struct xc_sr_save_batch;
+struct xc_sr_postcopy;
 
 /**
  * Save operations.  To be implemented for each type of guest, for use by the
@@ -91,6 +94,13 @@ struct xc_sr_save_ops
      */
     int (*check_vm_state)(struct xc_sr_context *ctx);
 
+    /**
+     * Clear from a bitmap of pfns those which must be in place before the
+     * guest can run, and so can't be sent post-copy.  NULL if the guest type
+     * doesn't support post-copy migration.
+     */
+    int (*postcopy_filter)(struct xc_sr_context *ctx, unsigned long *bitmap);
+
     /**
      * Clean up the local environment.  Will be called exactly once, either
      * after a successful save, or upon encountering an error.
@@ -165,6 +175,34 @@ struct xc_sr_restore_ops
     int (*cleanup)(struct xc_sr_context *ctx);
 };
 
+/**
+ * A unit of work for the worker threads, embedded in a larger structure
+ * describing the actual work.  Jobs are started in the order they are queued.
+ */
+struct xc_sr_job
+{
+    void (*fn)(struct xc_sr_job *job);
+    struct xc_sr_job *next;
+    bool done;
+};
+
+/*
+ * Threads running jobs.  With no threads, jobs are run synchronously when
+ * queued.
+ */
+struct xc_sr_workers
+{
+    pthread_mutex_t lock;
+    pthread_cond_t queued, done;
+    struct xc_sr_job *head, **tail;
+    pthread_t *threads;
+    unsigned nr_threads;
+    bool stop;
+};
+
+/* Upper bound for the number of worker threads used by default. */
+#define MAX_WORKERS 8
+
 /* x86 PV per-vcpu storage structure for blobs heading Xen-wards. */
 struct xc_sr_x86_pv_restore_vcpu
 {
@@ -180,6 +218,9 @@ struct xc_sr_context
 
     xc_dominfo_t dominfo;
 
+    /* Threads processing page data. */
+    struct xc_sr_workers workers;
+
     union /* Common save or restore data. */
     {
         struct /* Save data. */
@@ -198,6 +239,12 @@ struct xc_sr_context
             /* Further debugging information in the stream. */
             bool debug;
 
+            /* Send page data as PAGE_DATA_COMPRESSED records. */
+            bool compress;
+
+            /* List pages of zeroes in PAGE_DATA_ZERO records. */
+            bool zero_pages;
+
             /* Parameters for tweaking live migration. */
             unsigned max_iterations;
             unsigned dirty_threshold;
@@ -206,9 +253,36 @@ struct xc_sr_context
 
             xen_pfn_t *batch_pfns;
             unsigned nr_batch_pfns;
+
+            /*
+             * Batches being mapped (and compressed) by the workers, to be
+             * written to the stream in order.  Oldest at batch_head.
+             */
+            struct xc_sr_save_batch *batches;
+            unsigned nr_batches, batch_head, nr_busy_batches;
+
             unsigned long *deferred_pages;
             unsigned long nr_deferred_pages;
             xc_hypercall_buffer_t dirty_bitmap_hbuf;
+
+            /*
+             * Hash of the contents of each NOTAB pfn as last sent, or 0.
+             * Pages dirtied again but hashing the same are not resent.
+             * Only allocated for streams with several passes over memory.
+             */
+            uint64_t *page_hashes;
+
+            /* Pages elided from the stream, for statistics. */
+            unsigned long nr_zero_pages, nr_unchanged_pages;
+
+            /*
+             * Post-copy migration: the memory still dirty when the guest is
+             * suspended is sent after the rest of its state, pages faulted
+             * on by the resumed guest first.
+             */
+            bool postcopy;
+            unsigned long *postcopy_pfns;
+            unsigned long nr_postcopy_pfns;
         } save;
 
         struct /* Restore data. */
@@ -260,6 +334,9 @@ struct xc_sr_context
 
             /* Sender has invoked verify mode on the stream. */
             bool verify;
+
+            /* Post-copy migration state, from the first POSTCOPY_PFNS. */
+            struct xc_sr_postcopy *postcopy;
         } restore;
     };
 
@@ -391,6 +468,22 @@ static inline int write_record(struct xc_sr_context *ctx,
  */
 int read_record(struct xc_sr_context *ctx, int fd, struct xc_sr_record *rec);
 
+/*
+ * Start worker threads, nr of them or a default number if nr is 0.
+ *
+ * Returns 0 on success and non-0 on failure.
+ */
+int start_workers(struct xc_sr_context *ctx, unsigned nr);
+
+/* Wait for queued jobs to complete and stop the worker threads. */
+void stop_workers(struct xc_sr_context *ctx);
+
+/* Queue a job to be run by the next available worker thread. */
+void queue_job(struct xc_sr_context *ctx, struct xc_sr_job *job);
+
+/* Wait for a queued job to complete. */
+void wait_job(struct xc_sr_context *ctx, struct xc_sr_job *job);
+
 /*
  * This would ideally be private in restore.c, but is needed by
  * x86_pv_localise_page() if we receive pagetables frames ahead of the
@@ -399,6 +492,28 @@ int read_record(struct xc_sr_context *ctx, int fd, struct xc_sr_record *rec);
 int populate_pfns(struct xc_sr_context *ctx, unsigned count,
                   const xen_pfn_t *original_pfns, const uint32_t *types);
 
+/*
+ * Post-copy migration, restore side.  See xc_sr_restore_postcopy.c.
+ */
+int handle_postcopy_pfns(struct xc_sr_context *ctx, struct xc_sr_record *rec);
+int handle_postcopy_transition(struct xc_sr_context *ctx);
+
+/* Is the guest running, with pages still to be faulted in? */
+bool postcopy_active(const struct xc_sr_context *ctx);
+
+/* Serve the guest's page faults until there is data in the stream. */
+int postcopy_wait_for_stream(struct xc_sr_context *ctx);
+
+/* Load the data of pages the guest may be waiting for. */
+int postcopy_process_page_data(struct xc_sr_context *ctx, unsigned count,
+                               const xen_pfn_t *pfns, const uint32_t *types,
+                               const void *page_data);
+
+/* Check all pages have arrived, and stop paging.  At the END record. */
+int postcopy_complete(struct xc_sr_context *ctx);
+
+void postcopy_cleanup(struct xc_sr_context *ctx);
+
 #endif
 /*
  * Local variables:
@@ -4,6 +4,8 @@
 
 #include "xc_sr_common.h"
 
+#include "../../xen/include/xen/lz4.h"
+
 /*
  * Read and validate the Image and Domain headers.
  */
@@ -197,11 +199,12 @@ int populate_pfns(struct xc_sr_context *ctx, unsigned count,
 /*
  * Given a list of pfns, their types, and a block of page data from the
  * stream, populate and record their types, map the relevant subset and copy
- * the data into the guest.
+ * the data into the guest.  With no page data, the pages are cleared.
  */
 static int process_page_data(struct xc_sr_context *ctx, unsigned count,
                              xen_pfn_t *pfns, uint32_t *types, void *page_data)
 {
+    static const uint8_t zero_page[PAGE_SIZE];
     xc_interface *xch = ctx->xch;
     xen_pfn_t *mfns = malloc(count * sizeof(*mfns));
     int *map_errs = malloc(count * sizeof(*map_errs));
@@ -219,6 +222,12 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
         goto err;
     }
 
+    if ( postcopy_active(ctx) )
+    {
+        rc = postcopy_process_page_data(ctx, count, pfns, types, page_data);
+        goto err;
+    }
+
     rc = populate_pfns(ctx, count, pfns, types);
     if ( rc )
     {
@@ -285,6 +294,19 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
             goto err;
         }
 
+        if ( !page_data )
+        {
+            if ( !ctx->restore.verify )
+                memset(guest_page, 0, PAGE_SIZE);
+            else if ( memcmp(guest_page, zero_page, PAGE_SIZE) )
+                ERROR("verify pfn %#"PRIpfn" failed (expected zeroes)",
+                      pfns[i]);
+
+            ++j;
+            guest_page += PAGE_SIZE;
+            continue;
+        }
+
         /* Undo page normalisation done by the saver. */
         rc = ctx->restore.ops.localise_page(ctx, types[i], page_data);
         if ( rc )
@@ -326,8 +348,158 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
 }
 
 /*
- * Validate a PAGE_DATA record from the stream, and pass the results to
- * process_page_data() to actually perform the legwork.
+ * Decompression of a range of pages from a PAGE_DATA_COMPRESSED record.
+ */
+struct xc_sr_decompress_job
+{
+    struct xc_sr_job job; /* Must be first. */
+    const uint8_t *src;
+    const uint32_t *sizes;
+    uint8_t *dst;
+    unsigned nr_pages;
+    int rc;
+};
+
+/* Pages decompressed per job. */
+#define DECOMPRESS_JOB_PAGES 64
+
+static int decompress_page(const uint8_t *src, uint32_t size, uint8_t *dst)
+{
+#ifdef __MINIOS__
+    /* There is only the decompressor unsafe for untrusted input. */
+    return -1;
+#else
+    size_t len = PAGE_SIZE;
+
+    if ( lz4_decompress_unknownoutputsize(src, size, dst, &len) ||
+         len != PAGE_SIZE )
+        return -1;
+
+    return 0;
+#endif
+}
+
+static void decompress_job(struct xc_sr_job *job)
+{
+    struct xc_sr_decompress_job *d = (struct xc_sr_decompress_job *)job;
+    const uint8_t *src = d->src;
+    uint8_t *dst = d->dst;
+    unsigned i;
+
+    d->rc = 0;
+
+    for ( i = 0; i < d->nr_pages; ++i )
+    {
+        if ( d->sizes[i] == PAGE_SIZE )
+            memcpy(dst, src, PAGE_SIZE);
+        else if ( decompress_page(src, d->sizes[i], dst) )
+        {
+            d->rc = -1;
+            return;
+        }
+
+        src += d->sizes[i];
+        dst += PAGE_SIZE;
+    }
+}
+
+/*
+ * Validate the page data of a PAGE_DATA_COMPRESSED record, and decompress it
+ * into a buffer allocated with malloc().  The worker threads share the work.
+ */
+static void *decompress_page_data(struct xc_sr_context *ctx, void *data,
+                                  size_t length, unsigned nr_pages)
+{
+    xc_interface *xch = ctx->xch;
+    const uint32_t *sizes = data;
+    size_t sizes_len = ROUNDUP(nr_pages * sizeof(*sizes), REC_ALIGN_ORDER);
+    size_t total = 0;
+    const uint8_t *src = data + sizes_len;
+    uint8_t *pages = NULL;
+    struct xc_sr_decompress_job *jobs = NULL;
+    unsigned i, j, nr_jobs = (nr_pages + DECOMPRESS_JOB_PAGES - 1) /
+                             DECOMPRESS_JOB_PAGES;
+
+    if ( length < sizes_len )
+    {
+        ERROR("PAGE_DATA_COMPRESSED record too short to contain %u sizes",
+              nr_pages);
+        return NULL;
+    }
+
+    for ( i = 0; i < nr_pages; ++i )
+    {
+        if ( sizes[i] == 0 || sizes[i] > PAGE_SIZE )
+        {
+            ERROR("Invalid size %u of page %u in PAGE_DATA_COMPRESSED record",
+                  sizes[i], i);
+            return NULL;
+        }
+        total += sizes[i];
+    }
+
+    if ( length != sizes_len + total )
+    {
+        ERROR("PAGE_DATA_COMPRESSED record wrong size: length %zu, expected"
+              " %zu + %zu", length, sizes_len, total);
+        return NULL;
+    }
+
+    pages = malloc(nr_pages * PAGE_SIZE);
+    jobs = calloc(nr_jobs, sizeof(*jobs));
+    if ( !pages || !jobs )
+    {
+        ERROR("Unable to allocate memory to decompress %u pages", nr_pages);
+        goto err;
+    }
+
+    for ( i = 0; i < nr_jobs; ++i )
+    {
+        unsigned first = i * DECOMPRESS_JOB_PAGES;
+
+        jobs[i].job.fn = decompress_job;
+        jobs[i].src = src;
+        jobs[i].sizes = &sizes[first];
+        jobs[i].dst = pages + first * PAGE_SIZE;
+        jobs[i].nr_pages = min_t(unsigned, nr_pages - first,
+                                 DECOMPRESS_JOB_PAGES);
+
+        for ( j = 0; j < jobs[i].nr_pages; ++j )
+            src += jobs[i].sizes[j];
+
+        queue_job(ctx, &jobs[i].job);
+    }
+
+    for ( i = 0; i < nr_jobs; ++i )
+    {
+        wait_job(ctx, &jobs[i].job);
+        if ( jobs[i].rc )
+        {
+            ERROR("Failed to decompress pages %u to %u of PAGE_DATA_COMPRESSED"
+                  " record", i * DECOMPRESS_JOB_PAGES,
+                  i * DECOMPRESS_JOB_PAGES + jobs[i].nr_pages - 1);
+            /* Don't leave running jobs behind. */
+            while ( ++i < nr_jobs )
+                wait_job(ctx, &jobs[i].job);
+            goto err;
+        }
+    }
+
+    free(jobs);
+
+    return pages;
+
+ err:
+    free(jobs);
+    free(pages);
+
+    return NULL;
+}
+
+/*
+ * Validate a PAGE_DATA, PAGE_DATA_COMPRESSED or PAGE_DATA_ZERO record from
+ * the stream, and pass the results to process_page_data() to actually
+ * perform the legwork.
  */
 static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
 {
@@ -335,25 +507,29 @@ static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
     struct xc_sr_rec_page_data_header *pages = rec->data;
     unsigned i, pages_of_data = 0;
     int rc = -1;
+    size_t data_len;
+    void *page_data = NULL;
 
     xen_pfn_t *pfns = NULL, pfn;
     uint32_t *types = NULL, type;
 
     if ( rec->length < sizeof(*pages) )
     {
-        ERROR("PAGE_DATA record truncated: length %u, min %zu",
-              rec->length, sizeof(*pages));
+        ERROR("%s record truncated: length %u, min %zu",
+              rec_type_to_str(rec->type), rec->length, sizeof(*pages));
         goto err;
     }
     else if ( pages->count < 1 )
     {
-        ERROR("Expected at least 1 pfn in PAGE_DATA record");
+        ERROR("Expected at least 1 pfn in %s record",
+              rec_type_to_str(rec->type));
         goto err;
     }
     else if ( rec->length < sizeof(*pages) + (pages->count * sizeof(uint64_t)) )
     {
-        ERROR("PAGE_DATA record (length %u) too short to contain %u"
-              " pfns worth of information", rec->length, pages->count);
+        ERROR("%s record (length %u) too short to contain %u"
+              " pfns worth of information", rec_type_to_str(rec->type),
+              rec->length, pages->count);
         goto err;
     }
 
@@ -383,6 +559,13 @@ static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
                   type, pfn, i);
             goto err;
         }
+        else if ( rec->type == REC_TYPE_PAGE_DATA_ZERO &&
+                  type != XEN_DOMCTL_PFINFO_NOTAB )
+        {
+            ERROR("Invalid type %#"PRIx32" for pfn %#"PRIpfn" (index %u)"
+                  " in PAGE_DATA_ZERO record", type, pfn, i);
+            goto err;
+        }
         else if ( type < XEN_DOMCTL_PFINFO_BROKEN )
             /* NOTAB and all L1 through L4 tables (including pinned) should
              * have a page worth of data in the record. */
@@ -392,9 +575,29 @@ static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         types[i] = type;
     }
 
-    if ( rec->length != (sizeof(*pages) +
-                         (sizeof(uint64_t) * pages->count) +
-                         (PAGE_SIZE * pages_of_data)) )
+    data_len = rec->length - sizeof(*pages) - sizeof(uint64_t) * pages->count;
+
+    if ( rec->type == REC_TYPE_PAGE_DATA_COMPRESSED )
+    {
+        page_data = decompress_page_data(ctx, &pages->pfn[pages->count],
+                                         data_len, pages_of_data);
+        if ( !page_data )
+            goto err;
+    }
+    else if ( rec->type == REC_TYPE_PAGE_DATA_ZERO )
+    {
+        if ( data_len )
+        {
+            ERROR("PAGE_DATA_ZERO record wrong size: length %u, expected "
+                  "%zu + %zu", rec->length, sizeof(*pages),
+                  (sizeof(uint64_t) * pages->count));
+            goto err;
+        }
+
+        rc = process_page_data(ctx, pages->count, pfns, types, NULL);
+        goto err;
+    }
+    else if ( data_len != PAGE_SIZE * pages_of_data )
     {
         ERROR("PAGE_DATA record wrong size: length %u, expected "
               "%zu + %zu + %lu", rec->length, sizeof(*pages),
@@ -403,8 +606,9 @@ static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
     }
 
     rc = process_page_data(ctx, pages->count, pfns, types,
-                           &pages->pfn[pages->count]);
+                           page_data ?: &pages->pfn[pages->count]);
  err:
+    free(page_data);
     free(types);
     free(pfns);
 
@@ -637,6 +841,8 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         break;
 
     case REC_TYPE_PAGE_DATA:
+    case REC_TYPE_PAGE_DATA_COMPRESSED:
+    case REC_TYPE_PAGE_DATA_ZERO:
         rc = handle_page_data(ctx, rec);
         break;
 
@@ -649,6 +855,14 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         rc = handle_checkpoint(ctx);
         break;
 
+    case REC_TYPE_POSTCOPY_PFNS:
+        rc = handle_postcopy_pfns(ctx, rec);
+        break;
+
+    case REC_TYPE_POSTCOPY_TRANSITION:
+        rc = handle_postcopy_transition(ctx);
+        break;
+
     default:
         rc = ctx->restore.ops.process_record(ctx, rec);
         break;
@@ -684,6 +898,10 @@ static int setup(struct xc_sr_context *ctx)
     if ( rc )
         goto err;
 
+    rc = start_workers(ctx, 0);
+    if ( rc )
+        goto err;
+
     ctx->restore.max_populated_pfn = (32 * 1024 / 4) - 1;
     ctx->restore.populated_pfns = bitmap_alloc(
         ctx->restore.max_populated_pfn + 1);
@@ -721,6 +939,9 @@ static void cleanup(struct xc_sr_context *ctx)
     if ( ctx->restore.checkpointed == XC_MIG_STREAM_COLO )
         xc_hypercall_buffer_free_pages(xch, dirty_bitmap,
                                    NRPAGES(bitmap_size(ctx->restore.p2m_size)));
+    stop_workers(ctx);
+    postcopy_cleanup(ctx);
+
     free(ctx->restore.buffered_records);
     free(ctx->restore.populated_pfns);
     if ( ctx->restore.ops.cleanup(ctx) )
@@ -744,6 +965,14 @@ static int restore(struct xc_sr_context *ctx)
 
     do
     {
+        if ( postcopy_active(ctx) )
+        {
+            /* Serve the guest's page faults while waiting for the stream. */
+            rc = postcopy_wait_for_stream(ctx);
+            if ( rc )
+                goto err;
+        }
+
         rc = read_record(ctx, ctx->fd, &rec);
         if ( rc )
         {
@@ -787,6 +1016,17 @@ static int restore(struct xc_sr_context *ctx)
 
  remus_failover:
 
+    if ( postcopy_active(ctx) )
+    {
+        /* The guest is already running. */
+        rc = postcopy_complete(ctx);
+        if ( rc )
+            goto err;
+
+        IPRINTF("Restore successful");
+        goto done;
+    }
+
     if ( ctx->restore.checkpointed == XC_MIG_STREAM_COLO )
     {
         /* With COLO, we have already called stream_complete */
@@ -0,0 +1,655 @@
+#include <assert.h>
+#include <poll.h>
+
+#include <xenevtchn.h>
+#include <xen/vm_event.h>
+
+#include "xc_sr_common.h"
+
+/*
+ * Post-copy migration.  The sender announces the pages it will send after
+ * the rest of the guest state in POSTCOPY_PFNS records.  On the
+ * POSTCOPY_TRANSITION record, those pages are paged out with the mem_paging
+ * interface and the guest is resumed.  Accesses to the missing pages pause
+ * the vcpu and are reported on the paging ring; the pages are requested from
+ * the sender with POSTCOPY_FAULT records on the back channel, and loaded as
+ * they arrive in the stream, which also carries the other pages in the
+ * background.
+ */
+struct xc_sr_postcopy
+{
+    /*
+     * Bitmaps of pfns whose data is still to come, which have been asked
+     * for, and which the guest has given up in the meantime.
+     */
+    unsigned long *pending, *requested, *dropped;
+    xen_pfn_t max_pfn;
+    unsigned long nr_pending;
+
+    /* Guest running, with pending pages paged out. */
+    bool active;
+
+    void *ring_page;
+    vm_event_back_ring_t back_ring;
+    xenevtchn_handle *xce;
+    xenevtchn_port_or_error_t port;
+
+    /* Paging requests waiting for the data of their page. */
+    vm_event_request_t *waiting;
+    unsigned nr_waiting, max_waiting;
+
+    /* Page aligned buffer for xc_mem_paging_load(). */
+    void *buffer;
+};
+
+static bool pfn_is_pending(const struct xc_sr_postcopy *pc, xen_pfn_t pfn)
+{
+    return pfn <= pc->max_pfn && test_bit(pfn, pc->pending);
+}
+
+/*
+ * Grow the bitmaps to cover pfn, to the nearest power of two, as for the
+ * populated pfns.
+ */
+static int grow_bitmaps(struct xc_sr_context *ctx, xen_pfn_t pfn)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+    unsigned long **bitmaps[] = { &pc->pending, &pc->requested, &pc->dropped };
+    xen_pfn_t new_max;
+    size_t old_sz, new_sz;
+    unsigned long *p;
+    unsigned i;
+
+    if ( pfn <= pc->max_pfn && pc->pending )
+        return 0;
+
+    new_max = pfn;
+    new_max |= new_max >> 1;
+    new_max |= new_max >> 2;
+    new_max |= new_max >> 4;
+    new_max |= new_max >> 8;
+    new_max |= new_max >> 16;
+#ifdef __x86_64__
+    new_max |= new_max >> 32;
+#endif
+
+    old_sz = pc->pending ? bitmap_size(pc->max_pfn + 1) : 0;
+    new_sz = bitmap_size(new_max + 1);
+
+    for ( i = 0; i < ARRAY_SIZE(bitmaps); ++i )
+    {
+        p = realloc(*bitmaps[i], new_sz);
+        if ( !p )
+        {
+            ERROR("Failed to realloc post-copy bitmaps");
+            errno = ENOMEM;
+            return -1;
+        }
+
+        memset((uint8_t *)p + old_sz, 0, new_sz - old_sz);
+        *bitmaps[i] = p;
+    }
+
+    pc->max_pfn = new_max;
+
+    return 0;
+}
+
+/*
+ * Process a POSTCOPY_PFNS record: note the pfns as pending.  They are paged
+ * out on the transition.
+ */
+int handle_postcopy_pfns(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_postcopy_pfns_header *hdr = rec->data;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+    xen_pfn_t pfn;
+    uint32_t type;
+    unsigned i;
+
+    if ( !ctx->dominfo.hvm )
+    {
+        ERROR("Post-copy migration is only supported for HVM guests");
+        return -1;
+    }
+
+    if ( pc && pc->active )
+    {
+        ERROR("POSTCOPY_PFNS record after POSTCOPY_TRANSITION");
+        return -1;
+    }
+
+    if ( rec->length < sizeof(*hdr) || hdr->count < 1 ||
+         rec->length != sizeof(*hdr) + hdr->count * sizeof(*hdr->pfn) )
+    {
+        ERROR("POSTCOPY_PFNS record wrong size: length %u", rec->length);
+        return -1;
+    }
+
+    if ( !pc )
+    {
+        pc = ctx->restore.postcopy = calloc(1, sizeof(*pc));
+        if ( !pc )
+        {
+            ERROR("Unable to allocate post-copy state");
+            return -1;
+        }
+    }
+
+    for ( i = 0; i < hdr->count; ++i )
+    {
+        pfn = hdr->pfn[i] & PAGE_DATA_PFN_MASK;
+        type = (hdr->pfn[i] & PAGE_DATA_TYPE_MASK) >> 32;
+
+        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfn) ||
+             type != XEN_DOMCTL_PFINFO_NOTAB )
+        {
+            ERROR("Invalid pfn %#"PRIpfn" (type %#"PRIx32", index %u) in"
+                  " POSTCOPY_PFNS record", pfn, type, i);
+            return -1;
+        }
+
+        if ( grow_bitmaps(ctx, pfn) )
+            return -1;
+
+        if ( !test_and_set_bit(pfn, pc->pending) )
+            pc->nr_pending++;
+    }
+
+    return 0;
+}
+
+static int enable_paging(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+    uint32_t remote_port;
+
+    pc->ring_page = xc_vm_event_enable(xch, ctx->domid,
+                                       HVM_PARAM_PAGING_RING_PFN,
+                                       &remote_port);
+    if ( !pc->ring_page )
+    {
+        PERROR("Failed to enable paging");
+        return -1;
+    }
+
+    pc->xce = xenevtchn_open(NULL, 0);
+    if ( !pc->xce )
+    {
+        PERROR("Failed to open event channel");
+        return -1;
+    }
+
+    pc->port = xenevtchn_bind_interdomain(pc->xce, ctx->domid, remote_port);
+    if ( pc->port < 0 )
+    {
+        PERROR("Failed to bind paging event channel");
+        return -1;
+    }
+
+    SHARED_RING_INIT((vm_event_sring_t *)pc->ring_page);
+    BACK_RING_INIT(&pc->back_ring, (vm_event_sring_t *)pc->ring_page,
+                   PAGE_SIZE);
+
+    return 0;
+}
+
+/*
+ * Page out the pending pfns, so guest accesses to them get reported.  The
+ * guest hasn't run yet, so nothing else can be using them.
+ */
+static int evict_pending(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+    xen_pfn_t pfn, pfns[MAX_BATCH_SIZE];
+    unsigned i, nr;
+    int rc;
+
+    for ( pfn = 0; pfn <= pc->max_pfn; )
+    {
+        for ( nr = 0; nr < MAX_BATCH_SIZE && pfn <= pc->max_pfn; ++pfn )
+            if ( test_bit(pfn, pc->pending) )
+                pfns[nr++] = pfn;
+
+        if ( nr == 0 )
+            break;
+
+        /* Pages not sent before need to exist to be paged out. */
+        rc = populate_pfns(ctx, nr, pfns, NULL);
+        if ( rc )
+            return rc;
+
+        for ( i = 0; i < nr; ++i )
+        {
+            xen_pfn_t gfn = ctx->restore.ops.pfn_to_gfn(ctx, pfns[i]);
+
+            if ( xc_mem_paging_nominate(xch, ctx->domid, gfn) ||
+                 xc_mem_paging_evict(xch, ctx->domid, gfn) )
+            {
+                PERROR("Failed to page out pfn %#"PRIpfn, pfns[i]);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Process the POSTCOPY_TRANSITION record: all state but the pending pages
+ * has arrived.  Complete the restore of the guest state, page out the
+ * pending pages and have the toolstack resume the guest.
+ *
+ * Without a postcopy callback to resume the guest, the pending pages are
+ * simply received as in a regular migration.
+ */
+int handle_postcopy_transition(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+    struct restore_callbacks *cb = ctx->restore.callbacks;
+    int rc;
+
+    if ( !pc || !pc->nr_pending || !cb || !cb->postcopy )
+    {
+        postcopy_cleanup(ctx);
+        return 0;
+    }
+
+    if ( ctx->restore.checkpointed != XC_MIG_STREAM_NONE || pc->active )
+    {
+        ERROR("Unexpected POSTCOPY_TRANSITION record");
+        return -1;
+    }
+
+    rc = ctx->restore.ops.stream_complete(ctx);
+    if ( rc )
+        return rc;
+
+    if ( posix_memalign(&pc->buffer, PAGE_SIZE, PAGE_SIZE) )
+    {
+        pc->buffer = NULL;
+        ERROR("Unable to allocate post-copy page buffer");
+        return -1;
+    }
+
+    rc = enable_paging(ctx);
+    if ( rc )
+        return rc;
+
+    rc = evict_pending(ctx);
+    if ( rc )
+        return rc;
+
+    pc->active = true;
+
+    IPRINTF("Resuming guest with %lu pages to follow", pc->nr_pending);
+
+    if ( cb->restore_results )
+        cb->restore_results(ctx->restore.xenstore_gfn,
+                            ctx->restore.console_gfn, cb->data);
+
+    if ( cb->postcopy(cb->data) != 1 )
+    {
+        ERROR("Failed to resume the guest");
+        return -1;
+    }
+
+    return 0;
+}
+
+bool postcopy_active(const struct xc_sr_context *ctx)
+{
+    return ctx->restore.postcopy && ctx->restore.postcopy->active;
+}
+
+static int resume_vcpu(struct xc_sr_context *ctx,
+                       const vm_event_request_t *req)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+    vm_event_response_t *rsp;
+
+    if ( !(req->flags & VM_EVENT_FLAG_VCPU_PAUSED) )
+        return 0;
+
+    rsp = RING_GET_RESPONSE(&pc->back_ring, pc->back_ring.rsp_prod_pvt);
+    memset(rsp, 0, sizeof(*rsp));
+    rsp->version = VM_EVENT_INTERFACE_VERSION;
+    rsp->vcpu_id = req->vcpu_id;
+    rsp->flags = req->flags;
+    rsp->reason = req->reason;
+    rsp->u.mem_paging.gfn = req->u.mem_paging.gfn;
+
+    pc->back_ring.rsp_prod_pvt++;
+    RING_PUSH_RESPONSES(&pc->back_ring);
+
+    if ( xenevtchn_notify(pc->xce, pc->port) )
+    {
+        PERROR("Failed to notify paging event channel");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Ask the sender for pages the guest is waiting for.  Without a back
+ * channel, wait for the sender to get to them.
+ */
+static int send_fault(struct xc_sr_context *ctx, uint64_t *pfns,
+                      unsigned count)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_postcopy_fault hdr = { .count = count };
+    struct xc_sr_record rec =
+    {
+        .type = REC_TYPE_POSTCOPY_FAULT,
+        .length = sizeof(hdr) + count * sizeof(*pfns),
+    };
+    struct iovec iov[] =
+    {
+        { .iov_base = &rec.type,   .iov_len = sizeof(rec.type) },
+        { .iov_base = &rec.length, .iov_len = sizeof(rec.length) },
+        { .iov_base = &hdr,        .iov_len = sizeof(hdr) },
+        { .iov_base = pfns,        .iov_len = count * sizeof(*pfns) },
+    };
+
+    if ( count == 0 || ctx->restore.send_back_fd < 0 )
+        return 0;
+
+    if ( writev_exact(ctx->restore.send_back_fd, iov, ARRAY_SIZE(iov)) )
+    {
+        PERROR("Failed to send POSTCOPY_FAULT record");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Consume the requests on the paging ring.  Vcpus waiting for pages not yet
+ * received are kept waiting, and the pages asked for.
+ */
+static int handle_paging_requests(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+    uint64_t pfns[RING_SIZE(&pc->back_ring)];
+    unsigned nr_pfns = 0;
+    vm_event_request_t req, *p;
+    xen_pfn_t pfn;
+    int rc;
+
+    rc = xenevtchn_pending(pc->xce);
+    if ( rc < 0 )
+    {
+        PERROR("Failed to read paging event channel");
+        return -1;
+    }
+
+    if ( xenevtchn_unmask(pc->xce, rc) )
+    {
+        PERROR("Failed to unmask paging event channel");
+        return -1;
+    }
+
+    while ( RING_HAS_UNCONSUMED_REQUESTS(&pc->back_ring) )
+    {
+        memcpy(&req, RING_GET_REQUEST(&pc->back_ring,
+                                      pc->back_ring.req_cons), sizeof(req));
+        pc->back_ring.req_cons++;
+        pc->back_ring.sring->req_event = pc->back_ring.req_cons + 1;
+
+        if ( req.version != VM_EVENT_INTERFACE_VERSION ||
+             req.reason != VM_EVENT_REASON_MEM_PAGING )
+        {
+            ERROR("Unexpected paging request: version %#x, reason %u",
+                  req.version, req.reason);
+            return -1;
+        }
+
+        /* Gfns and pfns are the same for HVM guests. */
+        pfn = req.u.mem_paging.gfn;
+
+        if ( req.u.mem_paging.flags & MEM_PAGING_DROP_PAGE )
+        {
+            /* Ballooned out while paged out: don't load it any more. */
+            if ( pfn_is_pending(pc, pfn) )
+            {
+                clear_bit(pfn, pc->pending);
+                set_bit(pfn, pc->dropped);
+                pc->nr_pending--;
+            }
+        }
+        else if ( pfn_is_pending(pc, pfn) )
+        {
+            if ( pc->nr_waiting == pc->max_waiting )
+            {
+                unsigned max = pc->max_waiting * 2 ?: 16;
+
+                p = realloc(pc->waiting, max * sizeof(*p));
+                if ( !p )
+                {
+                    ERROR("Unable to allocate memory for paging requests");
+                    return -1;
+                }
+                pc->waiting = p;
+                pc->max_waiting = max;
+            }
+
+            pc->waiting[pc->nr_waiting++] = req;
+
+            if ( !test_and_set_bit(pfn, pc->requested) )
+            {
+                pfns[nr_pfns++] = pfn;
+
+                /* The guest may refill the ring while it is drained. */
+                if ( nr_pfns == ARRAY_SIZE(pfns) )
+                {
+                    rc = send_fault(ctx, pfns, nr_pfns);
+                    if ( rc )
+                        return rc;
+                    nr_pfns = 0;
+                }
+            }
+
+            continue;
+        }
+
+        rc = resume_vcpu(ctx, &req);
+        if ( rc )
+            return rc;
+    }
+
+    return send_fault(ctx, pfns, nr_pfns);
+}
+
+int postcopy_wait_for_stream(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+    struct pollfd fds[2] =
+    {
+        { .fd = ctx->fd, .events = POLLIN },
+        { .fd = xenevtchn_fd(pc->xce), .events = POLLIN },
+    };
+    int rc;
+
+    for ( ;; )
+    {
+        rc = poll(fds, ARRAY_SIZE(fds), -1);
+        if ( rc < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            PERROR("Failed to poll the stream and paging event channel");
+            return -1;
+        }
+
+        if ( fds[1].revents & POLLIN )
+        {
+            rc = handle_paging_requests(ctx);
+            if ( rc )
+                return rc;
+        }
+
+        if ( fds[0].revents )
+            return 0;
+    }
+}
+
+/*
+ * Load the data of a pending page into the guest, and resume the vcpus
+ * waiting for it.  A NULL data is a page of zeroes.
+ */
+static int load_page(struct xc_sr_context *ctx, xen_pfn_t pfn,
+                     const void *data)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+    unsigned i, j;
+    int rc;
+
+    if ( data )
+        memcpy(pc->buffer, data, PAGE_SIZE);
+    else
+        memset(pc->buffer, 0, PAGE_SIZE);
+
+    if ( xc_mem_paging_load(xch, ctx->domid,
+                            ctx->restore.ops.pfn_to_gfn(ctx, pfn),
+                            pc->buffer) )
+    {
+        PERROR("Failed to load pfn %#"PRIpfn, pfn);
+        return -1;
+    }
+
+    clear_bit(pfn, pc->pending);
+    pc->nr_pending--;
+
+    if ( !test_bit(pfn, pc->requested) )
+        return 0;
+
+    for ( i = 0, j = 0; i < pc->nr_waiting; ++i )
+    {
+        if ( pc->waiting[i].u.mem_paging.gfn != pfn )
+        {
+            pc->waiting[j++] = pc->waiting[i];
+            continue;
+        }
+
+        rc = resume_vcpu(ctx, &pc->waiting[i]);
+        if ( rc )
+            return rc;
+    }
+    pc->nr_waiting = j;
+
+    return 0;
+}
+
+int postcopy_process_page_data(struct xc_sr_context *ctx, unsigned count,
+                               const xen_pfn_t *pfns, const uint32_t *types,
+                               const void *page_data)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+    unsigned i;
+    int rc;
+
+    for ( i = 0; i < count; ++i )
+    {
+        switch ( types[i] )
+        {
+        case XEN_DOMCTL_PFINFO_XTAB:
+        case XEN_DOMCTL_PFINFO_BROKEN:
+        case XEN_DOMCTL_PFINFO_XALLOC:
+            /* No page data to deal with. */
+            continue;
+        }
+
+        if ( pfn_is_pending(pc, pfns[i]) )
+        {
+            rc = load_page(ctx, pfns[i], page_data);
+            if ( rc )
+                return rc;
+        }
+        else if ( pfns[i] > pc->max_pfn || !test_bit(pfns[i], pc->dropped) )
+        {
+            ERROR("Unexpected pfn %#"PRIpfn" (type %#"PRIx32") after"
+                  " POSTCOPY_TRANSITION", pfns[i], types[i]);
+            return -1;
+        }
+
+        if ( page_data )
+            page_data += PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+int postcopy_complete(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+
+    if ( pc->nr_pending )
+    {
+        ERROR("Stream ended with %lu post-copy pages missing",
+              pc->nr_pending);
+        return -1;
+    }
+
+    assert(pc->nr_waiting == 0);
+
+    if ( xc_mem_paging_disable(xch, ctx->domid) )
+    {
+        PERROR("Failed to disable paging");
+        return -1;
+    }
+
+    IPRINTF("All post-copy pages received");
+
+    return 0;
+}
+
+void postcopy_cleanup(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+
+    if ( !pc )
+        return;
+
+    if ( pc->xce )
+    {
+        if ( pc->port >= 0 )
+            xenevtchn_unbind(pc->xce, pc->port);
+        xenevtchn_close(pc->xce);
+    }
+
+    if ( pc->ring_page )
+        xenforeignmemory_unmap(xch->fmem, pc->ring_page, 1);
+
+    free(pc->buffer);
+    free(pc->waiting);
+    free(pc->pending);
+    free(pc->requested);
+    free(pc->dropped);
+    free(pc);
+
+    ctx->restore.postcopy = NULL;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
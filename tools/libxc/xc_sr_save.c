@@ -1,8 +1,11 @@
 #include <assert.h>
+#include <poll.h>
 #include <arpa/inet.h>
 
 #include "xc_sr_common.h"
 
+#include "../../xen/include/xen/lz4.h"
+
 /*
  * Writes an Image header and Domain header into the stream.
  */
@@ -67,67 +70,203 @@ static int write_checkpoint_record(struct xc_sr_context *ctx)
 }
 
 /*
- * Writes a batch of memory as a PAGE_DATA record into the stream.  The batch
- * is constructed in ctx->save.batch_pfns.
- *
- * This function:
- * - gets the types for each pfn in the batch.
- * - for each pfn with real data:
- *   - maps and attempts to localise the pages.
- * - construct and writes a PAGE_DATA record into the stream.
+ * A batch of pfns on its way into the stream.  The pages are mapped and
+ * normalised by the main thread, then elided and optionally compressed by
+ * a worker thread, while the main thread writes out the records of earlier
+ * batches, in the order the batches were queued.
  */
-static int write_batch(struct xc_sr_context *ctx)
+struct xc_sr_save_batch
 {
-    xc_interface *xch = ctx->xch;
-    xen_pfn_t *mfns = NULL, *types = NULL;
-    void *guest_mapping = NULL;
-    void **guest_data = NULL;
-    void **local_pages = NULL;
-    int *errors = NULL, rc = -1;
-    unsigned i, p, nr_pages = 0, nr_pages_mapped = 0;
-    unsigned nr_pfns = ctx->save.nr_batch_pfns;
-    void *page, *orig_page;
-    uint64_t *rec_pfns = NULL;
-    struct iovec *iov = NULL; int iovcnt = 0;
-    struct xc_sr_rec_page_data_header hdr = { 0 };
-    struct xc_sr_record rec =
-    {
-        .type = REC_TYPE_PAGE_DATA,
-    };
+    struct xc_sr_job job; /* Must be first. */
+    struct xc_sr_context *ctx;
 
-    assert(nr_pfns != 0);
+    xen_pfn_t *pfns;
+    unsigned nr_pfns;
 
     /* Mfns of the batch pfns. */
-    mfns = malloc(nr_pfns * sizeof(*mfns));
+    xen_pfn_t *mfns;
     /* Types of the batch pfns. */
-    types = malloc(nr_pfns * sizeof(*types));
+    xen_pfn_t *types;
     /* Errors from attempting to map the gfns. */
-    errors = malloc(nr_pfns * sizeof(*errors));
+    int *errors;
+    void *guest_mapping;
+    unsigned nr_pages, nr_pages_mapped;
     /* Pointers to page data to send.  Mapped gfns or local allocations. */
-    guest_data = calloc(nr_pfns, sizeof(*guest_data));
+    void **guest_data;
     /* Pointers to locally allocated pages.  Need freeing. */
-    local_pages = calloc(nr_pfns, sizeof(*local_pages));
-    /* iovec[] for writev(). */
-    iov = malloc((nr_pfns + 4) * sizeof(*iov));
+    void **local_pages;
+    /* Private copies of the mapped NOTAB pages, when hashing pages. */
+    uint8_t *copies;
+    /* Pfn list of the record. */
+    uint64_t *rec_pfns;
+    unsigned nr_rec_pfns;
+    /* Pfn list of the PAGE_DATA_ZERO record. */
+    uint64_t *zero_pfns;
+    unsigned nr_zero_pfns;
+    /* Pages not sent, as unchanged since they were last sent. */
+    unsigned nr_unchanged;
+    /* Pfns which couldn't be sent now, to be retried later. */
+    xen_pfn_t *deferred;
+    unsigned nr_deferred;
+
+    /* Compressed page data, and the size of each page in it. */
+    uint8_t *cdata;
+    size_t cdata_size;
+    uint32_t *sizes;
+    void *wrkmem;
+};
+
+static void defer_pfn(struct xc_sr_save_batch *batch, xen_pfn_t pfn)
+{
+    batch->deferred[batch->nr_deferred++] = pfn;
+}
+
+static bool page_is_zero(const void *page)
+{
+    const unsigned long *p = page;
+    unsigned i;
+
+    /* A cache line at a time, which the compiler can vectorise. */
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i += 8 )
+        if ( p[i + 0] | p[i + 1] | p[i + 2] | p[i + 3] |
+             p[i + 4] | p[i + 5] | p[i + 6] | p[i + 7] )
+            return false;
+
+    return true;
+}
+
+#define HASH_PRIME1 0x9e3779b185ebca87ULL
+#define HASH_PRIME2 0xc2b2ae3d27d4eb4fULL
+#define HASH_PRIME3 0x165667b19e3779f9ULL
 
-    if ( !mfns || !types || !errors || !guest_data || !local_pages || !iov )
+static inline uint64_t rol64(uint64_t x, unsigned n)
+{
+    return (x << n) | (x >> (64 - n));
+}
+
+/*
+ * 64bit hash of a page, never 0.  Four independent xxHash64 style lanes,
+ * to keep the multipliers busy.
+ */
+static uint64_t hash_page(const void *page)
+{
+    const uint64_t *p = page;
+    uint64_t v[4] = { HASH_PRIME1 + HASH_PRIME2, HASH_PRIME2, 0, -HASH_PRIME1 };
+    uint64_t h;
+    unsigned i, j;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i += 4 )
+        for ( j = 0; j < 4; ++j )
+            v[j] = rol64(v[j] + p[i + j] * HASH_PRIME2, 31) * HASH_PRIME1;
+
+    h = rol64(v[0], 1) + rol64(v[1], 7) + rol64(v[2], 12) + rol64(v[3], 18);
+
+    h ^= h >> 33;
+    h *= HASH_PRIME2;
+    h ^= h >> 29;
+    h *= HASH_PRIME3;
+    h ^= h >> 32;
+
+    return h ?: 1;
+}
+
+/*
+ * Decide whether the data of a NOTAB page can be left out of the PAGE_DATA
+ * record.  Pages unchanged since they were last sent are skipped, and, if
+ * the stream may contain them, pages of zeroes are listed in the
+ * PAGE_DATA_ZERO record instead.
+ *
+ * The hash must be of the very data which gets sent.  Hashing the live
+ * page and sending a later read of it would let the guest change it after
+ * the hash and back before the next pass, which would then skip it
+ * although the receiver had different data.
+ */
+static bool elide_page(struct xc_sr_save_batch *batch, xen_pfn_t pfn,
+                       const void *page)
+{
+    uint64_t *hashes = batch->ctx->save.page_hashes, hash;
+
+    if ( hashes )
     {
-        ERROR("Unable to allocate arrays for a batch of %u pages",
-              nr_pfns);
-        goto err;
+        hash = hash_page(page);
+        if ( hashes[pfn] == hash )
+        {
+            batch->nr_unchanged++;
+            return true;
+        }
+        hashes[pfn] = hash;
+    }
+
+    if ( batch->ctx->save.zero_pages && page_is_zero(page) )
+    {
+        batch->zero_pfns[batch->nr_zero_pfns++] =
+            ((uint64_t)XEN_DOMCTL_PFINFO_NOTAB << 32) | pfn;
+        return true;
     }
 
+    return false;
+}
+
+/*
+ * Compress the pages of a batch into batch->cdata.  Pages which don't get
+ * smaller are stored as they are.
+ */
+static void compress_batch(struct xc_sr_save_batch *batch)
+{
+    unsigned i, p;
+    size_t sz;
+
+    batch->cdata_size = 0;
+
+    for ( i = 0, p = 0; i < batch->nr_pfns; ++i )
+    {
+        uint8_t *dst = batch->cdata + batch->cdata_size;
+
+        if ( !batch->guest_data[i] )
+            continue;
+
+        if ( lz4_compress(batch->guest_data[i], PAGE_SIZE, dst, &sz,
+                          batch->wrkmem) || sz >= PAGE_SIZE )
+        {
+            memcpy(dst, batch->guest_data[i], PAGE_SIZE);
+            sz = PAGE_SIZE;
+        }
+
+        batch->sizes[p++] = sz;
+        batch->cdata_size += sz;
+    }
+}
+
+/*
+ * Map a batch of memory for a PAGE_DATA record.  Runs on the main thread
+ * before the batch is handed to a worker: the save ops, the libxc calls
+ * and the error logging below use state of the context and of the xc
+ * handle which nothing serialises.
+ *
+ * This function:
+ * - gets the types for each pfn in the batch.
+ * - for each pfn with real data:
+ *   - maps and attempts to localise the pages.
+ */
+static int map_batch(struct xc_sr_context *ctx,
+                     struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    xen_pfn_t *mfns = batch->mfns, *types = batch->types;
+    int *errors = batch->errors, rc = -1;
+    unsigned i, p, nr_pages = 0;
+    unsigned nr_pfns = batch->nr_pfns;
+    void *page, *orig_page;
+
+    assert(nr_pfns != 0);
+
     for ( i = 0; i < nr_pfns; ++i )
     {
-        types[i] = mfns[i] = ctx->save.ops.pfn_to_gfn(ctx,
-                                                      ctx->save.batch_pfns[i]);
+        types[i] = mfns[i] = ctx->save.ops.pfn_to_gfn(ctx, batch->pfns[i]);
 
         /* Likely a ballooned page. */
         if ( mfns[i] == INVALID_MFN )
-        {
-            set_bit(ctx->save.batch_pfns[i], ctx->save.deferred_pages);
-            ++ctx->save.nr_deferred_pages;
-        }
+            defer_pfn(batch, batch->pfns[i]);
     }
 
     rc = xc_get_pfn_type_batch(xch, ctx->domid, nr_pfns, types);
@@ -153,14 +292,14 @@ static int write_batch(struct xc_sr_context *ctx)
 
     if ( nr_pages > 0 )
     {
-        guest_mapping = xenforeignmemory_map(xch->fmem,
+        batch->guest_mapping = xenforeignmemory_map(xch->fmem,
             ctx->domid, PROT_READ, nr_pages, mfns, errors);
-        if ( !guest_mapping )
+        if ( !batch->guest_mapping )
         {
             PERROR("Failed to map guest pages");
             goto err;
         }
-        nr_pages_mapped = nr_pages;
+        batch->nr_pages_mapped = nr_pages;
 
         for ( i = 0, p = 0; i < nr_pfns; ++i )
         {
@@ -175,22 +314,21 @@ static int write_batch(struct xc_sr_context *ctx)
             if ( errors[p] )
             {
                 ERROR("Mapping of pfn %#"PRIpfn" (mfn %#"PRIpfn") failed %d",
-                      ctx->save.batch_pfns[i], mfns[p], errors[p]);
+                      batch->pfns[i], mfns[p], errors[p]);
                 goto err;
             }
 
-            orig_page = page = guest_mapping + (p * PAGE_SIZE);
+            orig_page = page = batch->guest_mapping + (p * PAGE_SIZE);
             rc = ctx->save.ops.normalise_page(ctx, types[i], &page);
 
             if ( orig_page != page )
-                local_pages[i] = page;
+                batch->local_pages[i] = page;
 
             if ( rc )
             {
                 if ( rc == -1 && errno == EAGAIN )
                 {
-                    set_bit(ctx->save.batch_pfns[i], ctx->save.deferred_pages);
-                    ++ctx->save.nr_deferred_pages;
+                    defer_pfn(batch, batch->pfns[i]);
                     types[i] = XEN_DOMCTL_PFINFO_XTAB;
                     --nr_pages;
                 }
@@ -198,103 +336,333 @@ static int write_batch(struct xc_sr_context *ctx)
                     goto err;
             }
             else
-                guest_data[i] = page;
+                batch->guest_data[i] = page;
 
             rc = -1;
             ++p;
         }
     }
 
-    rec_pfns = malloc(nr_pfns * sizeof(*rec_pfns));
-    if ( !rec_pfns )
+    batch->nr_pages = nr_pages;
+    rc = 0;
+
+ err:
+    return rc;
+}
+
+/*
+ * Finish preparing a mapped batch for its record.  Runs on a worker thread,
+ * so must not touch the context beyond reading it and updating the page
+ * hashes of the pfns in the batch, and must not log.
+ *
+ * This function:
+ * - elides zero and unchanged pages.
+ * - lists the pfns of the record.
+ * - compresses the page data, if requested.
+ */
+static void process_batch(struct xc_sr_save_batch *batch)
+{
+    struct xc_sr_context *ctx = batch->ctx;
+    xen_pfn_t *types = batch->types;
+    unsigned i;
+
+    for ( i = 0; i < batch->nr_pfns; ++i )
+    {
+        if ( types[i] == XEN_DOMCTL_PFINFO_NOTAB )
+        {
+            /* Hash and send one read of the page, see elide_page(). */
+            if ( batch->guest_data[i] && ctx->save.page_hashes &&
+                 !batch->local_pages[i] )
+            {
+                uint8_t *copy = batch->copies + (size_t)i * PAGE_SIZE;
+
+                memcpy(copy, batch->guest_data[i], PAGE_SIZE);
+                batch->guest_data[i] = copy;
+            }
+
+            if ( batch->guest_data[i] &&
+                 elide_page(batch, batch->pfns[i], batch->guest_data[i]) )
+            {
+                batch->guest_data[i] = NULL;
+                --batch->nr_pages;
+            }
+
+            /* Elided page. */
+            if ( !batch->guest_data[i] )
+                continue;
+        }
+        else if ( ctx->save.page_hashes )
+            ctx->save.page_hashes[batch->pfns[i]] = 0;
+
+        batch->rec_pfns[batch->nr_rec_pfns++] =
+            ((uint64_t)(types[i]) << 32) | batch->pfns[i];
+    }
+
+    if ( ctx->save.compress )
+        compress_batch(batch);
+}
+
+static void process_batch_job(struct xc_sr_job *job)
+{
+    process_batch((struct xc_sr_save_batch *)job);
+}
+
+/*
+ * Writes a batch prepared by process_batch() into the stream, as a PAGE_DATA or
+ * PAGE_DATA_COMPRESSED record, preceded by a PAGE_DATA_ZERO record if any
+ * pages of zeroes were found.  Either record is left out if empty.
+ */
+static int write_batch(struct xc_sr_context *ctx,
+                       struct xc_sr_save_batch *batch)
+{
+    static const uint8_t zeroes[(1u << REC_ALIGN_ORDER) - 1] = { 0 };
+    xc_interface *xch = ctx->xch;
+    unsigned i, nr_pfns = batch->nr_rec_pfns, nr_pages = batch->nr_pages;
+    struct iovec *iov = NULL; int iovcnt = 0;
+    struct xc_sr_rec_page_data_header hdr = { 0 };
+    struct xc_sr_rec_page_data_zero_header zero_hdr = { 0 };
+    struct xc_sr_record rec =
+    {
+        .type = REC_TYPE_PAGE_DATA,
+    };
+    struct xc_sr_record zero_rec =
+    {
+        .type = REC_TYPE_PAGE_DATA_ZERO,
+    };
+    size_t sizes_len = ROUNDUP(nr_pages * sizeof(*batch->sizes),
+                               REC_ALIGN_ORDER);
+    int rc = -1;
+
+    for ( i = 0; i < batch->nr_deferred; ++i )
+        set_bit(batch->deferred[i], ctx->save.deferred_pages);
+    ctx->save.nr_deferred_pages += batch->nr_deferred;
+
+    ctx->save.nr_zero_pages += batch->nr_zero_pfns;
+    ctx->save.nr_unchanged_pages += batch->nr_unchanged;
+
+    /* iovec[] for writev(). */
+    iov = malloc((nr_pfns + 10) * sizeof(*iov));
+    if ( !iov )
     {
-        ERROR("Unable to allocate %zu bytes of memory for page data pfn list",
-              nr_pfns * sizeof(*rec_pfns));
+        ERROR("Unable to allocate iovec for a batch of %u pages", nr_pfns);
         goto err;
     }
 
+    if ( batch->nr_zero_pfns )
+    {
+        zero_hdr.count = batch->nr_zero_pfns;
+
+        zero_rec.length = sizeof(zero_hdr);
+        zero_rec.length += zero_hdr.count * sizeof(*batch->zero_pfns);
+
+        iov[iovcnt].iov_base = &zero_rec.type;
+        iov[iovcnt].iov_len = sizeof(zero_rec.type);
+        iovcnt++;
+
+        iov[iovcnt].iov_base = &zero_rec.length;
+        iov[iovcnt].iov_len = sizeof(zero_rec.length);
+        iovcnt++;
+
+        iov[iovcnt].iov_base = &zero_hdr;
+        iov[iovcnt].iov_len = sizeof(zero_hdr);
+        iovcnt++;
+
+        iov[iovcnt].iov_base = batch->zero_pfns;
+        iov[iovcnt].iov_len = zero_hdr.count * sizeof(*batch->zero_pfns);
+        iovcnt++;
+    }
+
+    if ( nr_pfns == 0 )
+        goto write;
+
     hdr.count = nr_pfns;
 
     rec.length = sizeof(hdr);
-    rec.length += nr_pfns * sizeof(*rec_pfns);
-    rec.length += nr_pages * PAGE_SIZE;
+    rec.length += nr_pfns * sizeof(*batch->rec_pfns);
 
-    for ( i = 0; i < nr_pfns; ++i )
-        rec_pfns[i] = ((uint64_t)(types[i]) << 32) | ctx->save.batch_pfns[i];
+    iov[iovcnt].iov_base = &rec.type;
+    iov[iovcnt].iov_len = sizeof(rec.type);
+    iovcnt++;
+
+    iov[iovcnt].iov_base = &rec.length;
+    iov[iovcnt].iov_len = sizeof(rec.length);
+    iovcnt++;
 
-    iov[0].iov_base = &rec.type;
-    iov[0].iov_len = sizeof(rec.type);
+    iov[iovcnt].iov_base = &hdr;
+    iov[iovcnt].iov_len = sizeof(hdr);
+    iovcnt++;
 
-    iov[1].iov_base = &rec.length;
-    iov[1].iov_len = sizeof(rec.length);
+    iov[iovcnt].iov_base = batch->rec_pfns;
+    iov[iovcnt].iov_len = nr_pfns * sizeof(*batch->rec_pfns);
+    iovcnt++;
 
-    iov[2].iov_base = &hdr;
-    iov[2].iov_len = sizeof(hdr);
+    if ( ctx->save.compress )
+    {
+        /* The sizes array is padded with zeroes past the used entries. */
+        memset(batch->sizes + nr_pages, 0,
+               sizes_len - nr_pages * sizeof(*batch->sizes));
+
+        rec.type = REC_TYPE_PAGE_DATA_COMPRESSED;
+        rec.length += sizes_len + batch->cdata_size;
 
-    iov[3].iov_base = rec_pfns;
-    iov[3].iov_len = nr_pfns * sizeof(*rec_pfns);
+        iov[iovcnt].iov_base = batch->sizes;
+        iov[iovcnt].iov_len = sizes_len;
+        iovcnt++;
 
-    iovcnt = 4;
+        iov[iovcnt].iov_base = batch->cdata;
+        iov[iovcnt].iov_len = batch->cdata_size;
+        iovcnt++;
 
-    if ( nr_pages )
+        iov[iovcnt].iov_base = (void *)zeroes;
+        iov[iovcnt].iov_len = ROUNDUP(rec.length, REC_ALIGN_ORDER) -
+                              rec.length;
+        iovcnt++;
+    }
+    else if ( nr_pages )
     {
-        for ( i = 0; i < nr_pfns; ++i )
+        rec.length += nr_pages * PAGE_SIZE;
+
+        for ( i = 0; i < batch->nr_pfns; ++i )
         {
-            if ( guest_data[i] )
+            if ( batch->guest_data[i] )
             {
-                iov[iovcnt].iov_base = guest_data[i];
+                iov[iovcnt].iov_base = batch->guest_data[i];
                 iov[iovcnt].iov_len = PAGE_SIZE;
                 iovcnt++;
                 --nr_pages;
             }
         }
+
+        /* Sanity check we have sent all the pages we expected to. */
+        assert(nr_pages == 0);
     }
 
-    if ( writev_exact(ctx->fd, iov, iovcnt) )
+ write:
+    if ( iovcnt && writev_exact(ctx->fd, iov, iovcnt) )
     {
         PERROR("Failed to write page data to stream");
         goto err;
     }
 
-    /* Sanity check we have sent all the pages we expected to. */
-    assert(nr_pages == 0);
-    rc = ctx->save.nr_batch_pfns = 0;
+    rc = 0;
 
  err:
-    free(rec_pfns);
-    if ( guest_mapping )
-        xenforeignmemory_unmap(xch->fmem, guest_mapping, nr_pages_mapped);
-    for ( i = 0; local_pages && i < nr_pfns; ++i )
-        free(local_pages[i]);
     free(iov);
-    free(local_pages);
-    free(guest_data);
-    free(errors);
-    free(types);
-    free(mfns);
 
     return rc;
 }
 
 /*
- * Flush a batch of pfns into the stream.
+ * Release the mappings and local pages of a batch, for reuse.
+ */
+static void release_batch(struct xc_sr_context *ctx,
+                          struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned i;
+
+    if ( batch->guest_mapping )
+        xenforeignmemory_unmap(xch->fmem, batch->guest_mapping,
+                               batch->nr_pages_mapped);
+    batch->guest_mapping = NULL;
+    batch->nr_pages_mapped = 0;
+
+    for ( i = 0; i < batch->nr_pfns; ++i )
+    {
+        free(batch->local_pages[i]);
+        batch->local_pages[i] = NULL;
+        batch->guest_data[i] = NULL;
+    }
+
+    batch->nr_pfns = 0;
+    batch->nr_rec_pfns = 0;
+    batch->nr_zero_pfns = 0;
+    batch->nr_unchanged = 0;
+    batch->nr_deferred = 0;
+}
+
+/*
+ * Wait for the oldest batch in flight, write it into the stream and release
+ * it.
+ */
+static int complete_batch(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_batch *batch =
+        &ctx->save.batches[ctx->save.batch_head];
+    int rc;
+
+    assert(ctx->save.nr_busy_batches);
+
+    wait_job(ctx, &batch->job);
+
+    rc = write_batch(ctx, batch);
+    release_batch(ctx, batch);
+
+    ctx->save.batch_head = (ctx->save.batch_head + 1) % ctx->save.nr_batches;
+    ctx->save.nr_busy_batches--;
+
+    return rc;
+}
+
+/*
+ * Write all batches in flight into the stream.
+ */
+static int complete_all_batches(struct xc_sr_context *ctx)
+{
+    int rc = 0;
+
+    while ( ctx->save.nr_busy_batches && !rc )
+        rc = complete_batch(ctx);
+
+    return rc;
+}
+
+/*
+ * Map the pfns collected in ctx->save.batch_pfns and hand them to a
+ * worker.  Once all
+ * batches are in flight, the oldest one is written into the stream first.
  */
 static int flush_batch(struct xc_sr_context *ctx)
 {
+    struct xc_sr_save_batch *batch;
+    xen_pfn_t *pfns;
     int rc = 0;
 
     if ( ctx->save.nr_batch_pfns == 0 )
         return rc;
 
-    rc = write_batch(ctx);
+    if ( ctx->save.nr_busy_batches == ctx->save.nr_batches )
+    {
+        rc = complete_batch(ctx);
+        if ( rc )
+            return rc;
+    }
 
-    if ( !rc )
+    batch = &ctx->save.batches[(ctx->save.batch_head +
+                                ctx->save.nr_busy_batches) %
+                               ctx->save.nr_batches];
+
+    /* Swap pfn arrays with the batch rather than copying. */
+    pfns = batch->pfns;
+    batch->pfns = ctx->save.batch_pfns;
+    batch->nr_pfns = ctx->save.nr_batch_pfns;
+    ctx->save.batch_pfns = pfns;
+    ctx->save.nr_batch_pfns = 0;
+
+    rc = map_batch(ctx, batch);
+    if ( rc )
     {
-        VALGRIND_MAKE_MEM_UNDEFINED(ctx->save.batch_pfns,
-                                    MAX_BATCH_SIZE *
-                                    sizeof(*ctx->save.batch_pfns));
+        release_batch(ctx, batch);
+        return rc;
     }
 
+    ctx->save.nr_busy_batches++;
+    queue_job(ctx, &batch->job);
+
+    VALGRIND_MAKE_MEM_UNDEFINED(ctx->save.batch_pfns,
+                                MAX_BATCH_SIZE *
+                                sizeof(*ctx->save.batch_pfns));
+
     return rc;
 }
 
@@ -314,6 +682,107 @@ static int add_to_batch(struct xc_sr_context *ctx, xen_pfn_t pfn)
     return rc;
 }
 
+static int alloc_batches(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_batch *batch;
+    unsigned i;
+
+    /* Enough to keep all workers busy while the main thread writes. */
+    ctx->save.nr_batches = ctx->workers.nr_threads + 1;
+    ctx->save.batches = calloc(ctx->save.nr_batches,
+                               sizeof(*ctx->save.batches));
+    if ( !ctx->save.batches )
+        return -1;
+
+    for ( i = 0; i < ctx->save.nr_batches; ++i )
+    {
+        batch = &ctx->save.batches[i];
+
+        batch->job.fn = process_batch_job;
+        batch->ctx = ctx;
+        batch->pfns = malloc(MAX_BATCH_SIZE * sizeof(*batch->pfns));
+        batch->mfns = malloc(MAX_BATCH_SIZE * sizeof(*batch->mfns));
+        batch->types = malloc(MAX_BATCH_SIZE * sizeof(*batch->types));
+        batch->errors = malloc(MAX_BATCH_SIZE * sizeof(*batch->errors));
+        batch->guest_data = calloc(MAX_BATCH_SIZE,
+                                   sizeof(*batch->guest_data));
+        batch->local_pages = calloc(MAX_BATCH_SIZE,
+                                    sizeof(*batch->local_pages));
+        batch->rec_pfns = malloc(MAX_BATCH_SIZE * sizeof(*batch->rec_pfns));
+        batch->zero_pfns = malloc(MAX_BATCH_SIZE * sizeof(*batch->zero_pfns));
+        batch->deferred = malloc(MAX_BATCH_SIZE * sizeof(*batch->deferred));
+
+        if ( !batch->pfns || !batch->mfns || !batch->types ||
+             !batch->errors || !batch->guest_data || !batch->local_pages ||
+             !batch->rec_pfns || !batch->zero_pfns || !batch->deferred )
+            return -1;
+
+        if ( ctx->save.page_hashes )
+        {
+            batch->copies = malloc(MAX_BATCH_SIZE * PAGE_SIZE);
+            if ( !batch->copies )
+                return -1;
+        }
+
+        if ( !ctx->save.compress )
+            continue;
+
+        /* Room for a worst case compression result past the last page. */
+        batch->cdata = malloc(MAX_BATCH_SIZE * PAGE_SIZE +
+                              lz4_compressbound(PAGE_SIZE));
+        batch->sizes = malloc(ROUNDUP(MAX_BATCH_SIZE * sizeof(*batch->sizes),
+                                      REC_ALIGN_ORDER));
+        batch->wrkmem = malloc(LZ4_MEM_COMPRESS);
+
+        if ( !batch->cdata || !batch->sizes || !batch->wrkmem )
+            return -1;
+    }
+
+    return 0;
+}
+
+static void free_batches(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_batch *batch;
+    unsigned i;
+
+    if ( !ctx->save.batches )
+        return;
+
+    /* Drain batches still in flight after an error. */
+    while ( ctx->save.nr_busy_batches )
+    {
+        batch = &ctx->save.batches[ctx->save.batch_head];
+        wait_job(ctx, &batch->job);
+        release_batch(ctx, batch);
+        ctx->save.batch_head = (ctx->save.batch_head + 1) %
+                               ctx->save.nr_batches;
+        ctx->save.nr_busy_batches--;
+    }
+
+    for ( i = 0; i < ctx->save.nr_batches; ++i )
+    {
+        batch = &ctx->save.batches[i];
+
+        free(batch->pfns);
+        free(batch->mfns);
+        free(batch->types);
+        free(batch->errors);
+        free(batch->guest_data);
+        free(batch->local_pages);
+        free(batch->copies);
+        free(batch->rec_pfns);
+        free(batch->zero_pfns);
+        free(batch->deferred);
+        free(batch->cdata);
+        free(batch->sizes);
+        free(batch->wrkmem);
+    }
+
+    free(ctx->save.batches);
+    ctx->save.batches = NULL;
+}
+
 /*
  * Pause/suspend the domain, and refresh ctx->dominfo if required.
  */
@@ -390,6 +859,10 @@ static int send_dirty_pages(struct xc_sr_context *ctx,
     if ( rc )
         return rc;
 
+    rc = complete_all_batches(ctx);
+    if ( rc )
+        return rc;
+
     if ( written > entries )
         DPRINTF("Bitmap contained more entries than expected...");
 
@@ -569,6 +1042,248 @@ static int colo_merge_secondary_dirty_bitmap(struct xc_sr_context *ctx)
     return rc;
 }
 
+/*
+ * Split the memory still dirty once the guest is suspended between pages
+ * sent now and pages sent after the guest resumes on the destination.  The
+ * latter are announced in POSTCOPY_PFNS records and left in
+ * ctx->save.postcopy_pfns.
+ */
+static int start_postcopy(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned long *postcopy = ctx->save.postcopy_pfns;
+    xen_pfn_t p, *pfns = NULL, *types = NULL;
+    uint64_t *rec_pfns = NULL;
+    unsigned i, nr, nr_rec;
+    struct xc_sr_rec_postcopy_pfns_header hdr = { 0 };
+    struct xc_sr_record rec =
+    {
+        .type = REC_TYPE_POSTCOPY_PFNS,
+        .length = sizeof(hdr),
+        .data = &hdr,
+    };
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    memcpy(postcopy, dirty_bitmap, bitmap_size(ctx->save.p2m_size));
+
+    rc = ctx->save.ops.postcopy_filter(ctx, postcopy);
+    if ( rc )
+        return rc;
+
+    rc = -1;
+    pfns = malloc(MAX_BATCH_SIZE * sizeof(*pfns));
+    types = malloc(MAX_BATCH_SIZE * sizeof(*types));
+    rec_pfns = malloc(MAX_BATCH_SIZE * sizeof(*rec_pfns));
+    if ( !pfns || !types || !rec_pfns )
+    {
+        ERROR("Unable to allocate memory for post-copy pfns");
+        goto out;
+    }
+
+    /* Only NOTAB pages are left for later, anything else is sent now. */
+    for ( p = 0; p < ctx->save.p2m_size; )
+    {
+        for ( nr = 0; nr < MAX_BATCH_SIZE && p < ctx->save.p2m_size; ++p )
+        {
+            if ( test_bit(p, postcopy) )
+            {
+                pfns[nr] = p;
+                types[nr] = ctx->save.ops.pfn_to_gfn(ctx, p);
+                nr++;
+            }
+        }
+
+        if ( nr == 0 )
+            break;
+
+        if ( xc_get_pfn_type_batch(xch, ctx->domid, nr, types) )
+        {
+            PERROR("Failed to get types for post-copy pfns");
+            goto out;
+        }
+
+        for ( i = 0, nr_rec = 0; i < nr; ++i )
+        {
+            if ( types[i] == XEN_DOMCTL_PFINFO_NOTAB )
+                rec_pfns[nr_rec++] = pfns[i];
+            else
+                clear_bit(pfns[i], postcopy);
+        }
+
+        if ( nr_rec == 0 )
+            continue;
+
+        hdr.count = nr_rec;
+        rc = write_split_record(ctx, &rec, rec_pfns,
+                                nr_rec * sizeof(*rec_pfns));
+        if ( rc )
+            goto out;
+        rc = -1;
+
+        ctx->save.nr_postcopy_pfns += nr_rec;
+    }
+
+    for ( p = 0; p < ctx->save.p2m_size; ++p )
+    {
+        if ( !test_bit(p, dirty_bitmap) || test_bit(p, postcopy) )
+            continue;
+
+        rc = add_to_batch(ctx, p);
+        if ( rc )
+            goto out;
+    }
+
+    rc = flush_batch(ctx);
+    if ( rc )
+        goto out;
+
+    rc = complete_all_batches(ctx);
+    if ( rc )
+        goto out;
+
+    /*
+     * The destination won't have the data of post-copy pages, whatever it
+     * had before, so they must all be sent.
+     */
+    free(ctx->save.page_hashes);
+    ctx->save.page_hashes = NULL;
+
+    DPRINTF("Sending %lu pages post-copy", ctx->save.nr_postcopy_pfns);
+
+ out:
+    free(rec_pfns);
+    free(types);
+    free(pfns);
+
+    return rc;
+}
+
+/*
+ * Read a POSTCOPY_FAULT record from the destination, and send the pages
+ * listed in it straight away.
+ */
+static int handle_postcopy_fault(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec;
+    struct xc_sr_rec_postcopy_fault *fault;
+    unsigned i;
+    int rc;
+
+    rc = read_record(ctx, ctx->save.recv_fd, &rec);
+    if ( rc )
+        return rc;
+
+    rc = -1;
+    fault = rec.data;
+
+    if ( rec.type != REC_TYPE_POSTCOPY_FAULT )
+    {
+        ERROR("Expected POSTCOPY_FAULT record, got %#x (%s)",
+              rec.type, rec_type_to_str(rec.type));
+        goto err;
+    }
+
+    if ( rec.length < sizeof(*fault) ||
+         rec.length != sizeof(*fault) + fault->count * sizeof(*fault->pfn) )
+    {
+        ERROR("POSTCOPY_FAULT record wrong size: length %u", rec.length);
+        goto err;
+    }
+
+    for ( i = 0; i < fault->count; ++i )
+    {
+        if ( fault->pfn[i] >= ctx->save.p2m_size ||
+             !test_and_clear_bit(fault->pfn[i], ctx->save.postcopy_pfns) )
+            /* Sent already, or on its way. */
+            continue;
+
+        ctx->save.nr_postcopy_pfns--;
+
+        rc = add_to_batch(ctx, fault->pfn[i]);
+        if ( rc )
+            goto err;
+        rc = -1;
+    }
+
+    rc = flush_batch(ctx);
+    if ( !rc )
+        rc = complete_all_batches(ctx);
+
+ err:
+    free(rec.data);
+
+    return rc;
+}
+
+/*
+ * Send the post-copy pages, following a POSTCOPY_TRANSITION record.  Pages
+ * the guest faults on are sent first, the others in the background.
+ */
+static int send_postcopy_pages(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec = { REC_TYPE_POSTCOPY_TRANSITION, 0, NULL };
+    struct pollfd pfd = { .fd = ctx->save.recv_fd, .events = POLLIN };
+    unsigned long total = ctx->save.nr_postcopy_pfns;
+    xen_pfn_t next = 0;
+    int rc;
+
+    rc = write_record(ctx, &rec);
+    if ( rc )
+        return rc;
+
+    xc_set_progress_prefix(xch, "Post-copy frames");
+
+    while ( ctx->save.nr_postcopy_pfns )
+    {
+        if ( ctx->save.recv_fd >= 0 )
+        {
+            rc = poll(&pfd, 1, 0);
+            if ( rc < 0 && errno != EINTR )
+            {
+                PERROR("Failed to poll for post-copy faults");
+                goto out;
+            }
+
+            if ( rc > 0 )
+            {
+                rc = handle_postcopy_fault(ctx);
+                if ( rc )
+                    goto out;
+                continue;
+            }
+        }
+
+        while ( ctx->save.nr_batch_pfns < MAX_BATCH_SIZE &&
+                next < ctx->save.p2m_size )
+        {
+            if ( test_and_clear_bit(next, ctx->save.postcopy_pfns) )
+            {
+                ctx->save.batch_pfns[ctx->save.nr_batch_pfns++] = next;
+                ctx->save.nr_postcopy_pfns--;
+            }
+            ++next;
+        }
+
+        rc = flush_batch(ctx);
+        if ( rc )
+            goto out;
+
+        xc_report_progress_step(xch, total - ctx->save.nr_postcopy_pfns,
+                                total);
+    }
+
+    rc = complete_all_batches(ctx);
+
+ out:
+    xc_set_progress_prefix(xch, NULL);
+
+    return rc;
+}
+
 /*
  * Suspend the domain and send dirty memory.
  * This is the last iteration of the live migration and the
@@ -620,7 +1335,11 @@ static int suspend_and_send_dirty(struct xc_sr_context *ctx)
         }
     }
 
-    rc = send_dirty_pages(ctx, stats.dirty_count + ctx->save.nr_deferred_pages);
+    if ( ctx->save.postcopy )
+        rc = start_postcopy(ctx);
+    else
+        rc = send_dirty_pages(ctx,
+                              stats.dirty_count + ctx->save.nr_deferred_pages);
     if ( rc )
         goto out;
 
@@ -650,6 +1369,11 @@ static int verify_frames(struct xc_sr_context *ctx)
     if ( rc )
         goto out;
 
+    /* Send everything again, unchanged or not. */
+    if ( ctx->save.page_hashes )
+        memset(ctx->save.page_hashes, 0,
+               ctx->save.p2m_size * sizeof(*ctx->save.page_hashes));
+
     xc_set_progress_prefix(xch, "Frames verify");
     rc = send_all_pages(ctx);
     if ( rc )
@@ -736,24 +1460,68 @@ static int send_domain_memory_nonlive(struct xc_sr_context *ctx)
 static int setup(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
+    bool hash_pages;
     int rc;
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->save.dirty_bitmap_hbuf);
 
+    if ( ctx->save.postcopy &&
+         (!ctx->save.ops.postcopy_filter || !ctx->save.live ||
+          ctx->save.checkpointed != XC_MIG_STREAM_NONE) )
+    {
+        ERROR("Post-copy is only supported for live migration of HVM guests");
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    /*
+     * Verify mode resends all of memory once the guest is suspended, while
+     * post-copy leaves the pages still dirty then until after the guest
+     * state.  Refuse the combination rather than sending a stream which
+     * does only one of the two.
+     */
+    if ( ctx->save.postcopy && ctx->save.debug )
+    {
+        ERROR("Post-copy can't be combined with verify mode (XCFLAGS_DEBUG)");
+        errno = EINVAL;
+        return -1;
+    }
+
     rc = ctx->save.ops.setup(ctx);
     if ( rc )
         goto err;
 
+    rc = start_workers(ctx, 0);
+    if ( rc )
+        goto err;
+
     dirty_bitmap = xc_hypercall_buffer_alloc_pages(
                    xch, dirty_bitmap, NRPAGES(bitmap_size(ctx->save.p2m_size)));
     ctx->save.batch_pfns = malloc(MAX_BATCH_SIZE *
                                   sizeof(*ctx->save.batch_pfns));
     ctx->save.deferred_pages = calloc(1, bitmap_size(ctx->save.p2m_size));
+    if ( ctx->save.postcopy )
+        ctx->save.postcopy_pfns = bitmap_alloc(ctx->save.p2m_size);
 
-    if ( !ctx->save.batch_pfns || !dirty_bitmap || !ctx->save.deferred_pages )
+    /*
+     * Page hashes only pay off when memory is sent more than once.  The
+     * COLO secondary runs and changes its memory, so they can't be used
+     * there.  Entries of pfns never sent are never touched, so a sparse
+     * p2m costs address space only.
+     */
+    hash_pages = ctx->save.live &&
+                 ctx->save.checkpointed != XC_MIG_STREAM_COLO;
+    if ( hash_pages )
+        ctx->save.page_hashes = calloc(ctx->save.p2m_size,
+                                       sizeof(*ctx->save.page_hashes));
+
+    if ( !ctx->save.batch_pfns || !dirty_bitmap ||
+         !ctx->save.deferred_pages || alloc_batches(ctx) ||
+         (hash_pages && !ctx->save.page_hashes) ||
+         (ctx->save.postcopy && !ctx->save.postcopy_pfns) )
     {
-        ERROR("Unable to allocate memory for dirty bitmaps, batch pfns and"
-              " deferred pages");
+        ERROR("Unable to allocate memory for dirty bitmaps, batches,"
+              " deferred pages and page hashes");
         rc = -1;
         errno = ENOMEM;
         goto err;
@@ -772,6 +1540,9 @@ static void cleanup(struct xc_sr_context *ctx)
                                     &ctx->save.dirty_bitmap_hbuf);
 
 
+    free_batches(ctx);
+    stop_workers(ctx);
+
     xc_shadow_control(xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_OFF,
                       NULL, 0, NULL, 0, NULL);
 
@@ -780,6 +1551,8 @@ static void cleanup(struct xc_sr_context *ctx)
 
     xc_hypercall_buffer_free_pages(xch, dirty_bitmap,
                                    NRPAGES(bitmap_size(ctx->save.p2m_size)));
+    free(ctx->save.postcopy_pfns);
+    free(ctx->save.page_hashes);
     free(ctx->save.deferred_pages);
     free(ctx->save.batch_pfns);
 }
@@ -840,6 +1613,13 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
         if ( rc )
             goto err;
 
+        if ( ctx->save.postcopy )
+        {
+            rc = send_postcopy_pages(ctx);
+            if ( rc )
+                goto err;
+        }
+
         if ( ctx->save.checkpointed != XC_MIG_STREAM_NONE )
         {
             /*
@@ -889,6 +1669,9 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
         }
     } while ( ctx->save.checkpointed != XC_MIG_STREAM_NONE );
 
+    DPRINTF("Elided %lu zero pages and %lu unchanged pages",
+            ctx->save.nr_zero_pages, ctx->save.nr_unchanged_pages);
+
     xc_report_progress_single(xch, "End of stream");
 
     rc = write_end_record(ctx);
@@ -930,6 +1713,9 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.save.callbacks = callbacks;
     ctx.save.live  = !!(flags & XCFLAGS_LIVE);
     ctx.save.debug = !!(flags & XCFLAGS_DEBUG);
+    ctx.save.compress = !!(flags & XCFLAGS_STREAM_COMPRESS);
+    ctx.save.zero_pages = !!(flags & XCFLAGS_STREAM_ZERO_PAGES);
+    ctx.save.postcopy = !!(flags & XCFLAGS_POSTCOPY);
     ctx.save.checkpointed = stream_type;
     ctx.save.recv_fd = recv_fd;
 
@@ -947,6 +1733,13 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.save.max_iterations = 5;
     ctx.save.dirty_threshold = 50;
 
+    /*
+     * Post-copy sends whatever is dirty after the first pass once, so
+     * further passes would only add to the total.
+     */
+    if ( ctx.save.postcopy )
+        ctx.save.max_iterations = 1;
+
     /* Sanity checks for callbacks. */
     if ( hvm )
         assert(callbacks->switch_qemu_logdirty);
@@ -204,6 +204,85 @@ static int x86_hvm_end_of_checkpoint(struct xc_sr_context *ctx)
     return 0;
 }
 
+/*
+ * Keep pages named by HVM params out of a post-copy migration: they are
+ * accessed by Xen and the toolstack on the restoring side, which can't wait
+ * for them to be faulted in.
+ */
+static int x86_hvm_postcopy_filter(struct xc_sr_context *ctx,
+                                   unsigned long *bitmap)
+{
+    static const unsigned int pfn_params[] = {
+        HVM_PARAM_STORE_PFN,
+        HVM_PARAM_IOREQ_PFN,
+        HVM_PARAM_BUFIOREQ_PFN,
+        HVM_PARAM_PAGING_RING_PFN,
+        HVM_PARAM_MONITOR_RING_PFN,
+        HVM_PARAM_SHARING_RING_PFN,
+        HVM_PARAM_CONSOLE_PFN,
+    };
+    static const unsigned int addr_params[] = {
+        HVM_PARAM_IDENT_PT,
+        HVM_PARAM_VM_GENERATION_ID_ADDR,
+    };
+    xc_interface *xch = ctx->xch;
+    uint64_t value, nr;
+    unsigned int i;
+    int rc;
+
+    for ( i = 0; i < ARRAY_SIZE(pfn_params) + ARRAY_SIZE(addr_params); i++ )
+    {
+        uint32_t index = i < ARRAY_SIZE(pfn_params) ? pfn_params[i] :
+            addr_params[i - ARRAY_SIZE(pfn_params)];
+
+        rc = xc_hvm_param_get(xch, ctx->domid, index, &value);
+        if ( rc )
+        {
+            PERROR("Failed to get HVMPARAM at index %u", index);
+            return rc;
+        }
+
+        if ( i >= ARRAY_SIZE(pfn_params) )
+            value >>= PAGE_SHIFT;
+
+        if ( value && value < ctx->save.p2m_size )
+            clear_bit(value, bitmap);
+    }
+
+    rc = xc_hvm_param_get(xch, ctx->domid, HVM_PARAM_IOREQ_SERVER_PFN, &value);
+    if ( !rc )
+        rc = xc_hvm_param_get(xch, ctx->domid,
+                              HVM_PARAM_NR_IOREQ_SERVER_PAGES, &nr);
+    if ( rc )
+    {
+        PERROR("Failed to get ioreq server pages");
+        return rc;
+    }
+
+    for ( ; nr && value < ctx->save.p2m_size; nr--, value++ )
+        clear_bit(value, bitmap);
+
+    /* The VM86 TSS, if any, is in the low 32 bits, its size above. */
+    rc = xc_hvm_param_get(xch, ctx->domid, HVM_PARAM_VM86_TSS_SIZED, &value);
+    if ( rc )
+    {
+        PERROR("Failed to get HVM_PARAM_VM86_TSS_SIZED");
+        return rc;
+    }
+
+    if ( (uint32_t)value )
+    {
+        uint64_t pfn = (uint32_t)value >> PAGE_SHIFT;
+        uint64_t end = ((uint32_t)value + (value >> 32) + PAGE_SIZE - 1) >>
+                       PAGE_SHIFT;
+
+        for ( ; pfn < end && pfn < ctx->save.p2m_size; pfn++ )
+            clear_bit(pfn, bitmap);
+    }
+
+    return 0;
+}
+
 static int x86_hvm_cleanup(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
@@ -229,6 +308,7 @@ struct xc_sr_save_ops save_ops_x86_hvm =
     .start_of_checkpoint = x86_hvm_start_of_checkpoint,
     .end_of_checkpoint   = x86_hvm_end_of_checkpoint,
     .check_vm_state      = x86_hvm_check_vm_state,
+    .postcopy_filter     = x86_hvm_postcopy_filter,
     .cleanup             = x86_hvm_cleanup,
 };
 
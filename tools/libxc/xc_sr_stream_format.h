@@ -76,6 +76,11 @@ struct xc_sr_rhdr
 #define REC_TYPE_VERIFY                     0x0000000dU
 #define REC_TYPE_CHECKPOINT                 0x0000000eU
 #define REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST  0x0000000fU
+#define REC_TYPE_PAGE_DATA_COMPRESSED       0x00000010U
+#define REC_TYPE_PAGE_DATA_ZERO             0x00000011U
+#define REC_TYPE_POSTCOPY_PFNS              0x00000012U
+#define REC_TYPE_POSTCOPY_TRANSITION        0x00000013U
+#define REC_TYPE_POSTCOPY_FAULT             0x00000014U
 
 #define REC_TYPE_OPTIONAL             0x80000000U
 
@@ -90,6 +95,57 @@ struct xc_sr_rec_page_data_header
 #define PAGE_DATA_PFN_MASK  0x000fffffffffffffULL
 #define PAGE_DATA_TYPE_MASK 0xf000000000000000ULL
 
+/*
+ * PAGE_DATA_COMPRESSED
+ *
+ * The pfn array is followed by a uint32_t array with the size of each page
+ * worth of data, padded to 8 octets, and the data.  Pages of page size are
+ * stored uncompressed, others as LZ4 blocks.
+ */
+struct xc_sr_rec_page_data_compressed_header
+{
+    uint32_t count;
+    uint32_t _res1;
+    uint64_t pfn[0];
+};
+
+/*
+ * PAGE_DATA_ZERO
+ *
+ * A pfn array as in PAGE_DATA, of NOTAB pages only, and no data: the pages
+ * are all zeroes.
+ */
+struct xc_sr_rec_page_data_zero_header
+{
+    uint32_t count;
+    uint32_t _res1;
+    uint64_t pfn[0];
+};
+
+/*
+ * POSTCOPY_PFNS
+ *
+ * A pfn array as in PAGE_DATA, of NOTAB pages only, whose data will follow
+ * after the POSTCOPY_TRANSITION record.
+ */
+struct xc_sr_rec_postcopy_pfns_header
+{
+    uint32_t count;
+    uint32_t _res1;
+    uint64_t pfn[0];
+};
+
+/*
+ * POSTCOPY_FAULT, from the receiver back to the sender: an array of pfns the
+ * guest is waiting for.
+ */
+struct xc_sr_rec_postcopy_fault
+{
+    uint32_t count;
+    uint32_t _res1;
+    uint64_t pfn[0];
+};
+
 /* X86_PV_INFO */
 struct xc_sr_rec_x86_pv_info
 {
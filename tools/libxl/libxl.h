@@ -287,6 +287,12 @@
  */
 #define LIBXL_HAVE_SCHED_CREDIT2_PARAMS 1
 
+/*
+ * LIBXL_HAVE_SCHED_CREDIT2_CAP indicates that the cap field of
+ * libxl_domain_sched_params is honoured by the Credit2 scheduler too.
+ */
+#define LIBXL_HAVE_SCHED_CREDIT2_CAP 1
+
 /*
  * libxl ABI compatibility
  *
@@ -1019,6 +1025,25 @@ void libxl_mac_copy(libxl_ctx *ctx, libxl_mac *dst, const libxl_mac *src);
  */
 #define LIBXL_HAVE_QED 1
 
+/*
+ * LIBXL_HAVE_SUSPEND_COMPRESS
+ *
+ * If this is defined, libxl_domain_suspend() accepts LIBXL_SUSPEND_COMPRESS
+ * to have the page data in the stream compressed.  Restoring such a stream
+ * requires a libxl with this define.
+ */
+#define LIBXL_HAVE_SUSPEND_COMPRESS 1
+
+/*
+ * LIBXL_HAVE_SUSPEND_ZERO_PAGES
+ *
+ * If this is defined, libxl_domain_suspend() accepts
+ * LIBXL_SUSPEND_ZERO_PAGES to have pages of zeroes listed in the stream
+ * rather than sent in full.  Restoring such a stream requires a libxl with
+ * this define.
+ */
+#define LIBXL_HAVE_SUSPEND_ZERO_PAGES 1
+
 typedef char **libxl_string_list;
 void libxl_string_list_dispose(libxl_string_list *sl);
 int libxl_string_list_length(const libxl_string_list *sl);
@@ -1368,6 +1393,8 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd,
                          LIBXL_EXTERNAL_CALLERS_ONLY;
 #define LIBXL_SUSPEND_DEBUG 1
 #define LIBXL_SUSPEND_LIVE 2
+#define LIBXL_SUSPEND_COMPRESS 4
+#define LIBXL_SUSPEND_ZERO_PAGES 8
 
 /* @param suspend_cancel [from xenctrl.h:xc_domain_resume( @param fast )]
  *   If this parameter is true, use co-operative resume. The guest
@@ -376,6 +376,8 @@ void libxl__domain_save(libxl__egc *egc, libxl__domain_save_state *dss)
 
     dss->xcflags = (live ? XCFLAGS_LIVE : 0)
           | (debug ? XCFLAGS_DEBUG : 0)
+          | (dss->compress ? XCFLAGS_STREAM_COMPRESS : 0)
+          | (dss->zero_pages ? XCFLAGS_STREAM_ZERO_PAGES : 0)
           | (dss->hvm ? XCFLAGS_HVM : 0);
 
     /* Disallow saving a guest with vNUMA configured because migration
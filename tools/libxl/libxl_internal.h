@@ -3291,6 +3291,8 @@ struct libxl__domain_save_state {
     libxl_domain_type type;
     int live;
     int debug;
+    int compress;
+    int zero_pages;
     int checkpointed_stream;
     const libxl_domain_remus_info *remus;
     /* private */
@@ -391,6 +391,7 @@ static int sched_credit2_domain_get(libxl__gc *gc, uint32_t domid,
     libxl_domain_sched_params_init(scinfo);
     scinfo->sched = LIBXL_SCHEDULER_CREDIT2;
     scinfo->weight = sdom.weight;
+    scinfo->cap = sdom.cap;
 
     return 0;
 }
@@ -399,13 +400,23 @@ static int sched_credit2_domain_set(libxl__gc *gc, uint32_t domid,
                                     const libxl_domain_sched_params *scinfo)
 {
     struct xen_domctl_sched_credit2 sdom;
+    xc_domaininfo_t domaininfo;
     int rc;
 
-    rc = xc_sched_credit2_domain_get(CTX->xch, domid, &sdom);
-    if (rc != 0) {
-        LOGED(ERROR, domid, "Getting domain sched credit2");
+    rc = xc_domain_getinfolist(CTX->xch, domid, 1, &domaininfo);
+    if (rc < 0) {
+        LOGED(ERROR, domid, "Getting domain info list");
         return ERROR_FAIL;
     }
+    if (rc != 1 || domaininfo.domain != domid)
+        return ERROR_INVAL;
+
+    /*
+     * A weight of 0 and a cap of ~0 tell Xen to leave the parameter
+     * alone, so only what the caller asked for is changed.
+     */
+    sdom.weight = 0;
+    sdom.cap = (uint16_t)~0U;
 
     if (scinfo->weight != LIBXL_DOMAIN_SCHED_PARAM_WEIGHT_DEFAULT) {
         if (scinfo->weight < 1 || scinfo->weight > 65535) {
@@ -416,6 +427,17 @@ static int sched_credit2_domain_set(libxl__gc *gc, uint32_t domid,
         sdom.weight = scinfo->weight;
     }
 
+    if (scinfo->cap != LIBXL_DOMAIN_SCHED_PARAM_CAP_DEFAULT) {
+        if (scinfo->cap < 0
+            || scinfo->cap > (domaininfo.max_vcpu_id + 1) * 100) {
+            LOGD(ERROR, domid, "Cpu cap out of range, "
+                 "valid range is from 0 to %d for specified number of vcpus",
+                 ((domaininfo.max_vcpu_id + 1) * 100));
+            return ERROR_INVAL;
+        }
+        sdom.cap = scinfo->cap;
+    }
+
     rc = xc_sched_credit2_domain_set(CTX->xch, domid, &sdom);
     if ( rc < 0 ) {
         LOGED(ERROR, domid, "Setting domain sched credit2");
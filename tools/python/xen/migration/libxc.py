@@ -65,6 +65,11 @@ REC_TYPE_x86_pv_vcpu_msrs           = 0x0000000c
 REC_TYPE_verify                     = 0x0000000d
 REC_TYPE_checkpoint                 = 0x0000000e
 REC_TYPE_checkpoint_dirty_pfn_list  = 0x0000000f
+REC_TYPE_page_data_compressed       = 0x00000010
+REC_TYPE_page_data_zero             = 0x00000011
+REC_TYPE_postcopy_pfns              = 0x00000012
+REC_TYPE_postcopy_transition        = 0x00000013
+REC_TYPE_postcopy_fault             = 0x00000014
 
 rec_type_to_str = {
     REC_TYPE_end                        : "End",
@@ -82,7 +87,12 @@ rec_type_to_str = {
     REC_TYPE_x86_pv_vcpu_msrs           : "x86 PV vcpu msrs",
     REC_TYPE_verify                     : "Verify",
     REC_TYPE_checkpoint                 : "Checkpoint",
-    REC_TYPE_checkpoint_dirty_pfn_list  : "Checkpoint dirty pfn list"
+    REC_TYPE_checkpoint_dirty_pfn_list  : "Checkpoint dirty pfn list",
+    REC_TYPE_page_data_compressed       : "Page data compressed",
+    REC_TYPE_page_data_zero             : "Page data zero",
+    REC_TYPE_postcopy_pfns              : "Postcopy pfns",
+    REC_TYPE_postcopy_transition        : "Postcopy transition",
+    REC_TYPE_postcopy_fault             : "Postcopy fault",
 }
 
 # page_data
@@ -209,7 +219,8 @@ class VerifyLibxc(VerifyBase):
         contentsz = (length + 7) & ~7
         content = self.rdexact(contentsz)
 
-        if rtype != REC_TYPE_page_data:
+        if rtype not in (REC_TYPE_page_data, REC_TYPE_page_data_compressed,
+                         REC_TYPE_page_data_zero):
 
             if self.squashed_pagedata_records > 0:
                 self.info("Squashed %d Page Data records together"
@@ -242,7 +253,7 @@ class VerifyLibxc(VerifyBase):
             raise RecordError("End record with non-zero length")
 
 
-    def verify_record_page_data(self, content):
+    def verify_record_page_data(self, content, compressed=False, zero=False):
         """ Page Data record """
         minsz = calcsize(PAGE_DATA_FORMAT)
 
@@ -274,12 +285,36 @@ class VerifyLibxc(VerifyBase):
                 raise RecordError("Invalid type value in pfn[%d]: 0x%016x",
                                   idx, pfn & PAGE_DATA_TYPE_LTAB_MASK)
 
+            if zero and \
+                    (pfn & PAGE_DATA_TYPE_LTAB_MASK) != PAGE_DATA_TYPE_NOTAB:
+                raise RecordError("Non-NOTAB type in PAGE_DATA_ZERO pfn[%d]: "
+                                  "0x%016x" % (idx, pfn))
+
             # We expect page data for each normal page or pagetable
             if PAGE_DATA_TYPE_NOTAB <= (pfn & PAGE_DATA_TYPE_LTABTYPE_MASK) \
                     <= PAGE_DATA_TYPE_L4TAB:
                 nr_pages += 1
 
-        pagesz = nr_pages * 4096
+        if zero:
+            pagesz = 0
+        elif compressed:
+            sizesz = (nr_pages * 4 + 7) & ~7
+            if len(content) < minsz + pfnsz + sizesz:
+                raise RecordError("PAGE_DATA_COMPRESSED record must contain a "
+                                  "size for each page")
+
+            sizes = unpack("=%dI" % (nr_pages, ),
+                           content[minsz + pfnsz:
+                                   minsz + pfnsz + nr_pages * 4])
+            for idx, size in enumerate(sizes):
+                if not 0 < size <= 4096:
+                    raise RecordError("Invalid size of page %d: %d"
+                                      % (idx, size))
+
+            pagesz = sizesz + sum(sizes)
+        else:
+            pagesz = nr_pages * 4096
+
         if len(content) != minsz + pfnsz + pagesz:
             raise RecordError("Expected %u + %u + %u, got %u"
                               % (minsz, pfnsz, pagesz, len(content)))
@@ -414,6 +449,50 @@ class VerifyLibxc(VerifyBase):
         raise RecordError("Found checkpoint dirty pfn list record in stream")
 
 
+    def verify_record_postcopy_pfns(self, content):
+        """ postcopy pfns record """
+        minsz = calcsize(PAGE_DATA_FORMAT)
+
+        if len(content) <= minsz:
+            raise RecordError("POSTCOPY_PFNS record must be at least %d bytes "
+                              "long" % (minsz, ))
+
+        count, res1 = unpack(PAGE_DATA_FORMAT, content[:minsz])
+
+        if res1 != 0:
+            raise StreamError("Reserved bits set in POSTCOPY_PFNS record "
+                              "0x%04x" % (res1, ))
+
+        if len(content) != minsz + count * 8:
+            raise RecordError("POSTCOPY_PFNS record wrong size: count %d, "
+                              "length %d" % (count, len(content)))
+
+        pfns = unpack("=%dQ" % (count,), content[minsz:])
+
+        for idx, pfn in enumerate(pfns):
+
+            if pfn & PAGE_DATA_PFN_RESZ_MASK:
+                raise RecordError("Reserved bits set in pfn[%d]: 0x%016x"
+                                  % (idx, pfn & PAGE_DATA_PFN_RESZ_MASK))
+
+            if (pfn & PAGE_DATA_TYPE_LTAB_MASK) != PAGE_DATA_TYPE_NOTAB:
+                raise RecordError("Non-NOTAB type in POSTCOPY_PFNS pfn[%d]: "
+                                  "0x%016x" % (idx, pfn))
+
+
+    def verify_record_postcopy_transition(self, content):
+        """ postcopy transition record """
+
+        if len(content) != 0:
+            raise RecordError("Postcopy transition record with non-zero "
+                              "length")
+
+
+    def verify_record_postcopy_fault(self, content):
+        """ postcopy fault """
+        raise RecordError("Found postcopy fault record in stream")
+
+
 record_verifiers = {
     REC_TYPE_end:
         VerifyLibxc.verify_record_end,
@@ -455,4 +534,16 @@ record_verifiers = {
         VerifyLibxc.verify_record_checkpoint,
     REC_TYPE_checkpoint_dirty_pfn_list:
         VerifyLibxc.verify_record_checkpoint_dirty_pfn_list,
+    REC_TYPE_page_data_compressed:
+        lambda s, x:
+        VerifyLibxc.verify_record_page_data(s, x, compressed=True),
+    REC_TYPE_page_data_zero:
+        lambda s, x:
+        VerifyLibxc.verify_record_page_data(s, x, zero=True),
+    REC_TYPE_postcopy_pfns:
+        VerifyLibxc.verify_record_postcopy_pfns,
+    REC_TYPE_postcopy_transition:
+        VerifyLibxc.verify_record_postcopy_transition,
+    REC_TYPE_postcopy_fault:
+        VerifyLibxc.verify_record_postcopy_fault,
     }
@@ -0,0 +1,34 @@
+/*
+ * Xen emulation for the credit2 runqueue harness
+ *
+ * What common/rbtree.c needs from the hypervisor environment is all in
+ * ../emul-common.h; this only adds the tree itself.
+ *
+ * This file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2 (GPLv2)
+ * as published by the Free Software Foundation.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details. <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CREDIT2_RUNQ_TEST_EMUL_H__
+#define __CREDIT2_RUNQ_TEST_EMUL_H__
+
+#include "../emul-common.h"
+
+#include "rbtree.h"
+
+#endif /* __CREDIT2_RUNQ_TEST_EMUL_H__ */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
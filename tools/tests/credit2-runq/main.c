@@ -0,0 +1,285 @@
+/*
+ * Replay of credit2 runqueue activity, comparing the credit ordered linked
+ * list credit2 used to keep runnable vcpus in with the red-black tree it
+ * uses now.
+ *
+ * A set of pcpus sharing a runqueue repeatedly burn some of their current
+ * vcpu's credit and schedule: the vcpu either blocks or goes back on the
+ * runqueue, and the first vcpu of the runqueue allowed on the pcpu is
+ * picked.  Blocked vcpus wake up at random.  Credits are reset when the
+ * picked vcpu runs out, without resorting the runqueue, as credit2 does.
+ *
+ * Both runqueues are driven with the same sequence of events, and must
+ * pick the same vcpus.
+ *
+ * Usage: test_credit2_runq [<events> [<max-vcpus>]]
+ *
+ * This file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2 (GPLv2)
+ * as published by the Free Software Foundation.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details. <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#include "emul.h"
+
+#define NR_PCPUS     16
+#define CREDIT_INIT  10500000
+#define CARRYOVER    (CREDIT_INIT / 2)
+
+struct vcpu {
+    unsigned int id;
+    int credit;
+    /* Pcpus the vcpu may run on, as a bitmap. */
+    unsigned int affinity;
+    int running, on_runq;
+    struct list_head runq_elem;
+    struct rb_node runq_node;
+};
+
+struct runq_ops {
+    const char *name;
+    void (*init)(void);
+    void (*insert)(struct vcpu *v);
+    void (*remove)(struct vcpu *v);
+    /* First vcpu on the runqueue which may run on cpu. */
+    struct vcpu *(*candidate)(unsigned int cpu);
+};
+
+static struct list_head list_runq;
+
+static void list_init(void)
+{
+    INIT_LIST_HEAD(&list_runq);
+}
+
+static void list_insert(struct vcpu *v)
+{
+    struct list_head *iter;
+
+    list_for_each( iter, &list_runq )
+        if ( v->credit > list_entry(iter, struct vcpu, runq_elem)->credit )
+            break;
+    list_add_tail(&v->runq_elem, iter);
+}
+
+static void list_remove(struct vcpu *v)
+{
+    list_del_init(&v->runq_elem);
+}
+
+static struct vcpu *list_candidate(unsigned int cpu)
+{
+    struct list_head *iter;
+
+    list_for_each( iter, &list_runq )
+    {
+        struct vcpu *v = list_entry(iter, struct vcpu, runq_elem);
+
+        if ( v->affinity & (1u << cpu) )
+            return v;
+    }
+
+    return NULL;
+}
+
+static struct rb_root tree_runq;
+
+static void tree_init(void)
+{
+    tree_runq = RB_ROOT;
+}
+
+/* As runq_insert() in common/sched_credit2.c. */
+static void tree_insert(struct vcpu *v)
+{
+    struct rb_node **link, *parent = NULL;
+
+    for ( link = &tree_runq.rb_node; *link; )
+    {
+        parent = *link;
+        if ( v->credit > rb_entry(parent, struct vcpu, runq_node)->credit )
+            link = &parent->rb_left;
+        else
+            link = &parent->rb_right;
+    }
+    rb_link_node(&v->runq_node, parent, link);
+    rb_insert_color(&v->runq_node, &tree_runq);
+}
+
+static void tree_remove(struct vcpu *v)
+{
+    rb_erase(&v->runq_node, &tree_runq);
+}
+
+static struct vcpu *tree_candidate(unsigned int cpu)
+{
+    struct rb_node *iter;
+
+    for ( iter = rb_first(&tree_runq); iter; iter = rb_next(iter) )
+    {
+        struct vcpu *v = rb_entry(iter, struct vcpu, runq_node);
+
+        if ( v->affinity & (1u << cpu) )
+            return v;
+    }
+
+    return NULL;
+}
+
+static const struct runq_ops runqs[] = {
+    { "list", list_init, list_insert, list_remove, list_candidate },
+    { "tree", tree_init, tree_insert, tree_remove, tree_candidate },
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void reset_credit(struct vcpu *vcpus, unsigned int nr)
+{
+    unsigned int i;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        vcpus[i].credit += CREDIT_INIT;
+        if ( vcpus[i].credit > CREDIT_INIT + CARRYOVER )
+            vcpus[i].credit = CREDIT_INIT + CARRYOVER;
+    }
+}
+
+/*
+ * Replay events on nr vcpus, returning a checksum of the vcpus picked, and
+ * accounting the time spent in the runqueue operations in *time.
+ */
+static uint64_t replay(const struct runq_ops *ops, struct vcpu *vcpus,
+                       unsigned int nr, unsigned int events, uint64_t *time)
+{
+    struct vcpu *curr[NR_PCPUS] = { NULL };
+    uint64_t sum = 0, t;
+    unsigned int i;
+
+    srand(nr);
+    ops->init();
+    for ( i = 0; i < nr; i++ )
+    {
+        vcpus[i].id = i;
+        vcpus[i].credit = CREDIT_INIT;
+        /* A quarter of the vcpus are pinned to half of the pcpus. */
+        vcpus[i].affinity = (i & 3) ? ~0u : 0x5555u;
+        vcpus[i].running = 0;
+        vcpus[i].on_runq = 0;
+    }
+
+    *time = 0;
+    for ( i = 0; i < events; i++ )
+    {
+        unsigned int cpu = rand() % NR_PCPUS;
+        struct vcpu *v = &vcpus[rand() % nr], *next;
+
+        /* Wakeup of a blocked vcpu. */
+        if ( rand() & 1 )
+        {
+            if ( !v->running && !v->on_runq )
+            {
+                t = now_ns();
+                ops->insert(v);
+                *time += now_ns() - t;
+                v->on_runq = 1;
+            }
+            continue;
+        }
+
+        /* Schedule on cpu: its vcpu blocks or goes back on the runqueue. */
+        v = curr[cpu];
+        t = now_ns();
+        if ( v )
+        {
+            v->credit -= rand() % (CREDIT_INIT / 4);
+            v->running = 0;
+            if ( rand() % 4 )
+            {
+                ops->insert(v);
+                v->on_runq = 1;
+            }
+        }
+
+        next = ops->candidate(cpu);
+        if ( next )
+        {
+            ops->remove(next);
+            next->on_runq = 0;
+            next->running = 1;
+            if ( next->credit <= 0 )
+                reset_credit(vcpus, nr);
+        }
+        *time += now_ns() - t;
+
+        curr[cpu] = next;
+        if ( next )
+            sum = sum * 31 + next->id;
+    }
+
+    return sum;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int events = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+    unsigned int max_vcpus = argc > 2 ? strtoul(argv[2], NULL, 0) : 1024;
+    unsigned int nr, i;
+
+    printf("%10s", "vcpus");
+    for ( i = 0; i < ARRAY_SIZE(runqs); i++ )
+        printf(" %9s ns/event", runqs[i].name);
+    printf("\n");
+
+    for ( nr = 16; nr <= max_vcpus; nr *= 2 )
+    {
+        struct vcpu *vcpus = calloc(nr, sizeof(*vcpus));
+        uint64_t sum[ARRAY_SIZE(runqs)], time;
+
+        if ( vcpus == NULL )
+            return 1;
+
+        printf("%10u", nr);
+        for ( i = 0; i < ARRAY_SIZE(runqs); i++ )
+        {
+            sum[i] = replay(&runqs[i], vcpus, nr, events, &time);
+            printf(" %18.1f", (double)time / events);
+        }
+        printf("\n");
+
+        for ( i = 1; i < ARRAY_SIZE(runqs); i++ )
+            if ( sum[i] != sum[0] )
+            {
+                printf("%s and %s picked different vcpus\n",
+                       runqs[0].name, runqs[i].name);
+                return 1;
+            }
+
+        free(vcpus);
+    }
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
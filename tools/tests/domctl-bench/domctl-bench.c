@@ -0,0 +1,235 @@
+/*
+ * domctl-bench.c
+ *
+ * Measure how domain construction scales when done in parallel, as a
+ * toolstack starting many guests at once would.  Each thread repeatedly
+ * creates a domain, runs the usual sequence of build time domctls against
+ * it and destroys it again.  The run is repeated with 1, 2, 4, ... threads
+ * up to the requested maximum.  Optionally the domains get created as HVM
+ * guests with a shadow/HAP pool, whose (de)allocation is one of the slower
+ * domctls.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <xenctrl.h>
+
+struct bench {
+    unsigned int max_threads, iterations, vcpus;
+    unsigned long pool_mb;
+    int hvm;
+};
+
+struct worker {
+    const struct bench *b;
+    pthread_t thread;
+    unsigned int done;
+    int rc;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Create, configure and destroy one domain. */
+static int build_one(xc_interface *xch, const struct bench *b)
+{
+    xen_domain_handle_t handle = { 0 };
+    xc_domain_configuration_t config = {
+        .emulation_flags = b->hvm ? XEN_X86_EMU_ALL : 0,
+    };
+    uint32_t flags = b->hvm ? XEN_DOMCTL_CDF_hvm_guest | XEN_DOMCTL_CDF_hap
+                            : 0;
+    uint32_t domid = 0;
+    xc_dominfo_t info;
+    unsigned long mb = b->pool_mb;
+    int rc;
+
+    rc = xc_domain_create(xch, 0, handle, flags, &domid, &config);
+    if ( rc )
+    {
+        perror("xc_domain_create");
+        return rc;
+    }
+
+    if ( (rc = xc_domain_max_vcpus(xch, domid, b->vcpus)) )
+        perror("xc_domain_max_vcpus");
+    else if ( (rc = xc_domain_setmaxmem(xch, domid, 256 << 10)) )
+        perror("xc_domain_setmaxmem");
+    else if ( b->hvm && mb &&
+              (rc = xc_shadow_control(xch, domid,
+                                      XEN_DOMCTL_SHADOW_OP_SET_ALLOCATION,
+                                      NULL, 0, &mb, 0, NULL)) )
+        perror("xc_shadow_control");
+    else if ( (rc = xc_domain_getinfo(xch, domid, 1, &info)) != 1 )
+    {
+        perror("xc_domain_getinfo");
+        rc = -1;
+    }
+    else
+        rc = 0;
+
+    if ( xc_domain_destroy(xch, domid) )
+    {
+        perror("xc_domain_destroy");
+        rc = -1;
+    }
+
+    return rc;
+}
+
+static void *worker_fn(void *arg)
+{
+    struct worker *w = arg;
+    xc_interface *xch = xc_interface_open(NULL, NULL, 0);
+
+    if ( !xch )
+    {
+        perror("xc_interface_open");
+        w->rc = -1;
+        return NULL;
+    }
+
+    for ( w->done = 0; w->done < w->b->iterations; w->done++ )
+        if ( (w->rc = build_one(xch, w->b)) )
+            break;
+
+    xc_interface_close(xch);
+
+    return NULL;
+}
+
+static int run(const struct bench *b, unsigned int nr_threads)
+{
+    struct worker *w = calloc(nr_threads, sizeof(*w));
+    unsigned int i, done = 0;
+    double t;
+    int rc = 0;
+
+    if ( !w )
+    {
+        perror("calloc");
+        return -1;
+    }
+
+    t = now();
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        w[i].b = b;
+        if ( (errno = pthread_create(&w[i].thread, NULL, worker_fn, &w[i])) )
+        {
+            perror("pthread_create");
+            nr_threads = i;
+            rc = -1;
+            break;
+        }
+    }
+
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        pthread_join(w[i].thread, NULL);
+        done += w[i].done;
+        if ( w[i].rc )
+            rc = -1;
+    }
+    t = now() - t;
+
+    printf("%3u threads: %6u domains in %8.3f s, %8.1f domains/s\n",
+           nr_threads, done, t, done / t);
+
+    free(w);
+
+    return rc;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -t <count>   maximum number of threads (default 8)\n"
+            "  -i <count>   domains built per thread (default 50)\n"
+            "  -v <count>   vcpus per domain (default 1)\n"
+            "  -H           build HVM (HAP) domains\n"
+            "  -p <MiB>     paging pool of HVM domains (default 4)\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench b = {
+        .max_threads = 8,
+        .iterations = 50,
+        .vcpus = 1,
+        .pool_mb = 4,
+    };
+    unsigned int nr;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "t:i:v:Hp:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 't':
+            b.max_threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            b.iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 'v':
+            b.vcpus = strtoul(optarg, NULL, 0);
+            break;
+        case 'H':
+            b.hvm = 1;
+            break;
+        case 'p':
+            b.pool_mb = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ( !b.max_threads || !b.iterations || !b.vcpus || optind != argc )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    printf("%s domains, %u vcpus, %u per thread\n",
+           b.hvm ? "HVM" : "PV", b.vcpus, b.iterations);
+
+    for ( nr = 1; nr <= b.max_threads; nr *= 2 )
+    {
+        if ( run(&b, nr) )
+            return 1;
+        if ( nr < b.max_threads && nr * 2 > b.max_threads )
+            nr = b.max_threads / 2;
+    }
+
+    return 0;
+}
+
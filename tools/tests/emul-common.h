@@ -0,0 +1,132 @@
+/*
+ * Xen emulation shared by the test harnesses
+ *
+ * The harnesses under tools/tests built with emul.mk take hypervisor
+ * source files and build them as ordinary userspace code.  This provides
+ * the parts of the hypervisor environment more than one of them needs; each
+ * harness' emul.h includes it and adds whatever is specific to the code it
+ * tests.
+ *
+ * This file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2 (GPLv2)
+ * as published by the Free Software Foundation.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details. <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TESTS_EMUL_COMMON_H__
+#define __TESTS_EMUL_COMMON_H__
+
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef int bool_t;
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define likely(x)    __builtin_expect(!!(x), 1)
+#define unlikely(x)  __builtin_expect(!!(x), 0)
+#define noinline     __attribute__((__noinline__))
+#define __packed     __attribute__((__packed__))
+#define __must_check __attribute__((__warn_unused_result__))
+
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define ASSERT(p) assert(p)
+#define BUG_ON(p) assert(!(p))
+#define BUILD_BUG_ON(cond) ((void)sizeof(char[1 - 2 * !!(cond)]))
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define min(x, y) ((x) < (y) ? (x) : (y))
+#define max(x, y) ((x) > (y) ? (x) : (y))
+
+#define xmalloc(type) ((type *)malloc(sizeof(type)))
+#define xfree(p) free(p)
+
+#define printk printf
+#define EXPORT_SYMBOL(var)
+
+/* The harnesses are single threaded: locks are no-ops. */
+typedef int spinlock_t;
+typedef int rwlock_t;
+#define spin_lock_init(l) (*(l) = 0)
+#define spin_lock(l)      ((void)(l))
+#define spin_unlock(l)    ((void)(l))
+#define rwlock_init(l)    (*(l) = 0)
+#define read_lock(l)      ((void)(l))
+#define read_unlock(l)    ((void)(l))
+#define write_lock(l)     ((void)(l))
+#define write_unlock(l)   ((void)(l))
+
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+    list->next = list->prev = list;
+}
+
+static inline void list_add(struct list_head *new, struct list_head *head)
+{
+    new->next = head->next;
+    new->prev = head;
+    head->next->prev = new;
+    head->next = new;
+}
+
+static inline void list_add_tail(struct list_head *new, struct list_head *head)
+{
+    new->next = head;
+    new->prev = head->prev;
+    head->prev->next = new;
+    head->prev = new;
+}
+
+static inline void list_del(struct list_head *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+}
+
+static inline void list_del_init(struct list_head *entry)
+{
+    list_del(entry);
+    INIT_LIST_HEAD(entry);
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+    return head->next == head;
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_for_each(pos, head) \
+    for ( pos = (head)->next; pos != (head); pos = pos->next )
+#define list_for_each_entry(pos, head, member)                        \
+    for ( pos = list_entry((head)->next, typeof(*pos), member);       \
+          &pos->member != (head);                                     \
+          pos = list_entry(pos->member.next, typeof(*pos), member) )
+
+#endif /* __TESTS_EMUL_COMMON_H__ */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,36 @@
+# Rules for test harnesses building hypervisor code as userspace programs.
+#
+# The including Makefile sets TARGET, its own sources and headers in SRCS
+# and HDRS, and the files it imports from the hypervisor in IMPORTED, and
+# provides a rule for each of those using $(import-xen-source) or
+# $(import-xen-header).  Imported files lose their <...> includes; sources
+# get the harness' emul.h instead, which builds on ../emul-common.h.
+# TEST_CFLAGS is passed to the compiler.
+
+.PHONY: all
+all: $(TARGET)
+
+.PHONY: run
+run: $(TARGET)
+	./$(TARGET)
+
+$(TARGET): $(SRCS) $(HDRS) $(IMPORTED) emul.h ../emul-common.h Makefile
+	$(HOSTCC) -O2 -g $(TEST_CFLAGS) -o $@ $(filter %.c,$(IMPORTED) $(SRCS))
+
+.PHONY: clean
+clean:
+	rm -rf $(TARGET) *.o *~ core* $(IMPORTED)
+
+.PHONY: distclean
+distclean: clean
+
+.PHONY: install
+install:
+
+define import-xen-source
+	sed -e "/^#include </d" -e "1i#include \"emul.h\"\n" <$< >$@
+endef
+
+define import-xen-header
+	sed -e "/^#include </d" <$< >$@
+endef
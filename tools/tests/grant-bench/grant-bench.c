@@ -0,0 +1,322 @@
+/*
+ * grant-bench.c
+ *
+ * Measure the cost of grant map and unmap operations, as done by backends
+ * in the hardware domain.  Pages are granted by this domain to itself
+ * (through gntalloc) and repeatedly mapped and unmapped in batches
+ * (through gntdev), each batch being a single hypercall.  Alternatively,
+ * measure grant copies from a local buffer into the granted pages, in
+ * segments as netback copies packets.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <xengnttab.h>
+
+#define PAGE_SIZE 4096
+
+struct bench {
+    uint32_t domid;
+    unsigned int nr_pages, batch, iterations;
+    int prot, touch;
+    /* Copy mode: bytes per copy segment, 0 to map and unmap. */
+    unsigned int seg_len;
+
+    xengnttab_handle *xgt;
+    xengntshr_handle *xgs;
+    uint32_t *refs;
+    void *shared;
+    void *local;
+    xengnttab_grant_copy_segment_t *segs;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_setup(struct bench *b)
+{
+    b->xgt = xengnttab_open(NULL, 0);
+    if ( !b->xgt )
+    {
+        perror("xengnttab_open");
+        return -1;
+    }
+
+    b->xgs = xengntshr_open(NULL, 0);
+    if ( !b->xgs )
+    {
+        perror("xengntshr_open");
+        return -1;
+    }
+
+    if ( xengnttab_set_max_grants(b->xgt, b->nr_pages) )
+    {
+        perror("xengnttab_set_max_grants");
+        return -1;
+    }
+
+    b->refs = calloc(b->nr_pages, sizeof(*b->refs));
+    if ( !b->refs )
+    {
+        perror("calloc");
+        return -1;
+    }
+
+    b->shared = xengntshr_share_pages(b->xgs, b->domid, b->nr_pages, b->refs,
+                                      1);
+    if ( !b->shared )
+    {
+        perror("xengntshr_share_pages");
+        return -1;
+    }
+    memset(b->shared, 0x5a, (size_t)b->nr_pages * PAGE_SIZE);
+
+    if ( b->seg_len )
+    {
+        b->local = malloc(PAGE_SIZE);
+        b->segs = calloc(b->batch, sizeof(*b->segs));
+        if ( !b->local || !b->segs )
+        {
+            perror("malloc");
+            return -1;
+        }
+        memset(b->local, 0xa5, PAGE_SIZE);
+    }
+
+    return 0;
+}
+
+static void bench_teardown(struct bench *b)
+{
+    if ( b->shared )
+        xengntshr_unshare(b->xgs, b->shared, b->nr_pages);
+    free(b->segs);
+    free(b->local);
+    free(b->refs);
+    if ( b->xgs )
+        xengntshr_close(b->xgs);
+    if ( b->xgt )
+        xengnttab_close(b->xgt);
+}
+
+/* Map and unmap all the pages, batch pages at a time. */
+static int bench_map(struct bench *b, double *map_time, double *unmap_time)
+{
+    unsigned int i, j;
+    double t;
+    void *addr;
+
+    for ( i = 0; i < b->nr_pages; i += b->batch )
+    {
+        unsigned int nr = b->nr_pages - i < b->batch ? b->nr_pages - i
+                                                    : b->batch;
+
+        t = now();
+        addr = xengnttab_map_domain_grant_refs(b->xgt, nr, b->domid,
+                                               &b->refs[i], b->prot);
+        *map_time += now() - t;
+        if ( !addr )
+        {
+            perror("xengnttab_map_domain_grant_refs");
+            return -1;
+        }
+
+        /* Fault the mappings in, as a backend would access them. */
+        if ( b->touch )
+            for ( j = 0; j < nr; j++ )
+                (void)*(volatile char *)(addr + j * PAGE_SIZE);
+
+        t = now();
+        if ( xengnttab_unmap(b->xgt, addr, nr) )
+        {
+            perror("xengnttab_unmap");
+            return -1;
+        }
+        *unmap_time += now() - t;
+    }
+
+    return 0;
+}
+
+/*
+ * Fill all the pages with copies from the local buffer, seg_len bytes at a
+ * time, batch segments per hypercall.  Consecutive segments go to the same
+ * page until it is full.
+ */
+static int bench_copy(struct bench *b, double *copy_time)
+{
+    unsigned int segs_per_page = PAGE_SIZE / b->seg_len;
+    unsigned long seg, nr_segs = (unsigned long)b->nr_pages * segs_per_page;
+    unsigned int i, nr;
+    double t;
+
+    for ( seg = 0; seg < nr_segs; seg += nr )
+    {
+        nr = nr_segs - seg < b->batch ? nr_segs - seg : b->batch;
+
+        for ( i = 0; i < nr; i++ )
+        {
+            xengnttab_grant_copy_segment_t *s = &b->segs[i];
+            unsigned long n = seg + i;
+
+            s->source.virt = b->local + (n % segs_per_page) * b->seg_len;
+            s->dest.foreign.ref = b->refs[n / segs_per_page];
+            s->dest.foreign.offset = (n % segs_per_page) * b->seg_len;
+            s->dest.foreign.domid = b->domid;
+            s->len = b->seg_len;
+            s->flags = GNTCOPY_dest_gref;
+            s->status = 0;
+        }
+
+        t = now();
+        if ( xengnttab_grant_copy(b->xgt, nr, b->segs) )
+        {
+            perror("xengnttab_grant_copy");
+            return -1;
+        }
+        *copy_time += now() - t;
+
+        for ( i = 0; i < nr; i++ )
+            if ( b->segs[i].status != GNTST_okay )
+            {
+                fprintf(stderr, "grant copy of segment %lu failed: %d\n",
+                        seg + i, b->segs[i].status);
+                return -1;
+            }
+    }
+
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -d <domid>   id of this domain (default 0)\n"
+            "  -n <pages>   number of pages granted (default 4096)\n"
+            "  -b <count>   pages per map/unmap hypercall, or segments per\n"
+            "               copy hypercall (default 32)\n"
+            "  -i <count>   iterations over all the pages (default 100)\n"
+            "  -r           map read-only\n"
+            "  -t           touch each page while it is mapped\n"
+            "  -c <bytes>   grant copy segments of this size instead of mapping\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench b = {
+        .nr_pages = 4096,
+        .batch = 32,
+        .iterations = 100,
+        .prot = PROT_READ | PROT_WRITE,
+    };
+    double map_time = 0, unmap_time = 0, copy_time = 0, ops;
+    unsigned int i;
+    int opt, rc = 1;
+
+    while ( (opt = getopt(argc, argv, "d:n:b:i:rtc:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'd':
+            b.domid = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            b.nr_pages = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            b.batch = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            b.iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            b.prot = PROT_READ;
+            break;
+        case 't':
+            b.touch = 1;
+            break;
+        case 'c':
+            b.seg_len = strtoul(optarg, NULL, 0);
+            if ( !b.seg_len || b.seg_len > PAGE_SIZE )
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ( !b.nr_pages || !b.batch || !b.iterations )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if ( bench_setup(&b) )
+        goto out;
+
+    if ( b.seg_len )
+    {
+        for ( i = 0; i < b.iterations; i++ )
+            if ( bench_copy(&b, &copy_time) )
+                goto out;
+
+        ops = (double)b.nr_pages * (PAGE_SIZE / b.seg_len) * b.iterations;
+        printf("%u pages, %u byte segments, %u per hypercall, %u iterations\n",
+               b.nr_pages, b.seg_len, b.batch, b.iterations);
+        printf("copy:  %8.0f ns/segment %10.0f segments/s %6.2f GB/s\n",
+               copy_time * 1e9 / ops, ops / copy_time,
+               ops * b.seg_len / copy_time / 1e9);
+        rc = 0;
+        goto out;
+    }
+
+    for ( i = 0; i < b.iterations; i++ )
+        if ( bench_map(&b, &map_time, &unmap_time) )
+            goto out;
+
+    ops = (double)b.nr_pages * b.iterations;
+    printf("%u pages, %u per hypercall, %u iterations, %s%s\n",
+           b.nr_pages, b.batch, b.iterations,
+           b.prot & PROT_WRITE ? "writable" : "read-only",
+           b.touch ? ", touched" : "");
+    printf("map:   %8.0f ns/page %10.0f pages/s\n",
+           map_time * 1e9 / ops, ops / map_time);
+    printf("unmap: %8.0f ns/page %10.0f pages/s\n",
+           unmap_time * 1e9 / ops, ops / unmap_time);
+    rc = 0;
+
+ out:
+    bench_teardown(&b);
+
+    return rc;
+}
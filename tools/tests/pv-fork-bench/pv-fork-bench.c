@@ -0,0 +1,202 @@
+/*
+ * pv-fork-bench.c
+ *
+ * Measure the cost of fork() in a PV guest.  A PV kernel copies and later
+ * tears down the page tables of the forking process through batches of
+ * mmu_update hypercalls, so the time taken by fork(), by the child writing
+ * to its copy-on-write memory, and by its exit is dominated by page table
+ * validation in the hypervisor for a process with a large address space.
+ *
+ * Run it in the guest to be measured; the hypervisor side can be watched
+ * at the same time with "xenperf" in the hardware domain, on a hypervisor
+ * built with performance counters ("mmu_updates to an already locked
+ * page" counts updates which reused the page table page of the previous
+ * request).
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define PAGE_SIZE 4096
+
+struct bench {
+    unsigned long nr_pages;
+    unsigned int forks;
+    /* Pages written by each child, i.e. copy-on-write faults taken. */
+    unsigned long touch;
+    /* Exec this program in the child rather than exiting. */
+    const char *exec;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void child(const struct bench *b, unsigned char *mem)
+{
+    unsigned long i;
+
+    for ( i = 0; i < b->touch; i++ )
+        mem[(i % b->nr_pages) * PAGE_SIZE] = i;
+
+    if ( b->exec )
+    {
+        execl(b->exec, b->exec, (char *)NULL);
+        _exit(127);
+    }
+
+    _exit(0);
+}
+
+static int run(const struct bench *b, unsigned char *mem,
+               double *t_fork, double *t_total)
+{
+    unsigned int n;
+    double t, start = now();
+    int status;
+    pid_t pid;
+
+    *t_fork = 0;
+    for ( n = 0; n < b->forks; n++ )
+    {
+        t = now();
+        pid = fork();
+        if ( pid == 0 )
+            child(b, mem);
+        *t_fork += now() - t;
+
+        if ( pid < 0 )
+        {
+            fprintf(stderr, "fork failed: %s\n", strerror(errno));
+            return 1;
+        }
+
+        if ( waitpid(pid, &status, 0) != pid )
+        {
+            fprintf(stderr, "waitpid failed: %s\n", strerror(errno));
+            return 1;
+        }
+
+        if ( !WIFEXITED(status) || WEXITSTATUS(status) )
+        {
+            fprintf(stderr, "child %u failed (status %#x)\n", n, status);
+            return 1;
+        }
+    }
+    *t_total = now() - start;
+
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -m <MB>      memory mapped and populated by the parent\n"
+            "               (default 256)\n"
+            "  -n <count>   number of forks (default 1000)\n"
+            "  -t <pages>   pages written by each child (default 0)\n"
+            "  -e <path>    exec this program in each child instead of\n"
+            "               exiting straight away\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench b = {
+        .nr_pages = 256UL << (20 - 12),
+        .forks = 1000,
+    };
+    unsigned char *mem;
+    unsigned long i;
+    double t_fork, t_total;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "m:n:t:e:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'm':
+            b.nr_pages = strtoul(optarg, NULL, 0) << (20 - 12);
+            break;
+        case 'n':
+            b.forks = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            b.touch = strtoul(optarg, NULL, 0);
+            break;
+        case 'e':
+            b.exec = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ( optind != argc || !b.nr_pages || !b.forks )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    mem = mmap(NULL, b.nr_pages * PAGE_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( mem == MAP_FAILED )
+    {
+        fprintf(stderr, "mmap of %lu pages failed: %s\n",
+                b.nr_pages, strerror(errno));
+        return 1;
+    }
+
+    /* Populate every page, so that all of the page tables get copied. */
+    for ( i = 0; i < b.nr_pages; i++ )
+        mem[i * PAGE_SIZE] = i;
+
+    if ( run(&b, mem, &t_fork, &t_total) )
+        return 1;
+
+    printf("%lu MB mapped, %u forks, %lu pages touched per child%s%s\n",
+           b.nr_pages >> (20 - 12), b.forks, b.touch,
+           b.exec ? ", exec " : "", b.exec ?: "");
+    printf("fork:  %8.1f us/fork\n", t_fork * 1e6 / b.forks);
+    printf("total: %8.1f us/fork %10.0f forks/s\n",
+           t_total * 1e6 / b.forks, b.forks / t_total);
+
+    munmap(mem, b.nr_pages * PAGE_SIZE);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,45 @@
+/*
+ * Xen emulation for the rangeset test harness
+ *
+ * What common/rangeset.c and common/rbtree.c need from the hypervisor
+ * environment, on top of ../emul-common.h.
+ *
+ * This file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2 (GPLv2)
+ * as published by the Free Software Foundation.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details. <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RANGESET_TEST_EMUL_H__
+#define __RANGESET_TEST_EMUL_H__
+
+#include "../emul-common.h"
+
+#define safe_strcpy(d, s) ({                    \
+    snprintf(d, sizeof(d), "%s", s) >= sizeof(d); \
+})
+
+struct domain {
+    unsigned int domain_id;
+    struct list_head rangesets;
+    spinlock_t rangesets_lock;
+};
+
+#include "rbtree.h"
+#include "rangeset.h"
+
+#endif /* __RANGESET_TEST_EMUL_H__ */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,248 @@
+/*
+ * Functional test and lookup microbenchmark for common/rangeset.c.
+ *
+ * The functional test drives random add/remove operations against both the
+ * hypervisor rangeset and a flat bitmap, checking that membership, overlap
+ * and range reporting agree after every step.
+ *
+ * The benchmark compares the tree based rangeset with an ordered linked
+ * list using the same lookup as the previous implementation, for sets of
+ * increasing size.
+ *
+ * Usage: test_rangeset [<iterations> [<max-ranges>]]
+ *
+ * This file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2 (GPLv2)
+ * as published by the Free Software Foundation.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details. <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#include "emul.h"
+
+#define UNIVERSE 512
+
+static unsigned char bitmap[UNIVERSE];
+
+/* Ordered singly linked list of disjoint ranges, looked up linearly. */
+struct list_range {
+    struct list_range *next;
+    unsigned long s, e;
+};
+
+static struct list_range *list_find(struct list_range *head, unsigned long s)
+{
+    struct list_range *x = NULL, *y;
+
+    for ( y = head; y != NULL; y = y->next )
+    {
+        if ( y->s > s )
+            break;
+        x = y;
+    }
+
+    return x;
+}
+
+static bool_t list_contains(struct list_range *head, unsigned long s)
+{
+    struct list_range *x = list_find(head, s);
+
+    return x && x->e >= s;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int count_cb(unsigned long s, unsigned long e, void *ctxt)
+{
+    unsigned long i;
+
+    for ( i = s; i <= e; i++ )
+        if ( !bitmap[i] )
+            return -1;
+
+    *(unsigned long *)ctxt += e - s + 1;
+
+    return 0;
+}
+
+static int check(struct rangeset *r)
+{
+    unsigned long i, j, set = 0, reported = 0;
+
+    for ( i = 0; i < UNIVERSE; i++ )
+    {
+        set += bitmap[i];
+        if ( rangeset_contains_singleton(r, i) != bitmap[i] )
+        {
+            printf("contains(%lu) mismatch\n", i);
+            return -1;
+        }
+    }
+
+    for ( i = 0; i < UNIVERSE; i += 7 )
+    {
+        bool_t any = 0;
+
+        for ( j = i; j < UNIVERSE && j < i + 13; j++ )
+            any |= bitmap[j];
+
+        if ( rangeset_overlaps_range(r, i, j - 1) != any )
+        {
+            printf("overlaps(%lu, %lu) mismatch\n", i, j - 1);
+            return -1;
+        }
+    }
+
+    if ( rangeset_report_ranges(r, 0, UNIVERSE - 1, count_cb, &reported) ||
+         reported != set )
+    {
+        printf("report_ranges mismatch: %lu != %lu\n", reported, set);
+        return -1;
+    }
+
+    if ( rangeset_is_empty(r) != !set )
+    {
+        printf("is_empty mismatch\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int functional_test(unsigned int iterations)
+{
+    struct rangeset *r = rangeset_new(NULL, "test", 0);
+    unsigned int i;
+    int rc = 0;
+
+    if ( r == NULL )
+        return -1;
+
+    for ( i = 0; i < iterations && !rc; i++ )
+    {
+        unsigned long s = rand() % UNIVERSE;
+        unsigned long e = s + rand() % (i & 1 ? 4 : 48);
+        bool_t add = rand() % 3 != 0;
+
+        if ( e >= UNIVERSE )
+            e = UNIVERSE - 1;
+
+        rc = add ? rangeset_add_range(r, s, e)
+                 : rangeset_remove_range(r, s, e);
+        if ( rc )
+        {
+            printf("%s(%lu, %lu) failed: %d\n",
+                   add ? "add" : "remove", s, e, rc);
+            break;
+        }
+
+        memset(&bitmap[s], add, e - s + 1);
+        rc = check(r);
+    }
+
+    rangeset_destroy(r);
+
+    return rc;
+}
+
+static int benchmark(unsigned int iterations, unsigned int max_ranges)
+{
+    unsigned int nr, i;
+
+    printf("%10s %12s %12s\n", "ranges", "list ns/op", "tree ns/op");
+
+    for ( nr = 16; nr <= max_ranges; nr *= 4 )
+    {
+        struct rangeset *r = rangeset_new(NULL, "bench", 0);
+        struct list_range *head = NULL, **tail = &head, *x;
+        unsigned long hits[2] = { 0, 0 };
+        uint64_t t_list, t_tree;
+
+        if ( r == NULL )
+            return -1;
+
+        /* Ranges [4i, 4i+1], so a quarter of all lookups miss between. */
+        for ( i = 0; i < nr; i++ )
+        {
+            if ( rangeset_add_range(r, i * 4, i * 4 + 1) )
+                return -1;
+
+            x = malloc(sizeof(*x));
+            if ( x == NULL )
+                return -1;
+            x->s = i * 4;
+            x->e = i * 4 + 1;
+            x->next = NULL;
+            *tail = x;
+            tail = &x->next;
+        }
+
+        srand(nr);
+        t_list = now_ns();
+        for ( i = 0; i < iterations; i++ )
+            hits[0] += list_contains(head, rand() % (nr * 4));
+        t_list = now_ns() - t_list;
+
+        srand(nr);
+        t_tree = now_ns();
+        for ( i = 0; i < iterations; i++ )
+            hits[1] += rangeset_contains_singleton(r, rand() % (nr * 4));
+        t_tree = now_ns() - t_tree;
+
+        if ( hits[0] != hits[1] )
+        {
+            printf("lookup results differ: %lu != %lu\n", hits[0], hits[1]);
+            return -1;
+        }
+
+        printf("%10u %12.1f %12.1f\n", nr,
+               (double)t_list / iterations, (double)t_tree / iterations);
+
+        while ( (x = head) != NULL )
+        {
+            head = x->next;
+            free(x);
+        }
+        rangeset_destroy(r);
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+    unsigned int max_ranges = argc > 2 ? strtoul(argv[2], NULL, 0) : 16384;
+
+    srand(0);
+
+    printf("%-40s", "Testing rangeset operations...");
+    if ( functional_test(iterations / 10 ?: 1) )
+        return 1;
+    printf("okay\n");
+
+    return benchmark(iterations, max_ranges) ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,65 @@
+/*
+ * Xen emulation for the tmem compression benchmark
+ *
+ * What common/lzo.c and the LZ4 compressor and decompressor from
+ * common/lz4/ need from the hypervisor environment, on top of
+ * ../emul-common.h.
+ *
+ * This file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2 (GPLv2)
+ * as published by the Free Software Foundation.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details. <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TMEM_COMPRESS_TEST_EMUL_H__
+#define __TMEM_COMPRESS_TEST_EMUL_H__
+
+#include "../emul-common.h"
+
+#define INIT
+
+#if defined(__i386__) || defined(__x86_64__)
+#define CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS 1
+#endif
+
+/* Like the hypervisor, define only the byte order that applies. */
+#undef __LITTLE_ENDIAN
+#undef __BIG_ENDIAN
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define __LITTLE_ENDIAN 1234
+#else
+#define __BIG_ENDIAN 4321
+#endif
+
+static inline u16 le16_to_cpup(const void *p)
+{
+    const u8 *b = p;
+
+    return b[0] | (b[1] << 8);
+}
+
+static inline u32 le32_to_cpup(const void *p)
+{
+    const u8 *b = p;
+
+    return le16_to_cpup(b) | ((u32)le16_to_cpup(b + 2) << 16);
+}
+
+#include "lzo.h"
+#include "lz4.h"
+
+#endif /* __TMEM_COMPRESS_TEST_EMUL_H__ */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,262 @@
+/*
+ * Comparison of the LZO and LZ4 compressors tmem can use for its pools.
+ *
+ * Each set of synthetic guest pages is compressed and decompressed a page
+ * at a time, as tmem does on puts and gets, with the LZO and the LZ4 code
+ * from the hypervisor.  Throughput is given in MB/s of uncompressed data;
+ * the ratio is uncompressed over compressed size, counting pages which
+ * don't shrink (which tmem stores uncompressed) at full size.
+ *
+ * Usage: test_tmem_compress [<pages> [<rounds>]]
+ *
+ * This file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2 (GPLv2)
+ * as published by the Free Software Foundation.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details. <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "emul.h"
+
+#define PAGE_SIZE 4096
+#define DST_SIZE  (2 * PAGE_SIZE)
+
+static unsigned char workmem[LZO1X_1_MEM_COMPRESS > LZ4_MEM_COMPRESS ?
+                             LZO1X_1_MEM_COMPRESS : LZ4_MEM_COMPRESS];
+
+static int lzo_comp(const unsigned char *src, unsigned char *dst,
+                    size_t *dst_len)
+{
+    return lzo1x_1_compress(src, PAGE_SIZE, dst, dst_len, workmem);
+}
+
+static int lzo_decomp(const unsigned char *src, size_t src_len,
+                      unsigned char *dst)
+{
+    size_t out_len = PAGE_SIZE;
+    int rc = lzo1x_decompress_safe(src, src_len, dst, &out_len);
+
+    return rc ?: out_len != PAGE_SIZE;
+}
+
+static int lz4_comp(const unsigned char *src, unsigned char *dst,
+                    size_t *dst_len)
+{
+    return lz4_compress(src, PAGE_SIZE, dst, dst_len, workmem);
+}
+
+static int lz4_decomp(const unsigned char *src, size_t src_len,
+                      unsigned char *dst)
+{
+    size_t in_len;
+    int rc = lz4_decompress(src, &in_len, dst, PAGE_SIZE);
+
+    return rc ?: in_len != src_len;
+}
+
+static const struct compressor {
+    const char *name;
+    int (*comp)(const unsigned char *, unsigned char *, size_t *);
+    int (*decomp)(const unsigned char *, size_t, unsigned char *);
+} compressors[] = {
+    { "lzo", lzo_comp, lzo_decomp },
+    { "lz4", lz4_comp, lz4_decomp },
+};
+
+static void fill_zero(unsigned char *page)
+{
+    memset(page, 0, PAGE_SIZE);
+}
+
+static void fill_random(unsigned char *page)
+{
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE; i++ )
+        page[i] = random();
+}
+
+/* Words from a small vocabulary, as in page cache pages of text files. */
+static void fill_text(unsigned char *page)
+{
+    static const char *const words[] = {
+        "the", "of", "and", "to", "in", "is", "that", "for", "it", "as",
+        "with", "was", "on", "be", "by", "this", "are", "from", "or",
+        "which", "an", "have", "not", "but", "memory", "page", "domain",
+        "guest", "hypervisor", "\n", "return", "struct", "int", "    ",
+    };
+    unsigned int n = 0;
+
+    while ( n < PAGE_SIZE )
+    {
+        const char *w = words[random() % ARRAY_SIZE(words)];
+        size_t len = strlen(w);
+
+        if ( len > PAGE_SIZE - n - 1 )
+            len = PAGE_SIZE - n - 1;
+        memcpy(page + n, w, len);
+        n += len;
+        page[n++] = ' ';
+    }
+}
+
+/*
+ * Arrays of kernel-like structures: pointers sharing their upper bits,
+ * small counters and flags, and padding.
+ */
+static void fill_struct(unsigned char *page)
+{
+    struct {
+        uint64_t next, prev;
+        uint32_t refcount, flags;
+        uint64_t index;
+        uint8_t pad[32];
+    } s;
+    unsigned int n;
+
+    memset(&s, 0, sizeof(s));
+    for ( n = 0; n + sizeof(s) <= PAGE_SIZE; n += sizeof(s) )
+    {
+        s.next = 0xffff880000000000ULL | ((uint64_t)random() << 6);
+        s.prev = 0xffff880000000000ULL | ((uint64_t)random() << 6);
+        s.refcount = random() % 4;
+        s.flags = (random() % 2) ? 0x40 : 0x2c;
+        s.index++;
+        memcpy(page + n, &s, sizeof(s));
+    }
+    memset(page + n, 0, PAGE_SIZE - n);
+}
+
+/* Half zeroes, half random, as in partly used anonymous memory. */
+static void fill_mixed(unsigned char *page)
+{
+    fill_random(page);
+    memset(page + (random() % 2) * (PAGE_SIZE / 2), 0, PAGE_SIZE / 2);
+}
+
+static const struct page_set {
+    const char *name;
+    void (*fill)(unsigned char *);
+} page_sets[] = {
+    { "zero", fill_zero },
+    { "text", fill_text },
+    { "struct", fill_struct },
+    { "mixed", fill_mixed },
+    { "random", fill_random },
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int nr_pages = argc > 1 ? atoi(argv[1]) : 4096;
+    unsigned int rounds = argc > 2 ? atoi(argv[2]) : 10;
+    unsigned char *pages, *cdata, *out;
+    size_t *clen;
+    unsigned int s, c, i, r;
+    int rc = 0;
+
+    if ( !nr_pages || !rounds )
+    {
+        fprintf(stderr, "usage: %s [<pages> [<rounds>]]\n", argv[0]);
+        return 1;
+    }
+
+    pages = malloc((size_t)nr_pages * PAGE_SIZE);
+    cdata = malloc((size_t)nr_pages * DST_SIZE);
+    clen = malloc(nr_pages * sizeof(*clen));
+    out = malloc(PAGE_SIZE);
+    if ( !pages || !cdata || !clen || !out )
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    printf("%u pages, %u rounds\n", nr_pages, rounds);
+    printf("%-8s %-4s %10s %10s %7s\n",
+           "pages", "alg", "comp MB/s", "dec MB/s", "ratio");
+
+    for ( s = 0; s < ARRAY_SIZE(page_sets); s++ )
+    {
+        srandom(s + 1);
+        for ( i = 0; i < nr_pages; i++ )
+            page_sets[s].fill(pages + (size_t)i * PAGE_SIZE);
+
+        for ( c = 0; c < ARRAY_SIZE(compressors); c++ )
+        {
+            const struct compressor *cp = &compressors[c];
+            double t, t_comp, t_decomp, mb;
+            unsigned long stored = 0;
+
+            t = now();
+            for ( r = 0; r < rounds; r++ )
+                for ( i = 0; i < nr_pages; i++ )
+                    if ( cp->comp(pages + (size_t)i * PAGE_SIZE,
+                                  cdata + (size_t)i * DST_SIZE, &clen[i]) )
+                    {
+                        fprintf(stderr, "%s: compression of %s page %u failed\n",
+                                cp->name, page_sets[s].name, i);
+                        return 1;
+                    }
+            t_comp = now() - t;
+
+            t = now();
+            for ( r = 0; r < rounds; r++ )
+                for ( i = 0; i < nr_pages; i++ )
+                    if ( cp->decomp(cdata + (size_t)i * DST_SIZE, clen[i], out) )
+                    {
+                        fprintf(stderr, "%s: decompression of %s page %u failed\n",
+                                cp->name, page_sets[s].name, i);
+                        return 1;
+                    }
+            t_decomp = now() - t;
+
+            for ( i = 0; i < nr_pages; i++ )
+            {
+                cp->decomp(cdata + (size_t)i * DST_SIZE, clen[i], out);
+                if ( memcmp(out, pages + (size_t)i * PAGE_SIZE, PAGE_SIZE) )
+                {
+                    fprintf(stderr, "%s: %s page %u corrupted\n",
+                            cp->name, page_sets[s].name, i);
+                    rc = 1;
+                }
+                stored += clen[i] < PAGE_SIZE ? clen[i] : PAGE_SIZE;
+            }
+
+            mb = (double)nr_pages * rounds * PAGE_SIZE / (1024 * 1024);
+            printf("%-8s %-4s %10.0f %10.0f %7.2f\n",
+                   page_sets[s].name, cp->name, mb / t_comp, mb / t_decomp,
+                   (double)nr_pages * PAGE_SIZE / stored);
+        }
+    }
+
+    free(out);
+    free(clen);
+    free(cdata);
+    free(pages);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -2,6 +2,7 @@
 #include <limits.h>
 #include <stdio.h>
 #include <sys/mman.h>
+#include <time.h>
 
 #include "x86_emulate.h"
 #include "blowfish.h"
@@ -43,6 +44,15 @@ static const struct {
 
 static unsigned int bytes_read;
 
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 static int read(
     unsigned int seg,
     unsigned long offset,
@@ -195,6 +205,8 @@ int main(int argc, char **argv)
     struct cpu_user_regs regs;
     char *instr;
     unsigned int *res, i, j;
+    struct x86_emulate_dcache *dcache;
+    unsigned long ns[2];
     bool stack_exec;
     int rc;
 #ifndef __x86_64__
@@ -209,6 +221,8 @@ int main(int argc, char **argv)
     ctxt.vendor    = X86_VENDOR_UNKNOWN;
     ctxt.addr_size = 8 * sizeof(void *);
     ctxt.sp_size   = 8 * sizeof(void *);
+    ctxt.dcache    = NULL;
+    ctxt.dcache_tag = 0;
 
     res = mmap((void *)0x100000, MMAP_SZ, PROT_READ|PROT_WRITE|PROT_EXEC,
                MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS, 0, 0);
@@ -2126,6 +2140,60 @@ int main(int argc, char **argv)
     else
         printf("skipped\n");
 
+    dcache = x86_emulate_dcache_alloc();
+    if ( !dcache )
+    {
+        fprintf(stderr, "Decode cache allocation failed\n");
+        exit(1);
+    }
+    ctxt.dcache = dcache;
+    memset(&regs, 0, sizeof(regs));
+
+    printf("%-40s", "Testing cached mov 4(%eax,%ecx,4),%ecx...");
+    instr[0] = 0x8b; instr[1] = 0x4c; instr[2] = 0x88; instr[3] = 0x04;
+    for ( i = 0; i < 8; i++ )
+        res[i] = ~i;
+    for ( i = 0; i < 6; i++ )
+    {
+        regs.eflags = 0x200;
+        regs.eip    = (unsigned long)&instr[0];
+        regs.eax    = (unsigned long)res;
+        regs.ecx    = i;
+        rc = x86_emulate(&ctxt, &emulops);
+        if ( (rc != X86EMUL_OKAY) ||
+             (regs.ecx != ~(i + 1)) ||
+             (regs.eip != (unsigned long)&instr[4]) )
+            goto fail;
+    }
+    printf("okay\n");
+
+    printf("%-40s", "Testing cached decode of modified code...");
+    instr[0] = 0x83; instr[1] = 0x00; instr[2] = 0x01;
+    regs.eflags = 0x200;
+    regs.eip    = (unsigned long)&instr[0];
+    regs.eax    = (unsigned long)res;
+    *res        = 0;
+    rc = x86_emulate(&ctxt, &emulops);
+    if ( (rc != X86EMUL_OKAY) || (*res != 1) ||
+         (regs.eip != (unsigned long)&instr[3]) )
+        goto fail;
+    instr[2] = 0x05;
+    regs.eip    = (unsigned long)&instr[0];
+    rc = x86_emulate(&ctxt, &emulops);
+    if ( (rc != X86EMUL_OKAY) || (*res != 6) ||
+         (regs.eip != (unsigned long)&instr[3]) )
+        goto fail;
+    instr[0] = 0x01; instr[1] = 0x08;
+    regs.eip    = (unsigned long)&instr[0];
+    regs.ecx    = 0x10;
+    rc = x86_emulate(&ctxt, &emulops);
+    if ( (rc != X86EMUL_OKAY) || (*res != 0x16) ||
+         (regs.eip != (unsigned long)&instr[2]) )
+        goto fail;
+    printf("okay\n");
+
+    ctxt.dcache = NULL;
+
     for ( j = 0; j < ARRAY_SIZE(blobs); j++ )
     {
         if ( !blobs[j].size )
@@ -2194,6 +2262,81 @@ int main(int argc, char **argv)
         printf("okay\n");
     }
 
+    /* Run the code sequences again, this time through the decode cache. */
+    ctxt.dcache = dcache;
+    for ( j = 0; j < ARRAY_SIZE(blobs); j++ )
+    {
+        if ( !blobs[j].size )
+            continue;
+
+        memcpy(res, blobs[j].code, blobs[j].size);
+        ctxt.addr_size = ctxt.sp_size = blobs[j].bitness;
+
+        i = printf("Testing %s %u-bit cached decode...",
+                   blobs[j].name, ctxt.addr_size);
+        if ( blobs[j].set_regs )
+            blobs[j].set_regs(&regs);
+        regs.eip = (unsigned long)res;
+        regs.esp = (unsigned long)res + MMAP_SZ - 4;
+        if ( ctxt.addr_size == 64 )
+        {
+            *(uint32_t *)(unsigned long)regs.esp = 0;
+            regs.esp -= 4;
+        }
+        *(uint32_t *)(unsigned long)regs.esp = 0x12345678;
+        regs.eflags = 2;
+        while ( regs.eip >= (unsigned long)res &&
+                regs.eip < (unsigned long)res + blobs[j].size )
+        {
+            rc = x86_emulate(&ctxt, &emulops);
+            if ( rc != X86EMUL_OKAY )
+            {
+                printf("failed at %%eip == %08lx (opcode %08x)\n",
+                       (unsigned long)regs.eip, ctxt.opcode);
+                return 1;
+            }
+        }
+        if ( (regs.eip != 0x12345678) ||
+             (regs.esp != ((unsigned long)res + MMAP_SZ)) ||
+             !blobs[j].check_regs(&regs) )
+            goto fail;
+        printf("%*sokay\n", i < 40 ? 40 - i : 0, "");
+    }
+
+    /*
+     * Model a driver polling an MMIO register: the same load gets emulated
+     * over and over, which is what the decode cache is meant to speed up.
+     * Timings are only of interest when working on the emulator, so this
+     * only runs when asked for with --bench.
+     */
+    if ( argc > 1 && !strcmp(argv[1], "--bench") )
+    {
+        printf("%-40s", "Benchmarking repeated emulation...");
+        ctxt.addr_size = ctxt.sp_size = 8 * sizeof(void *);
+        instr[0] = 0x8b; instr[1] = 0x54; instr[2] = 0x88; instr[3] = 0x04;
+        for ( i = 0; i < 8; i++ )
+            res[i] = ~i;
+        regs.eflags = 0x200;
+        for ( j = 0; j < 2; j++ )
+        {
+            ctxt.dcache = j ? dcache : NULL;
+            ns[j] = now_ns();
+            for ( i = 0; i < 0x40000; i++ )
+            {
+                regs.eip = (unsigned long)&instr[0];
+                regs.eax = (unsigned long)res;
+                regs.ecx = i & 3;
+                rc = x86_emulate(&ctxt, &emulops);
+                if ( (rc != X86EMUL_OKAY) || (regs.edx != ~((i & 3) + 1)) )
+                    goto fail;
+            }
+            ns[j] = (now_ns() - ns[j]) / i;
+        }
+        printf("%luns, %luns cached\n", ns[0], ns[1]);
+    }
+
+    x86_emulate_dcache_free(dcache);
+
     return 0;
 
  fail:
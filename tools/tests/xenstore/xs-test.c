@@ -35,6 +35,7 @@
 #define WRITE_BUFFERS_N    10
 #define WRITE_BUFFERS_SIZE 4000
 #define MAX_TA_LOOPS       100
+#define WATCH_WRITES       100
 
 struct test {
     char *name;
@@ -403,6 +404,45 @@ static int test_ta3_deinit(uintptr_t par)
     return verify_node(paths[0], "b", 1);
 }
 
+static int watch_all(uintptr_t par, bool add)
+{
+    char node[64];
+    unsigned int i;
+    bool ok;
+
+    for ( i = 0; i < par; i++ )
+    {
+        snprintf(node, sizeof(node), "%s/w/%u", path, i);
+        ok = add ? xs_watch(xsh, node, "xs-test")
+                 : xs_unwatch(xsh, node, "xs-test");
+        if ( !ok )
+            return errno;
+    }
+
+    return 0;
+}
+
+static int test_watch_init(uintptr_t par)
+{
+    return watch_all(par, true);
+}
+
+static int test_watch(uintptr_t par)
+{
+    unsigned int i;
+
+    for ( i = 0; i < WATCH_WRITES; i++ )
+        if ( !xs_write(xsh, XBT_NULL, paths[0], write_buffers[0], 1) )
+            return errno;
+
+    return 0;
+}
+
+static int test_watch_deinit(uintptr_t par)
+{
+    return watch_all(par, false);
+}
+
 #define TEST(s, f, p, l) { s, f ## _init, f, f ## _deinit, (uintptr_t)(p), l }
 struct test tests[] = {
 TEST("read 1", test_read, 1, "Read node with 1 byte data"),
@@ -417,6 +457,9 @@ TEST("ta empty x", test_ta1, 1, "Empty transaction abort"),
 TEST("ta rmw", test_ta2, 0, "Read-modify-write transaction"),
 TEST("ta rmw x", test_ta2, 1, "Read-modify-write transaction abort"),
 TEST("ta err", test_ta3, 0, "Transaction with conflict"),
+TEST("watch 0", test_watch, 0, "100 writes, no watches"),
+TEST("watch 1k", test_watch, 1000, "100 writes, 1000 unrelated watches"),
+TEST("watch 10k", test_watch, 10000, "100 writes, 10000 unrelated watches"),
 };
 
 static void cleanup(void)
@@ -66,11 +66,31 @@
 #include <systemd/sd-daemon.h>
 #endif
 
+/* Linux has epoll, which saves registering all fds for every wait. */
+#if defined(__linux__)
+#define XENSTORED_EPOLL 1
+#include <sys/epoll.h>
+#endif
+
+/* Maximum number of requests handled per connection and wakeup. */
+#define MAX_REQUESTS_PER_WAKEUP 16
+
 extern xenevtchn_handle *xce_handle; /* in xenstored_domain.c */
+
+/* Events reported for the fds not belonging to connections. */
+static short sock_revents, ro_sock_revents, reopen_log_revents, xce_revents;
+
+#ifdef XENSTORED_EPOLL
+static int epoll_fd = -1;
+/* epoll data of the fds not belonging to connections. */
+static char sock_tag, ro_sock_tag, reopen_log_tag, xce_tag;
+#else
+static int sock_pollfd_idx = -1, ro_sock_pollfd_idx = -1;
 static int xce_pollfd_idx = -1;
 static struct pollfd *fds;
 static unsigned int current_array_size;
 static unsigned int nr_fds;
+#endif
 
 #define ROUNDUP(_x, _w) (((unsigned long)(_x)+(1UL<<(_w))-1) & ~((1UL<<(_w))-1))
 
@@ -79,9 +99,11 @@ LIST_HEAD(connections);
 int tracefd = -1;
 static bool recovery = true;
 static int reopen_log_pipe[2];
+#ifndef XENSTORED_EPOLL
 static int reopen_log_pipe0_pollfd_idx = -1;
+#endif
 char *tracefile = NULL;
-static TDB_CONTEXT *tdb_ctx = NULL;
+TDB_CONTEXT *tdb_ctx = NULL;
 
 static void corrupt(struct connection *conn, const char *fmt, ...);
 static const char *sockmsg_string(enum xsd_sockmsg_type type);
@@ -105,22 +127,10 @@ int quota_nb_watch_per_domain = 128;
 int quota_max_entry_size = 2048; /* 2K */
 int quota_max_transaction = 10;
 
-TDB_CONTEXT *tdb_context(struct connection *conn)
+void set_tdb_key(const char *name, TDB_DATA *key)
 {
-	/* conn = NULL used in manual_node at setup. */
-	if (!conn || !conn->transaction)
-		return tdb_ctx;
-	return tdb_transaction_context(conn->transaction);
-}
-
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb)
-{
-	if (!(tdb_ctx->flags & TDB_INTERNAL))
-		if (rename(newname, xs_daemon_tdb()) != 0)
-			return false;
-	tdb_close(tdb_ctx);
-	tdb_ctx = talloc_steal(talloc_autofree_context(), newtdb);
-	return true;
+	key->dptr = (char *)name;
+	key->dsize = strlen(name);
 }
 
 void trace(const char *fmt, ...)
@@ -195,7 +205,7 @@ void trace_destroy(const void *data, const char *type)
 /**
  * Signal handler for SIGHUP, which requests that the trace log is reopened
  * (in the main loop).  A single byte is written to reopen_log_pipe, to awaken
- * the poll() in the main loop.
+ * the poll() or epoll_wait() in the main loop.
  */
 static void trigger_reopen_log(int signal __attribute__((unused)))
 {
@@ -225,52 +235,47 @@ void reopen_log(void)
 	}
 }
 
+/* Write out queued messages until done or the connection would block. */
 static bool write_messages(struct connection *conn)
 {
 	int ret;
 	struct buffered_data *out;
 
-	out = list_top(&conn->out_list, struct buffered_data, list);
-	if (out == NULL)
-		return true;
+	while ((out = list_top(&conn->out_list, struct buffered_data, list))) {
+		if (out->inhdr) {
+			if (verbose)
+				xprintf("Writing msg %s (%.*s) out to %p\n",
+					sockmsg_string(out->hdr.msg.type),
+					out->hdr.msg.len,
+					out->buffer, conn);
+			ret = conn->write(conn, out->hdr.raw + out->used,
+					  sizeof(out->hdr) - out->used);
+			if (ret < 0)
+				return false;
+
+			out->used += ret;
+			if (out->used < sizeof(out->hdr))
+				return true;
+
+			out->inhdr = false;
+			out->used = 0;
+		}
 
-	if (out->inhdr) {
-		if (verbose)
-			xprintf("Writing msg %s (%.*s) out to %p\n",
-				sockmsg_string(out->hdr.msg.type),
-				out->hdr.msg.len,
-				out->buffer, conn);
-		ret = conn->write(conn, out->hdr.raw + out->used,
-				  sizeof(out->hdr) - out->used);
+		ret = conn->write(conn, out->buffer + out->used,
+				  out->hdr.msg.len - out->used);
 		if (ret < 0)
 			return false;
 
 		out->used += ret;
-		if (out->used < sizeof(out->hdr))
+		if (out->used != out->hdr.msg.len)
 			return true;
 
-		out->inhdr = false;
-		out->used = 0;
+		trace_io(conn, out, 1);
 
-		/* Second write might block if non-zero. */
-		if (out->hdr.msg.len && !conn->domain)
-			return true;
+		list_del(&out->list);
+		talloc_free(out);
 	}
 
-	ret = conn->write(conn, out->buffer + out->used,
-			  out->hdr.msg.len - out->used);
-	if (ret < 0)
-		return false;
-
-	out->used += ret;
-	if (out->used != out->hdr.msg.len)
-		return true;
-
-	trace_io(conn, out, 1);
-
-	list_del(&out->list);
-	talloc_free(out);
-
 	return true;
 }
 
@@ -297,6 +302,120 @@ static int destroy_conn(void *_conn)
 	return 0;
 }
 
+#ifdef XENSTORED_EPOLL
+/* The POLL* and EPOLL* event flags share their values. */
+static int epoll_set(int op, int fd, short events, void *data)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = data;
+
+	return epoll_ctl(epoll_fd, op, fd, &ev);
+}
+
+static void init_reopen_log_fd(void)
+{
+	if (reopen_log_pipe[0] != -1 &&
+	    epoll_set(EPOLL_CTL_ADD, reopen_log_pipe[0], POLLIN|POLLPRI,
+		      &reopen_log_tag))
+		barf_perror("Could not add reopen log pipe to epoll set");
+}
+
+static void init_fds(int sock, int ro_sock)
+{
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+		barf_perror("Could not create epoll set");
+
+	if (sock != -1 &&
+	    epoll_set(EPOLL_CTL_ADD, sock, POLLIN|POLLPRI, &sock_tag))
+		barf_perror("Could not add socket to epoll set");
+	if (ro_sock != -1 &&
+	    epoll_set(EPOLL_CTL_ADD, ro_sock, POLLIN|POLLPRI, &ro_sock_tag))
+		barf_perror("Could not add ro socket to epoll set");
+	if (xce_handle != NULL &&
+	    epoll_set(EPOLL_CTL_ADD, xenevtchn_fd(xce_handle), POLLIN|POLLPRI,
+		      &xce_tag))
+		barf_perror("Could not add event channel to epoll set");
+	init_reopen_log_fd();
+}
+
+static bool add_conn_fd(struct connection *conn)
+{
+	conn->events = POLLIN|POLLPRI;
+
+	return !epoll_set(EPOLL_CTL_ADD, conn->fd, conn->events, conn);
+}
+
+static int wait_for_events(int timeout)
+{
+	struct epoll_event ev[64];
+	void *data;
+	int i, n;
+
+	n = epoll_wait(epoll_fd, ev, ARRAY_SIZE(ev), timeout);
+
+	sock_revents = ro_sock_revents = reopen_log_revents = xce_revents = 0;
+	for (i = 0; i < n; i++) {
+		data = ev[i].data.ptr;
+		if (data == &sock_tag)
+			sock_revents = ev[i].events;
+		else if (data == &ro_sock_tag)
+			ro_sock_revents = ev[i].events;
+		else if (data == &reopen_log_tag)
+			reopen_log_revents = ev[i].events;
+		else if (data == &xce_tag)
+			xce_revents = ev[i].events;
+		else
+			((struct connection *)data)->revents = ev[i].events;
+	}
+
+	return n < 0 ? -1 : 0;
+}
+
+/*
+ * Wait for output to be writable only when there is some, and return the
+ * timeout for the next wait: 0 if a domain connection has work left.
+ */
+static void update_fds(int sock, int ro_sock, int *ptimeout)
+{
+	struct connection *conn;
+	short events;
+
+	*ptimeout = -1;
+
+	list_for_each_entry(conn, &connections, list) {
+		if (conn->domain) {
+			if (conn->ring_pending ||
+			    (domain_can_write(conn) &&
+			     !list_empty(&conn->out_list)))
+				*ptimeout = 0;
+		} else {
+			events = POLLIN|POLLPRI;
+			if (!list_empty(&conn->out_list))
+				events |= POLLOUT;
+			if (events != conn->events &&
+			    !epoll_set(EPOLL_CTL_MOD, conn->fd, events, conn))
+				conn->events = events;
+		}
+	}
+}
+#else
+static inline void init_reopen_log_fd(void)
+{
+}
+
+static inline void init_fds(int sock, int ro_sock)
+{
+}
+
+static inline bool add_conn_fd(struct connection *conn)
+{
+	return true;
+}
+
 /* This function returns index inside the array if succeed, -1 if fail */
 static int set_fd(int fd, short events)
 {
@@ -331,9 +450,35 @@ fail:
 	return -1;
 }
 
-static void initialize_fds(int sock, int *p_sock_pollfd_idx,
-			   int ro_sock, int *p_ro_sock_pollfd_idx,
-			   int *ptimeout)
+static short get_revents(int idx)
+{
+	return idx == -1 ? 0 : fds[idx].revents;
+}
+
+static int wait_for_events(int timeout)
+{
+	struct connection *conn;
+
+	if (poll(fds, nr_fds, timeout) < 0)
+		return -1;
+
+	sock_revents = get_revents(sock_pollfd_idx);
+	ro_sock_revents = get_revents(ro_sock_pollfd_idx);
+	reopen_log_revents = get_revents(reopen_log_pipe0_pollfd_idx);
+	xce_revents = get_revents(xce_pollfd_idx);
+
+	list_for_each_entry(conn, &connections, list)
+		if (!conn->domain)
+			conn->revents = get_revents(conn->pollfd_idx);
+
+	return 0;
+}
+
+/*
+ * Rebuild the pollfd array and return the timeout for the next wait: 0
+ * if a domain connection has work left.
+ */
+static void update_fds(int sock, int ro_sock, int *ptimeout)
 {
 	struct connection *conn;
 
@@ -343,10 +488,13 @@ static void initialize_fds(int sock, int *p_sock_pollfd_idx,
 
 	*ptimeout = -1;
 
+	sock_pollfd_idx = ro_sock_pollfd_idx = -1;
+	reopen_log_pipe0_pollfd_idx = xce_pollfd_idx = -1;
+
 	if (sock != -1)
-		*p_sock_pollfd_idx = set_fd(sock, POLLIN|POLLPRI);
+		sock_pollfd_idx = set_fd(sock, POLLIN|POLLPRI);
 	if (ro_sock != -1)
-		*p_ro_sock_pollfd_idx = set_fd(ro_sock, POLLIN|POLLPRI);
+		ro_sock_pollfd_idx = set_fd(ro_sock, POLLIN|POLLPRI);
 	if (reopen_log_pipe[0] != -1)
 		reopen_log_pipe0_pollfd_idx =
 			set_fd(reopen_log_pipe[0], POLLIN|POLLPRI);
@@ -357,7 +505,7 @@ static void initialize_fds(int sock, int *p_sock_pollfd_idx,
 
 	list_for_each_entry(conn, &connections, list) {
 		if (conn->domain) {
-			if (domain_can_read(conn) ||
+			if (conn->ring_pending ||
 			    (domain_can_write(conn) &&
 			     !list_empty(&conn->out_list)))
 				*ptimeout = 0;
@@ -369,6 +517,7 @@ static void initialize_fds(int sock, int *p_sock_pollfd_idx,
 		}
 	}
 }
+#endif
 
 /*
  * If it fails, returns NULL and sets errno.
@@ -380,17 +529,17 @@ static struct node *read_node(struct connection *conn, const void *ctx,
 	TDB_DATA key, data;
 	struct xs_tdb_record_hdr *hdr;
 	struct node *node;
-	TDB_CONTEXT * context = tdb_context(conn);
 
-	key.dptr = (void *)name;
-	key.dsize = strlen(name);
-	data = tdb_fetch(context, key);
+	transaction_key(conn, name, &key);
+	data = tdb_fetch(tdb_ctx, key);
 
 	if (data.dptr == NULL) {
-		if (tdb_error(context) == TDB_ERR_NOEXIST)
+		if (tdb_error(tdb_ctx) == TDB_ERR_NOEXIST) {
+			/* A concurrent creation must fail a transaction. */
+			transaction_read(conn, name, NO_GENERATION);
 			errno = ENOENT;
-		else {
-			log("TDB error on read: %s", tdb_errorstr(context));
+		} else {
+			log("TDB error on read: %s", tdb_errorstr(tdb_ctx));
 			errno = EIO;
 		}
 		return NULL;
@@ -408,12 +557,12 @@ static struct node *read_node(struct connection *conn, const void *ctx,
 		return NULL;
 	}
 	node->parent = NULL;
-	node->tdb = tdb_context(conn);
 	talloc_steal(node, data.dptr);
 
 	/* Datalen, childlen, number of permissions */
 	hdr = (void *)data.dptr;
 	node->generation = hdr->generation;
+	transaction_read(conn, name, node->generation);
 	node->num_perms = hdr->num_perms;
 	node->datalen = hdr->datalen;
 	node->childlen = hdr->childlen;
@@ -432,16 +581,13 @@ static bool write_node(struct connection *conn, struct node *node)
 {
 	/*
 	 * conn will be null when this is called from manual_node.
-	 * tdb_context copes with this.
+	 * access_node copes with this.
 	 */
 
 	TDB_DATA key, data;
 	void *p;
 	struct xs_tdb_record_hdr *hdr;
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
 	data.dsize = sizeof(*hdr)
 		+ node->num_perms*sizeof(node->perms[0])
 		+ node->datalen + node->childlen;
@@ -449,6 +595,11 @@ static bool write_node(struct connection *conn, struct node *node)
 	if (domain_is_unprivileged(conn) && data.dsize >= quota_max_entry_size)
 		goto error;
 
+	if (access_node(conn, node, NODE_ACCESS_WRITE, &key)) {
+		errno = ENOMEM;
+		return false;
+	}
+
 	add_change_node(conn, node, false);
 
 	data.dptr = talloc_size(node, data.dsize);
@@ -465,7 +616,7 @@ static bool write_node(struct connection *conn, struct node *node)
 	memcpy(p, node->children, node->childlen);
 
 	/* TDB should set errno, but doesn't even set ecode AFAICT. */
-	if (tdb_store(tdb_context(conn), key, data, TDB_REPLACE) != 0) {
+	if (tdb_store(tdb_ctx, key, data, TDB_REPLACE) != 0) {
 		corrupt(conn, "Write of %s failed", key.dptr);
 		goto error;
 	}
@@ -894,15 +1045,24 @@ static int do_read(struct connection *conn, struct buffered_data *in)
 	return 0;
 }
 
-static void delete_node_single(struct connection *conn, struct node *node,
-			       bool changed)
+/* Remove the node's record from the store. */
+static int delete_node_record(struct connection *conn, struct node *node)
 {
 	TDB_DATA key;
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
+	if (access_node(conn, node, NODE_ACCESS_DELETE, &key))
+		return ENOMEM;
+
+	if (key.dptr && tdb_delete(tdb_ctx, key) != 0)
+		return EIO;
 
-	if (tdb_delete(tdb_context(conn), key) != 0) {
+	return 0;
+}
+
+static void delete_node_single(struct connection *conn, struct node *node,
+			       bool changed)
+{
+	if (delete_node_record(conn, node)) {
 		corrupt(conn, "Could not delete '%s'", node->name);
 		return;
 	}
@@ -951,7 +1111,6 @@ static struct node *construct_node(struct connection *conn, const void *ctx,
 
 	/* Allocate node */
 	node = talloc(ctx, struct node);
-	node->tdb = tdb_context(conn);
 	node->name = talloc_strdup(node, name);
 
 	/* Inherit permissions, except unprivileged domains own what they create */
@@ -969,26 +1128,11 @@ static struct node *construct_node(struct connection *conn, const void *ctx,
 	return node;
 }
 
-static int destroy_node(void *_node)
-{
-	struct node *node = _node;
-	TDB_DATA key;
-
-	if (streq(node->name, "/"))
-		corrupt(NULL, "Destroying root node!");
-
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	tdb_delete(node->tdb, key);
-	return 0;
-}
-
 static struct node *create_node(struct connection *conn, const void *ctx,
 				const char *name,
 				void *data, unsigned int datalen)
 {
-	struct node *node, *i;
+	struct node *node, *i, *j;
 
 	node = construct_node(conn, ctx, name);
 	if (!node)
@@ -997,19 +1141,17 @@ static struct node *create_node(struct connection *conn, const void *ctx,
 	node->data = data;
 	node->datalen = datalen;
 
-	/* We write out the nodes down, setting destructor in case
+	/* We write out the nodes down, removing them again in case
 	 * something goes wrong. */
 	for (i = node; i; i = i->parent) {
 		if (!write_node(conn, i)) {
 			domain_entry_dec(conn, i);
+			for (j = node; j != i; j = j->parent)
+				delete_node_record(conn, j);
 			return NULL;
 		}
-		talloc_set_destructor(i, destroy_node);
 	}
 
-	/* OK, now remove destructors so they stay around */
-	for (i = node; i; i = i->parent)
-		talloc_set_destructor(i, NULL);
 	return node;
 }
 
@@ -1345,8 +1487,9 @@ static void consider_message(struct connection *conn)
 }
 
 /* Errors in reading or allocating here mean we get out of sync, so we
- * drop the whole client connection. */
-static void handle_input(struct connection *conn)
+ * drop the whole client connection.
+ * Returns true if a complete request has been handled. */
+static bool handle_input(struct connection *conn)
 {
 	int bytes;
 	struct buffered_data *in;
@@ -1355,7 +1498,7 @@ static void handle_input(struct connection *conn)
 		conn->in = new_buffer(conn);
 		/* In case of no memory just try it again next time. */
 		if (!conn->in)
-			return;
+			return false;
 	}
 	in = conn->in;
 
@@ -1368,7 +1511,7 @@ static void handle_input(struct connection *conn)
 				goto bad_client;
 			in->used += bytes;
 			if (in->used != sizeof(in->hdr))
-				return;
+				return false;
 
 			if (in->hdr.msg.len > XENSTORE_PAYLOAD_MAX) {
 				syslog(LOG_ERR, "Client tried to feed us %i",
@@ -1383,7 +1526,7 @@ static void handle_input(struct connection *conn)
 			in->buffer = talloc_array(in, char, in->hdr.msg.len);
 		/* In case of no memory just try it again next time. */
 		if (!in->buffer)
-			return;
+			return false;
 		in->used = 0;
 		in->inhdr = false;
 	}
@@ -1395,15 +1538,16 @@ static void handle_input(struct connection *conn)
 
 	in->used += bytes;
 	if (in->used != in->hdr.msg.len)
-		return;
+		return false;
 
 	trace_io(conn, in, 0);
 	consider_message(conn);
-	return;
+	return true;
 
 bad_client:
 	/* Kill it. */
 	talloc_free(conn);
+	return false;
 }
 
 static void handle_output(struct connection *conn)
@@ -1462,10 +1606,9 @@ static int readfd(struct connection *conn, void *data, unsigned int len)
 	int rc;
 
 	while ((rc = read(conn->fd, data, len)) < 0) {
-		if (errno == EAGAIN) {
-			rc = 0;
-			break;
-		}
+		/* Nothing to read right now. */
+		if (errno == EAGAIN)
+			return 0;
 		if (errno != EINTR)
 			break;
 	}
@@ -1488,10 +1631,18 @@ static void accept_connection(int sock, bool canwrite)
 	if (fd < 0)
 		return;
 
+	/* Several requests are handled per wakeup: never block on reads. */
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+		close(fd);
+		return;
+	}
+
 	conn = new_connection(writefd, readfd);
 	if (conn) {
 		conn->fd = fd;
 		conn->can_write = canwrite;
+		if (!add_conn_fd(conn))
+			talloc_free(conn);
 	} else
 		close(fd);
 }
@@ -1715,8 +1866,13 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
 			void *private)
 {
 	struct hashtable *reachable = private;
-	char * name = talloc_strndup(NULL, key.dptr, key.dsize);
+	char * name;
 
+	/* Records of running transactions aren't reachable from the root. */
+	if (key.dsize && key.dptr[0] != '/')
+		return 0;
+
+	name = talloc_strndup(NULL, key.dptr, key.dsize);
 	if (!name) {
 		log("clean_store: ENOMEM");
 		return 1;
@@ -1905,7 +2061,6 @@ int priv_domid = 0;
 int main(int argc, char *argv[])
 {
 	int opt, *sock = NULL, *ro_sock = NULL;
-	int sock_pollfd_idx = -1, ro_sock_pollfd_idx = -1;
 	bool dofork = true;
 	bool outputpid = false;
 	bool no_domain_init = false;
@@ -2020,8 +2175,8 @@ int main(int argc, char *argv[])
 		tracefile = talloc_strdup(NULL, tracefile);
 
 	/* Get ready to listen to the tools. */
-	initialize_fds(*sock, &sock_pollfd_idx, *ro_sock, &ro_sock_pollfd_idx,
-		       &timeout);
+	init_fds(*sock, *ro_sock);
+	update_fds(*sock, *ro_sock, &timeout);
 
 	/* Tell the kernel we're up and running. */
 	xenbus_notify_running();
@@ -2034,58 +2189,43 @@ int main(int argc, char *argv[])
 	/* Main loop. */
 	for (;;) {
 		struct connection *conn, *next;
+		unsigned int n;
 
-		if (poll(fds, nr_fds, timeout) < 0) {
+		if (wait_for_events(timeout) < 0) {
 			if (errno == EINTR)
 				continue;
 			barf_perror("Poll failed");
 		}
 
-		if (reopen_log_pipe0_pollfd_idx != -1) {
-			if (fds[reopen_log_pipe0_pollfd_idx].revents
-			    & ~POLLIN) {
-				close(reopen_log_pipe[0]);
-				close(reopen_log_pipe[1]);
-				init_pipe(reopen_log_pipe);
-			} else if (fds[reopen_log_pipe0_pollfd_idx].revents
-				   & POLLIN) {
-				char c;
-				if (read(reopen_log_pipe[0], &c, 1) != 1)
-					barf_perror("read failed");
-				reopen_log();
-			}
-			reopen_log_pipe0_pollfd_idx = -1;
+		if (reopen_log_revents & ~POLLIN) {
+			close(reopen_log_pipe[0]);
+			close(reopen_log_pipe[1]);
+			init_pipe(reopen_log_pipe);
+			init_reopen_log_fd();
+		} else if (reopen_log_revents & POLLIN) {
+			char c;
+			if (read(reopen_log_pipe[0], &c, 1) != 1)
+				barf_perror("read failed");
+			reopen_log();
 		}
 
-		if (sock_pollfd_idx != -1) {
-			if (fds[sock_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("sock poll failed");
-				break;
-			} else if (fds[sock_pollfd_idx].revents & POLLIN) {
-				accept_connection(*sock, true);
-				sock_pollfd_idx = -1;
-			}
-		}
+		if (sock_revents & ~POLLIN) {
+			barf_perror("sock poll failed");
+			break;
+		} else if (sock_revents & POLLIN)
+			accept_connection(*sock, true);
 
-		if (ro_sock_pollfd_idx != -1) {
-			if (fds[ro_sock_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("ro sock poll failed");
-				break;
-			} else if (fds[ro_sock_pollfd_idx].revents & POLLIN) {
-				accept_connection(*ro_sock, false);
-				ro_sock_pollfd_idx = -1;
-			}
-		}
+		if (ro_sock_revents & ~POLLIN) {
+			barf_perror("ro sock poll failed");
+			break;
+		} else if (ro_sock_revents & POLLIN)
+			accept_connection(*ro_sock, false);
 
-		if (xce_pollfd_idx != -1) {
-			if (fds[xce_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("xce_handle poll failed");
-				break;
-			} else if (fds[xce_pollfd_idx].revents & POLLIN) {
-				handle_event();
-				xce_pollfd_idx = -1;
-			}
-		}
+		if (xce_revents & ~POLLIN) {
+			barf_perror("xce_handle poll failed");
+			break;
+		} else if (xce_revents & POLLIN)
+			handle_event();
 
 		next = list_entry(connections.next, typeof(*conn), list);
 		if (&next->list != &connections)
@@ -2099,8 +2239,18 @@ int main(int argc, char *argv[])
 				talloc_increase_ref_count(next);
 
 			if (conn->domain) {
-				if (domain_can_read(conn))
-					handle_input(conn);
+				/*
+				 * Only look at rings we were notified about,
+				 * and don't let a busy one starve the others.
+				 */
+				if (conn->ring_pending) {
+					for (n = 0; n < MAX_REQUESTS_PER_WAKEUP &&
+						    domain_can_read(conn); n++)
+						if (!handle_input(conn))
+							break;
+					conn->ring_pending =
+						domain_can_read(conn);
+				}
 				if (talloc_free(conn) == 0)
 					continue;
 
@@ -2108,39 +2258,33 @@ int main(int argc, char *argv[])
 				if (domain_can_write(conn) &&
 				    !list_empty(&conn->out_list))
 					handle_output(conn);
+				domain_notify(conn);
 				if (talloc_free(conn) == 0)
 					continue;
 			} else {
-				if (conn->pollfd_idx != -1) {
-					if (fds[conn->pollfd_idx].revents
-					    & ~(POLLIN|POLLOUT))
-						talloc_free(conn);
-					else if (fds[conn->pollfd_idx].revents
-						 & POLLIN)
-						handle_input(conn);
-				}
+				if (conn->revents & ~(POLLIN|POLLOUT))
+					talloc_free(conn);
+				else if (conn->revents & POLLIN)
+					for (n = 0; n < MAX_REQUESTS_PER_WAKEUP; n++)
+						if (!handle_input(conn))
+							break;
 				if (talloc_free(conn) == 0)
 					continue;
 
 				talloc_increase_ref_count(conn);
 
-				if (conn->pollfd_idx != -1) {
-					if (fds[conn->pollfd_idx].revents
-					    & ~(POLLIN|POLLOUT))
-						talloc_free(conn);
-					else if (fds[conn->pollfd_idx].revents
-						 & POLLOUT)
-						handle_output(conn);
-				}
+				if (conn->revents & ~(POLLIN|POLLOUT))
+					talloc_free(conn);
+				else if (!list_empty(&conn->out_list))
+					handle_output(conn);
 				if (talloc_free(conn) == 0)
 					continue;
 
-				conn->pollfd_idx = -1;
+				conn->revents = 0;
 			}
 		}
 
-		initialize_fds(*sock, &sock_pollfd_idx, *ro_sock,
-			       &ro_sock_pollfd_idx, &timeout);
+		update_fds(*sock, *ro_sock, &timeout);
 	}
 }
 
@@ -68,6 +68,12 @@ struct connection
 	int fd;
 	/* The index of pollfd in global pollfd array */
 	int pollfd_idx;
+	/* Events (POLL* flags) fd is waited for with, and reported for it. */
+	short events;
+	short revents;
+
+	/* Domain connections: event received, or requests left in ring. */
+	bool ring_pending;
 
 	/* Who am I? 0 for socket connections. */
 	unsigned int id;
@@ -107,14 +113,12 @@ extern struct list_head connections;
 struct node {
 	const char *name;
 
-	/* Database I came from */
-	TDB_CONTEXT *tdb;
-
 	/* Parent (optional) */
 	struct node *parent;
 
 	/* Generation count. */
 	uint64_t generation;
+#define NO_GENERATION ~((uint64_t)0)
 
 	/* Permissions. */
 	unsigned int num_perms;
@@ -151,11 +155,11 @@ struct node *get_node(struct connection *conn,
 		      const char *name,
 		      enum xs_perm_type perm);
 
-/* Get TDB context for this connection */
-TDB_CONTEXT *tdb_context(struct connection *conn);
+/* The node store, shared by all transactions. */
+extern TDB_CONTEXT *tdb_ctx;
 
-/* Replace the tdb: required for transaction code */
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb);
+/* Set the tdb key of a node. */
+void set_tdb_key(const char *name, TDB_DATA *key);
 
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read);
 void check_store(void);
@@ -74,6 +74,9 @@ struct domain
 
 	/* number of watch for this domain */
 	int nbwatch;
+
+	/* Has the ring been accessed since the domain was last notified? */
+	bool notify;
 };
 
 static LIST_HEAD(domains);
@@ -129,7 +132,7 @@ static int writechn(struct connection *conn,
 	xen_mb();
 	intf->rsp_prod += len;
 
-	xenevtchn_notify(xce_handle, conn->domain->port);
+	conn->domain->notify = true;
 
 	return len;
 }
@@ -159,7 +162,7 @@ static int readchn(struct connection *conn, void *data, unsigned int len)
 	xen_mb();
 	intf->req_cons += len;
 
-	xenevtchn_notify(xce_handle, conn->domain->port);
+	conn->domain->notify = true;
 
 	return len;
 }
@@ -235,16 +238,29 @@ static void domain_cleanup(void)
 		fire_watches(NULL, NULL, "@releaseDomain", false);
 }
 
-/* We scan all domains rather than use the information given here. */
+static struct domain *find_domain_by_port(evtchn_port_t port)
+{
+	struct domain *i;
+
+	list_for_each_entry(i, &domains, list) {
+		if (i->port == port)
+			return i;
+	}
+	return NULL;
+}
+
 void handle_event(void)
 {
 	evtchn_port_t port;
+	struct domain *domain;
 
 	if ((port = xenevtchn_pending(xce_handle)) == -1)
 		barf_perror("Failed to read from event fd");
 
 	if (port == virq_port)
 		domain_cleanup();
+	else if ((domain = find_domain_by_port(port)) && domain->conn)
+		domain->conn->ring_pending = true;
 
 	if (xenevtchn_unmask(xce_handle, port) == -1)
 		barf_perror("Failed to write to event fd");
@@ -256,6 +272,14 @@ bool domain_can_read(struct connection *conn)
 	return (intf->req_cons != intf->req_prod);
 }
 
+void domain_notify(struct connection *conn)
+{
+	if (conn->domain->notify) {
+		conn->domain->notify = false;
+		xenevtchn_notify(xce_handle, conn->domain->port);
+	}
+}
+
 bool domain_is_unprivileged(struct connection *conn)
 {
 	return (conn && conn->domain && conn->domain->domid != 0 && conn->domain->domid != priv_domid);
@@ -304,10 +328,13 @@ static struct domain *new_domain(void *context, unsigned int domid,
 
 	domain->conn->domain = domain;
 	domain->conn->id = domid;
+	/* The ring might hold requests already. */
+	domain->conn->ring_pending = true;
 
 	domain->remote_port = port;
 	domain->nbentry = 0;
 	domain->nbwatch = 0;
+	domain->notify = false;
 
 	return domain;
 }
@@ -16,6 +16,7 @@
     along with this program; If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -35,6 +36,51 @@
 #include "xenstore_lib.h"
 #include "utils.h"
 
+/*
+ * Transactions no longer work on a private copy of the whole store.
+ *
+ * Instead every node a transaction touches is recorded in its list of
+ * accessed nodes, together with the generation count the node had in the
+ * global store when it was first accessed (NO_GENERATION if it didn't
+ * exist).  Nodes written within the transaction are stored in the same tdb
+ * under a key made of the transaction's unique generation count followed
+ * by the node's path, e.g. "1234/local/domain/1".  As real node names
+ * always start with '/' these can't clash with the global store.  Nodes
+ * deleted within the transaction are accessed nodes without such a record.
+ *
+ * Reads of a node modified in the transaction are served from the
+ * transaction's record, all other reads from the global store.  The latter
+ * might return data newer than the transaction's start, but only if
+ * another update raced with the transaction, in which case the generation
+ * check at commit time will fail the transaction.
+ *
+ * On commit the generation counts of all accessed nodes are compared with
+ * the global store; any difference means a conflicting update and the
+ * transaction fails with EAGAIN.  Otherwise the records of all modified
+ * nodes are moved to their global keys (or the global nodes deleted).
+ */
+
+struct accessed_node
+{
+	/* List of all accessed nodes in the context of this transaction. */
+	struct list_head list;
+
+	/* The name of the node. */
+	char *node;
+
+	/* The tdb key of the transaction's version of the node. */
+	char *trans_name;
+
+	/* Global generation count when first accessed, or NO_GENERATION. */
+	uint64_t generation;
+
+	/* Written or deleted in this transaction? */
+	bool modified;
+
+	/* Is there a record under trans_name in the tdb? */
+	bool ta_node;
+};
+
 struct changed_node
 {
 	/* List of all changed nodes in the context of this transaction. */
@@ -67,30 +113,147 @@ struct transaction
 	/* Connection-local identifier for this transaction. */
 	uint32_t id;
 
-	/* Generation when transaction started. */
+	/* Unique generation count, prefix of the transaction's tdb keys. */
 	uint64_t generation;
 
-	/* Transaction internal generation. */
-	uint64_t trans_gen;
-
-	/* TDB to work on, and filename */
-	TDB_CONTEXT *tdb;
-	char *tdb_name;
+	/* List of accessed nodes. */
+	struct list_head accessed;
 
 	/* List of changed nodes. */
 	struct list_head changes;
 
 	/* List of changed domains - to record the changed domain entry number */
 	struct list_head changed_domains;
+
+	/* Set if an allocation failed: the transaction can't commit. */
+	bool fail;
 };
 
 extern int quota_max_transaction;
 static uint64_t generation;
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans)
+static struct accessed_node *find_accessed_node(struct transaction *trans,
+						const char *name)
+{
+	struct accessed_node *i;
+
+	list_for_each_entry(i, &trans->accessed, list)
+		if (streq(i->node, name))
+			return i;
+
+	return NULL;
+}
+
+/* Return generation count of a node in the global store. */
+static uint64_t global_generation(const char *name)
+{
+	TDB_DATA key, data;
+	uint64_t gen;
+
+	set_tdb_key(name, &key);
+	data = tdb_fetch(tdb_ctx, key);
+	if (!data.dptr)
+		return NO_GENERATION;
+
+	gen = ((struct xs_tdb_record_hdr *)data.dptr)->generation;
+	talloc_free(data.dptr);
+
+	return gen;
+}
+
+static struct accessed_node *add_accessed_node(struct transaction *trans,
+					       const char *name,
+					       uint64_t gen)
 {
-	return trans->tdb;
+	struct accessed_node *i;
+
+	i = talloc_zero(trans, struct accessed_node);
+	if (!i)
+		goto nomem;
+	i->node = talloc_strdup(i, name);
+	i->trans_name = talloc_asprintf(i, "%"PRIu64"%s",
+					trans->generation, name);
+	if (!i->node || !i->trans_name)
+		goto nomem;
+	i->generation = gen;
+	list_add_tail(&i->list, &trans->accessed);
+
+	return i;
+
+ nomem:
+	/* All we can do is let the transaction fail. */
+	talloc_free(i);
+	trans->fail = true;
+	return NULL;
+}
+
+void transaction_key(struct connection *conn, const char *name, TDB_DATA *key)
+{
+	struct accessed_node *i;
+
+	if (conn && conn->transaction) {
+		i = find_accessed_node(conn->transaction, name);
+		if (i && i->modified) {
+			set_tdb_key(i->trans_name, key);
+			return;
+		}
+	}
+
+	set_tdb_key(name, key);
+}
+
+void transaction_read(struct connection *conn, const char *name, uint64_t gen)
+{
+	struct transaction *trans;
+
+	if (!conn || !conn->transaction)
+		return;
+
+	trans = conn->transaction;
+	if (!find_accessed_node(trans, name))
+		add_accessed_node(trans, name, gen);
+}
+
+int access_node(struct connection *conn, struct node *node,
+		enum node_access_type type, TDB_DATA *key)
+{
+	struct accessed_node *i;
+	struct transaction *trans;
+
+	if (type == NODE_ACCESS_WRITE)
+		node->generation = generation++;
+
+	if (!conn || !conn->transaction) {
+		/* They're changing the global database. */
+		set_tdb_key(node->name, key);
+		return 0;
+	}
+
+	trans = conn->transaction;
+
+	i = find_accessed_node(trans, node->name);
+	if (!i) {
+		i = add_accessed_node(trans, node->name,
+				      global_generation(node->name));
+		if (!i)
+			return ENOMEM;
+	}
+
+	i->modified = true;
+
+	if (type == NODE_ACCESS_WRITE) {
+		i->ta_node = true;
+		set_tdb_key(i->trans_name, key);
+	} else {
+		/* Only a record of our own needs deleting. */
+		if (i->ta_node)
+			set_tdb_key(i->trans_name, key);
+		else
+			key->dptr = NULL;
+		i->ta_node = false;
+	}
+
+	return 0;
 }
 
 /* Callers get a change node (which can fail) and only commit after they've
@@ -100,16 +263,11 @@ void add_change_node(struct connection *conn, struct node *node, bool recurse)
 	struct changed_node *i;
 	struct transaction *trans;
 
-	if (!conn || !conn->transaction) {
-		/* They're changing the global database. */
-		node->generation = generation++;
+	if (!conn || !conn->transaction)
 		return;
-	}
 
 	trans = conn->transaction;
 
-	node->generation = generation + trans->trans_gen++;
-
 	list_for_each_entry(i, &trans->changes, list) {
 		if (streq(i->node, node->name)) {
 			if (recurse)
@@ -121,13 +279,13 @@ void add_change_node(struct connection *conn, struct node *node, bool recurse)
 	i = talloc(trans, struct changed_node);
 	if (!i) {
 		/* All we can do is let the transaction fail. */
-		generation++;
+		trans->fail = true;
 		return;
 	}
 	i->node = talloc_strdup(i, node->name);
 	if (!i->node) {
 		/* All we can do is let the transaction fail. */
-		generation++;
+		trans->fail = true;
 		talloc_free(i);
 		return;
 	}
@@ -135,14 +293,72 @@ void add_change_node(struct connection *conn, struct node *node, bool recurse)
 	list_add_tail(&i->list, &trans->changes);
 }
 
+/* Has any node the transaction looked at been changed meanwhile? */
+static bool check_transaction(struct transaction *trans)
+{
+	struct accessed_node *i;
+
+	list_for_each_entry(i, &trans->accessed, list)
+		if (global_generation(i->node) != i->generation)
+			return false;
+
+	return true;
+}
+
+/* Move the transaction's versions of all modified nodes to the store. */
+static int finalize_transaction(struct transaction *trans)
+{
+	struct accessed_node *i;
+	struct xs_tdb_record_hdr *hdr;
+	TDB_DATA key, ta_key, data;
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		if (!i->modified)
+			continue;
+
+		set_tdb_key(i->node, &key);
+
+		if (!i->ta_node) {
+			/* Deleted in the transaction (or never created). */
+			tdb_delete(tdb_ctx, key);
+			continue;
+		}
+
+		set_tdb_key(i->trans_name, &ta_key);
+		data = tdb_fetch(tdb_ctx, ta_key);
+		if (!data.dptr)
+			return EIO;
+
+		hdr = (void *)data.dptr;
+		hdr->generation = generation++;
+		if (tdb_store(tdb_ctx, key, data, TDB_REPLACE) != 0) {
+			talloc_free(data.dptr);
+			return EIO;
+		}
+		talloc_free(data.dptr);
+
+		tdb_delete(tdb_ctx, ta_key);
+		i->ta_node = false;
+	}
+
+	return 0;
+}
+
 static int destroy_transaction(void *_transaction)
 {
 	struct transaction *trans = _transaction;
+	struct accessed_node *i;
+	TDB_DATA key;
 
 	trace_destroy(trans, "transaction");
-	if (trans->tdb)
-		tdb_close(trans->tdb);
-	unlink(trans->tdb_name);
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		if (!i->ta_node)
+			continue;
+		set_tdb_key(i->trans_name, &key);
+		tdb_delete(tdb_ctx, key);
+	}
+
 	return 0;
 }
 
@@ -177,18 +393,10 @@ int do_transaction_start(struct connection *conn, struct buffered_data *in)
 	if (!trans)
 		return ENOMEM;
 
+	INIT_LIST_HEAD(&trans->accessed);
 	INIT_LIST_HEAD(&trans->changes);
 	INIT_LIST_HEAD(&trans->changed_domains);
-	trans->generation = generation;
-	trans->tdb_name = talloc_asprintf(trans, "%s.%p",
-					  xs_daemon_tdb(), trans);
-	if (!trans->tdb_name)
-		return ENOMEM;
-	trans->tdb = tdb_copy(tdb_context(conn), trans->tdb_name);
-	if (!trans->tdb)
-		return errno;
-	/* Make it close if we go away. */
-	talloc_steal(trans, trans->tdb);
+	trans->generation = generation++;
 
 	/* Pick an unused transaction identifier. */
 	do {
@@ -214,6 +422,7 @@ int do_transaction_end(struct connection *conn, struct buffered_data *in)
 	struct changed_node *i;
 	struct changed_domain *d;
 	struct transaction *trans;
+	int ret;
 
 	if (!arg || (!streq(arg, "T") && !streq(arg, "F")))
 		return EINVAL;
@@ -229,13 +438,11 @@ int do_transaction_end(struct connection *conn, struct buffered_data *in)
 	talloc_steal(in, trans);
 
 	if (streq(arg, "T")) {
-		/* FIXME: Merge, rather failing on any change. */
-		if (trans->generation != generation)
+		if (trans->fail || !check_transaction(trans))
 			return EAGAIN;
-		if (!replace_tdb(trans->tdb_name, trans->tdb))
-			return errno;
-		/* Don't close this: we won! */
-		trans->tdb = NULL;
+		ret = finalize_transaction(trans);
+		if (ret)
+			return ret;
 
 		/* fix domain entry for each changed domain */
 		list_for_each_entry(d, &trans->changed_domains, list)
@@ -244,7 +451,6 @@ int do_transaction_end(struct connection *conn, struct buffered_data *in)
 		/* Fire off the watches for everything that changed. */
 		list_for_each_entry(i, &trans->changes, list)
 			fire_watches(conn, in, i->node, i->recurse);
-		generation += trans->trans_gen;
 	}
 	send_ack(conn, XS_TRANSACTION_END);
 
@@ -264,7 +470,7 @@ void transaction_entry_inc(struct transaction *trans, unsigned int domid)
 	d = talloc(trans, struct changed_domain);
 	if (!d) {
 		/* Let the transaction fail. */
-		generation++;
+		trans->fail = true;
 		return;
 	}
 	d->domid = domid;
@@ -285,7 +491,7 @@ void transaction_entry_dec(struct transaction *trans, unsigned int domid)
 	d = talloc(trans, struct changed_domain);
 	if (!d) {
 		/* Let the transaction fail. */
-		generation++;
+		trans->fail = true;
 		return;
 	}
 	d->domid = domid;
@@ -21,6 +21,11 @@
 
 struct transaction;
 
+enum node_access_type {
+	NODE_ACCESS_WRITE,
+	NODE_ACCESS_DELETE
+};
+
 int do_transaction_start(struct connection *conn, struct buffered_data *node);
 int do_transaction_end(struct connection *conn, struct buffered_data *in);
 
@@ -34,8 +39,18 @@ void transaction_entry_dec(struct transaction *trans, unsigned int domid);
 void add_change_node(struct connection *conn, struct node *node,
                      bool recurse);
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans);
+/* Get the tdb key to read a node from in the context of this connection. */
+void transaction_key(struct connection *conn, const char *name, TDB_DATA *key);
+
+/* A node with the given generation count was read. */
+void transaction_read(struct connection *conn, const char *name, uint64_t gen);
+
+/*
+ * A node is going to be written or deleted: sets the tdb key to use.
+ * For deletion key->dptr is set to NULL if there's no record to delete.
+ */
+int access_node(struct connection *conn, struct node *node,
+                enum node_access_type type, TDB_DATA *key);
 
 void conn_delete_all_transactions(struct connection *conn);
 
@@ -25,6 +25,7 @@
 #include <assert.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "xenstored_watch.h"
 #include "xenstore_lib.h"
 #include "utils.h"
@@ -32,11 +33,45 @@
 
 extern int quota_nb_watch_per_domain;
 
+/*
+ * Watches are indexed by path: each watched path and all of its ancestors
+ * have a watch_node, found via a hashtable of full paths and linked into a
+ * tree.  Special "@..." event paths hang directly off "/", as a watch on "/"
+ * sees those events, too.  A change to a node then visits only the watches
+ * on the node and its ancestors, plus the ones below it for a removal,
+ * instead of every watch of every connection.
+ */
+struct watch_node
+{
+	/* Siblings, i.e. the children of the parent. */
+	struct list_head list;
+
+	/* Parent, NULL for "/". */
+	struct watch_node *parent;
+
+	/* Nodes one level below this one. */
+	struct list_head children;
+
+	/* Watches registered for exactly this path. */
+	struct list_head watches;
+
+	char *path;
+};
+
+static struct hashtable *watch_index;
+
 struct watch
 {
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Watches on the same path */
+	struct list_head node_list;
+
+	/* The connection the watch belongs to, and its index node. */
+	struct connection *conn;
+	struct watch_node *wnode;
+
 	/* Current outstanding events applying to this watch. */
 	struct list_head events;
 
@@ -56,24 +91,6 @@ static bool check_event_node(const char *node)
 	return true;
 }
 
-/* Is child a subnode of parent, or equal? */
-static bool is_child(const char *child, const char *parent)
-{
-	unsigned int len = strlen(parent);
-
-	/*
-	 * / should really be "" for this algorithm to work, but that's a
-	 * usability nightmare.
-	 */
-	if (streq(parent, "/"))
-		return true;
-
-	if (strncmp(child, parent, len) != 0)
-		return false;
-
-	return child[len] == '/' || child[len] == '\0';
-}
-
 /*
  * Send a watch event.
  * Temporary memory allocations are done with ctx.
@@ -119,6 +136,120 @@ static void add_event(struct connection *conn,
 	talloc_free(data);
 }
 
+static unsigned int hash_from_key_fn(void *k)
+{
+	char *str = k;
+	unsigned int hash = 5381;
+	char c;
+
+	while ((c = *str++))
+		hash = ((hash << 5) + hash) + (unsigned int)c;
+
+	return hash;
+}
+
+static int keys_equal_fn(void *key1, void *key2)
+{
+	return 0 == strcmp((char *)key1, (char *)key2);
+}
+
+/* Free index nodes which have neither watches nor children any longer. */
+static void put_watch_node(struct watch_node *wnode)
+{
+	struct watch_node *parent;
+
+	while (wnode && list_empty(&wnode->watches) &&
+	       list_empty(&wnode->children)) {
+		parent = wnode->parent;
+		if (parent)
+			list_del(&wnode->list);
+		hashtable_remove(watch_index, wnode->path);
+		talloc_free(wnode);
+		wnode = parent;
+	}
+}
+
+/* Find or create the index node of a path. */
+static struct watch_node *get_watch_node(const char *path)
+{
+	struct watch_node *wnode, *parent = NULL;
+	char *parent_path, *key;
+
+	if (!watch_index) {
+		watch_index = create_hashtable(64, hash_from_key_fn,
+					       keys_equal_fn);
+		if (!watch_index)
+			return NULL;
+	}
+
+	wnode = hashtable_search(watch_index, (void *)path);
+	if (wnode)
+		return wnode;
+
+	if (!streq(path, "/")) {
+		if (strstarts(path, "@") || !strchr(path + 1, '/'))
+			parent_path = talloc_strdup(NULL, "/");
+		else
+			parent_path = talloc_strndup(NULL, path,
+						     strrchr(path, '/') - path);
+		if (!parent_path)
+			return NULL;
+		parent = get_watch_node(parent_path);
+		talloc_free(parent_path);
+		if (!parent)
+			return NULL;
+	}
+
+	wnode = talloc_zero(NULL, struct watch_node);
+	key = strdup(path);
+	if (!wnode || !key)
+		goto nomem;
+	wnode->path = talloc_strdup(wnode, path);
+	if (!wnode->path || !hashtable_insert(watch_index, key, wnode))
+		goto nomem;
+
+	INIT_LIST_HEAD(&wnode->children);
+	INIT_LIST_HEAD(&wnode->watches);
+	wnode->parent = parent;
+	if (parent)
+		list_add_tail(&wnode->list, &parent->children);
+
+	return wnode;
+
+ nomem:
+	free(key);
+	talloc_free(wnode);
+	put_watch_node(parent);
+	return NULL;
+}
+
+/* Send events for all watches registered for path. */
+static void fire_watch_node(void *ctx, const char *path, const char *name)
+{
+	struct watch_node *wnode;
+	struct watch *watch;
+
+	wnode = hashtable_search(watch_index, (void *)path);
+	if (!wnode)
+		return;
+
+	list_for_each_entry(watch, &wnode->watches, node_list)
+		add_event(watch->conn, ctx, watch, name);
+}
+
+/* Send events for all watches below wnode: they have been removed. */
+static void fire_watch_subtree(void *ctx, struct watch_node *wnode)
+{
+	struct watch_node *child;
+	struct watch *watch;
+
+	list_for_each_entry(child, &wnode->children, list) {
+		list_for_each_entry(watch, &child->watches, node_list)
+			add_event(watch->conn, ctx, watch, watch->node);
+		fire_watch_subtree(ctx, child);
+	}
+}
+
 /*
  * Check whether any watch events are to be sent.
  * Temporary memory allocations are done with ctx.
@@ -126,27 +257,47 @@ static void add_event(struct connection *conn,
 void fire_watches(struct connection *conn, void *ctx, const char *name,
 		  bool recurse)
 {
-	struct connection *i;
-	struct watch *watch;
+	struct watch_node *wnode;
+	char *path, *slash;
 
 	/* During transactions, don't fire watches. */
 	if (conn && conn->transaction)
 		return;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		list_for_each_entry(watch, &i->watches, list) {
-			if (is_child(name, watch->node))
-				add_event(i, ctx, watch, name);
-			else if (recurse && is_child(watch->node, name))
-				add_event(i, ctx, watch, watch->node);
+	if (!watch_index)
+		return;
+
+	/* Create an event for each watch on the node or one of its parents. */
+	fire_watch_node(ctx, "/", name);
+	if (!streq(name, "/")) {
+		path = talloc_strdup(ctx, name);
+		if (!path)
+			return;
+		for (slash = strchr(path + 1, '/'); slash;
+		     slash = strchr(slash + 1, '/')) {
+			*slash = 0;
+			fire_watch_node(ctx, path, name);
+			*slash = '/';
 		}
+		fire_watch_node(ctx, path, name);
+		talloc_free(path);
+	}
+
+	/* And for each watch below it if all the children are affected. */
+	if (recurse) {
+		wnode = hashtable_search(watch_index, (void *)name);
+		if (wnode)
+			fire_watch_subtree(ctx, wnode);
 	}
 }
 
 static int destroy_watch(void *_watch)
 {
-	trace_destroy(_watch, "watch");
+	struct watch *watch = _watch;
+
+	trace_destroy(watch, "watch");
+	list_del(&watch->node_list);
+	put_watch_node(watch->wnode);
 	return 0;
 }
 
@@ -192,15 +343,22 @@ int do_watch(struct connection *conn, struct buffered_data *in)
 		talloc_free(watch);
 		return ENOMEM;
 	}
+	watch->wnode = get_watch_node(watch->node);
+	if (!watch->wnode) {
+		talloc_free(watch);
+		return ENOMEM;
+	}
 	if (relative)
 		watch->relative_path = get_implicit_path(conn);
 	else
 		watch->relative_path = NULL;
 
 	INIT_LIST_HEAD(&watch->events);
+	watch->conn = conn;
 
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
+	list_add_tail(&watch->node_list, &watch->wnode->watches);
 	trace_create(watch, "watch");
 	talloc_set_destructor(watch, destroy_watch);
 	send_ack(conn, XS_WATCH);
@@ -1,12 +1,25 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <errno.h>
 #include "mread.h"
 
+struct mread_readahead {
+    pthread_t *threads;
+    int nr_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* Offset the analysis has got to, and next chunk to fault in */
+    off_t position, next;
+    int stop;
+};
+
 mread_handle_t mread_init(int fd)
 {
     struct stat s;
@@ -24,12 +37,116 @@ mread_handle_t mread_init(int fd)
 
     h->fd = fd;
 
-    fstat(fd, &s);
+    if ( fstat(fd, &s) )
+    {
+        perror("fstat");
+        exit(1);
+    }
+
+    if ( !S_ISREG(s.st_mode) )
+    {
+        /* Can't seek back: keep what hasn't been released in memory. */
+        h->stream.active = 1;
+        h->file_size = MREAD_STREAM_SIZE;
+        return h;
+    }
+
     h->file_size = s.st_size;
 
+    /*
+     * Where the address space allows, map the whole file once.  With many
+     * pcpus, the windows of the trace are spread over more of the file than
+     * the cache of regions below can hold.
+     */
+    if ( sizeof(void *) >= 8 && h->file_size > 0 )
+    {
+        h->base = mmap(NULL, h->file_size, PROT_READ, MAP_SHARED, fd, 0);
+        if ( h->base == MAP_FAILED )
+            h->base = NULL;
+    }
+
     return h;
 }
 
+static ssize_t mread_stream(mread_handle_t h, void *rec, ssize_t len,
+                            off_t offset)
+{
+    size_t used;
+    ssize_t r;
+
+    if ( offset < h->stream.start )
+    {
+        fprintf(stderr, "%s: offset %llx already released (start %llx)\n",
+                __func__, (unsigned long long)offset,
+                (unsigned long long)h->stream.start);
+        exit(1);
+    }
+
+    while ( !h->stream.eof && offset + len > h->stream.end )
+    {
+        used = h->stream.end - h->stream.start;
+
+        if ( used + MREAD_BUF_SIZE > h->stream.size )
+        {
+            size_t size = h->stream.size ? h->stream.size * 2 : MREAD_BUF_SIZE;
+            char *b;
+
+            while ( size < used + MREAD_BUF_SIZE )
+                size *= 2;
+
+            b = realloc(h->stream.buffer, size);
+            if ( !b )
+            {
+                perror("realloc");
+                exit(1);
+            }
+            h->stream.buffer = b;
+            h->stream.size = size;
+        }
+
+        r = read(h->fd, h->stream.buffer + used, h->stream.size - used);
+        if ( r < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            return -1;
+        }
+
+        if ( r == 0 )
+            h->stream.eof = 1;
+        h->stream.end += r;
+    }
+
+    if ( offset >= h->stream.end )
+        return 0;
+    if ( offset + len > h->stream.end )
+        len = h->stream.end - offset;
+
+    memcpy(rec, h->stream.buffer + (offset - h->stream.start), len);
+
+    return len;
+}
+
+void mread_release(mread_handle_t h, off_t offset)
+{
+    off_t released;
+
+    if ( !h->stream.active || offset <= h->stream.start )
+        return;
+
+    if ( offset > h->stream.end )
+        offset = h->stream.end;
+
+    /* Only move the data once enough has been released to be worth it. */
+    released = offset - h->stream.start;
+    if ( released < MREAD_BUF_SIZE || released < h->stream.size / 2 )
+        return;
+
+    memmove(h->stream.buffer, h->stream.buffer + released,
+            h->stream.end - offset);
+    h->stream.start = offset;
+}
+
 ssize_t mread64(mread_handle_t h, void *rec, ssize_t len, off_t offset)
 {
     /* Idea: have a "cache" of N mmaped regions.  If the offset is
@@ -53,6 +170,10 @@ ssize_t mread64(mread_handle_t h, void *rec, ssize_t len, off_t offset)
 
     dprintf(warn, "%s: offset %llx len %d\n", __func__,
             offset, len);
+
+    if ( h->stream.active )
+        return mread_stream(h, rec, len, offset);
+
     if ( offset > h->file_size )
     {
         dprintf(warn, " offset > file size %llx, returning 0\n",
@@ -66,6 +187,12 @@ ssize_t mread64(mread_handle_t h, void *rec, ssize_t len, off_t offset)
         len = h->file_size - offset;
     }
 
+    if ( h->base )
+    {
+        memcpy(rec, h->base + offset, len);
+        return len;
+    }
+
     /* Try to find the offset in our range */
     dprintf(warn, " Trying last, %d\n", last);
     if ( h->map[h->last].buffer
@@ -158,3 +285,120 @@ copy:
     return len;
 #undef dprintf
 }
+
+static void *readahead_thread(void *arg)
+{
+    mread_handle_t h = arg;
+    struct mread_readahead *ra = h->ra;
+    off_t offset, end;
+    unsigned char sum = 0;
+
+    pthread_mutex_lock(&ra->lock);
+    while ( !ra->stop )
+    {
+        if ( ra->next < ra->position )
+            ra->next = ra->position & MREAD_BUF_MASK;
+
+        if ( ra->next >= h->file_size
+             || ra->next >= ra->position + MREAD_RA_AHEAD )
+        {
+            pthread_cond_wait(&ra->cond, &ra->lock);
+            continue;
+        }
+
+        offset = ra->next;
+        ra->next += MREAD_BUF_SIZE;
+        pthread_mutex_unlock(&ra->lock);
+
+        /* Touch each page, so the faults happen here rather than in
+         * the analysis. */
+        end = offset + MREAD_BUF_SIZE;
+        if ( end > h->file_size )
+            end = h->file_size;
+        for ( ; offset < end; offset += 1 << PAGE_SHIFT )
+            sum += *(volatile char *)(h->base + offset);
+
+        pthread_mutex_lock(&ra->lock);
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    return (void *)(unsigned long)sum;
+}
+
+int mread_readahead_start(mread_handle_t h, int nr_threads)
+{
+    struct mread_readahead *ra;
+    int i;
+
+    /* Only worth it, and safe to do unlocked, on a whole file mapping */
+    if ( !h->base || nr_threads <= 0 )
+        return 0;
+
+    ra = calloc(1, sizeof(*ra));
+    if ( !ra || !(ra->threads = calloc(nr_threads, sizeof(*ra->threads))) )
+    {
+        free(ra);
+        return -1;
+    }
+
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+    h->ra = ra;
+
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        if ( pthread_create(&ra->threads[i], NULL, readahead_thread, h) )
+            break;
+        ra->nr_threads++;
+    }
+
+    if ( !ra->nr_threads )
+    {
+        mread_readahead_stop(h);
+        return -1;
+    }
+
+    return 0;
+}
+
+void mread_readahead_position(mread_handle_t h, off_t offset)
+{
+    struct mread_readahead *ra = h->ra;
+
+    /*
+     * The pcpus' windows are interleaved, so offset jumps back and forth
+     * around the front of the analysis.  Only follow it forward, in steps
+     * large enough not to keep waking the threads up.  Only the caller
+     * writes position: no need to lock to compare.
+     */
+    if ( !ra || offset < ra->position + MREAD_RA_STEP )
+        return;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->position = offset;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+}
+
+void mread_readahead_stop(mread_handle_t h)
+{
+    struct mread_readahead *ra = h->ra;
+    int i;
+
+    if ( !ra )
+        return;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = 1;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+
+    for ( i = 0; i < ra->nr_threads; i++ )
+        pthread_join(ra->threads[i], NULL);
+
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+    free(ra->threads);
+    free(ra);
+    h->ra = NULL;
+}
@@ -3,16 +3,38 @@
 #define PAGE_SHIFT 12
 #define MREAD_BUF_SIZE (1ULL<<(PAGE_SHIFT+MREAD_BUF_SHIFT))
 #define MREAD_BUF_MASK (~(MREAD_BUF_SIZE-1))
+/* How far ahead of the analysis the readahead threads fault in the file */
+#define MREAD_RA_AHEAD (128*MREAD_BUF_SIZE)
+#define MREAD_RA_STEP (MREAD_RA_AHEAD/8)
+/* File size reported for streams, whose real size is only known at EOF */
+#define MREAD_STREAM_SIZE ((off_t)(~0ULL>>1))
+struct mread_readahead;
 typedef struct mread_ctrl {
     int fd;
     off_t file_size;
+    /* The whole file, if it could be mapped at once */
+    char * base;
     struct mread_buffer {
         char * buffer;
         off_t start_offset;
         int accessed;
     } map[MREAD_MAPS];
     int clock, last;
+    /* Pipes and other unseekable files: buffer [start, end) of the stream */
+    struct {
+        int active, eof;
+        char * buffer;
+        size_t size;
+        off_t start, end;
+    } stream;
+    struct mread_readahead *ra;
 } *mread_handle_t;
 
 mread_handle_t mread_init(int fd);
 ssize_t mread64(mread_handle_t h, void *dst, ssize_t len, off_t offset);
+/* Streams only: data before offset won't be read again */
+void mread_release(mread_handle_t h, off_t offset);
+/* Fault the file in ahead of the current position using nr_threads threads */
+int mread_readahead_start(mread_handle_t h, int nr_threads);
+void mread_readahead_position(mread_handle_t h, off_t offset);
+void mread_readahead_stop(mread_handle_t h);
@@ -47,6 +47,9 @@ struct mread_ctrl;
 #define DEFAULT_SAMPLE_SIZE 1024
 #define DEFAULT_SAMPLE_MAX  1024*1024*32
 #define DEFAULT_INTERVAL_LENGTH 1000
+#define DEFAULT_READAHEAD_THREADS 4
+/* When streaming, release the data behind all pcpus every so many records */
+#define STREAM_RELEASE_INTERVAL 4096
 
 struct array_struct {
     unsigned long long *values;
@@ -189,6 +192,7 @@ struct {
     int interrupt_eip_enumeration_vector;
     int default_guest_paging_levels;
     int sample_size, sample_max;
+    int readahead_threads;
     enum error_level tolerance; /* Tolerate up to this level of error */
     struct {
         tsc_t cycles;
@@ -259,6 +263,7 @@ struct {
     .default_guest_paging_levels = 2,
     .sample_size = DEFAULT_SAMPLE_SIZE,
     .sample_max = DEFAULT_SAMPLE_MAX,
+    .readahead_threads = DEFAULT_READAHEAD_THREADS,
     .tolerance = ERR_SANITY,
     .interval = { .msec = DEFAULT_INTERVAL_LENGTH },
 };
@@ -7892,6 +7897,19 @@ void sched_process(struct pcpu_info *p)
                        ri->dump_header, r->domid, r->vcpuid);
             }
             break;
+        case TRC_SCHED_CLASS_EVT(CSCHED2, 24): /* PLACEMENT        */
+            if(opt.dump_all) {
+                struct {
+                    unsigned int vcpuid:16, domid:16;
+                    unsigned int cpu:16, node:8, mem_local:4, soft_affine:4;
+                } *r = (typeof(r))ri->d;
+
+                printf(" %s csched2:placement d%uv%u on cpu %u (node %u)%s%s\n",
+                       ri->dump_header, r->domid, r->vcpuid, r->cpu, r->node,
+                       r->mem_local ? "" : ", memory remote",
+                       r->soft_affine ? "" : ", outside soft affinity");
+            }
+            break;
         /* RTDS (TRC_RTDS_xxx) */
         case TRC_SCHED_CLASS_EVT(RTDS, 1): /* TICKLE           */
             if(opt.dump_all) {
@@ -9750,13 +9768,30 @@ struct pcpu_info * choose_next_record(void)
     if(opt.progress && min_p && min_p->file_offset >= G.progress.update_offset)
         progress_update(min_p->file_offset);
 
+    if(min_p)
+        mread_readahead_position(G.mh, min_p->file_offset);
+
     /* If there are active pcpus, make sure we chose one */
     assert(min_p || (P.max_active_pcpu==-1));
 
     return min_p;
 }
 
+/* Streams can't be read back: let go of what all pcpus are past. */
+void stream_release(void) {
+    off_t min_offset = G.mh->file_size;
+    int i;
+
+    for(i=0; i<=P.max_active_pcpu; i++)
+        if(P.pcpu[i].active && P.pcpu[i].file_offset < min_offset)
+            min_offset = P.pcpu[i].file_offset;
+
+    mread_release(G.mh, min_offset);
+}
+
 void process_records(void) {
+    unsigned long long count = 0;
+
     while(1) {
         struct pcpu_info *p = NULL;
 
@@ -9765,6 +9800,9 @@ void process_records(void) {
 
         process_record(p);
 
+        if(G.mh->stream.active && !(++count % STREAM_RELEASE_INTERVAL))
+            stream_release();
+
         /* Lost records gets processed twice. */
         if(p->ri.event == TRC_LOST_RECORDS) {
             p->ri.event = TRC_LOST_RECORDS_END;
@@ -9966,6 +10004,7 @@ enum {
     OPT_PROGRESS,
     OPT_TOLERANCE,
     OPT_TSC_LOOP_FATAL,
+    OPT_THREADS,
     /* Specific letters */
     OPT_DUMP_ALL='a',
     OPT_INTERVAL_LENGTH='i',
@@ -10446,6 +10485,16 @@ error_t cmd_parser(int key, char *arg, struct argp_state *state)
         opt.tsc_loop_fatal = 1;
         break;
 
+    case OPT_THREADS:
+    {
+        char * inval;
+
+        opt.readahead_threads = (int)strtol(arg, &inval, 0);
+        if( inval == arg || opt.readahead_threads < 0 )
+            argp_usage(state);
+    }
+    break;
+
     case ARGP_KEY_ARG:
     {
         /* FIXME - strcpy */
@@ -10740,6 +10789,11 @@ const struct argp_option cmd_opts[] =  {
       .arg = "errlevel",
       .doc = "Sets tolerance for errors found in the file.  Default is 3; max is 6.", },
 
+    { .name = "threads",
+      .key = OPT_THREADS,
+      .arg = "N",
+      .doc = "Number of threads reading the trace file ahead of the analysis.  Default is 4; 0 disables.", },
+
 
     { 0 },
 };
@@ -10747,7 +10801,7 @@ const struct argp_option cmd_opts[] =  {
 const struct argp parser_def = {
     .options = cmd_opts,
     .parser = cmd_parser,
-    .args_doc = "[trace file]",
+    .args_doc = "[trace file, or - to read a trace live from stdin]",
     .doc = "",
 };
 
@@ -10763,18 +10817,27 @@ int main(int argc, char *argv[]) {
     if (G.trace_file == NULL)
         exit(1);
 
-    if ( (G.fd = open(G.trace_file, O_RDONLY)) < 0) {
+    if ( !strcmp(G.trace_file, "-") )
+        G.fd = STDIN_FILENO;
+    else if ( (G.fd = open(G.trace_file, O_RDONLY)) < 0) {
         perror("open");
         error(ERR_SYSTEM, NULL);
-    } else {
-        struct stat s;
-        fstat(G.fd, &s);
-        G.file_size = s.st_size;
     }
 
     if ( (G.mh = mread_init(G.fd)) == NULL )
         perror("mread");
 
+    /* Streams report an unbounded size until they end. */
+    G.file_size = G.mh->file_size;
+
+    if ( G.mh->stream.active && opt.progress ) {
+        fprintf(stderr, "Progress not available when streaming, disabling\n");
+        opt.progress = 0;
+    }
+
+    if ( mread_readahead_start(G.mh, opt.readahead_threads) )
+        fprintf(stderr, "Failed to start readahead threads, continuing without\n");
+
     if (G.symbol_file != NULL)
         parse_symbol_file(G.symbol_file);
 
@@ -10788,6 +10851,8 @@ int main(int argc, char *argv[]) {
 
     process_records();
 
+    mread_readahead_stop(G.mh);
+
     if(opt.interval_mode)
         interval_tail();
 
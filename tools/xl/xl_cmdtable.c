@@ -165,6 +165,8 @@ struct cmd_spec cmd_table[] = {
       "-e              Do not wait in the background (on <host>) for the death\n"
       "                of the domain.\n"
       "--debug         Print huge (!) amount of debug during the migration process.\n"
+      "--compress      Compress the memory contents sent to <host>.\n"
+      "--zero-pages    List pages of zeroes rather than sending them.\n"
       "-p              Do not unpause domain after migrating it."
     },
     { "restore",
@@ -262,9 +264,10 @@ struct cmd_spec cmd_table[] = {
     { "sched-credit2",
       &main_sched_credit2, 0, 1,
       "Get/set credit2 scheduler parameters",
-      "[-d <Domain> [-w[=WEIGHT]]] [-p CPUPOOL]",
+      "[-d <Domain> [-w[=WEIGHT]|-c[=CAP]]] [-p CPUPOOL]",
       "-d DOMAIN, --domain=DOMAIN     Domain to modify\n"
       "-w WEIGHT, --weight=WEIGHT     Weight (int)\n"
+      "-c CAP,    --cap=CAP           Cap (int)\n"
       "-s         --schedparam        Query / modify scheduler parameters\n"
       "-r RLIMIT, --ratelimit_us=RLIMIT Set the scheduling rate limit, in microseconds\n"
       "-p CPUPOOL, --cpupool=CPUPOOL  Restrict output to CPUPOOL"
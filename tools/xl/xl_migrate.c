@@ -177,6 +177,7 @@ static void migrate_do_preamble(int send_fd, int recv_fd, pid_t child,
 }
 
 static void migrate_domain(uint32_t domid, const char *rune, int debug,
+                           int compress, int zero_pages,
                            const char *override_config_file)
 {
     pid_t child = -1;
@@ -205,6 +206,10 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
 
     if (debug)
         flags |= LIBXL_SUSPEND_DEBUG;
+    if (compress)
+        flags |= LIBXL_SUSPEND_COMPRESS;
+    if (zero_pages)
+        flags |= LIBXL_SUSPEND_ZERO_PAGES;
     rc = libxl_domain_suspend(ctx, domid, send_fd, flags, NULL);
     if (rc) {
         fprintf(stderr, "migration sender: libxl_domain_suspend failed"
@@ -530,9 +535,12 @@ int main_migrate(int argc, char **argv)
     char *rune = NULL;
     char *host;
     int opt, daemonize = 1, monitor = 1, debug = 0, pause_after_migration = 0;
+    int compress = 0, zero_pages = 0;
     static struct option opts[] = {
         {"debug", 0, 0, 0x100},
         {"live", 0, 0, 0x200},
+        {"compress", 0, 0, 0x300},
+        {"zero-pages", 0, 0, 0x400},
         COMMON_LONG_OPTS
     };
 
@@ -559,6 +567,12 @@ int main_migrate(int argc, char **argv)
     case 0x200: /* --live */
         /* ignored for compatibility with xm */
         break;
+    case 0x300: /* --compress */
+        compress = 1;
+        break;
+    case 0x400: /* --zero-pages */
+        zero_pages = 1;
+        break;
     }
 
     domid = find_domain(argv[optind]);
@@ -589,7 +603,8 @@ int main_migrate(int argc, char **argv)
                   pause_after_migration ? " -p" : "");
     }
 
-    migrate_domain(domid, rune, debug, config_filename);
+    migrate_domain(domid, rune, debug, compress, zero_pages,
+                   config_filename);
     return EXIT_SUCCESS;
 }
 
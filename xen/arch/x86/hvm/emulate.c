@@ -1926,6 +1926,7 @@ void hvm_emulate_init_once(
     hvmemul_ctxt->ctxt.regs = regs;
     hvmemul_ctxt->ctxt.vendor = curr->domain->arch.cpuid->x86_vendor;
     hvmemul_ctxt->ctxt.force_writeback = true;
+    hvmemul_ctxt->ctxt.dcache = curr->arch.hvm_vcpu.hvm_io.insn_dcache;
 
     if ( cpu_has_vmx )
         hvmemul_ctxt->ctxt.swint_emulate = x86_swint_emulate_none;
@@ -1958,6 +1959,8 @@ void hvm_emulate_init_per_insn(
     if ( hvmemul_ctxt->seg_reg[x86_seg_ss].attr.fields.dpl == 3 )
         pfec |= PFEC_user_mode;
 
+    hvmemul_ctxt->ctxt.dcache_tag = curr->arch.hvm_vcpu.guest_cr[3];
+
     hvmemul_ctxt->insn_buf_eip = hvmemul_ctxt->ctxt.regs->rip;
     if ( !insn_bytes )
     {
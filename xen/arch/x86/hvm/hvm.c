@@ -1512,6 +1512,9 @@ int hvm_vcpu_initialise(struct vcpu *v)
     spin_lock_init(&v->arch.hvm_vcpu.tm_lock);
     INIT_LIST_HEAD(&v->arch.hvm_vcpu.tm_list);
 
+    /* Optional: emulation simply goes without if this fails. */
+    v->arch.hvm_vcpu.hvm_io.insn_dcache = x86_emulate_dcache_alloc();
+
     rc = hvm_vcpu_cacheattr_init(v); /* teardown: vcpu_cacheattr_destroy */
     if ( rc != 0 )
         goto fail1;
@@ -1575,6 +1578,8 @@ int hvm_vcpu_initialise(struct vcpu *v)
  fail2:
     hvm_vcpu_cacheattr_destroy(v);
  fail1:
+    x86_emulate_dcache_free(v->arch.hvm_vcpu.hvm_io.insn_dcache);
+    v->arch.hvm_vcpu.hvm_io.insn_dcache = NULL;
     return rc;
 }
 
@@ -1598,6 +1603,9 @@ void hvm_vcpu_destroy(struct vcpu *v)
         vlapic_destroy(v);
 
     hvm_vcpu_cacheattr_destroy(v);
+
+    x86_emulate_dcache_free(v->arch.hvm_vcpu.hvm_io.insn_dcache);
+    v->arch.hvm_vcpu.hvm_io.insn_dcache = NULL;
 }
 
 void hvm_vcpu_down(struct vcpu *v)
@@ -4112,10 +4120,10 @@ static int hvmop_set_param(
         /*
          * Update GUEST_CR3 in each VMCS to point at identity map.
          * All foreign updates to guest state must synchronise on
-         * the domctl_lock.
+         * the domain's domctl_lock.
          */
         rc = -ERESTART;
-        if ( !domctl_lock_acquire() )
+        if ( !domctl_lock_acquire(d) )
             break;
 
         rc = 0;
@@ -4125,7 +4133,7 @@ static int hvmop_set_param(
             paging_update_cr3(v);
         domain_unpause(d);
 
-        domctl_lock_release();
+        domctl_lock_release(d);
         break;
     case HVM_PARAM_DM_DOMAIN:
         if ( a.value == DOMID_SELF )
@@ -26,6 +26,21 @@
 #define mode_is(d, name) \
     ((d)->arch.hvm_domain.params[HVM_PARAM_TIMER_MODE] == HVMPTM_##name)
 
+/*
+ * Lazy periodic timers.
+ *
+ * The Xen timer behind a periodic time source only needs to be armed when
+ * its expiry has to interrupt something: the vcpu is running, or it is
+ * blocked and the timer interrupt can wake it up. When the vcpu is
+ * descheduled while runnable, or blocks with the interrupt masked, the timers
+ * that would otherwise keep running are stopped and flagged as lazy, and the
+ * tick they would have produced is accounted for when the vcpu is scheduled
+ * again (pt_restore_timer()), when the interrupt is unmasked (pt_resume()),
+ * or when the time source moves to another vcpu.
+ */
+static bool_t __read_mostly opt_vpt_lazy = 1;
+boolean_param("vpt_lazy", opt_vpt_lazy);
+
 void hvm_init_guest_time(struct domain *d)
 {
     struct pl_time *pl = d->arch.hvm_domain.pl_time;
@@ -115,6 +130,13 @@ static int pt_irq_masked(struct periodic_time *pt)
             domain_vioapic(v->domain)->redirtbl[gsi].fields.mask);
 }
 
+/* Would pt_update_irq() suspend @pt if it had a tick pending? */
+static int pt_irq_suspended(struct periodic_time *pt)
+{
+    /* RTC code takes care of disabling the timer itself. */
+    return (pt->irq != RTC_IRQ || !pt->priv) && pt_irq_masked(pt);
+}
+
 static void pt_lock(struct periodic_time *pt)
 {
     struct vcpu *v;
@@ -153,6 +175,47 @@ static void pt_process_missed_ticks(struct periodic_time *pt)
     pt->scheduled += missed_ticks * pt->period;
 }
 
+/* Stop @pt's timer, whose expiry nobody needs to know about right now. */
+static void pt_lazy_stop(struct periodic_time *pt)
+{
+    ASSERT(!pt->pending_intr_nr);
+
+    stop_timer(&pt->timer);
+    pt->lazy = 1;
+    perfc_incr(vpt_lazy_stop);
+}
+
+/* Do what pt_timer_fn() would have done if @pt's timer had been running. */
+static void pt_lazy_update(struct periodic_time *pt)
+{
+    if ( !pt->lazy )
+        return;
+
+    pt->lazy = 0;
+
+    if ( pt->scheduled >= NOW() )
+        return;
+
+    pt->pending_intr_nr++;
+    pt->scheduled += pt->period;
+    pt->do_not_freeze = 0;
+    perfc_incr(vpt_lazy_tick);
+}
+
+/*
+ * @pt's vcpu may need to hear about the tick now: deliver it if it is already
+ * due, or re-arm the timer.
+ */
+static void pt_lazy_wake(struct periodic_time *pt)
+{
+    pt_lazy_update(pt);
+
+    if ( pt->pending_intr_nr )
+        vcpu_kick(pt->vcpu);
+    else
+        set_timer(&pt->timer, pt->scheduled);
+}
+
 static void pt_freeze_time(struct vcpu *v)
 {
     if ( !mode_is(v->domain, delay_for_missed_ticks) )
@@ -179,13 +242,27 @@ void pt_save_timer(struct vcpu *v)
     struct periodic_time *pt;
 
     if ( v->pause_flags & VPF_blocked )
+    {
+        if ( !opt_vpt_lazy )
+            return;
+
+        /* A masked interrupt can't wake us: no need for the timer. */
+        spin_lock(&v->arch.hvm_vcpu.tm_lock);
+        list_for_each_entry ( pt, head, list )
+            if ( !pt->pending_intr_nr && pt_irq_suspended(pt) )
+                pt_lazy_stop(pt);
+        spin_unlock(&v->arch.hvm_vcpu.tm_lock);
+
         return;
+    }
 
     spin_lock(&v->arch.hvm_vcpu.tm_lock);
 
     list_for_each_entry ( pt, head, list )
         if ( !pt->do_not_freeze )
             stop_timer(&pt->timer);
+        else if ( opt_vpt_lazy && !pt->pending_intr_nr )
+            pt_lazy_stop(pt);
 
     pt_freeze_time(v);
 
@@ -201,6 +278,8 @@ void pt_restore_timer(struct vcpu *v)
 
     list_for_each_entry ( pt, head, list )
     {
+        pt_lazy_update(pt);
+
         if ( pt->pending_intr_nr == 0 )
         {
             pt_process_missed_ticks(pt);
@@ -219,6 +298,8 @@ static void pt_timer_fn(void *data)
 
     pt_lock(pt);
 
+    perfc_incr(vpt_timer_fn);
+
     pt->pending_intr_nr++;
     pt->scheduled += pt->period;
     pt->do_not_freeze = 0;
@@ -243,8 +324,7 @@ int pt_update_irq(struct vcpu *v)
     {
         if ( pt->pending_intr_nr )
         {
-            /* RTC code takes care of disabling the timer itself. */
-            if ( (pt->irq != RTC_IRQ || !pt->priv) && pt_irq_masked(pt) )
+            if ( pt_irq_suspended(pt) )
             {
                 /* suspend timer emulation */
                 list_del(&pt->list);
@@ -395,6 +475,7 @@ void create_periodic_time(
     pt->pending_intr_nr = 0;
     pt->do_not_freeze = 0;
     pt->irq_issued = 0;
+    pt->lazy = 0;
 
     /* Periodic timer must be at least 0.1ms. */
     if ( (period < 100000) && period )
@@ -437,6 +518,12 @@ void create_periodic_time(
     list_add(&pt->list, &v->arch.hvm_vcpu.tm_list);
 
     init_timer(&pt->timer, pt_timer_fn, pt, v->processor);
+    /*
+     * Guest periodic timers have their own catch-up logic and do not need to
+     * be precise: let them share interrupts with other timers.
+     */
+    set_timer_slack(&pt->timer,
+                    min_t(uint64_t, pt->period >> 4, MICROSECS(100)));
     set_timer(&pt->timer, pt->scheduled);
 
     spin_unlock(&v->arch.hvm_vcpu.tm_lock);
@@ -486,6 +573,10 @@ static void pt_adjust_vcpu(struct periodic_time *pt, struct vcpu *v)
         list_add(&pt->list, &v->arch.hvm_vcpu.tm_list);
 
         migrate_timer(&pt->timer, v->processor);
+
+        /* The new vcpu may be running already. */
+        if ( pt->lazy )
+            pt_lazy_wake(pt);
     }
     spin_unlock(&v->arch.hvm_vcpu.tm_lock);
 }
@@ -524,6 +615,9 @@ static void pt_resume(struct periodic_time *pt)
         return;
 
     pt_lock(pt);
+    if ( pt->lazy && (pt->vcpu->pause_flags & VPF_blocked) &&
+         !pt_irq_suspended(pt) )
+        pt_lazy_wake(pt);
     if ( pt->pending_intr_nr && !pt->on_list )
     {
         pt->on_list = 1;
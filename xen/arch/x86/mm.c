@@ -3654,6 +3654,35 @@ long do_mmuext_op(
     return rc;
 }
 
+/*
+ * The page table page targeted by a run of consecutive normal updates.  It
+ * is looked up, mapped and locked once for the whole run rather than once
+ * per request: guests issue long batches of updates to the same page (e.g.
+ * when copying or tearing down an address space), and the type reference
+ * held through page_lock() keeps the page's type stable across the run.
+ */
+struct mmu_update_pt {
+    struct page_info *page;
+    unsigned long gmfn;
+    void *va;
+    bool_t locked;
+};
+
+static void mmu_update_pt_release(struct mmu_update_pt *pt,
+                                  struct domain_mmap_cache *cache)
+{
+    if ( !pt->page )
+        return;
+
+    if ( pt->locked )
+        page_unlock(pt->page);
+    else
+        put_page_type(pt->page);
+    unmap_domain_page_with_cache(pt->va, cache);
+    put_page(pt->page);
+    pt->page = NULL;
+}
+
 long do_mmu_update(
     XEN_GUEST_HANDLE_PARAM(mmu_update_t) ureqs,
     unsigned int count,
@@ -3668,6 +3697,7 @@ long do_mmu_update(
     struct vcpu *curr = current, *v = curr;
     struct domain *d = v->domain, *pt_owner = d, *pg_owner;
     struct domain_mmap_cache mapcache;
+    struct mmu_update_pt pt = { .page = NULL };
     uint32_t xsm_needed = 0;
     uint32_t xsm_checked = 0;
     int rc = put_old_guest_table(curr);
@@ -3775,28 +3805,48 @@ long do_mmu_update(
 
             req.ptr -= cmd;
             gmfn = req.ptr >> PAGE_SHIFT;
-            page = get_page_from_gfn(pt_owner, gmfn, &p2mt, P2M_ALLOC);
 
-            if ( p2m_is_paged(p2mt) )
+            if ( pt.page && pt.gmfn == gmfn )
+                perfc_incr(mmu_update_pt_reuse);
+            else
             {
-                ASSERT(!page);
-                p2m_mem_paging_populate(pg_owner, gmfn);
-                rc = -ENOENT;
-                break;
-            }
+                mmu_update_pt_release(&pt, &mapcache);
 
-            if ( unlikely(!page) )
-            {
-                MEM_LOG("Could not get page for normal update");
-                break;
+                page = get_page_from_gfn(pt_owner, gmfn, &p2mt, P2M_ALLOC);
+
+                if ( p2m_is_paged(p2mt) )
+                {
+                    ASSERT(!page);
+                    p2m_mem_paging_populate(pg_owner, gmfn);
+                    rc = -ENOENT;
+                    break;
+                }
+
+                if ( unlikely(!page) )
+                {
+                    MEM_LOG("Could not get page for normal update");
+                    break;
+                }
+
+                pt.locked = page_lock(page);
+                if ( !pt.locked && !get_page_type(page, PGT_writable_page) )
+                {
+                    put_page(page);
+                    break;
+                }
+
+                pt.page = page;
+                pt.gmfn = gmfn;
+                pt.va = map_domain_page_with_cache(page_to_mfn(page),
+                                                   &mapcache);
             }
 
+            page = pt.page;
             mfn = page_to_mfn(page);
-            va = map_domain_page_with_cache(mfn, &mapcache);
-            va = (void *)((unsigned long)va +
+            va = (void *)((unsigned long)pt.va +
                           (unsigned long)(req.ptr & ~PAGE_MASK));
 
-            if ( page_lock(page) )
+            if ( pt.locked )
             {
                 switch ( page->u.inuse.type_info & PGT_type_mask )
                 {
@@ -3860,20 +3910,15 @@ long do_mmu_update(
                         rc = 0;
                     break;
                 }
-                page_unlock(page);
                 if ( rc == -EINTR )
                     rc = -ERESTART;
             }
-            else if ( get_page_type(page, PGT_writable_page) )
+            else
             {
                 perfc_incr(writable_mmu_updates);
                 if ( paging_write_guest_entry(v, va, req.val, _mfn(mfn)) )
                     rc = 0;
-                put_page_type(page);
             }
-
-            unmap_domain_page_with_cache(va, &mapcache);
-            put_page(page);
         }
         break;
 
@@ -3928,6 +3973,8 @@ long do_mmu_update(
         guest_handle_add_offset(ureqs, 1);
     }
 
+    mmu_update_pt_release(&pt, &mapcache);
+
     if ( rc == -ERESTART )
     {
         ASSERT(i < count);
@@ -22,6 +22,9 @@
 #include <xen/iommu.h>
 #include <xen/vm_event.h>
 #include <xen/event.h>
+#include <xen/perfc.h>
+#include <xen/tasklet.h>
+#include <xen/time.h>
 #include <public/vm_event.h>
 #include <asm/domain.h>
 #include <asm/page.h>
@@ -381,6 +384,7 @@ int p2m_pod_empty_cache(struct domain *d)
     /* After this barrier no new PoD activities can happen. */
     BUG_ON(!d->is_dying);
     spin_barrier(&p2m->pod.lock.lock);
+    tasklet_kill(&p2m->pod.sweep_tasklet);
 
     lock_page_alloc(p2m);
 
@@ -662,6 +666,22 @@ void p2m_pod_dump_data(struct domain *d)
            p2m->pod.entry_count, p2m->pod.count);
 }
 
+/*
+ * Check whether the first nr words (a multiple of 8) at p are all zero.
+ * A cache line's worth of words is OR-ed together per iteration, so there
+ * is one branch per line rather than one per word.
+ */
+static bool_t pod_zero_words(const unsigned long *p, unsigned int nr)
+{
+    unsigned int i;
+
+    for ( i = 0; i < nr; i += 8 )
+        if ( p[i] | p[i + 1] | p[i + 2] | p[i + 3] |
+             p[i + 4] | p[i + 5] | p[i + 6] | p[i + 7] )
+            return 0;
+
+    return 1;
+}
 
 /* Search for all-zero superpages to be reclaimed as superpages for the
  * PoD cache. Must be called w/ pod lock held, must lock the superpage
@@ -674,7 +694,7 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, unsigned long gfn)
     unsigned long * map = NULL;
     int ret=0, reset = 0;
     unsigned long i, n;
-    unsigned int j;
+    bool_t zero;
     int max_ref = 1;
     struct domain *d = p2m->domain;
 
@@ -739,16 +759,12 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, unsigned long gfn)
     {
         /* Quick zero-check */
         map = map_domain_page(_mfn(mfn_x(mfn0) + i));
-
-        for ( j=0; j<16; j++ )
-            if( *(map+j) != 0 )
-                break;
-
+        zero = pod_zero_words(map, 16);
         unmap_domain_page(map);
+        perfc_incr(pod_zero_check);
 
-        if ( j < 16 )
+        if ( !zero )
             goto out;
-
     }
 
     /* Try to remove the page, restoring old mapping if it fails. */
@@ -773,14 +789,7 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, unsigned long gfn)
     for ( i=0; i < SUPERPAGE_PAGES; i++ )
     {
         map = map_domain_page(_mfn(mfn_x(mfn0) + i));
-
-        for ( j=0; j<PAGE_SIZE/sizeof(*map); j++ )
-            if( *(map+j) != 0 )
-            {
-                reset = 1;
-                break;
-            }
-
+        reset = !pod_zero_words(map, PAGE_SIZE / sizeof(*map));
         unmap_domain_page(map);
 
         if ( reset )
@@ -806,6 +815,7 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, unsigned long gfn)
      * back on the PoD cache, and account for the new p2m PoD entries */
     p2m_pod_cache_add(p2m, mfn_to_page(mfn0), PAGE_ORDER_2M);
     p2m->pod.entry_count += SUPERPAGE_PAGES;
+    perfc_incr(pod_reclaim_super);
 
     ret = SUPERPAGE_PAGES;
 
@@ -825,8 +835,9 @@ p2m_pod_zero_check(struct p2m_domain *p2m, unsigned long *gfns, int count)
     p2m_type_t types[count];
     unsigned long * map[count];
     struct domain *d = p2m->domain;
+    bool_t zero;
 
-    int i, j;
+    int i;
     int max_ref = 1;
 
     /* Allow an extra refcount for one shadow pt mapping in shadowed domains */
@@ -857,11 +868,8 @@ p2m_pod_zero_check(struct p2m_domain *p2m, unsigned long *gfns, int count)
             continue;
 
         /* Quick zero-check */
-        for ( j=0; j<16; j++ )
-            if( *(map[i]+j) != 0 )
-                break;
-
-        if ( j < 16 )
+        perfc_incr(pod_zero_check);
+        if ( !pod_zero_words(map[i], 16) )
         {
             unmap_domain_page(map[i]);
             map[i] = NULL;
@@ -894,15 +902,13 @@ p2m_pod_zero_check(struct p2m_domain *p2m, unsigned long *gfns, int count)
         if(!map[i])
             continue;
 
-        for ( j=0; j<PAGE_SIZE/sizeof(*map[i]); j++ )
-            if( *(map[i]+j) != 0 )
-                break;
+        zero = pod_zero_words(map[i], PAGE_SIZE / sizeof(*map[i]));
 
         unmap_domain_page(map[i]);
 
         /* See comment in p2m_pod_zero_check_superpage() re gnttab
          * check timing.  */
-        if ( j < PAGE_SIZE/sizeof(*map[i]) )
+        if ( !zero )
         {
             p2m_set_entry(p2m, gfns[i], mfns[i], PAGE_ORDER_4K,
                 types[i], p2m->default_access);
@@ -927,6 +933,7 @@ p2m_pod_zero_check(struct p2m_domain *p2m, unsigned long *gfns, int count)
             /* Add to cache, and account for the new p2m PoD entry */
             p2m_pod_cache_add(p2m, mfn_to_page(mfns[i]), PAGE_ORDER_4K);
             p2m->pod.entry_count++;
+            perfc_incr(pod_reclaim_single);
         }
     }
     
@@ -934,21 +941,40 @@ p2m_pod_zero_check(struct p2m_domain *p2m, unsigned long *gfns, int count)
 
 #define POD_SWEEP_LIMIT 1024
 #define POD_SWEEP_STRIDE  16
-static void
-p2m_pod_emergency_sweep(struct p2m_domain *p2m)
+/* Cache size the background sweeper tries to maintain */
+#define POD_BG_TARGET     (4 * SUPERPAGE_PAGES)
+/* Back-off after the background sweeper has covered the whole p2m */
+#define POD_BG_BACKOFF    SECONDS(1)
+
+/*
+ * Sweep down from p2m->pod.reclaim_single, looking for zero pages to
+ * reclaim.  Ram mapped as a superpage is first checked as a whole, so that
+ * a zeroed superpage goes back to the cache as a superpage rather than
+ * being splintered by the 4k check.
+ *
+ * An emergency sweep stops once it is past limit gfns and has found
+ * something (or needs to be preempted), and falls back to checking 4k
+ * pages of non-zero superpages.  A background sweep covers at most limit
+ * gfns, stops early once the cache is at POD_BG_TARGET, and leaves
+ * superpage mappings alone.
+ *
+ * Returns non-zero if the sweep reached the bottom of the p2m.
+ */
+static int
+p2m_pod_sweep(struct p2m_domain *p2m, unsigned long limit, bool_t background)
 {
     unsigned long gfns[POD_SWEEP_STRIDE];
-    unsigned long i, j=0, start, limit;
+    unsigned long i, j=0, start, stop, last_super = gfn_x(INVALID_GFN);
     p2m_type_t t;
 
+    ASSERT(pod_locked_by_me(p2m));
 
     if ( p2m->pod.reclaim_single == 0 )
         p2m->pod.reclaim_single = p2m->pod.max_guest;
 
     start = p2m->pod.reclaim_single;
-    limit = (start > POD_SWEEP_LIMIT) ? (start - POD_SWEEP_LIMIT) : 0;
+    stop = (start > limit) ? (start - limit) : 0;
 
-    /* FIXME: Figure out how to avoid superpages */
     /* NOTE: Promote to globally locking the p2m. This will get complicated
      * in a fine-grained scenario. If we lock each gfn individually we must be
      * careful about spinlock recursion limits and POD_SWEEP_STRIDE. */
@@ -956,7 +982,28 @@ p2m_pod_emergency_sweep(struct p2m_domain *p2m)
     for ( i=p2m->pod.reclaim_single; i > 0 ; i-- )
     {
         p2m_access_t a;
-        (void)p2m->get_entry(p2m, i, &t, &a, 0, NULL, NULL);
+        unsigned int cur_order;
+
+        perfc_incr(pod_sweep_gfn);
+        (void)p2m->get_entry(p2m, i, &t, &a, 0, &cur_order, NULL);
+        if ( p2m_is_ram(t) && cur_order >= SUPERPAGE_ORDER )
+        {
+            unsigned long base = i & ~(SUPERPAGE_PAGES - 1);
+
+            if ( base != last_super )
+            {
+                last_super = base;
+                if ( background || p2m_pod_zero_check_superpage(p2m, base) )
+                {
+                    /* Not to be touched, or reclaimed: skip the rest. */
+                    i = base;
+                    if ( i == 0 )
+                        break;
+                    goto next;
+                }
+            }
+        }
+
         if ( p2m_is_ram(t) )
         {
             gfns[j] = i;
@@ -968,12 +1015,20 @@ p2m_pod_emergency_sweep(struct p2m_domain *p2m)
                 j = 0;
             }
         }
+
+    next:
+        if ( background )
+        {
+            if ( i < stop || p2m->pod.count >= POD_BG_TARGET )
+                break;
+        }
         /* Stop if we're past our limit and we have found *something*.
          *
          * NB that this is a zero-sum game; we're increasing our cache size
          * by re-increasing our 'debt'.  Since we hold the pod lock,
          * (entry_count - count) must remain the same. */
-        if ( i < limit && (p2m->pod.count > 0 || hypercall_preempt_check()) )
+        else if ( i < stop &&
+                  (p2m->pod.count > 0 || hypercall_preempt_check()) )
             break;
     }
 
@@ -983,6 +1038,43 @@ p2m_pod_emergency_sweep(struct p2m_domain *p2m)
     p2m_unlock(p2m);
     p2m->pod.reclaim_single = i ? i - 1 : i;
 
+    return i == 0;
+}
+
+static void
+p2m_pod_emergency_sweep(struct p2m_domain *p2m)
+{
+    perfc_incr(pod_sweep_emergency);
+    p2m_pod_sweep(p2m, POD_SWEEP_LIMIT, 0);
+}
+
+void p2m_pod_sweep_tasklet(unsigned long data)
+{
+    struct p2m_domain *p2m = (struct p2m_domain *)data;
+    struct domain *d = p2m->domain;
+    bool_t again = 0;
+
+    perfc_incr(pod_sweep_bg);
+
+    /* p2m before pod, as on the fault path. */
+    p2m_lock(p2m);
+    pod_lock(p2m);
+
+    if ( likely(!d->is_dying) )
+    {
+        if ( p2m_pod_sweep(p2m, POD_SWEEP_LIMIT, 1) )
+            p2m->pod.sweep_next = NOW() + POD_BG_BACKOFF;
+        else
+            again = p2m->pod.count < POD_BG_TARGET &&
+                    p2m->pod.entry_count > p2m->pod.count;
+    }
+
+    pod_unlock(p2m);
+    p2m_unlock(p2m);
+
+    /* Continue in bounded chunks, so as not to starve the idle vcpu. */
+    if ( again )
+        tasklet_schedule(&p2m->pod.sweep_tasklet);
 }
 
 static void pod_eager_reclaim(struct p2m_domain *p2m)
@@ -1089,6 +1181,12 @@ p2m_pod_demand_populate(struct p2m_domain *p2m, unsigned long gfn,
     if ( p2m->pod.count == 0 )
         goto out_of_memory;
 
+    /* Refill the cache in the background before it runs dry. */
+    if ( p2m->pod.count < POD_BG_TARGET / 2 &&
+         p2m->pod.entry_count > p2m->pod.count &&
+         NOW() >= p2m->pod.sweep_next )
+        tasklet_schedule(&p2m->pod.sweep_tasklet);
+
     /* Keep track of the highest gfn demand-populated by a guest fault */
     if ( gfn > p2m->pod.max_guest )
         p2m->pod.max_guest = gfn;
@@ -773,12 +773,12 @@ long paging_domctl_continuation(XEN_GUEST_HANDLE_PARAM(xen_domctl_t) u_domctl)
     ret = xsm_domctl(XSM_OTHER, d, op.cmd);
     if ( !ret )
     {
-        if ( domctl_lock_acquire() )
+        if ( domctl_lock_acquire(d) )
         {
             ret = paging_domctl(d, &op.u.shadow_op,
                                 guest_handle_cast(u_domctl, void), 1);
 
-            domctl_lock_release();
+            domctl_lock_release(d);
         }
         else
             ret = -ERESTART;
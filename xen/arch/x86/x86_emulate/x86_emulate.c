@@ -1928,6 +1928,18 @@ struct x86_emulate_state {
     unsigned long ip;
     struct cpu_user_regs *regs;
 
+    /*
+     * Registers (-1 if none) contributing to the memory operand's effective
+     * address, such that it can be re-computed for a cached decode.
+     */
+    int8_t ea_base, ea_index;
+    uint8_t ea_scale;
+    bool ea_pc_rel;
+    unsigned long ea_disp;
+
+    /* Decode depended on EFLAGS.VM or CR0.PE, and hence can't be cached. */
+    bool mode_dep;
+
 #ifndef NDEBUG
     /*
      * Track caller of x86_decode_insn() to spot missing as well as
@@ -2136,6 +2148,27 @@ x86_decode_0f38(
     return X86EMUL_OKAY;
 }
 
+/* Base and index registers of the eight 16-bit ModRM memory forms. */
+static const int8_t ea16_base[8] = { 3, 3, 5, 5, 6, 7, 5, 3 };
+static const int8_t ea16_index[8] = { 6, 7, 6, 7, -1, -1, -1, -1 };
+
+/* Register contribution to the memory operand's effective address. */
+static unsigned long
+ea_regs(
+    const struct x86_emulate_state *state,
+    struct cpu_user_regs *regs)
+{
+    unsigned long off = 0;
+
+    if ( state->ea_index >= 0 )
+        off = *(long *)decode_register(state->ea_index, regs, 0) <<
+              state->ea_scale;
+    if ( state->ea_base >= 0 )
+        off += *(long *)decode_register(state->ea_base, regs, 0);
+
+    return off;
+}
+
 static int
 x86_decode(
     struct x86_emulate_state *state,
@@ -2156,6 +2189,7 @@ x86_decode(
     ea.reg = PTR_POISON;
     state->regs = ctxt->regs;
     state->ip = ctxt->regs->r(ip);
+    state->ea_base = state->ea_index = -1;
 
     /* Initialise output state in x86_emulate_ctxt */
     ctxt->retire.raw = 0;
@@ -2268,10 +2302,12 @@ x86_decode(
             default:
                 BUG(); /* Shouldn't be possible. */
             case 2:
+                state->mode_dep = true;
                 if ( state->regs->_eflags & X86_EFLAGS_VM )
                     break;
                 /* fall through */
             case 4:
+                state->mode_dep = true;
                 if ( modrm_mod != 3 || in_realmode(ctxt, ops) )
                     break;
                 /* fall through */
@@ -2469,6 +2505,9 @@ x86_decode(
                 ea.mem.off = state->regs->bx;
                 break;
             }
+            state->ea_base = modrm_mod || modrm_rm != 6
+                             ? ea16_base[modrm_rm] : -1;
+            state->ea_index = ea16_index[modrm_rm];
             switch ( modrm_mod )
             {
             case 0:
@@ -2493,9 +2532,15 @@ x86_decode(
                 sib_index = ((sib >> 3) & 7) | ((rex_prefix << 2) & 8);
                 sib_base  = (sib & 7) | ((rex_prefix << 3) & 8);
                 if ( sib_index != 4 )
+                {
                     ea.mem.off = *(long *)decode_register(sib_index,
                                                           state->regs, 0);
+                    state->ea_index = sib_index;
+                    state->ea_scale = (sib >> 6) & 3;
+                }
                 ea.mem.off <<= (sib >> 6) & 3;
+                if ( (modrm_mod != 0) || ((sib_base & 7) != 5) )
+                    state->ea_base = sib_base;
                 if ( (modrm_mod == 0) && ((sib_base & 7) == 5) )
                     ea.mem.off += insn_fetch_type(int32_t);
                 else if ( sib_base == 4 )
@@ -2521,6 +2566,7 @@ x86_decode(
                 modrm_rm |= (rex_prefix & 1) << 3;
                 ea.mem.off = *(long *)decode_register(modrm_rm,
                                                       state->regs, 0);
+                state->ea_base = modrm_rm;
                 if ( (modrm_rm == 5) && (modrm_mod != 0) )
                     ea.mem.seg = x86_seg_ss;
             }
@@ -2530,6 +2576,7 @@ x86_decode(
                 if ( (modrm_rm & 7) != 5 )
                     break;
                 ea.mem.off = insn_fetch_type(int32_t);
+                state->ea_base = -1;
                 pc_rel = mode_64bit();
                 break;
             case 1:
@@ -2605,6 +2652,9 @@ x86_decode(
 
     if ( ea.type == OP_MEM )
     {
+        state->ea_disp = ea.mem.off - ea_regs(state, state->regs);
+        state->ea_pc_rel = pc_rel;
+
         if ( pc_rel )
             ea.mem.off += state->ip;
 
@@ -2627,6 +2677,141 @@ x86_decode(
 #undef insn_fetch_bytes
 #undef insn_fetch_type
 
+/*
+ * Decoded instruction cache.  Entries are keyed by the caller supplied tag,
+ * rIP and address size, and keep a copy of the raw instruction bytes next
+ * to the decoder's output.  Each lookup re-fetches and compares the bytes,
+ * so self-modifying code (or a different mapping under the same tag) just
+ * misses and gets re-decoded.
+ */
+#define DCACHE_ENTRIES 8
+
+struct x86_emulate_dcache {
+    unsigned int next;
+    struct dcache_entry {
+        unsigned long tag, ip;
+        uint8_t addr_size, len;
+        uint8_t insn[MAX_INST_LEN];
+        unsigned int opcode;
+        struct x86_emulate_state state;
+    } ent[DCACHE_ENTRIES];
+};
+
+static struct dcache_entry *
+dcache_find(
+    struct x86_emulate_dcache *dcache,
+    const struct x86_emulate_ctxt *ctxt)
+{
+    unsigned long ip = ctxt->regs->r(ip);
+    unsigned int i;
+
+    for ( i = 0; i < ARRAY_SIZE(dcache->ent); i++ )
+    {
+        struct dcache_entry *ent = &dcache->ent[i];
+
+        if ( ent->len && ent->ip == ip && ent->tag == ctxt->dcache_tag &&
+             ent->addr_size == ctxt->addr_size )
+            return ent;
+    }
+
+    return NULL;
+}
+
+static bool
+dcache_lookup(
+    struct x86_emulate_state *state,
+    struct x86_emulate_ctxt *ctxt,
+    const struct x86_emulate_ops *ops)
+{
+    struct dcache_entry *ent = dcache_find(ctxt->dcache, ctxt);
+    uint8_t insn[MAX_INST_LEN];
+
+    if ( !ent )
+        return false;
+
+    /*
+     * Any failure here is left for the decoder to re-encounter and report,
+     * which is why a possibly raised event doesn't get propagated.
+     */
+    if ( ops->insn_fetch(x86_seg_cs, ent->ip, insn, ent->len,
+                         ctxt) != X86EMUL_OKAY )
+    {
+        x86_emul_reset_event(ctxt);
+        return false;
+    }
+
+    if ( memcmp(insn, ent->insn, ent->len) )
+    {
+        ent->len = 0;
+        return false;
+    }
+
+    *state = ent->state;
+    state->regs = ctxt->regs;
+    state->ip = ent->ip + ent->len;
+
+    if ( ea.type == OP_MEM )
+    {
+        ea.mem.off = state->ea_disp + ea_regs(state, state->regs);
+        if ( state->ea_pc_rel )
+            ea.mem.off += state->ip;
+
+        ea.mem.off = truncate_ea(ea.mem.off);
+    }
+
+    ctxt->opcode = ent->opcode;
+    ctxt->retire.raw = 0;
+    x86_emul_reset_event(ctxt);
+
+    return true;
+}
+
+static void
+dcache_insert(
+    const struct x86_emulate_state *state,
+    struct x86_emulate_ctxt *ctxt,
+    const struct x86_emulate_ops *ops)
+{
+    struct x86_emulate_dcache *dcache = ctxt->dcache;
+    struct dcache_entry *ent;
+    unsigned long len = state->ip - ctxt->regs->r(ip);
+
+    if ( state->mode_dep || !len || len > MAX_INST_LEN )
+        return;
+
+    ent = dcache_find(dcache, ctxt);
+    if ( !ent )
+        ent = &dcache->ent[dcache->next++ % ARRAY_SIZE(dcache->ent)];
+
+    ent->len = 0;
+    if ( ops->insn_fetch(x86_seg_cs, ctxt->regs->r(ip), ent->insn, len,
+                         ctxt) != X86EMUL_OKAY )
+    {
+        x86_emul_reset_event(ctxt);
+        return;
+    }
+
+    ent->tag = ctxt->dcache_tag;
+    ent->ip = ctxt->regs->r(ip);
+    ent->addr_size = ctxt->addr_size;
+    ent->opcode = ctxt->opcode;
+    ent->state = *state;
+#ifndef NDEBUG
+    ent->state.caller = NULL;
+#endif
+    ent->len = len;
+}
+
+struct x86_emulate_dcache *x86_emulate_dcache_alloc(void)
+{
+    return xzalloc(struct x86_emulate_dcache);
+}
+
+void x86_emulate_dcache_free(struct x86_emulate_dcache *dcache)
+{
+    xfree(dcache);
+}
+
 /* Undo DEBUG wrapper. */
 #undef x86_emulate
 
@@ -2651,9 +2836,15 @@ x86_emulate(
 
     ASSERT(ops->read);
 
-    rc = x86_decode(&state, ctxt, ops);
-    if ( rc != X86EMUL_OKAY )
-        return rc;
+    if ( !ctxt->dcache || !dcache_lookup(&state, ctxt, ops) )
+    {
+        rc = x86_decode(&state, ctxt, ops);
+        if ( rc != X86EMUL_OKAY )
+            return rc;
+
+        if ( ctxt->dcache )
+            dcache_insert(&state, ctxt, ops);
+    }
 
     /* Sync rIP to post decode value. */
     _regs.r(ip) = state.ip;
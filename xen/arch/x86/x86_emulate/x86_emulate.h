@@ -470,6 +470,13 @@ struct x86_emulate_ctxt
     /* Caller data that can be used by x86_emulate_ops' routines. */
     void *data;
 
+    /*
+     * Optional decoded instruction cache, and the tag identifying the
+     * address space rIP refers to (e.g. the guest's CR3).
+     */
+    struct x86_emulate_dcache *dcache;
+    unsigned long dcache_tag;
+
     /*
      * Input/output state:
      */
@@ -606,6 +613,14 @@ void *
 decode_register(
     uint8_t modrm_reg, struct cpu_user_regs *regs, int highbyte_regs);
 
+/*
+ * Decoded instruction cache, for callers repeatedly emulating the same
+ * instructions (see x86_emulate_ctxt's dcache field).
+ */
+struct x86_emulate_dcache;
+struct x86_emulate_dcache *x86_emulate_dcache_alloc(void);
+void x86_emulate_dcache_free(struct x86_emulate_dcache *dcache);
+
 /* Unhandleable read, write or instruction fetch */
 int
 x86emul_unhandleable_rw(
@@ -284,6 +284,7 @@ struct domain *domain_create(domid_t domid, unsigned int domcr_flags,
     spin_lock_init_prof(d, domain_lock);
     spin_lock_init_prof(d, page_alloc_lock);
     spin_lock_init(&d->hypercall_deadlock_mutex);
+    spin_lock_init(&d->domctl_lock);
     INIT_PAGE_LIST_HEAD(&d->page_list);
     INIT_PAGE_LIST_HEAD(&d->xenpage_list);
 
@@ -618,7 +619,7 @@ int domain_kill(struct domain *d)
     if ( d == current->domain )
         return -EINVAL;
 
-    /* Protected by domctl_lock. */
+    /* Protected by d->domctl_lock. */
     switch ( d->is_dying )
     {
     case DOMDYING_alive:
@@ -32,7 +32,16 @@
 #include <public/domctl.h>
 #include <xsm/xsm.h>
 
-static DEFINE_SPINLOCK(domctl_lock);
+/*
+ * Most domctls only need serialising against others targeting the same
+ * domain: they hold domctl_lock for reading, plus the target's own
+ * domctl_lock.  Operations on global state, or on more than one domain,
+ * hold domctl_lock for writing instead.
+ */
+static DEFINE_RWLOCK(domctl_lock);
+
+/* Serialises domain ID allocation in XEN_DOMCTL_createdomain. */
+static DEFINE_SPINLOCK(domctl_create_lock);
 DEFINE_SPINLOCK(vcpu_alloc_lock);
 
 static int bitmap_to_xenctl_bitmap(struct xenctl_bitmap *xenctl_bitmap,
@@ -218,31 +227,110 @@ void getdomaininfo(struct domain *d, struct xen_domctl_getdomaininfo *info)
     arch_get_domain_info(d, info);
 }
 
-bool_t domctl_lock_acquire(void)
+/* domctl_op_lock() result for operations needing only the read side. */
+#define DOMCTL_LOCK_SHARED ((spinlock_t *)1)
+
+/*
+ * Acquire the domctl locks for an operation on @d (NULL if none), with @lock
+ * being the lock serialising it against its peers, DOMCTL_LOCK_SHARED if
+ * there is nothing to serialise against, or NULL if it needs to exclude all
+ * other domctls.
+ */
+static bool_t domctl_trylock(struct domain *d, spinlock_t *lock)
 {
+    struct domain *currd = current->domain;
+
     /*
      * Caller may try to pause its own VCPUs. We must prevent deadlock
      * against other non-domctl routines which try to do the same.
      */
-    if ( !spin_trylock(&current->domain->hypercall_deadlock_mutex) )
+    if ( d == currd && !spin_trylock(&currd->hypercall_deadlock_mutex) )
         return 0;
 
     /*
      * Trylock here is paranoia if we have multiple privileged domains. Then
      * we could have one domain trying to pause another which is spinning
-     * on domctl_lock -- results in deadlock.
+     * on a domctl lock -- results in deadlock.
      */
-    if ( spin_trylock(&domctl_lock) )
-        return 1;
+    if ( !lock )
+    {
+        if ( write_trylock(&domctl_lock) )
+            return 1;
+    }
+    else if ( read_trylock(&domctl_lock) )
+    {
+        if ( lock == DOMCTL_LOCK_SHARED || spin_trylock(lock) )
+            return 1;
+        read_unlock(&domctl_lock);
+    }
 
-    spin_unlock(&current->domain->hypercall_deadlock_mutex);
+    if ( d == currd )
+        spin_unlock(&currd->hypercall_deadlock_mutex);
     return 0;
 }
 
-void domctl_lock_release(void)
+static void domctl_unlock(struct domain *d, spinlock_t *lock)
 {
-    spin_unlock(&domctl_lock);
-    spin_unlock(&current->domain->hypercall_deadlock_mutex);
+    if ( !lock )
+        write_unlock(&domctl_lock);
+    else
+    {
+        if ( lock != DOMCTL_LOCK_SHARED )
+            spin_unlock(lock);
+        read_unlock(&domctl_lock);
+    }
+
+    if ( d == current->domain )
+        spin_unlock(&d->hypercall_deadlock_mutex);
+}
+
+/*
+ * Two domains privileged over each other could each be pausing the other
+ * from within a domctl, and would then deadlock in domain_pause().  The
+ * global lock used to rule this out, and still does for everyone but the
+ * hardware domain: only its operations get serialised per target domain,
+ * while those of any other domain exclude all other domctls.
+ */
+static spinlock_t *domctl_dom_lock(struct domain *d)
+{
+    if ( !d || !is_hardware_domain(current->domain) )
+        return NULL;
+
+    return &d->domctl_lock;
+}
+
+/* Serialise against domctls on @d, or against all of them if @d is NULL. */
+bool_t domctl_lock_acquire(struct domain *d)
+{
+    return domctl_trylock(d, domctl_dom_lock(d));
+}
+
+void domctl_lock_release(struct domain *d)
+{
+    domctl_unlock(d, domctl_dom_lock(d));
+}
+
+static spinlock_t *domctl_op_lock(const struct xen_domctl *op,
+                                  struct domain *d)
+{
+    switch ( op->cmd )
+    {
+    case XEN_DOMCTL_createdomain:
+        return &domctl_create_lock;
+
+    /* Operations involving another domain, or global state. */
+    case XEN_DOMCTL_set_target:
+    case XEN_DOMCTL_psr_cmt_op:
+        return NULL;
+
+    /* Enumeration only walks the domain list, under RCU. */
+    case XEN_DOMCTL_getdomaininfo:
+        if ( !d )
+            return DOMCTL_LOCK_SHARED;
+        break;
+    }
+
+    return domctl_dom_lock(d);
 }
 
 static inline
@@ -384,7 +472,8 @@ long do_domctl(XEN_GUEST_HANDLE_PARAM(xen_domctl_t) u_domctl)
     long ret = 0;
     bool_t copyback = 0;
     struct xen_domctl curop, *op = &curop;
-    struct domain *d;
+    struct domain *d, *lock_d;
+    spinlock_t *lock;
 
     if ( copy_from_guest(op, u_domctl, 1) )
         return -EFAULT;
@@ -409,7 +498,9 @@ long do_domctl(XEN_GUEST_HANDLE_PARAM(xen_domctl_t) u_domctl)
     if ( ret )
         goto domctl_out_unlock_domonly;
 
-    if ( !domctl_lock_acquire() )
+    lock_d = d;
+    lock = domctl_op_lock(op, d);
+    if ( !domctl_trylock(lock_d, lock) )
     {
         if ( d )
             rcu_unlock_domain(d);
@@ -532,9 +623,10 @@ long do_domctl(XEN_GUEST_HANDLE_PARAM(xen_domctl_t) u_domctl)
             rover = dom;
         }
 
+        ret = -EINVAL;
         if ( (op->u.createdomain.flags & XEN_DOMCTL_CDF_hvm_guest)
              && (op->u.createdomain.flags & XEN_DOMCTL_CDF_pvh_guest) )
-            return -EINVAL;
+            break;
 
         domcr_flags = 0;
         if ( op->u.createdomain.flags & XEN_DOMCTL_CDF_hvm_guest )
@@ -1157,7 +1249,7 @@ long do_domctl(XEN_GUEST_HANDLE_PARAM(xen_domctl_t) u_domctl)
         break;
     }
 
-    domctl_lock_release();
+    domctl_unlock(lock_d, lock);
 
  domctl_out_unlock_domonly:
     if ( d )
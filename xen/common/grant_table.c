@@ -100,6 +100,9 @@ struct gnttab_unmap_common {
     unsigned long frame;
     struct grant_mapping *map;
     struct domain *rd;
+
+    /* Mappings removed, to be flushed before completing the batch */
+    bool_t flush_tlb, flush_iotlb;
 };
 
 /* Number of unmap operations that are done between each tlb flush */
@@ -119,12 +122,24 @@ struct gnttab_unmap_common {
  */
 struct grant_mapping {
     u32      ref;           /* grant ref */
-    u16      flags;         /* 0-4: GNTMAP_* ; 5-15: unused */
+    u16      flags;         /* 0-4: GNTMAP_* ; 5: MAPTRACK_iommu_ref */
     domid_t  domid;         /* granting domain */
     u32      vcpu;          /* vcpu which created the grant mapping */
     u32      pad;           /* round size to a power of 2 */
 };
 
+/* The mapping holds a reference on the frame's IOMMU mapping. */
+#define MAPTRACK_iommu_ref (1U << 5)
+
+/*
+ * Domains for which gnttab_need_iommu_mapping() count the mappings of each
+ * frame in their grant table's iommu_refs, readers in the low half and
+ * writers in the high half of the (int) value.
+ */
+#define IOMMU_REF_READ   (1U << 0)
+#define IOMMU_REF_WRITE  (1U << 16)
+#define IOMMU_REF_MASK(inc) ((inc) == IOMMU_REF_READ ? 0xffffU : 0x7fff0000U)
+
 #define MAPTRACK_PER_PAGE (PAGE_SIZE / sizeof(struct grant_mapping))
 #define maptrack_entry(t, e) \
     ((t)->maptrack[(e)/MAPTRACK_PER_PAGE][(e)%MAPTRACK_PER_PAGE])
@@ -269,34 +284,6 @@ static int __get_paged_frame(unsigned long gfn, unsigned long *frame, struct pag
     return rc;
 }
 
-static inline void
-double_gt_lock(struct grant_table *lgt, struct grant_table *rgt)
-{
-    /*
-     * See mapkind() for why the write lock is also required for the
-     * remote domain.
-     */
-    if ( lgt < rgt )
-    {
-        grant_write_lock(lgt);
-        grant_write_lock(rgt);
-    }
-    else
-    {
-        if ( lgt != rgt )
-            grant_write_lock(rgt);
-        grant_write_lock(lgt);
-    }
-}
-
-static inline void
-double_gt_unlock(struct grant_table *lgt, struct grant_table *rgt)
-{
-    grant_write_unlock(lgt);
-    if ( lgt != rgt )
-        grant_write_unlock(rgt);
-}
-
 static inline int
 __get_maptrack_handle(
     struct grant_table *t,
@@ -704,39 +691,85 @@ static int grant_map_exists(const struct domain *ld,
     return -EINVAL;
 }
 
-#define MAPKIND_READ 1
-#define MAPKIND_WRITE 2
-static unsigned int mapkind(
-    struct grant_table *lgt, const struct domain *rd, unsigned long mfn)
+/*
+ * Add (or remove) a mapping of frame to the count of ld's mappings of it,
+ * changing its IOMMU mapping as it gets its first mapping or first writable
+ * one, or loses its last (writable) one.  Returns 1 if the IOMMU mapping was
+ * changed.  The IOTLB isn't flushed after removing a mapping: the caller
+ * must do so before releasing the page.
+ */
+static int gnttab_iommu_ref(struct domain *ld, unsigned long frame,
+                            bool_t readonly, bool_t add)
 {
-    struct grant_mapping *map;
-    grant_handle_t handle;
-    unsigned int kind = 0;
+    struct grant_table *lgt = ld->grant_table;
+    unsigned int inc = readonly ? IOMMU_REF_READ : IOMMU_REF_WRITE;
+    unsigned int old, refs;
+    void **slot;
+    int rc = 0;
 
-    /*
-     * Must have the local domain's grant table write lock when
-     * iterating over its maptrack entries.
-     */
-    ASSERT(percpu_rw_is_write_locked(&lgt->lock));
-    /*
-     * Must have the remote domain's grant table write lock while
-     * counting its active entries.
-     */
-    ASSERT(percpu_rw_is_write_locked(&rd->grant_table->lock));
+    spin_lock(&lgt->iommu_lock);
+
+    slot = radix_tree_lookup_slot(&lgt->iommu_refs, frame);
+    old = slot ? radix_tree_ptr_to_int(radix_tree_deref_slot(slot)) : 0;
 
-    for ( handle = 0; !(kind & MAPKIND_WRITE) &&
-                      handle < lgt->maptrack_limit; handle++ )
+    if ( add )
     {
-        map = &maptrack_entry(lgt, handle);
-        if ( !(map->flags & (GNTMAP_device_map|GNTMAP_host_map)) ||
-             map->domid != rd->domain_id )
-            continue;
-        if ( _active_entry(rd->grant_table, map->ref).frame == mfn )
-            kind |= map->flags & GNTMAP_readonly ?
-                    MAPKIND_READ : MAPKIND_WRITE;
+        if ( unlikely((old & IOMMU_REF_MASK(inc)) == IOMMU_REF_MASK(inc)) )
+        {
+            rc = -EOVERFLOW;
+            goto out;
+        }
+        refs = old + inc;
+    }
+    else
+    {
+        ASSERT(old & IOMMU_REF_MASK(inc));
+        refs = old - inc;
+    }
+
+    if ( !old )
+        rc = radix_tree_insert(&lgt->iommu_refs, frame,
+                               radix_tree_int_to_ptr(refs));
+    else if ( !refs )
+        radix_tree_delete(&lgt->iommu_refs, frame);
+    else
+        radix_tree_replace_slot(slot, radix_tree_int_to_ptr(refs));
+    if ( rc )
+        goto out;
+
+    /* We're not translated, so we know that gmfns and mfns are
+       the same things, so the IOMMU entry is always 1-to-1. */
+    if ( !!refs == !!old &&
+         (refs >= IOMMU_REF_WRITE) == (old >= IOMMU_REF_WRITE) )
+        goto out;
+
+    if ( !add )
+        this_cpu(iommu_dont_flush_iotlb) = 1;
+
+    if ( !refs )
+        rc = iommu_unmap_page(ld, frame);
+    else if ( refs >= IOMMU_REF_WRITE )
+        rc = iommu_map_page(ld, frame, frame,
+                            IOMMUF_readable|IOMMUF_writable);
+    else
+        rc = iommu_map_page(ld, frame, frame, IOMMUF_readable);
+
+    this_cpu(iommu_dont_flush_iotlb) = 0;
+
+    if ( !rc )
+        rc = 1;
+    else if ( add )
+    {
+        if ( !old )
+            radix_tree_delete(&lgt->iommu_refs, frame);
+        else
+            radix_tree_replace_slot(slot, radix_tree_int_to_ptr(old));
     }
 
-    return kind;
+ out:
+    spin_unlock(&lgt->iommu_lock);
+
+    return rc;
 }
 
 /*
@@ -757,8 +790,6 @@ __gnttab_map_grant_ref(
     unsigned long  frame = 0, nr_gets = 0;
     struct page_info *pg = NULL;
     int            rc = GNTST_okay;
-    u32            old_pin;
-    u32            act_pin;
     unsigned int   cache_flags;
     struct active_grant_entry *act = NULL;
     struct grant_mapping *mt;
@@ -859,7 +890,6 @@ __gnttab_map_grant_ref(
         }
     }
 
-    old_pin = act->pin;
     if ( op->flags & GNTMAP_device_map )
         act->pin += (op->flags & GNTMAP_readonly) ?
             GNTPIN_devr_inc : GNTPIN_devw_inc;
@@ -868,7 +898,6 @@ __gnttab_map_grant_ref(
             GNTPIN_hstr_inc : GNTPIN_hstw_inc;
 
     frame = act->frame;
-    act_pin = act->pin;
 
     cache_flags = (shah->flags & (GTF_PAT | GTF_PWT | GTF_PCD) );
 
@@ -950,34 +979,11 @@ __gnttab_map_grant_ref(
     }
 
     need_iommu = gnttab_need_iommu_mapping(ld);
-    if ( need_iommu )
+    if ( need_iommu &&
+         gnttab_iommu_ref(ld, frame, op->flags & GNTMAP_readonly, 1) < 0 )
     {
-        unsigned int kind;
-        int err = 0;
-
-        double_gt_lock(lgt, rgt);
-
-        /* We're not translated, so we know that gmfns and mfns are
-           the same things, so the IOMMU entry is always 1-to-1. */
-        kind = mapkind(lgt, rd, frame);
-        if ( (act_pin & (GNTPIN_hstw_mask|GNTPIN_devw_mask)) &&
-             !(old_pin & (GNTPIN_hstw_mask|GNTPIN_devw_mask)) )
-        {
-            if ( !(kind & MAPKIND_WRITE) )
-                err = iommu_map_page(ld, frame, frame,
-                                     IOMMUF_readable|IOMMUF_writable);
-        }
-        else if ( act_pin && !old_pin )
-        {
-            if ( !kind )
-                err = iommu_map_page(ld, frame, frame, IOMMUF_readable);
-        }
-        if ( err )
-        {
-            double_gt_unlock(lgt, rgt);
-            rc = GNTST_general_error;
-            goto undo_out;
-        }
+        rc = GNTST_general_error;
+        goto undo_out;
     }
 
     TRACE_1D(TRC_MEM_PAGE_GRANT_MAP, op->dom);
@@ -985,19 +991,13 @@ __gnttab_map_grant_ref(
     /*
      * All maptrack entry users check mt->flags first before using the
      * other fields so just ensure the flags field is stored last.
-     *
-     * However, if gnttab_need_iommu_mapping() then this would race
-     * with a concurrent mapcount() call (on an unmap, for example)
-     * and a lock is required.
      */
     mt = &maptrack_entry(lgt, handle);
     mt->domid = op->dom;
     mt->ref   = op->ref;
     smp_wmb();
-    write_atomic(&mt->flags, op->flags);
-
-    if ( need_iommu )
-        double_gt_unlock(lgt, rgt);
+    write_atomic(&mt->flags, (op->flags & ~MAPTRACK_iommu_ref) |
+                             (need_iommu ? MAPTRACK_iommu_ref : 0));
 
     op->dev_bus_addr = (u64)frame << PAGE_SHIFT;
     op->handle       = handle;
@@ -1079,6 +1079,7 @@ __gnttab_unmap_common(
     struct grant_table *lgt, *rgt;
     struct active_grant_entry *act;
     s16              rc = 0;
+    bool_t           put_iommu_ref = 0;
 
     ld = current->domain;
     lgt = ld->grant_table;
@@ -1168,6 +1169,8 @@ __gnttab_unmap_common(
                                               op->flags)) < 0 )
             goto act_release_out;
 
+        op->flush_tlb = 1;
+
         ASSERT(act->pin & (GNTPIN_hstw_mask | GNTPIN_hstr_mask));
         op->map->flags &= ~GNTMAP_host_map;
         if ( op->flags & GNTMAP_readonly )
@@ -1176,27 +1179,30 @@ __gnttab_unmap_common(
             act->pin -= GNTPIN_hstw_inc;
     }
 
+    /*
+     * Drop the IOMMU reference with the last of the mapping's flags, under
+     * the active entry lock so that only one unmap can do so.
+     */
+    if ( (op->map->flags & (GNTMAP_device_map | GNTMAP_host_map |
+                            MAPTRACK_iommu_ref)) == MAPTRACK_iommu_ref )
+    {
+        op->map->flags &= ~MAPTRACK_iommu_ref;
+        put_iommu_ref = 1;
+    }
+
  act_release_out:
     active_entry_release(act);
  unmap_out:
     grant_read_unlock(rgt);
 
-    if ( rc == GNTST_okay && gnttab_need_iommu_mapping(ld) )
+    if ( put_iommu_ref )
     {
-        unsigned int kind;
-        int err = 0;
-
-        double_gt_lock(lgt, rgt);
+        int err = gnttab_iommu_ref(ld, op->frame,
+                                   op->flags & GNTMAP_readonly, 0);
 
-        kind = mapkind(lgt, rd, op->frame);
-        if ( !kind )
-            err = iommu_unmap_page(ld, op->frame);
-        else if ( !(kind & MAPKIND_WRITE) )
-            err = iommu_map_page(ld, op->frame, op->frame, IOMMUF_readable);
-
-        double_gt_unlock(lgt, rgt);
-
-        if ( err )
+        if ( err > 0 )
+            op->flush_iotlb = 1;
+        else if ( err )
             rc = GNTST_general_error;
     }
 
@@ -1310,6 +1316,40 @@ __gnttab_unmap_common_complete(struct gnttab_unmap_common *op)
     rcu_unlock_domain(rd);
 }
 
+/*
+ * Flush the TLB and IOTLB entries of the mappings removed by a batch of
+ * unmap operations, once for the whole batch, before any of the pages can
+ * be released by __gnttab_unmap_common_complete().
+ */
+static int
+gnttab_flush_unmap_batch(
+    const struct gnttab_unmap_common *common, unsigned int nr)
+{
+    struct domain *ld = current->domain;
+    unsigned long lo = ~0UL, hi = 0;
+    bool_t flush_tlb = 0;
+    unsigned int i;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        flush_tlb |= common[i].flush_tlb;
+        if ( common[i].flush_iotlb )
+        {
+            lo = min(lo, common[i].frame);
+            hi = max(hi, common[i].frame);
+        }
+    }
+
+    if ( flush_tlb )
+        gnttab_flush_tlb(ld);
+
+    if ( lo > hi )
+        return 0;
+
+    return hi - lo < UINT_MAX ? iommu_iotlb_flush(ld, lo, hi - lo + 1)
+                              : iommu_iotlb_flush_all(ld);
+}
+
 static void
 __gnttab_unmap_grant_ref(
     struct gnttab_unmap_grant_ref *op,
@@ -1322,6 +1362,8 @@ __gnttab_unmap_grant_ref(
     /* Intialise these in case common contains old state */
     common->new_addr = 0;
     common->rd = NULL;
+    common->flush_tlb = 0;
+    common->flush_iotlb = 0;
 
     __gnttab_unmap_common(common);
     op->status = common->status;
@@ -1332,7 +1374,7 @@ static long
 gnttab_unmap_grant_ref(
     XEN_GUEST_HANDLE_PARAM(gnttab_unmap_grant_ref_t) uop, unsigned int count)
 {
-    int i, c, partial_done, done = 0;
+    int i, c, partial_done, done = 0, rc;
     struct gnttab_unmap_grant_ref op;
     struct gnttab_unmap_common common[GNTTAB_UNMAP_BATCH_SIZE];
 
@@ -1352,11 +1394,14 @@ gnttab_unmap_grant_ref(
             guest_handle_add_offset(uop, 1);
         }
 
-        gnttab_flush_tlb(current->domain);
+        rc = gnttab_flush_unmap_batch(common, partial_done);
 
         for ( i = 0; i < partial_done; i++ )
             __gnttab_unmap_common_complete(&(common[i]));
 
+        if ( unlikely(rc) )
+            return rc;
+
         count -= c;
         done += c;
 
@@ -1367,11 +1412,11 @@ gnttab_unmap_grant_ref(
     return 0;
 
 fault:
-    gnttab_flush_tlb(current->domain);
+    rc = gnttab_flush_unmap_batch(common, partial_done);
 
     for ( i = 0; i < partial_done; i++ )
         __gnttab_unmap_common_complete(&(common[i]));
-    return -EFAULT;
+    return rc ?: -EFAULT;
 }
 
 static void
@@ -1386,6 +1431,8 @@ __gnttab_unmap_and_replace(
     /* Intialise these in case common contains old state */
     common->dev_bus_addr = 0;
     common->rd = NULL;
+    common->flush_tlb = 0;
+    common->flush_iotlb = 0;
 
     __gnttab_unmap_common(common);
     op->status = common->status;
@@ -1395,7 +1442,7 @@ static long
 gnttab_unmap_and_replace(
     XEN_GUEST_HANDLE_PARAM(gnttab_unmap_and_replace_t) uop, unsigned int count)
 {
-    int i, c, partial_done, done = 0;
+    int i, c, partial_done, done = 0, rc;
     struct gnttab_unmap_and_replace op;
     struct gnttab_unmap_common common[GNTTAB_UNMAP_BATCH_SIZE];
 
@@ -1415,11 +1462,14 @@ gnttab_unmap_and_replace(
             guest_handle_add_offset(uop, 1);
         }
         
-        gnttab_flush_tlb(current->domain);
+        rc = gnttab_flush_unmap_batch(common, partial_done);
         
         for ( i = 0; i < partial_done; i++ )
             __gnttab_unmap_common_complete(&(common[i]));
 
+        if ( unlikely(rc) )
+            return rc;
+
         count -= c;
         done += c;
 
@@ -1430,11 +1480,11 @@ gnttab_unmap_and_replace(
     return 0;
 
 fault:
-    gnttab_flush_tlb(current->domain);
+    rc = gnttab_flush_unmap_batch(common, partial_done);
 
     for ( i = 0; i < partial_done; i++ )
         __gnttab_unmap_common_complete(&(common[i]));
-    return -EFAULT;    
+    return rc ?: -EFAULT;
 }
 
 static int
@@ -2332,49 +2382,6 @@ static int gnttab_copy_lock_domain(domid_t domid, unsigned int gref_flag,
     return rc;
 }
 
-static void gnttab_copy_unlock_domains(struct gnttab_copy_buf *src,
-                                       struct gnttab_copy_buf *dest)
-{
-    if ( src->domain )
-    {
-        rcu_unlock_domain(src->domain);
-        src->domain = NULL;
-    }
-    if ( dest->domain )
-    {
-        rcu_unlock_domain(dest->domain);
-        dest->domain = NULL;
-    }
-}
-
-static int gnttab_copy_lock_domains(const struct gnttab_copy *op,
-                                    struct gnttab_copy_buf *src,
-                                    struct gnttab_copy_buf *dest)
-{
-    int rc;
-
-    rc = gnttab_copy_lock_domain(op->source.domid,
-                                 op->flags & GNTCOPY_source_gref, src);
-    if ( rc < 0 )
-        goto error;
-    rc = gnttab_copy_lock_domain(op->dest.domid,
-                                 op->flags & GNTCOPY_dest_gref, dest);
-    if ( rc < 0 )
-        goto error;
-
-    rc = xsm_grant_copy(XSM_HOOK, src->domain, dest->domain);
-    if ( rc < 0 )
-    {
-        rc = GNTST_permission_denied;
-        goto error;
-    }
-    return 0;
-
- error:
-    gnttab_copy_unlock_domains(src, dest);
-    return rc;
-}
-
 static void gnttab_copy_release_buf(struct gnttab_copy_buf *buf)
 {
     if ( buf->virt )
@@ -2399,6 +2406,17 @@ static void gnttab_copy_release_buf(struct gnttab_copy_buf *buf)
     }
 }
 
+/* Release the buffer and the domain it belongs to. */
+static void gnttab_copy_put_buf(struct gnttab_copy_buf *buf)
+{
+    gnttab_copy_release_buf(buf);
+    if ( buf->domain )
+    {
+        rcu_unlock_domain(buf->domain);
+        buf->domain = NULL;
+    }
+}
+
 static int gnttab_copy_claim_buf(const struct gnttab_copy *op,
                                  const struct gnttab_copy_ptr *ptr,
                                  struct gnttab_copy_buf *buf,
@@ -2456,11 +2474,79 @@ static bool_t gnttab_copy_buf_valid(const struct gnttab_copy_ptr *p,
                                     const struct gnttab_copy_buf *b,
                                     bool_t has_gref)
 {
-    if ( !b->virt )
+    if ( !b->virt || p->domid != b->ptr.domid )
         return 0;
     if ( has_gref )
         return b->have_grant && p->u.ref == b->ptr.u.ref;
-    return p->u.gmfn == b->ptr.u.gmfn;
+    return !b->have_grant && p->u.gmfn == b->ptr.u.gmfn;
+}
+
+/*
+ * Source and destination buffers stay claimed (pinned and mapped) across
+ * the ops of a copy hypercall, so that a batch copying several segments
+ * from or to the same frames (e.g. netback copying a packet's fragments
+ * into a guest's receive buffers) only claims each frame once.
+ */
+#define GNTTAB_COPY_NR_BUFS 4
+
+/* Smallest copy done with non-temporal stores. */
+#define GNTTAB_COPY_NT_MIN (PAGE_SIZE / 2)
+
+struct gnttab_copy_bufs {
+    struct gnttab_copy_buf buf[GNTTAB_COPY_NR_BUFS];
+    unsigned int next;   /* Next one to evict, round robin. */
+};
+
+/*
+ * Find the buffer for p, or a buffer to claim it into with its domain
+ * locked.
+ */
+static int gnttab_copy_get_buf(struct gnttab_copy_bufs *bufs,
+                               const struct gnttab_copy_ptr *p,
+                               unsigned int gref_flag,
+                               struct gnttab_copy_buf **pbuf)
+{
+    struct gnttab_copy_buf *buf;
+    unsigned int i;
+
+    for ( i = 0; i < GNTTAB_COPY_NR_BUFS; i++ )
+    {
+        buf = &bufs->buf[i];
+        if ( gnttab_copy_buf_valid(p, buf, gref_flag) )
+        {
+            *pbuf = buf;
+            return GNTST_okay;
+        }
+    }
+
+    for ( i = 0; i < GNTTAB_COPY_NR_BUFS; i++ )
+        if ( !bufs->buf[i].virt )
+            break;
+    if ( i == GNTTAB_COPY_NR_BUFS )
+    {
+        i = bufs->next;
+        bufs->next = (i + 1) % GNTTAB_COPY_NR_BUFS;
+    }
+
+    buf = &bufs->buf[i];
+    gnttab_copy_release_buf(buf);
+    if ( buf->domain && buf->ptr.domid != p->domid )
+    {
+        rcu_unlock_domain(buf->domain);
+        buf->domain = NULL;
+    }
+    *pbuf = buf;
+
+    return buf->domain ? GNTST_okay
+                       : gnttab_copy_lock_domain(p->domid, gref_flag, buf);
+}
+
+static void gnttab_copy_put_bufs(struct gnttab_copy_bufs *bufs)
+{
+    unsigned int i;
+
+    for ( i = 0; i < GNTTAB_COPY_NR_BUFS; i++ )
+        gnttab_copy_put_buf(&bufs->buf[i]);
 }
 
 static int gnttab_copy_buf(const struct gnttab_copy *op,
@@ -2487,47 +2573,69 @@ static int gnttab_copy_buf(const struct gnttab_copy *op,
                  op->dest.offset, dest->ptr.offset,
                  op->len, dest->len);
 
-    memcpy(dest->virt + op->dest.offset, src->virt + op->source.offset,
-           op->len);
+    /*
+     * Large copies are done without going through the cache, as they would
+     * otherwise evict more of it than they are likely to be reused.  Below
+     * GNTTAB_COPY_NT_MIN, the partial cache lines and the fence cost more
+     * than this saves.
+     */
+    if ( op->len >= GNTTAB_COPY_NT_MIN )
+        memcpy_nt(dest->virt + op->dest.offset,
+                  src->virt + op->source.offset, op->len);
+    else
+        memcpy(dest->virt + op->dest.offset, src->virt + op->source.offset,
+               op->len);
     gnttab_mark_dirty(dest->domain, dest->frame);
     rc = GNTST_okay;
  out:
     return rc;
 }
 
+struct gnttab_copy_state {
+    struct gnttab_copy_bufs src, dest;
+    /* Domains the last XSM check was done for. */
+    domid_t src_domid, dest_domid;
+    bool_t checked;
+};
+
 static int gnttab_copy_one(const struct gnttab_copy *op,
-                           struct gnttab_copy_buf *dest,
-                           struct gnttab_copy_buf *src)
+                           struct gnttab_copy_state *state)
 {
+    struct gnttab_copy_buf *src = NULL, *dest = NULL;
     int rc;
 
-    if ( !src->domain || op->source.domid != src->ptr.domid ||
-         !dest->domain || op->dest.domid != dest->ptr.domid )
-    {
-        gnttab_copy_release_buf(src);
-        gnttab_copy_release_buf(dest);
-        gnttab_copy_unlock_domains(src, dest);
+    rc = gnttab_copy_get_buf(&state->src, &op->source,
+                             op->flags & GNTCOPY_source_gref, &src);
+    if ( rc < 0 )
+        goto out;
+    rc = gnttab_copy_get_buf(&state->dest, &op->dest,
+                             op->flags & GNTCOPY_dest_gref, &dest);
+    if ( rc < 0 )
+        goto out;
 
-        rc = gnttab_copy_lock_domains(op, src, dest);
-        if ( rc < 0 )
+    if ( !state->checked || op->source.domid != state->src_domid ||
+         op->dest.domid != state->dest_domid )
+    {
+        state->checked = 0;
+        if ( xsm_grant_copy(XSM_HOOK, src->domain, dest->domain) < 0 )
+        {
+            rc = GNTST_permission_denied;
             goto out;
+        }
+        state->src_domid = op->source.domid;
+        state->dest_domid = op->dest.domid;
+        state->checked = 1;
     }
 
-    /* Different source? */
-    if ( !gnttab_copy_buf_valid(&op->source, src,
-                                op->flags & GNTCOPY_source_gref) )
+    if ( !src->virt )
     {
-        gnttab_copy_release_buf(src);
         rc = gnttab_copy_claim_buf(op, &op->source, src, GNTCOPY_source_gref);
         if ( rc < 0 )
             goto out;
     }
 
-    /* Different dest? */
-    if ( !gnttab_copy_buf_valid(&op->dest, dest,
-                                op->flags & GNTCOPY_dest_gref) )
+    if ( !dest->virt )
     {
-        gnttab_copy_release_buf(dest);
         rc = gnttab_copy_claim_buf(op, &op->dest, dest, GNTCOPY_dest_gref);
         if ( rc < 0 )
             goto out;
@@ -2535,6 +2643,13 @@ static int gnttab_copy_one(const struct gnttab_copy *op,
 
     rc = gnttab_copy_buf(op, dest, src);
  out:
+    if ( rc < 0 )
+    {
+        if ( src )
+            gnttab_copy_put_buf(src);
+        if ( dest )
+            gnttab_copy_put_buf(dest);
+    }
     return rc;
 }
 
@@ -2543,8 +2658,7 @@ static long gnttab_copy(
 {
     unsigned int i;
     struct gnttab_copy op;
-    struct gnttab_copy_buf src = {};
-    struct gnttab_copy_buf dest = {};
+    struct gnttab_copy_state state = {};
     long rc = 0;
 
     for ( i = 0; i < count; i++ )
@@ -2561,12 +2675,7 @@ static long gnttab_copy(
             break;
         }
 
-        op.status = gnttab_copy_one(&op, &dest, &src);
-        if ( op.status != GNTST_okay )
-        {
-            gnttab_copy_release_buf(&src);
-            gnttab_copy_release_buf(&dest);
-        }
+        op.status = gnttab_copy_one(&op, &state);
 
         if ( unlikely(__copy_field_to_guest(uop, &op, status)) )
         {
@@ -2576,9 +2685,8 @@ static long gnttab_copy(
         guest_handle_add_offset(uop, 1);
     }
 
-    gnttab_copy_release_buf(&src);
-    gnttab_copy_release_buf(&dest);
-    gnttab_copy_unlock_domains(&src, &dest);
+    gnttab_copy_put_bufs(&state.src);
+    gnttab_copy_put_bufs(&state.dest);
 
     return rc;
 }
@@ -3197,6 +3305,8 @@ grant_table_create(
     /* Simple stuff. */
     percpu_rwlock_resource_init(&t->lock, grant_rwlock);
     spin_lock_init(&t->maptrack_lock);
+    spin_lock_init(&t->iommu_lock);
+    radix_tree_init(&t->iommu_refs);
     t->nr_grant_frames = INITIAL_NR_GRANT_FRAMES;
 
     /* Active grant table. */
@@ -3418,6 +3528,7 @@ grant_table_destroy(
     for ( i = 0; i < nr_maptrack_frames(t); i++ )
         free_xenheap_page(t->maptrack[i]);
     vfree(t->maptrack);
+    radix_tree_destroy(&t->iommu_refs, NULL);
 
     for ( i = 0; i < nr_active_grant_frames(t); i++ )
         free_xenheap_page(t->active[i]);
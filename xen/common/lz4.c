@@ -0,0 +1,13 @@
+/*
+ * LZ4 block compression and decompression for use at run time (by tmem).
+ * The boot time decompressor in unlz4.c uses the decompressor from here.
+ */
+
+#include <xen/lib.h>
+#include <xen/lz4.h>
+#include <xen/string.h>
+#include <xen/types.h>
+
+#define INIT
+#include "lz4/decompress.c"
+#include "lz4/compress.c"
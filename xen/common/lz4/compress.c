@@ -0,0 +1,209 @@
+/*
+ * LZ4 block compressor, used for tmem pools and for page data in the
+ * migration stream.
+ *
+ * The output is a raw LZ4 block as understood by lz4_decompress*() from
+ * decompress.c.  Only the greedy single-probe algorithm is implemented,
+ * which is what is wanted for guest pages: most of the gain comes from the
+ * runs of zeroes and repeated patterns found in guest memory, and the
+ * compressor has to keep up with the guest (or the network link).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef __XEN__
+#include <xen/lz4.h>
+#include <xen/string.h>
+#include <xen/types.h>
+#endif
+
+#define MINMATCH         4
+/* The last match must start at least 12 bytes before the end of input. */
+#define MATCH_FIND_LIMIT 12
+/* The last 5 bytes of input are always literals. */
+#define MATCH_END_LIMIT  5
+#define MAX_OFFSET       65535
+
+#define ML_BITS       4
+#define ML_MASK       ((1U << ML_BITS) - 1)
+#define RUN_BITS      (8 - ML_BITS)
+#define RUN_MASK      ((1U << RUN_BITS) - 1)
+
+/* 4096 uint32_t offsets fit in LZ4_MEM_COMPRESS on all architectures. */
+#define TABLE_LOG     12
+#define TABLE_SIZE    (1U << TABLE_LOG)
+
+/* Probe less often the longer no match has been found. */
+#define SKIP_STRENGTH 6
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline unsigned int hash32(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - TABLE_LOG);
+}
+
+/* Length of the common prefix of ip and ref, stopping at limit. */
+static inline size_t match_length(const uint8_t *ip, const uint8_t *ref,
+                                  const uint8_t *limit)
+{
+    const uint8_t *start = ip;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while ( ip + sizeof(unsigned long) <= limit )
+    {
+        unsigned long a, b;
+
+        memcpy(&a, ip, sizeof(a));
+        memcpy(&b, ref, sizeof(b));
+        if ( a != b )
+            return ip - start + __builtin_ctzl(a ^ b) / 8;
+        ip += sizeof(a);
+        ref += sizeof(b);
+    }
+#endif
+    while ( ip < limit && *ip == *ref )
+    {
+        ip++;
+        ref++;
+    }
+
+    return ip - start;
+}
+
+/* Emit the extra bytes of a length which did not fit into the token. */
+static inline uint8_t *put_length(uint8_t *op, size_t len)
+{
+    for ( ; len >= 255; len -= 255 )
+        *op++ = 255;
+    *op++ = len;
+
+    return op;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+                 unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+    uint32_t *table = wrkmem;
+    const uint8_t *ip = src, *anchor = src, *ref;
+    const uint8_t *const iend = src + src_len;
+    const uint8_t *const mflimit = iend - MATCH_FIND_LIMIT;
+    const uint8_t *const matchlimit = iend - MATCH_END_LIMIT;
+    uint8_t *op = dst, *token;
+    unsigned int attempts = 1U << SKIP_STRENGTH;
+    uint32_t seq;
+    size_t len, back;
+
+    if ( src_len > UINT32_MAX )
+        return -1;
+
+    if ( src_len < MATCH_FIND_LIMIT + 1 )
+        goto last_literals;
+
+    memset(table, 0, TABLE_SIZE * sizeof(*table));
+
+    /* Position 0 is implicitly in the table already. */
+    ip++;
+
+    while ( ip < mflimit )
+    {
+        seq = read32(ip);
+        ref = (const uint8_t *)src + table[hash32(seq)];
+        table[hash32(seq)] = ip - (const uint8_t *)src;
+
+        len = 0;
+        if ( ip - ref <= MAX_OFFSET && read32(ref) == seq )
+            len = MINMATCH + match_length(ip + MINMATCH, ref + MINMATCH,
+                                          matchlimit);
+
+        /* Extend the match backwards over pending literals. */
+        for ( back = 0; len && ip - back > anchor &&
+                        ref - back > (const uint8_t *)src &&
+                        ip[-back - 1] == ref[-back - 1]; back++ )
+            ;
+
+        if ( !len )
+        {
+            ip += attempts++ >> SKIP_STRENGTH;
+            continue;
+        }
+        attempts = 1U << SKIP_STRENGTH;
+        ip -= back;
+        ref -= back;
+        len += back;
+
+        /* Literals since the previous match. */
+        token = op++;
+        if ( ip - anchor >= RUN_MASK )
+        {
+            *token = RUN_MASK << ML_BITS;
+            op = put_length(op, ip - anchor - RUN_MASK);
+        }
+        else
+            *token = (ip - anchor) << ML_BITS;
+        memcpy(op, anchor, ip - anchor);
+        op += ip - anchor;
+
+        /* Offset, little endian. */
+        *op++ = (ip - ref);
+        *op++ = (ip - ref) >> 8;
+
+        /* Match length, beyond MINMATCH. */
+        if ( len - MINMATCH >= ML_MASK )
+        {
+            *token |= ML_MASK;
+            op = put_length(op, len - MINMATCH - ML_MASK);
+        }
+        else
+            *token |= len - MINMATCH;
+
+        ip += len;
+        anchor = ip;
+
+        /* Seed the table from the end of the match, which is never hashed. */
+        table[hash32(read32(ip - 2))] = ip - 2 - (const uint8_t *)src;
+    }
+
+ last_literals:
+    len = iend - anchor;
+    if ( len >= RUN_MASK )
+    {
+        *op++ = RUN_MASK << ML_BITS;
+        op = put_length(op, len - RUN_MASK);
+    }
+    else
+        *op++ = len << ML_BITS;
+    memcpy(op, anchor, len);
+    op += len;
+
+    *dst_len = op - dst;
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
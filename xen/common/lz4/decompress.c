@@ -129,11 +129,8 @@ static int INIT lz4_uncompress(const unsigned char *source, unsigned char *dest,
 		cpy = op + length - (STEPSIZE - 4);
 		if (cpy > (oend - COPYLENGTH)) {
 
-			/* Error: request to write beyond destination buffer */
-			if (cpy > oend)
-				goto _output_error;
-			if ((ref + COPYLENGTH) > oend ||
-					(op + COPYLENGTH) > oend)
+			/* Error: the last 5 bytes must be literals */
+			if (cpy > oend - LASTLITERALS)
 				goto _output_error;
 			LZ4_SECURECOPY(ref, op, (oend - COPYLENGTH));
 			while (op < cpy)
@@ -147,7 +144,12 @@ static int INIT lz4_uncompress(const unsigned char *source, unsigned char *dest,
 				goto _output_error;
 			continue;
 		}
-		if (unlikely((unsigned long)cpy < (unsigned long)op))
+		/*
+		 * Matches shorter than STEPSIZE legitimately end before op;
+		 * anything further back is a wrapped length.
+		 */
+		if (unlikely((unsigned long)cpy <
+			     (unsigned long)op - (STEPSIZE - 4)))
 			goto _output_error;
 		LZ4_SECURECOPY(ref, op, cpy);
 		op = cpy; /* correction */
@@ -279,7 +281,12 @@ static int lz4_uncompress_unknownoutputsize(const unsigned char *source,
 				goto _output_error;
 			continue;
 		}
-		if (unlikely((unsigned long)cpy < (unsigned long)op))
+		/*
+		 * Matches shorter than STEPSIZE legitimately end before op;
+		 * anything further back is a wrapped length.
+		 */
+		if (unlikely((unsigned long)cpy <
+			     (unsigned long)op - (STEPSIZE - 4)))
 			goto _output_error;
 		LZ4_SECURECOPY(ref, op, cpy);
 		op = cpy; /* correction */
@@ -10,6 +10,23 @@
 
 #ifdef __XEN__
 #include <asm/byteorder.h>
+
+/*
+ * Not every architecture provides these; packed accesses let the compiler
+ * pick plain loads and stores wherever that is allowed.
+ */
+#ifndef get_unaligned
+#define get_unaligned(p) ({						\
+	const struct { typeof(*(p)) v; } __packed *p_ = (const void *)(p); \
+	p_->v;								\
+})
+#endif
+#ifndef put_unaligned
+#define put_unaligned(val, p) do {					\
+	struct { typeof(*(p)) v; } __packed *p_ = (void *)(p);		\
+	p_->v = (val);							\
+} while (0)
+#endif
 #endif
 
 static inline u16 INIT get_unaligned_le16(const void *p)
@@ -122,6 +122,7 @@
 
 #include <xen/init.h>
 #include <xen/types.h>
+#include <xen/cpu.h>
 #include <xen/lib.h>
 #include <xen/sched.h>
 #include <xen/spinlock.h>
@@ -159,9 +160,41 @@ string_param("badpage", opt_badpage);
 
 /*
  * no-bootscrub -> Free pages are not zeroed during boot.
+ * bootscrub=idle -> Free pages are scrubbed in idle time after boot.
  */
-static bool_t opt_bootscrub __initdata = 1;
-boolean_param("bootscrub", opt_bootscrub);
+enum bootscrub_mode {
+    BOOTSCRUB_OFF,
+    BOOTSCRUB_ON,
+    BOOTSCRUB_IDLE,
+};
+static enum bootscrub_mode __initdata opt_bootscrub = BOOTSCRUB_ON;
+
+static void __init parse_bootscrub_param(const char *s)
+{
+    /* Interpret 'bootscrub' alone in its positive boolean form. */
+    if ( *s == '\0' )
+    {
+        opt_bootscrub = BOOTSCRUB_ON;
+        return;
+    }
+
+    switch ( parse_bool(s) )
+    {
+    case 0:
+        opt_bootscrub = BOOTSCRUB_OFF;
+        break;
+    case 1:
+        opt_bootscrub = BOOTSCRUB_ON;
+        break;
+    default:
+        if ( !strcmp(s, "idle") )
+            opt_bootscrub = BOOTSCRUB_IDLE;
+        else
+            printk(XENLOG_WARNING "Invalid bootscrub option: %s\n", s);
+        break;
+    }
+}
+custom_param("bootscrub", parse_bootscrub_param);
 
 /*
  * bootscrub_chunk -> Amount of bytes to scrub lockstep on non-SMT CPUs
@@ -393,6 +426,54 @@ static long midsize_alloc_zone_pages;
 static DEFINE_SPINLOCK(heap_lock);
 static long outstanding_claims; /* total outstanding claims by all domains */
 
+/*
+ * Free pages awaiting scrubbing, protected by heap_lock.
+ *
+ * Pages freed by dying domains are not scrubbed synchronously: they are
+ * flagged PGC_need_scrub and returned to the heap, where idle CPUs scrub
+ * them in the background (see scrub_free_pages()). The head of every
+ * buddy chunk containing such pages has u.free.dirty set, and dirty chunks
+ * are kept at the tail of the free lists so that allocations find clean
+ * memory first and only scrub on demand when there is none.
+ */
+static unsigned long node_need_scrub[MAX_NUMNODES];
+
+/* Largest chunk taken off the heap for each pass of the idle scrubber. */
+#define SCRUB_CHUNK_ORDER 9
+
+/*
+ * Per-CPU free page caches.
+ *
+ * Order-0 allocations and frees are satisfied from a small per-CPU list of
+ * pages belonging to the CPU's own node, which is refilled from and drained
+ * back to the buddy heap in batches, so that heap_lock is only taken once
+ * per batch rather than once per page.
+ *
+ * As far as the buddy heap is concerned cached pages are allocated: they do
+ * not contribute to avail[] or total_avail_pages, and they are kept in
+ * PGC_state_inuse with a zero reference count, so that neither the merging
+ * logic in free_heap_pages() nor the offlining code mistakes them for free
+ * buddy blocks.
+ */
+struct pcp_cache {
+    spinlock_t lock;
+    struct page_list_head list;
+    unsigned int count;
+};
+
+static DEFINE_PER_CPU(struct pcp_cache, pcp_cache);
+
+/* pcpu_page_cache=<n> -> Upper bound on pages cached per CPU (0 disables). */
+static unsigned int __read_mostly opt_pcp_high = 64;
+integer_param("pcpu_page_cache", opt_pcp_high);
+#define pcp_batch() max(opt_pcp_high / 4, 1U)
+
+/* Caches are only enabled once the heap has been scrubbed at boot. */
+static bool __read_mostly pcp_enabled;
+static atomic_t pcp_total_pages = ATOMIC_INIT(0);
+
+static void pcp_drain_all(void);
+
 unsigned long domain_adjust_tot_pages(struct domain *d, long pages)
 {
     long dom_before, dom_after, dom_claimed, sys_before, sys_after;
@@ -431,6 +512,10 @@ int domain_set_outstanding_pages(struct domain *d, unsigned long pages)
     int ret = -ENOMEM;
     unsigned long claim, avail_pages;
 
+    /* Cached pages are not accounted as available; return them first. */
+    if ( pages )
+        pcp_drain_all();
+
     /*
      * take the domain's page_alloc_lock, else all d->tot_page adjustments
      * must always take the global heap_lock rather than only in the much
@@ -500,7 +585,7 @@ void get_outstanding_claims(uint64_t *free_pages, uint64_t *outstanding_pages)
 {
     spin_lock(&heap_lock);
     *outstanding_pages = outstanding_claims;
-    *free_pages =  avail_domheap_pages();
+    *free_pages =  avail_domheap_pages() + atomic_read(&pcp_total_pages);
     spin_unlock(&heap_lock);
 }
 
@@ -683,6 +768,290 @@ static void check_low_mem_virq(void)
     }
 }
 
+static void free_heap_pages_locked(struct page_info *pg, unsigned int order,
+                                   bool need_scrub);
+
+/* Put a free chunk on its list, dirty chunks behind the clean ones. */
+static void page_list_add_scrub(struct page_info *pg, unsigned int node,
+                                unsigned int zone, unsigned int order,
+                                bool dirty)
+{
+    PFN_ORDER(pg) = order;
+    pg->u.free.dirty = dirty;
+
+    if ( dirty )
+        page_list_add_tail(pg, &heap(node, zone, order));
+    else
+        page_list_add(pg, &heap(node, zone, order));
+}
+
+/* Split buddy block @pg of order @j, keeping its top 2^@order pages. */
+static struct page_info *split_heap_block(
+    struct page_info *pg, unsigned int node, unsigned int zone,
+    unsigned int j, unsigned int order)
+{
+    bool dirty = pg->u.free.dirty;
+
+    while ( j != order )
+    {
+        page_list_add_scrub(pg, node, zone, --j, dirty);
+        pg += 1 << j;
+    }
+
+    return pg;
+}
+
+/*
+ * Take up to @nr order-0 pages of @node out of the buddy heap onto @list.
+ * Caller must hold heap_lock.
+ */
+static unsigned int pcp_take_heap_pages(
+    struct page_list_head *list, unsigned int node,
+    unsigned int zone_lo, unsigned int zone_hi, unsigned int nr)
+{
+    unsigned int j, n = 0, zone = zone_hi;
+    struct page_info *pg;
+
+    ASSERT(spin_is_locked(&heap_lock));
+
+    /*
+     * Never let the caches eat into claimed memory, or into the reserve
+     * which tmem keeps for mid-size allocations.
+     */
+    if ( !avail[node] ||
+         (outstanding_claims + midsize_alloc_zone_pages + nr >
+          total_avail_pages) )
+        return 0;
+
+    do {
+        while ( n < nr && avail[node][zone] )
+        {
+            /* Only clean pages may be cached. */
+            for ( j = 0; j <= MAX_ORDER; j++ )
+                if ( !page_list_empty(&heap(node, zone, j)) &&
+                     !page_list_first(&heap(node, zone, j))->u.free.dirty )
+                    break;
+            if ( j > MAX_ORDER )
+                break;
+
+            pg = page_list_remove_head(&heap(node, zone, j));
+
+            pg = split_heap_block(pg, node, zone, j, 0);
+
+            avail[node][zone]--;
+            total_avail_pages--;
+
+            BUG_ON(pg->count_info != PGC_state_free);
+            pg->count_info = PGC_state_inuse;
+            page_list_add_tail(pg, list);
+            n++;
+        }
+    } while ( n < nr && zone-- > zone_lo ); /* careful: unsigned zone may wrap */
+
+    if ( n )
+        check_low_mem_virq();
+
+    return n;
+}
+
+/* Return the pages on @list to the buddy heap. */
+static void pcp_release_pages(struct page_list_head *list)
+{
+    struct page_info *pg;
+
+    if ( page_list_empty(list) )
+        return;
+
+    perfc_incr(pcp_drain);
+
+    spin_lock(&heap_lock);
+    while ( (pg = page_list_remove_head(list)) != NULL )
+        free_heap_pages_locked(pg, 0, false);
+    spin_unlock(&heap_lock);
+}
+
+static struct page_info *pcp_alloc_page(
+    unsigned int node, unsigned int zone_lo, unsigned int zone_hi)
+{
+    struct pcp_cache *pcp = &this_cpu(pcp_cache);
+    struct page_info *pg = NULL;
+    unsigned int zone, n;
+    PAGE_LIST_HEAD(list);
+
+    if ( !pcp_enabled || node != cpu_to_node(smp_processor_id()) )
+        return NULL;
+
+    spin_lock(&pcp->lock);
+    if ( !page_list_empty(&pcp->list) )
+    {
+        pg = page_list_first(&pcp->list);
+        zone = page_to_zone(pg);
+        if ( zone >= zone_lo && zone <= zone_hi )
+        {
+            page_list_del(pg, &pcp->list);
+            pcp->count--;
+        }
+        else
+            pg = NULL;
+    }
+    n = pcp->count;
+    spin_unlock(&pcp->lock);
+
+    if ( pg )
+    {
+        atomic_dec(&pcp_total_pages);
+
+        /* The page may have been marked for offlining whilst cached. */
+        if ( unlikely(pg->count_info != PGC_state_inuse) )
+        {
+            page_list_add_tail(pg, &list);
+            pcp_release_pages(&list);
+            return NULL;
+        }
+
+        perfc_incr(pcp_alloc_hit);
+        return pg;
+    }
+
+    perfc_incr(pcp_alloc_miss);
+
+    /* Leave unsuitable cached pages alone; the caller takes the slow path. */
+    if ( n )
+        return NULL;
+
+    spin_lock(&heap_lock);
+    n = pcp_take_heap_pages(&list, node, zone_lo, zone_hi, pcp_batch());
+    spin_unlock(&heap_lock);
+
+    if ( !n )
+        return NULL;
+
+    perfc_incr(pcp_refill);
+
+    pg = page_list_remove_head(&list);
+    if ( --n )
+    {
+        spin_lock(&pcp->lock);
+        page_list_splice(&list, &pcp->list);
+        pcp->count += n;
+        spin_unlock(&pcp->lock);
+        atomic_add(n, &pcp_total_pages);
+    }
+
+    return pg;
+}
+
+/*
+ * Try to stash an order-0 page being freed in the local CPU's cache.
+ * Returns false if the page must instead go back to the buddy heap.
+ */
+static bool pcp_free_page(struct page_info *pg)
+{
+    struct pcp_cache *pcp = &this_cpu(pcp_cache);
+    unsigned long x = pg->count_info;
+    unsigned int i;
+    PAGE_LIST_HEAD(list);
+
+    if ( !pcp_enabled ||
+         phys_to_nid(page_to_maddr(pg)) != cpu_to_node(smp_processor_id()) )
+        return false;
+
+    /* Broken, offlining and dirty pages need the buddy heap's attention. */
+    if ( (x & (PGC_broken | PGC_need_scrub)) ||
+         ((x & PGC_state) != PGC_state_inuse) ||
+         (cmpxchg(&pg->count_info, x, PGC_state_inuse) != x) )
+        return false;
+
+    perfc_incr(pcp_free_hit);
+
+    spin_lock(&pcp->lock);
+    page_list_add(pg, &pcp->list);
+    if ( ++pcp->count > opt_pcp_high )
+    {
+        for ( i = 0; i < pcp_batch(); i++ )
+        {
+            pg = page_list_last(&pcp->list);
+            page_list_del(pg, &pcp->list);
+            page_list_add_tail(pg, &list);
+        }
+        pcp->count -= i;
+    }
+    else
+        i = 0;
+    spin_unlock(&pcp->lock);
+
+    atomic_add(1 - (int)i, &pcp_total_pages);
+    pcp_release_pages(&list);
+
+    return true;
+}
+
+static void pcp_drain_cpu(unsigned int cpu)
+{
+    struct pcp_cache *pcp = &per_cpu(pcp_cache, cpu);
+    PAGE_LIST_HEAD(list);
+    unsigned int n;
+
+    spin_lock(&pcp->lock);
+    page_list_move(&list, &pcp->list);
+    n = pcp->count;
+    pcp->count = 0;
+    spin_unlock(&pcp->lock);
+
+    atomic_sub(n, &pcp_total_pages);
+    pcp_release_pages(&list);
+}
+
+/* Flush all per-CPU caches back into the buddy heap. */
+static void pcp_drain_all(void)
+{
+    unsigned int cpu;
+
+    if ( !atomic_read(&pcp_total_pages) )
+        return;
+
+    for_each_online_cpu ( cpu )
+        pcp_drain_cpu(cpu);
+}
+
+static int cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct pcp_cache *pcp = &per_cpu(pcp_cache, cpu);
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        spin_lock_init(&pcp->lock);
+        INIT_PAGE_LIST_HEAD(&pcp->list);
+        pcp->count = 0;
+        break;
+    case CPU_UP_CANCELED:
+    case CPU_DEAD:
+        pcp_drain_cpu(cpu);
+        break;
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_nfb = {
+    .notifier_call = cpu_callback
+};
+
+static int __init pcp_cache_init(void)
+{
+    void *cpu = (void *)(long)smp_processor_id();
+
+    cpu_callback(&cpu_nfb, CPU_UP_PREPARE, cpu);
+    register_cpu_notifier(&cpu_nfb);
+    return 0;
+}
+presmp_initcall(pcp_cache_init);
+
 /* Allocate 2^@order contiguous pages. */
 static struct page_info *alloc_heap_pages(
     unsigned int zone_lo, unsigned int zone_hi,
@@ -694,12 +1063,15 @@ static struct page_info *alloc_heap_pages(
     unsigned long request = 1UL << order;
     struct page_info *pg;
     nodemask_t nodemask = (d != NULL ) ? d->node_affinity : node_online_map;
-    bool_t need_tlbflush = 0;
+    bool_t need_tlbflush = 0, drained = 0;
+    unsigned int dirty_ok;
     uint32_t tlbflush_timestamp = 0;
+    unsigned long dirty_pages = 0;
 
     /* Make sure there are enough bits in memflags for nodeID. */
     BUILD_BUG_ON((_MEMF_bits - _MEMF_node) < (8 * sizeof(nodeid_t)));
 
+ retry:
     if ( node == NUMA_NO_NODE )
     {
         if ( d != NULL )
@@ -720,6 +1092,24 @@ static struct page_info *alloc_heap_pages(
     if ( unlikely(order > MAX_ORDER) )
         return NULL;
 
+    if ( order == 0 && (pg = pcp_alloc_page(node, zone_lo, zone_hi)) )
+    {
+        if ( d != NULL )
+            d->last_alloc_node = node;
+
+        if ( !(memflags & MEMF_no_tlbflush) )
+            accumulate_tlbflush(&need_tlbflush, pg, &tlbflush_timestamp);
+
+        pg->u.inuse.type_info = 0;
+        page_set_owner(pg, NULL);
+        flush_page_to_ram(page_to_mfn(pg));
+
+        if ( need_tlbflush )
+            filtered_flush_tlb_mask(tlbflush_timestamp);
+
+        return pg;
+    }
+
     spin_lock(&heap_lock);
 
     /*
@@ -750,17 +1140,32 @@ static struct page_info *alloc_heap_pages(
      */
     for ( ; ; )
     {
-        zone = zone_hi;
-        do {
-            /* Check if target node can support the allocation. */
-            if ( !avail[node] || (avail[node][zone] < request) )
-                continue;
-
-            /* Find smallest order which can satisfy the request. */
-            for ( j = order; j <= MAX_ORDER; j++ )
-                if ( (pg = page_list_remove_head(&heap(node, zone, j))) )
-                    goto found;
-        } while ( zone-- > zone_lo ); /* careful: unsigned zone may wrap */
+        /* Only resort to chunks needing scrubbing if there is nothing else. */
+        for ( dirty_ok = 0; dirty_ok <= 1; dirty_ok++ )
+        {
+            zone = zone_hi;
+            do {
+                /* Check if target node can support the allocation. */
+                if ( !avail[node] || (avail[node][zone] < request) )
+                    continue;
+
+                /* Find smallest order which can satisfy the request. */
+                for ( j = order; j <= MAX_ORDER; j++ )
+                {
+                    if ( page_list_empty(&heap(node, zone, j)) )
+                        continue;
+                    pg = page_list_first(&heap(node, zone, j));
+                    if ( dirty_ok || !pg->u.free.dirty )
+                    {
+                        page_list_del(pg, &heap(node, zone, j));
+                        goto found;
+                    }
+                }
+            } while ( zone-- > zone_lo ); /* careful: unsigned zone may wrap */
+
+            if ( !avail[node] || !node_need_scrub[node] )
+                break;
+        }
 
         if ( (memflags & MEMF_exact_node) && req_node != NUMA_NO_NODE )
             goto not_found;
@@ -798,18 +1203,25 @@ static struct page_info *alloc_heap_pages(
     }
 
  not_found:
-    /* No suitable memory blocks. Fail the request. */
     spin_unlock(&heap_lock);
+
+    /* Pages sitting in per-CPU caches may make the request satisfiable. */
+    if ( !drained && atomic_read(&pcp_total_pages) )
+    {
+        pcp_drain_all();
+        drained = 1;
+        node = req_node;
+        nodemask = (d != NULL ) ? d->node_affinity : node_online_map;
+        nodemask_retry = 0;
+        goto retry;
+    }
+
+    /* No suitable memory blocks. Fail the request. */
     return NULL;
 
  found: 
     /* We may have to halve the chunk a number of times. */
-    while ( j != order )
-    {
-        PFN_ORDER(pg) = --j;
-        page_list_add_tail(pg, &heap(node, zone, j));
-        pg += 1 << j;
-    }
+    pg = split_heap_block(pg, node, zone, j, order);
 
     ASSERT(avail[node][zone] >= request);
     avail[node][zone] -= request;
@@ -824,8 +1236,13 @@ static struct page_info *alloc_heap_pages(
     for ( i = 0; i < (1 << order); i++ )
     {
         /* Reference count must continuously be zero for free pages. */
-        BUG_ON(pg[i].count_info != PGC_state_free);
-        pg[i].count_info = PGC_state_inuse;
+        BUG_ON((pg[i].count_info & ~PGC_need_scrub) != PGC_state_free);
+
+        /* Dirty pages keep their flag until scrubbed below. */
+        if ( pg[i].count_info & PGC_need_scrub )
+            dirty_pages++;
+        pg[i].count_info = PGC_state_inuse |
+                           (pg[i].count_info & PGC_need_scrub);
 
         if ( !(memflags & MEMF_no_tlbflush) )
             accumulate_tlbflush(&need_tlbflush, &pg[i],
@@ -841,11 +1258,22 @@ static struct page_info *alloc_heap_pages(
         flush_page_to_ram(page_to_mfn(&pg[i]));
     }
 
+    ASSERT(node_need_scrub[node] >= dirty_pages);
+    node_need_scrub[node] -= dirty_pages;
+
     spin_unlock(&heap_lock);
 
     if ( need_tlbflush )
         filtered_flush_tlb_mask(tlbflush_timestamp);
 
+    if ( unlikely(dirty_pages) )
+    {
+        for ( i = 0; i < (1 << order); i++ )
+            if ( test_and_clear_bit(_PGC_need_scrub, &pg[i].count_info) )
+                scrub_one_page(&pg[i]);
+        perfc_add(page_scrub_alloc, dirty_pages);
+    }
+
     return pg;
 }
 
@@ -856,6 +1284,7 @@ static int reserve_offlined_page(struct page_info *head)
     int zone = page_to_zone(head), i, head_order = PFN_ORDER(head), count = 0;
     struct page_info *cur_head;
     int cur_order;
+    bool dirty = head->u.free.dirty;
 
     ASSERT(spin_is_locked(&heap_lock));
 
@@ -897,8 +1326,7 @@ static int reserve_offlined_page(struct page_info *head)
             {
             merge:
                 /* We don't consider merging outside the head_order. */
-                page_list_add_tail(cur_head, &heap(node, zone, cur_order));
-                PFN_ORDER(cur_head) = cur_order;
+                page_list_add_scrub(cur_head, node, zone, cur_order, dirty);
                 cur_head += (1 << cur_order);
                 break;
             }
@@ -914,6 +1342,10 @@ static int reserve_offlined_page(struct page_info *head)
         total_avail_pages--;
         ASSERT(total_avail_pages >= 0);
 
+        /* The flag stays, so that the page gets scrubbed if onlined again. */
+        if ( cur_head->count_info & PGC_need_scrub )
+            node_need_scrub[node]--;
+
         page_list_add_tail(cur_head,
                            test_bit(_PGC_broken, &cur_head->count_info) ?
                            &page_broken_list : &page_offlined_list);
@@ -924,18 +1356,18 @@ static int reserve_offlined_page(struct page_info *head)
     return count;
 }
 
-/* Free 2^@order set of pages. */
-static void free_heap_pages(
-    struct page_info *pg, unsigned int order)
+/* Return 2^@order set of pages to the buddy heap. Caller holds heap_lock. */
+static void free_heap_pages_locked(struct page_info *pg, unsigned int order,
+                                   bool need_scrub)
 {
-    unsigned long mask, mfn = page_to_mfn(pg);
+    unsigned long mask;
     unsigned int i, node = phys_to_nid(page_to_maddr(pg)), tainted = 0;
     unsigned int zone = page_to_zone(pg);
+    bool dirty = false;
 
     ASSERT(order <= MAX_ORDER);
     ASSERT(node >= 0);
-
-    spin_lock(&heap_lock);
+    ASSERT(spin_is_locked(&heap_lock));
 
     for ( i = 0; i < (1 << order); i++ )
     {
@@ -952,20 +1384,17 @@ static void free_heap_pages(
          */
         ASSERT(!page_state_is(&pg[i], offlined));
         pg[i].count_info =
-            ((pg[i].count_info & PGC_broken) |
+            ((pg[i].count_info & (PGC_broken | PGC_need_scrub)) |
+             (need_scrub ? PGC_need_scrub : 0) |
              (page_state_is(&pg[i], offlining)
               ? PGC_state_offlined : PGC_state_free));
         if ( page_state_is(&pg[i], offlined) )
             tainted = 1;
-
-        /* If a page has no owner it will need no safety TLB flush. */
-        pg[i].u.free.need_tlbflush = (page_get_owner(&pg[i]) != NULL);
-        if ( pg[i].u.free.need_tlbflush )
-            pg[i].tlbflush_timestamp = tlbflush_current_time();
-
-        /* This page is not a guest frame any more. */
-        page_set_owner(&pg[i], NULL); /* set_gpfn_from_mfn snoops pg owner */
-        set_gpfn_from_mfn(mfn + i, INVALID_M2P_ENTRY);
+        if ( pg[i].count_info & PGC_need_scrub )
+        {
+            node_need_scrub[node]++;
+            dirty = true;
+        }
     }
 
     avail[node][zone] += 1 << order;
@@ -989,6 +1418,7 @@ static void free_heap_pages(
                  (phys_to_nid(page_to_maddr(pg-mask)) != node) )
                 break;
             pg -= mask;
+            dirty |= pg->u.free.dirty;
             page_list_del(pg, &heap(node, zone, order));
         }
         else
@@ -999,18 +1429,43 @@ static void free_heap_pages(
                  (PFN_ORDER(pg+mask) != order) ||
                  (phys_to_nid(page_to_maddr(pg+mask)) != node) )
                 break;
+            dirty |= pg[mask].u.free.dirty;
             page_list_del(pg + mask, &heap(node, zone, order));
         }
 
         order++;
     }
 
-    PFN_ORDER(pg) = order;
-    page_list_add_tail(pg, &heap(node, zone, order));
+    page_list_add_scrub(pg, node, zone, order, dirty);
 
     if ( tainted )
         reserve_offlined_page(pg);
+}
 
+/* Free 2^@order set of pages, optionally deferring their scrubbing. */
+static void free_heap_pages(
+    struct page_info *pg, unsigned int order, bool need_scrub)
+{
+    unsigned long mfn = page_to_mfn(pg);
+    unsigned int i;
+
+    for ( i = 0; i < (1 << order); i++ )
+    {
+        /* If a page has no owner it will need no safety TLB flush. */
+        pg[i].u.free.need_tlbflush = (page_get_owner(&pg[i]) != NULL);
+        if ( pg[i].u.free.need_tlbflush )
+            pg[i].tlbflush_timestamp = tlbflush_current_time();
+
+        /* This page is not a guest frame any more. */
+        page_set_owner(&pg[i], NULL); /* set_gpfn_from_mfn snoops pg owner */
+        set_gpfn_from_mfn(mfn + i, INVALID_M2P_ENTRY);
+    }
+
+    if ( order == 0 && !need_scrub && pcp_free_page(pg) )
+        return;
+
+    spin_lock(&heap_lock);
+    free_heap_pages_locked(pg, order, need_scrub);
     spin_unlock(&heap_lock);
 }
 
@@ -1231,7 +1686,7 @@ unsigned int online_page(unsigned long mfn, uint32_t *status)
     spin_unlock(&heap_lock);
 
     if ( (y & PGC_state) == PGC_state_offlined )
-        free_heap_pages(pg, 0);
+        free_heap_pages(pg, 0, false);
 
     return ret;
 }
@@ -1270,7 +1725,7 @@ int query_page_offline(unsigned long mfn, uint32_t *status)
  * not freeing it to the buddy allocator.
  */
 static void init_heap_pages(
-    struct page_info *pg, unsigned long nr_pages)
+    struct page_info *pg, unsigned long nr_pages, bool need_scrub)
 {
     unsigned long i;
 
@@ -1300,7 +1755,7 @@ static void init_heap_pages(
             nr_pages -= n;
         }
 
-        free_heap_pages(pg+i, 0);
+        free_heap_pages(pg+i, 0, need_scrub);
     }
 }
 
@@ -1327,13 +1782,16 @@ static unsigned long avail_heap_pages(
 
 unsigned long total_free_pages(void)
 {
-    return total_avail_pages - midsize_alloc_zone_pages;
+    return total_avail_pages + atomic_read(&pcp_total_pages) -
+           midsize_alloc_zone_pages;
 }
 
 void __init end_boot_allocator(void)
 {
     unsigned int i;
 
+    bool need_scrub = (opt_bootscrub == BOOTSCRUB_IDLE);
+
     /* Pages that are free now go to the domain sub-allocator. */
     for ( i = 0; i < nr_bootmem_regions; i++ )
     {
@@ -1341,7 +1799,7 @@ void __init end_boot_allocator(void)
         if ( (r->s < r->e) &&
              (phys_to_nid(pfn_to_paddr(r->s)) == cpu_to_node(0)) )
         {
-            init_heap_pages(mfn_to_page(r->s), r->e - r->s);
+            init_heap_pages(mfn_to_page(r->s), r->e - r->s, need_scrub);
             r->e = r->s;
             break;
         }
@@ -1350,10 +1808,10 @@ void __init end_boot_allocator(void)
     {
         struct bootmem_region *r = &bootmem_region_list[i];
         if ( r->s < r->e )
-            init_heap_pages(mfn_to_page(r->s), r->e - r->s);
+            init_heap_pages(mfn_to_page(r->s), r->e - r->s, need_scrub);
     }
     nr_bootmem_regions = 0;
-    init_heap_pages(virt_to_page(bootmem_region_list), 1);
+    init_heap_pages(virt_to_page(bootmem_region_list), 1, need_scrub);
 
     if ( !dma_bitsize && (num_online_nodes() > 1) )
         dma_bitsize = arch_get_dma_bitsize();
@@ -1448,8 +1906,9 @@ void __init scrub_heap_pages(void)
     int last_distance, best_node;
     int cpus;
 
-    if ( !opt_bootscrub )
-        return;
+    /* With bootscrub=idle the pages were flagged for the idle scrubber. */
+    if ( opt_bootscrub != BOOTSCRUB_ON )
+        goto out;
 
     cpumask_clear(&all_worker_cpus);
     /* Scrub block size. */
@@ -1569,6 +2028,10 @@ void __init scrub_heap_pages(void)
     /* Now that the heap is initialized, run checks and set bounds
      * for the low mem virq algorithm. */
     setup_low_mem_virq();
+
+ out:
+    /* Free pages may be cached per-CPU from now on. */
+    pcp_enabled = !!opt_pcp_high;
 }
 
 
@@ -1597,7 +2060,7 @@ void init_xenheap_pages(paddr_t ps, paddr_t pe)
 
     memguard_guard_range(maddr_to_virt(ps), pe - ps);
 
-    init_heap_pages(maddr_to_page(ps), (pe - ps) >> PAGE_SHIFT);
+    init_heap_pages(maddr_to_page(ps), (pe - ps) >> PAGE_SHIFT, false);
 }
 
 
@@ -1627,7 +2090,7 @@ void free_xenheap_pages(void *v, unsigned int order)
 
     memguard_guard_range(v, 1 << (order + PAGE_SHIFT));
 
-    free_heap_pages(virt_to_page(v), order);
+    free_heap_pages(virt_to_page(v), order, false);
 }
 
 #else
@@ -1681,12 +2144,9 @@ void free_xenheap_pages(void *v, unsigned int order)
     pg = virt_to_page(v);
 
     for ( i = 0; i < (1u << order); i++ )
-    {
-        scrub_one_page(&pg[i]);
         pg[i].count_info &= ~PGC_xen_heap;
-    }
 
-    free_heap_pages(pg, order);
+    free_heap_pages(pg, order, true);
 }
 
 #endif
@@ -1709,7 +2169,7 @@ void init_domheap_pages(paddr_t ps, paddr_t pe)
     if ( emfn <= smfn )
         return;
 
-    init_heap_pages(mfn_to_page(smfn), emfn - smfn);
+    init_heap_pages(mfn_to_page(smfn), emfn - smfn, false);
 }
 
 
@@ -1795,7 +2255,7 @@ struct page_info *alloc_domheap_pages(
     if ( d && !(memflags & MEMF_no_owner) &&
          assign_pages(d, pg, order, memflags) )
     {
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, false);
         return NULL;
     }
     
@@ -1863,11 +2323,7 @@ void free_domheap_pages(struct page_info *pg, unsigned int order)
             scrub = 1;
         }
 
-        if ( unlikely(scrub) )
-            for ( i = 0; i < (1 << order); i++ )
-                scrub_one_page(&pg[i]);
-
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, scrub);
     }
 
     if ( drop_dom_ref )
@@ -1926,6 +2382,8 @@ static void pagealloc_info(unsigned char key)
     }
 
     printk("    Dom heap: %lukB free\n", total << (PAGE_SHIFT-10));
+    printk("    Per-CPU caches: %lukB\n",
+           (unsigned long)atomic_read(&pcp_total_pages) << (PAGE_SHIFT-10));
 }
 
 static __init int pagealloc_keyhandler_init(void)
@@ -1936,6 +2394,98 @@ static __init int pagealloc_keyhandler_init(void)
 __initcall(pagealloc_keyhandler_init);
 
 
+/* Pick the node whose free memory this CPU should scrub in idle time. */
+static nodeid_t node_to_scrub(unsigned int cpu)
+{
+    nodeid_t node = cpu_to_node(cpu);
+
+    if ( node < MAX_NUMNODES && node_need_scrub[node] )
+        return node;
+
+    /* Help out with nodes which have no CPUs of their own. */
+    for_each_online_node ( node )
+        if ( node_need_scrub[node] && cpumask_empty(&node_to_cpumask(node)) )
+            return node;
+
+    return NUMA_NO_NODE;
+}
+
+/*
+ * Scrub a chunk of free memory which was freed without being scrubbed.
+ * Called from the idle loop; returns true if more scrubbing remains to be
+ * done, in which case the CPU should not go to sleep.
+ */
+bool scrub_free_pages(void)
+{
+    unsigned int cpu = smp_processor_id(), zone, order = 0, i;
+    unsigned long dirty_pages = 0;
+    struct page_info *pg;
+    nodeid_t node = node_to_scrub(cpu);
+    bool more;
+
+    if ( node == NUMA_NO_NODE )
+        return false;
+
+    spin_lock(&heap_lock);
+
+    /* Dirty chunks sit at the tail of the free lists. */
+    for ( zone = NR_ZONES; zone-- > 0; )
+        for ( order = MAX_ORDER + 1; order-- > 0; )
+        {
+            if ( page_list_empty(&heap(node, zone, order)) )
+                continue;
+            pg = page_list_last(&heap(node, zone, order));
+            if ( pg->u.free.dirty )
+                goto found;
+        }
+
+    spin_unlock(&heap_lock);
+    return false;
+
+ found:
+    /* Take a bounded piece of the chunk off the heap whilst scrubbing it. */
+    page_list_del(pg, &heap(node, zone, order));
+    pg = split_heap_block(pg, node, zone, order,
+                          min_t(unsigned int, order, SCRUB_CHUNK_ORDER));
+    order = min_t(unsigned int, order, SCRUB_CHUNK_ORDER);
+
+    for ( i = 0; i < (1U << order); i++ )
+    {
+        ASSERT((pg[i].count_info & ~PGC_need_scrub) == PGC_state_free);
+        if ( pg[i].count_info & PGC_need_scrub )
+            dirty_pages++;
+        pg[i].count_info = PGC_state_inuse |
+                           (pg[i].count_info & PGC_need_scrub);
+    }
+
+    avail[node][zone] -= 1UL << order;
+    total_avail_pages -= 1UL << order;
+    node_need_scrub[node] -= dirty_pages;
+
+    spin_unlock(&heap_lock);
+
+    for ( i = 0; i < (1U << order); i++ )
+    {
+        if ( pg[i].count_info & PGC_need_scrub )
+        {
+            scrub_one_page(&pg[i]);
+            clear_bit(_PGC_need_scrub, &pg[i].count_info);
+            perfc_incr(page_scrub_idle);
+        }
+
+        /* Pages not yet scrubbed go back still flagged. */
+        if ( softirq_pending(cpu) )
+            break;
+    }
+
+    spin_lock(&heap_lock);
+    free_heap_pages_locked(pg, order, false);
+    more = !!node_need_scrub[node];
+    spin_unlock(&heap_lock);
+
+    return more;
+}
+
 void scrub_one_page(struct page_info *pg)
 {
     if ( unlikely(pg->count_info & PGC_broken) )
@@ -1965,6 +2515,7 @@ static void dump_heap(unsigned char key)
         for ( j = 0; j < NR_ZONES; j++ )
             printk("heap[node=%d][zone=%d] -> %lu pages\n",
                    i, j, avail[i][j]);
+        printk("heap[node=%d] -> %lu pages to scrub\n", i, node_need_scrub[i]);
     }
 }
 
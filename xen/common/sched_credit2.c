@@ -25,6 +25,7 @@
 #include <xen/trace.h>
 #include <xen/cpu.h>
 #include <xen/keyhandler.h>
+#include <xen/rbtree.h>
 
 /* Meant only for helping developers during debugging. */
 /* #define d2printk printk */
@@ -57,6 +58,7 @@
 #define TRC_CSCHED2_SCHEDULE         TRC_SCHED_CLASS_EVT(CSCHED2, 21)
 #define TRC_CSCHED2_RATELIMIT        TRC_SCHED_CLASS_EVT(CSCHED2, 22)
 #define TRC_CSCHED2_RUNQ_CAND_CHECK  TRC_SCHED_CLASS_EVT(CSCHED2, 23)
+#define TRC_CSCHED2_PLACEMENT        TRC_SCHED_CLASS_EVT(CSCHED2, 24)
 
 /*
  * WARNING: This is still in an experimental phase.  Status and work can be found at the
@@ -71,7 +73,7 @@
  *  - "Mixed work" problem: if a VM is playing audio (5%) but also burning cpu (e.g.,
  *    a flash animation in the background) can we schedule it with low enough latency
  *    so that audio doesn't skip?
- *  - Cap and reservation: How to implement with the current system?
+ *  - Reservation: How to implement with the current system?
  * + Optimizing
  *  - Profiling, making new algorithms, making math more efficient (no long division)
  */
@@ -89,6 +91,13 @@
  * Credits are "reset" when the next vcpu in the runqueue is less than
  * or equal to zero.  At that point, everyone's credits are "clipped"
  * to a small value, and a fixed credit is added to everyone.
+ *
+ * Caps are enforced with a budget: a capped domain is given cap% of
+ * CSCHED2_BDGT_REPL_PERIOD of execution time every period, by a timer.
+ * Its vcpus take chunks of it before they run, burn them as they do, and
+ * give back what's left when they stop.  A vcpu that finds no budget left
+ * is "parked": it is not runnable (_VPF_parked) until the next
+ * replenishment.  Overruns are taken out of the next period's budget.
  */
 
 /*
@@ -112,6 +121,10 @@
  *     runqueue each cpu is;
  *  + serializes the operation of changing the weights of domains;
  *
+ * - Budget lock
+ *  + it is per-domain;
+ *  + protects the domain's budget and its list of parked vcpus;
+ *
  * - Type:
  *  + runqueue locks are 'regular' spinlocks;
  *  + the private scheduler lock can be an rwlock. In fact, data
@@ -123,7 +136,10 @@
  *  + tylock must be used when wanting to take a runqueue lock,
  *    if we already hold another one;
  *  + if taking both a runqueue lock and the private scheduler
- *    lock is, the latter must always be taken for first.
+ *    lock is, the latter must always be taken for first;
+ *  + the budget lock nests inside the runqueue lock: parked vcpus are
+ *    taken off the domain's list before their runqueue lock is taken to
+ *    unpark them.
  */
 
 /*
@@ -164,6 +180,8 @@
 #define CSCHED2_CREDIT_RESET         0
 /* Max timer: Maximum time a guest can be run for. */
 #define CSCHED2_MAX_TIMER            CSCHED2_CREDIT_INIT
+/* Period of the replenishment of the budget of capped domains. */
+#define CSCHED2_BDGT_REPL_PERIOD     MILLISECS(10)
 
 /*
  * Flags
@@ -294,6 +312,22 @@ integer_param("credit2_balance_under", opt_underload_balance_tolerance);
 static int __read_mostly opt_overload_balance_tolerance = -3;
 integer_param("credit2_balance_over", opt_overload_balance_tolerance);
 
+/*
+ * Placement costs.
+ *
+ * When picking a runqueue for a vcpu, and when deciding whether moving it
+ * helps balancing the load, a runqueue with none of its pcpus in the vcpu's
+ * soft affinity, and/or none of them on the NUMA nodes where the domain has
+ * its memory (i.e., in d->node_affinity), is considered more loaded than it
+ * actually is. How much more is expressed in percent of the load of one
+ * fully busy pcpu. Setting both to 0 makes runqueue selection and balancing
+ * purely load based again.
+ */
+static unsigned int __read_mostly opt_soft_affinity_cost = 25;
+integer_param("credit2_balance_soft_cost", opt_soft_affinity_cost);
+static unsigned int __read_mostly opt_numa_cost = 50;
+integer_param("credit2_balance_numa_cost", opt_numa_cost);
+
 /*
  * Runqueue organization.
  *
@@ -359,8 +393,9 @@ struct csched2_runqueue_data {
 
     spinlock_t lock;      /* Lock for this runqueue. */
     cpumask_t active;      /* CPUs enabled for this runqueue */
+    nodemask_t nodes;      /* NUMA nodes the CPUs in active are on */
 
-    struct list_head runq; /* Ordered list of runnable vms */
+    struct rb_root runq;   /* Runnable vcpus, by decreasing credit */
     struct list_head svc;  /* List of all vcpus assigned to this runqueue */
     unsigned int max_weight;
 
@@ -396,7 +431,7 @@ struct csched2_private {
  */
 struct csched2_vcpu {
     struct list_head rqd_elem;         /* On the runqueue data list  */
-    struct list_head runq_elem;        /* On the runqueue            */
+    struct rb_node runq_elem;          /* On the runqueue            */
     struct csched2_runqueue_data *rqd; /* Up-pointer to the runqueue */
 
     /* Up-pointers */
@@ -411,6 +446,9 @@ struct csched2_vcpu {
     unsigned flags;      /* 16 bits doesn't seem to play well with clear_bit() */
     int tickled_cpu;     /* cpu tickled for picking us up (-1 if none) */
 
+    s_time_t budget;     /* Budget to run for, STIME_MAX if not capped */
+    struct list_head parked_elem; /* On the domain's parked vcpus list */
+
     /* Individual contribution to load */
     s_time_t load_last_update;  /* Last time average was updated */
     s_time_t avgload;           /* Decaying queue load */
@@ -426,6 +464,14 @@ struct csched2_dom {
     struct domain *dom;
     uint16_t weight;
     uint16_t nr_vcpus;
+
+    uint16_t cap;                  /* Cap, in % of a pcpu, 0 if none */
+    spinlock_t budget_lock;
+    s_time_t budget;               /* Budget left in this period */
+    s_time_t tot_budget;           /* Budget given every period */
+    s_time_t next_repl;            /* Time of the next replenishment */
+    struct timer repl_timer;
+    struct list_head parked_vcpus; /* Vcpus waiting for budget */
 };
 
 /*
@@ -596,12 +642,17 @@ static s_time_t c2t(struct csched2_runqueue_data *rqd, s_time_t credit, struct c
 
 static inline int vcpu_on_runq(struct csched2_vcpu *svc)
 {
-    return !list_empty(&svc->runq_elem);
+    return !RB_EMPTY_NODE(&svc->runq_elem);
 }
 
-static inline struct csched2_vcpu * runq_elem(struct list_head *elem)
+static inline struct csched2_vcpu * runq_elem(struct rb_node *elem)
 {
-    return list_entry(elem, struct csched2_vcpu, runq_elem);
+    return rb_entry(elem, struct csched2_vcpu, runq_elem);
+}
+
+static inline bool has_cap(const struct csched2_vcpu *svc)
+{
+    return svc->budget != STIME_MAX;
 }
 
 static void activate_runqueue(struct csched2_private *prv, int rqi)
@@ -615,7 +666,8 @@ static void activate_runqueue(struct csched2_private *prv, int rqi)
     rqd->max_weight = 1;
     rqd->id = rqi;
     INIT_LIST_HEAD(&rqd->svc);
-    INIT_LIST_HEAD(&rqd->runq);
+    rqd->runq = RB_ROOT;
+    nodes_clear(rqd->nodes);
     spin_lock_init(&rqd->lock);
 
     __cpumask_set_cpu(rqi, &prv->active_queues);
@@ -1073,10 +1125,9 @@ update_load(const struct scheduler *ops,
 static void
 runq_insert(const struct scheduler *ops, struct csched2_vcpu *svc)
 {
-    struct list_head *iter;
+    struct rb_node **link, *parent = NULL;
     unsigned int cpu = svc->vcpu->processor;
-    struct list_head * runq = &c2rqd(ops, cpu)->runq;
-    int pos = 0;
+    struct rb_root *runq = &c2rqd(ops, cpu)->runq;
 
     ASSERT(spin_is_locked(per_cpu(schedule_data, cpu).schedule_lock));
 
@@ -1088,16 +1139,20 @@ runq_insert(const struct scheduler *ops, struct csched2_vcpu *svc)
     ASSERT(!svc->vcpu->is_running);
     ASSERT(!(svc->flags & CSFLAG_scheduled));
 
-    list_for_each( iter, runq )
+    /*
+     * Vcpus with the same credit are kept in the order they were inserted
+     * in, so svc goes after them.
+     */
+    for ( link = &runq->rb_node; *link; )
     {
-        struct csched2_vcpu * iter_svc = runq_elem(iter);
-
-        if ( svc->credit > iter_svc->credit )
-            break;
-
-        pos++;
+        parent = *link;
+        if ( svc->credit > runq_elem(parent)->credit )
+            link = &parent->rb_left;
+        else
+            link = &parent->rb_right;
     }
-    list_add_tail(&svc->runq_elem, iter);
+    rb_link_node(&svc->runq_elem, parent, link);
+    rb_insert_color(&svc->runq_elem, runq);
 
     if ( unlikely(tb_init_done) )
     {
@@ -1105,9 +1160,14 @@ runq_insert(const struct scheduler *ops, struct csched2_vcpu *svc)
             unsigned vcpu:16, dom:16;
             unsigned pos;
         } d;
+        struct rb_node *iter;
+
+        /* Only worth counting the position if someone is looking at it. */
+        d.pos = 0;
+        for ( iter = rb_prev(&svc->runq_elem); iter; iter = rb_prev(iter) )
+            d.pos++;
         d.dom = svc->vcpu->domain->domain_id;
         d.vcpu = svc->vcpu->vcpu_id;
-        d.pos = pos;
         __trace_var(TRC_CSCHED2_RUNQ_POS, 1,
                     sizeof(d),
                     (unsigned char *)&d);
@@ -1117,7 +1177,8 @@ runq_insert(const struct scheduler *ops, struct csched2_vcpu *svc)
 static inline void runq_remove(struct csched2_vcpu *svc)
 {
     ASSERT(vcpu_on_runq(svc));
-    list_del_init(&svc->runq_elem);
+    rb_erase(&svc->runq_elem, &svc->rqd->runq);
+    RB_CLEAR_NODE(&svc->runq_elem);
 }
 
 void burn_credits(struct csched2_runqueue_data *rqd, struct csched2_vcpu *, s_time_t);
@@ -1413,6 +1474,8 @@ void burn_credits(struct csched2_runqueue_data *rqd,
     {
         SCHED_STAT_CRANK(burn_credits_t2c);
         t2c_update(rqd, delta, svc);
+        if ( has_cap(svc) )
+            svc->budget -= delta;
         svc->start_time = now;
     }
     else if ( delta < 0 )
@@ -1437,6 +1500,175 @@ void burn_credits(struct csched2_runqueue_data *rqd,
     }
 }
 
+/*
+ * Make sure a capped vcpu has some budget to run with, taking it from its
+ * domain.  If there is none left, park the vcpu and return false.  The
+ * caller must take a parked vcpu off the runqueue, if it's on it.
+ */
+static bool vcpu_grab_budget(struct csched2_vcpu *svc)
+{
+    struct csched2_dom *sdom = svc->sdom;
+
+    ASSERT(spin_is_locked(per_cpu(schedule_data,
+                                  svc->vcpu->processor).schedule_lock));
+    ASSERT(has_cap(svc));
+
+    if ( svc->budget > 0 )
+        return true;
+
+    spin_lock(&sdom->budget_lock);
+
+    /* Any overrun of this vcpu is charged to the domain. */
+    sdom->budget += svc->budget;
+    svc->budget = 0;
+
+    if ( sdom->budget > 0 )
+    {
+        /*
+         * Each vcpu takes its share of the domain's budget, and is back for
+         * more if it uses it up.  Don't let the shares get too small to be
+         * worth a schedule.
+         */
+        s_time_t quota = max_t(s_time_t,
+                               sdom->tot_budget /
+                               max_t(unsigned int, sdom->nr_vcpus, 1),
+                               CSCHED2_MIN_TIMER);
+
+        svc->budget = min(quota, sdom->budget);
+        sdom->budget -= svc->budget;
+    }
+    else
+    {
+        list_add(&svc->parked_elem, &sdom->parked_vcpus);
+        set_bit(_VPF_parked, &svc->vcpu->pause_flags);
+        SCHED_STAT_CRANK(vcpu_parked);
+    }
+
+    spin_unlock(&sdom->budget_lock);
+
+    return svc->budget > 0;
+}
+
+/*
+ * Give the budget a vcpu has not used back to its domain.  If there is
+ * budget left for them, move the parked vcpus of the domain to parked, for
+ * the caller to unpark them once it has released the runqueue lock.
+ */
+static void vcpu_return_budget(struct csched2_vcpu *svc,
+                               struct list_head *parked)
+{
+    struct csched2_dom *sdom = svc->sdom;
+
+    ASSERT(has_cap(svc));
+
+    spin_lock(&sdom->budget_lock);
+
+    sdom->budget += svc->budget;
+    svc->budget = 0;
+
+    if ( sdom->budget > 0 )
+        list_splice_init(&sdom->parked_vcpus, parked);
+
+    spin_unlock(&sdom->budget_lock);
+}
+
+/*
+ * Unpark the vcpus on vcpus, a list private to the caller.  They are only
+ * taken off it with both their runqueue lock and the budget lock held, as
+ * csched2_vcpu_remove() may take them off it in the meantime.
+ */
+static void unpark_parked_vcpus(struct csched2_dom *sdom,
+                                struct list_head *vcpus)
+{
+    /* Nothing to do (and sdom may be NULL, for the idle vcpu). */
+    if ( list_empty(vcpus) )
+        return;
+
+    for ( ; ; )
+    {
+        const struct scheduler *ops;
+        struct csched2_vcpu *svc;
+        struct vcpu *v;
+        unsigned long flags;
+        spinlock_t *lock;
+
+        spin_lock_irqsave(&sdom->budget_lock, flags);
+        svc = list_empty(vcpus) ? NULL
+              : list_first_entry(vcpus, struct csched2_vcpu, parked_elem);
+        v = svc ? svc->vcpu : NULL;
+        spin_unlock_irqrestore(&sdom->budget_lock, flags);
+
+        if ( !v )
+            break;
+
+        lock = vcpu_schedule_lock_irqsave(v, &flags);
+
+        spin_lock(&sdom->budget_lock);
+        if ( list_empty(vcpus) ||
+             list_first_entry(vcpus, struct csched2_vcpu,
+                              parked_elem) != svc )
+        {
+            /* Removed from the scheduler in the meantime. */
+            spin_unlock(&sdom->budget_lock);
+            vcpu_schedule_unlock_irqrestore(lock, flags, v);
+            continue;
+        }
+        list_del_init(&svc->parked_elem);
+        spin_unlock(&sdom->budget_lock);
+
+        clear_bit(_VPF_parked, &v->pause_flags);
+        SCHED_STAT_CRANK(vcpu_unparked);
+
+        /* As in csched2_vcpu_wake(), which won't see it as it's not asleep. */
+        ops = per_cpu(scheduler, v->processor);
+        if ( unlikely(svc->flags & CSFLAG_scheduled) )
+            __set_bit(__CSFLAG_delayed_runq_add, &svc->flags);
+        else if ( vcpu_runnable(v) && svc->rqd )
+        {
+            s_time_t now = NOW();
+
+            ASSERT(!vcpu_on_runq(svc));
+            update_load(ops, svc->rqd, svc, 1, now);
+            runq_insert(ops, svc);
+            runq_tickle(ops, svc, now);
+        }
+
+        vcpu_schedule_unlock_irqrestore(lock, flags, v);
+    }
+}
+
+static void replenish_domain_budget(void *data)
+{
+    struct csched2_dom *sdom = data;
+    unsigned long flags;
+    s_time_t now;
+    LIST_HEAD(parked);
+
+    spin_lock_irqsave(&sdom->budget_lock, flags);
+
+    if ( !sdom->cap )
+    {
+        spin_unlock_irqrestore(&sdom->budget_lock, flags);
+        return;
+    }
+
+    /* Unused budget doesn't carry over, overruns do. */
+    sdom->budget = min_t(s_time_t, sdom->budget, 0) + sdom->tot_budget;
+
+    now = NOW();
+    do {
+        sdom->next_repl += CSCHED2_BDGT_REPL_PERIOD;
+    } while ( sdom->next_repl <= now );
+    set_timer(&sdom->repl_timer, sdom->next_repl);
+
+    if ( sdom->budget > 0 )
+        list_splice_init(&sdom->parked_vcpus, &parked);
+
+    spin_unlock_irqrestore(&sdom->budget_lock, flags);
+
+    unpark_parked_vcpus(sdom, &parked);
+}
+
 #ifndef NDEBUG
 static inline void
 csched2_vcpu_check(struct vcpu *vc)
@@ -1473,7 +1705,8 @@ csched2_alloc_vdata(const struct scheduler *ops, struct vcpu *vc, void *dd)
         return NULL;
 
     INIT_LIST_HEAD(&svc->rqd_elem);
-    INIT_LIST_HEAD(&svc->runq_elem);
+    RB_CLEAR_NODE(&svc->runq_elem);
+    INIT_LIST_HEAD(&svc->parked_elem);
 
     svc->sdom = dd;
     svc->vcpu = vc;
@@ -1487,12 +1720,14 @@ csched2_alloc_vdata(const struct scheduler *ops, struct vcpu *vc, void *dd)
         /* Starting load of 50% */
         svc->avgload = 1ULL << (csched2_priv(ops)->load_precision_shift - 1);
         svc->load_last_update = NOW() >> LOADAVG_GRANULARITY_SHIFT;
+        svc->budget = svc->sdom->cap ? 0 : STIME_MAX;
     }
     else
     {
         ASSERT(svc->sdom == NULL);
         svc->credit = CSCHED2_IDLE_CREDIT;
         svc->weight = 0;
+        svc->budget = STIME_MAX;
     }
     svc->tickled_cpu = -1;
 
@@ -1592,6 +1827,7 @@ csched2_context_saved(const struct scheduler *ops, struct vcpu *vc)
     struct csched2_vcpu * const svc = csched2_vcpu(vc);
     spinlock_t *lock = vcpu_schedule_lock_irq(vc);
     s_time_t now = NOW();
+    LIST_HEAD(were_parked);
 
     BUG_ON( !is_idle_vcpu(vc) && svc->rqd != c2rqd(ops, vc->processor));
     ASSERT(is_idle_vcpu(vc) || svc->rqd == c2rqd(ops, vc->processor));
@@ -1618,10 +1854,126 @@ csched2_context_saved(const struct scheduler *ops, struct vcpu *vc)
     else if ( !is_idle_vcpu(vc) )
         update_load(ops, svc->rqd, svc, -1, now);
 
+    /* It's off the pcpu: let other vcpus of the domain use its budget. */
+    if ( has_cap(svc) )
+        vcpu_return_budget(svc, &were_parked);
+
     vcpu_schedule_unlock_irq(lock, vc);
+
+    if ( !list_empty(&were_parked) )
+        unpark_parked_vcpus(svc->sdom, &were_parked);
+}
+
+/*
+ * Soft affinity and NUMA locality.
+ *
+ * A runqueue is "soft-affine" to a vcpu if at least one of its pcpus is in
+ * the vcpu's soft affinity (or if the vcpu has no meaningful soft affinity
+ * at all), and it is "memory-local" if at least one of its pcpus is on one
+ * of the nodes of the domain's node affinity, i.e., where memory for the
+ * domain is allocated from.
+ *
+ * d->node_affinity is read without taking d->node_affinity_lock: it changes
+ * very rarely, and a stale value only means one sub-optimal placement.
+ */
+static inline bool_t rqd_soft_affine(const struct csched2_runqueue_data *rqd,
+                                     const struct vcpu *v)
+{
+    return !has_soft_affinity(v, v->cpu_hard_affinity) ||
+           cpumask_intersects(v->cpu_soft_affinity, &rqd->active);
 }
 
-#define MAX_LOAD (STIME_MAX);
+static inline bool_t rqd_mem_local(const struct csched2_runqueue_data *rqd,
+                                   const struct domain *d)
+{
+    return nodes_intersects(rqd->nodes, d->node_affinity);
+}
+
+/*
+ * How much load (in the same fixed point format of the runqueue loads) we
+ * pretend rqd to have on top of its actual one, when considering whether to
+ * put svc there. See opt_soft_affinity_cost and opt_numa_cost.
+ */
+static s_time_t placement_cost(const struct csched2_private *prv,
+                               const struct csched2_vcpu *svc,
+                               const struct csched2_runqueue_data *rqd)
+{
+    s_time_t cost = 0;
+
+    if ( !rqd_soft_affine(rqd, svc->vcpu) )
+        cost += opt_soft_affinity_cost;
+    if ( !rqd_mem_local(rqd, svc->vcpu->domain) )
+        cost += opt_numa_cost;
+
+    return (cost << prv->load_precision_shift) / 100;
+}
+
+/*
+ * Pick a pcpu for v among the ones in mask (which must not be empty, and is
+ * trashed). We restrict ourselves to v's soft affinity, if that makes sense,
+ * and then prefer, in this order: v's current pcpu, if on one of the nodes
+ * of the domain's node affinity; any other pcpu on one of such nodes; v's
+ * current pcpu anyway; any pcpu.
+ */
+static unsigned int pick_cpu_in_mask(const struct vcpu *v, cpumask_t *mask)
+{
+    const struct domain *d = v->domain;
+    unsigned int cpu;
+
+    ASSERT(!cpumask_empty(mask));
+
+    if ( has_soft_affinity(v, mask) )
+        cpumask_and(mask, mask, v->cpu_soft_affinity);
+
+    if ( cpumask_test_cpu(v->processor, mask) &&
+         node_isset(cpu_to_node(v->processor), d->node_affinity) )
+        return v->processor;
+
+    for_each_cpu ( cpu, mask )
+        if ( node_isset(cpu_to_node(cpu), d->node_affinity) )
+            return cpu;
+
+    if ( cpumask_test_cpu(v->processor, mask) )
+        return v->processor;
+
+    return cpumask_any(mask);
+}
+
+/*
+ * Account for v having been placed on cpu: whether that is outside of its
+ * soft affinity, or far from its memory, is counted and traced, so that the
+ * effectiveness of the placement costs can be assessed.
+ */
+static void account_placement(const struct vcpu *v, unsigned int cpu)
+{
+    bool_t mem_local = node_isset(cpu_to_node(cpu), v->domain->node_affinity);
+    bool_t soft_affine = !has_soft_affinity(v, v->cpu_hard_affinity) ||
+                         cpumask_test_cpu(cpu, v->cpu_soft_affinity);
+
+    if ( !mem_local )
+        SCHED_STAT_CRANK(placed_mem_remote);
+    if ( !soft_affine )
+        SCHED_STAT_CRANK(placed_not_soft_affine);
+
+    if ( unlikely(tb_init_done) )
+    {
+        struct {
+            unsigned vcpu:16, dom:16;
+            unsigned cpu:16, node:8, mem_local:4, soft_affine:4;
+        } d;
+        d.dom = v->domain->domain_id;
+        d.vcpu = v->vcpu_id;
+        d.cpu = cpu;
+        d.node = cpu_to_node(cpu);
+        d.mem_local = mem_local;
+        d.soft_affine = soft_affine;
+        __trace_var(TRC_CSCHED2_PLACEMENT, 1,
+                    sizeof(d),
+                    (unsigned char *)&d);
+    }
+}
+
+#define MAX_LOAD (STIME_MAX)
 static int
 csched2_cpu_pick(const struct scheduler *ops, struct vcpu *vc)
 {
@@ -1679,13 +2031,16 @@ csched2_cpu_pick(const struct scheduler *ops, struct vcpu *vc)
         {
             cpumask_and(cpumask_scratch_cpu(cpu), cpumask_scratch_cpu(cpu),
                         &svc->migrate_rqd->active);
-            new_cpu = cpumask_any(cpumask_scratch_cpu(cpu));
+            new_cpu = pick_cpu_in_mask(vc, cpumask_scratch_cpu(cpu));
             goto out_up;
         }
         /* Fall-through to normal cpu pick */
     }
 
-    /* Find the runqueue with the lowest average load. */
+    /*
+     * Find the runqueue with the lowest average load, once the cost of
+     * running far from our soft affinity and from our memory is added.
+     */
     for_each_cpu(i, &prv->active_queues)
     {
         struct csched2_runqueue_data *rqd;
@@ -1719,6 +2074,9 @@ csched2_cpu_pick(const struct scheduler *ops, struct vcpu *vc)
             spin_unlock(&rqd->lock);
         }
 
+        if ( rqd_avgload != MAX_LOAD )
+            rqd_avgload += placement_cost(prv, svc, rqd);
+
         if ( rqd_avgload < min_avgload )
         {
             min_avgload = rqd_avgload;
@@ -1737,12 +2095,14 @@ csched2_cpu_pick(const struct scheduler *ops, struct vcpu *vc)
 
     cpumask_and(cpumask_scratch_cpu(cpu), cpumask_scratch_cpu(cpu),
                 &prv->rqd[min_rqi].active);
-    new_cpu = cpumask_any(cpumask_scratch_cpu(cpu));
+    new_cpu = pick_cpu_in_mask(vc, cpumask_scratch_cpu(cpu));
     BUG_ON(new_cpu >= nr_cpu_ids);
 
  out_up:
     read_unlock(&prv->lock);
  out:
+    account_placement(vc, new_cpu);
+
     if ( unlikely(tb_init_done) )
     {
         struct {
@@ -1769,6 +2129,7 @@ typedef struct {
     s_time_t load_delta;
     struct csched2_vcpu * best_push_svc, *best_pull_svc;
     /* NB: Read by consider() */
+    const struct csched2_private *prv;
     struct csched2_runqueue_data *lrqd;
     struct csched2_runqueue_data *orqd;                  
 } balance_state_t;
@@ -1798,6 +2159,17 @@ static void consider(balance_state_t *st,
     if ( delta < 0 )
         delta = -delta;
 
+    /*
+     * Moving a vcpu away from its soft affinity or its memory makes things
+     * worse, moving it toward them makes things better: account for both.
+     */
+    if ( push_svc )
+        delta += placement_cost(st->prv, push_svc, st->orqd) -
+                 placement_cost(st->prv, push_svc, st->lrqd);
+    if ( pull_svc )
+        delta += placement_cost(st->prv, pull_svc, st->lrqd) -
+                 placement_cost(st->prv, pull_svc, st->orqd);
+
     if ( delta < st->load_delta )
     {
         st->load_delta = delta;
@@ -1854,8 +2226,10 @@ static void migrate(const struct scheduler *ops,
                     cpupool_domain_cpumask(svc->vcpu->domain));
         cpumask_and(cpumask_scratch_cpu(cpu), cpumask_scratch_cpu(cpu),
                     &trqd->active);
-        svc->vcpu->processor = cpumask_any(cpumask_scratch_cpu(cpu));
+        svc->vcpu->processor = pick_cpu_in_mask(svc->vcpu,
+                                                cpumask_scratch_cpu(cpu));
         ASSERT(svc->vcpu->processor < nr_cpu_ids);
+        account_placement(svc->vcpu, svc->vcpu->processor);
 
         _runq_assign(svc, trqd);
         if ( on_runq )
@@ -1895,7 +2269,8 @@ static void balance_load(const struct scheduler *ops, int cpu, s_time_t now)
     struct list_head *push_iter, *pull_iter;
     bool_t inner_load_updated = 0;
 
-    balance_state_t st = { .best_push_svc = NULL, .best_pull_svc = NULL };
+    balance_state_t st = { .best_push_svc = NULL, .best_pull_svc = NULL,
+                           .prv = prv };
 
     /*
      * Basic algorithm: Push, pull, or swap.
@@ -2130,6 +2505,55 @@ csched2_vcpu_migrate(
         vc->processor = new_cpu;
 }
 
+/* Called with the private scheduler lock held. */
+static void csched2_dom_set_cap(struct csched2_dom *sdom, uint16_t cap)
+{
+    struct vcpu *v;
+    uint16_t old_cap = sdom->cap;
+    LIST_HEAD(parked);
+
+    spin_lock(&sdom->budget_lock);
+    sdom->tot_budget = CSCHED2_BDGT_REPL_PERIOD * cap / 100;
+    if ( !old_cap )
+    {
+        /* Start with a full budget. */
+        sdom->budget = sdom->tot_budget;
+        sdom->next_repl = NOW() + CSCHED2_BDGT_REPL_PERIOD;
+        set_timer(&sdom->repl_timer, sdom->next_repl);
+    }
+    sdom->cap = cap;
+    spin_unlock(&sdom->budget_lock);
+
+    /*
+     * When the cap is just changing, the vcpus keep the budget they have:
+     * the new one is in effect from the next replenishment.
+     */
+    if ( old_cap && cap )
+        return;
+
+    for_each_vcpu ( sdom->dom, v )
+    {
+        struct csched2_vcpu *svc = csched2_vcpu(v);
+        spinlock_t *lock = vcpu_schedule_lock(v);
+
+        svc->budget = cap ? 0 : STIME_MAX;
+
+        vcpu_schedule_unlock(lock, v);
+    }
+
+    /* Now that none can get parked any longer, unpark them all. */
+    if ( !cap )
+    {
+        stop_timer(&sdom->repl_timer);
+
+        spin_lock(&sdom->budget_lock);
+        list_splice_init(&sdom->parked_vcpus, &parked);
+        spin_unlock(&sdom->budget_lock);
+
+        unpark_parked_vcpus(sdom, &parked);
+    }
+}
+
 static int
 csched2_dom_cntl(
     const struct scheduler *ops,
@@ -2153,6 +2577,7 @@ csched2_dom_cntl(
     case XEN_DOMCTL_SCHEDOP_getinfo:
         read_lock_irqsave(&prv->lock, flags);
         op->u.credit2.weight = sdom->weight;
+        op->u.credit2.cap = sdom->cap;
         read_unlock_irqrestore(&prv->lock, flags);
         break;
     case XEN_DOMCTL_SCHEDOP_putinfo:
@@ -2183,6 +2608,20 @@ csched2_dom_cntl(
 
             write_unlock_irqrestore(&prv->lock, flags);
         }
+
+        if ( op->u.credit2.cap != (uint16_t)~0U )
+        {
+            if ( op->u.credit2.cap > 100 * sdom->nr_vcpus )
+            {
+                rc = -EINVAL;
+                break;
+            }
+
+            write_lock_irqsave(&prv->lock, flags);
+            if ( op->u.credit2.cap != sdom->cap )
+                csched2_dom_set_cap(sdom, op->u.credit2.cap);
+            write_unlock_irqrestore(&prv->lock, flags);
+        }
         break;
     default:
         rc = -EINVAL;
@@ -2242,6 +2681,11 @@ csched2_alloc_domdata(const struct scheduler *ops, struct domain *dom)
     sdom->weight = CSCHED2_DEFAULT_WEIGHT;
     sdom->nr_vcpus = 0;
 
+    spin_lock_init(&sdom->budget_lock);
+    INIT_LIST_HEAD(&sdom->parked_vcpus);
+    init_timer(&sdom->repl_timer, replenish_domain_budget, sdom,
+               smp_processor_id());
+
     write_lock_irqsave(&prv->lock, flags);
 
     list_add_tail(&sdom->sdom_elem, &csched2_priv(ops)->sdom);
@@ -2281,6 +2725,8 @@ csched2_free_domdata(const struct scheduler *ops, void *data)
 
     write_unlock_irqrestore(&prv->lock, flags);
 
+    kill_timer(&sdom->repl_timer);
+
     xfree(data);
 }
 
@@ -2300,7 +2746,7 @@ csched2_vcpu_insert(const struct scheduler *ops, struct vcpu *vc)
     spinlock_t *lock;
 
     ASSERT(!is_idle_vcpu(vc));
-    ASSERT(list_empty(&svc->runq_elem));
+    ASSERT(!vcpu_on_runq(svc));
 
     /* csched2_cpu_pick() expects the pcpu lock to be held */
     lock = vcpu_schedule_lock_irq(vc);
@@ -2338,7 +2784,7 @@ csched2_vcpu_remove(const struct scheduler *ops, struct vcpu *vc)
     spinlock_t *lock;
 
     ASSERT(!is_idle_vcpu(vc));
-    ASSERT(list_empty(&svc->runq_elem));
+    ASSERT(!vcpu_on_runq(svc));
 
     SCHED_STAT_CRANK(vcpu_remove);
 
@@ -2347,6 +2793,23 @@ csched2_vcpu_remove(const struct scheduler *ops, struct vcpu *vc)
 
     runq_deassign(ops, vc);
 
+    /*
+     * The vcpu is leaving the scheduler (or the cpupool): whoever takes it
+     * over doesn't know about parking.
+     */
+    if ( has_cap(svc) )
+    {
+        spin_lock(&svc->sdom->budget_lock);
+        svc->sdom->budget += svc->budget;
+        svc->budget = 0;
+        if ( !list_empty(&svc->parked_elem) )
+        {
+            list_del_init(&svc->parked_elem);
+            clear_bit(_VPF_parked, &vc->pause_flags);
+        }
+        spin_unlock(&svc->sdom->budget_lock);
+    }
+
     vcpu_schedule_unlock_irq(lock, vc);
 
     svc->sdom->nr_vcpus--;
@@ -2360,7 +2823,7 @@ csched2_runtime(const struct scheduler *ops, int cpu,
     s_time_t time, min_time;
     int rt_credit; /* Proposed runtime measured in credits */
     struct csched2_runqueue_data *rqd = c2rqd(ops, cpu);
-    struct list_head *runq = &rqd->runq;
+    struct rb_node *first = rb_first(&rqd->runq);
     struct csched2_private *prv = csched2_priv(ops);
 
     /*
@@ -2395,9 +2858,9 @@ csched2_runtime(const struct scheduler *ops, int cpu,
 
     /* 2) If there's someone waiting whose credit is positive,
      * run until your credit ~= his */
-    if ( ! list_empty(runq) )
+    if ( first )
     {
-        struct csched2_vcpu *swait = runq_elem(runq->next);
+        struct csched2_vcpu *swait = runq_elem(first);
 
         if ( ! is_idle_vcpu(swait->vcpu)
              && swait->credit > 0 )
@@ -2434,6 +2897,13 @@ csched2_runtime(const struct scheduler *ops, int cpu,
         SCHED_STAT_CRANK(runtime_max_timer);
     }
 
+    /*
+     * 4) A capped vcpu can't run beyond its budget, bar the minimum time
+     * (any overrun is charged to its domain).
+     */
+    if ( has_cap(snext) && snext->budget < time )
+        time = max(snext->budget, CSCHED2_MIN_TIMER);
+
     return time;
 }
 
@@ -2448,13 +2918,22 @@ runq_candidate(struct csched2_runqueue_data *rqd,
                int cpu, s_time_t now,
                unsigned int *skipped)
 {
-    struct list_head *iter;
+    struct rb_node *iter, *next;
     struct csched2_vcpu *snext = NULL;
-    struct csched2_private *prv = csched2_priv(per_cpu(scheduler, cpu));
+    const struct scheduler *ops = per_cpu(scheduler, cpu);
+    struct csched2_private *prv = csched2_priv(ops);
     bool yield = __test_and_clear_bit(__CSFLAG_vcpu_yield, &scurr->flags);
 
     *skipped = 0;
 
+    /*
+     * If the current vcpu is out of budget and can't get more, it gets
+     * parked, and isn't runnable any longer.
+     */
+    if ( !is_idle_vcpu(scurr->vcpu) && has_cap(scurr) &&
+         vcpu_runnable(scurr->vcpu) )
+        vcpu_grab_budget(scurr);
+
     /*
      * Return the current vcpu if it has executed for less than ratelimit.
      * Adjuststment for the selected vcpu's credit and decision
@@ -2491,9 +2970,11 @@ runq_candidate(struct csched2_runqueue_data *rqd,
     else
         snext = csched2_vcpu(idle_vcpu[cpu]);
 
-    list_for_each( iter, &rqd->runq )
+    for ( iter = rb_first(&rqd->runq); iter; iter = next )
     {
-        struct csched2_vcpu * svc = list_entry(iter, struct csched2_vcpu, runq_elem);
+        struct csched2_vcpu * svc = runq_elem(iter);
+
+        next = rb_next(iter);
 
         if ( unlikely(tb_init_done) )
         {
@@ -2544,7 +3025,16 @@ runq_candidate(struct csched2_runqueue_data *rqd,
          * yielding, choose it.
          */
         if ( yield || svc->credit > snext->credit )
+        {
+            /* Unless it's out of budget: then it is parked. */
+            if ( has_cap(svc) && !vcpu_grab_budget(svc) )
+            {
+                update_load(ops, rqd, svc, -1, now);
+                runq_remove(svc);
+                continue;
+            }
             snext = svc;
+        }
 
         /* In any case, if we got this far, break. */
         break;
@@ -2764,6 +3254,9 @@ csched2_dump_vcpu(struct csched2_private *prv, struct csched2_vcpu *svc)
 
     printk(" credit=%" PRIi32" [w=%u]", svc->credit, svc->weight);
 
+    if ( has_cap(svc) )
+        printk(" budget=%"PRI_stime, svc->budget);
+
     printk(" load=%"PRI_stime" (~%"PRI_stime"%%)", svc->avgload,
            (svc->avgload * 100) >> prv->load_precision_shift);
 
@@ -2849,9 +3342,10 @@ csched2_dump(const struct scheduler *ops)
 
         sdom = list_entry(iter_sdom, struct csched2_dom, sdom_elem);
 
-        printk("\tDomain: %d w %d v %d\n",
+        printk("\tDomain: %d w %d c %u v %d\n",
                sdom->dom->domain_id,
                sdom->weight,
+               sdom->cap,
                sdom->nr_vcpus);
 
         for_each_vcpu( sdom->dom, v )
@@ -2871,7 +3365,7 @@ csched2_dump(const struct scheduler *ops)
     for_each_cpu(i, &prv->active_queues)
     {
         struct csched2_runqueue_data *rqd = prv->rqd + i;
-        struct list_head *iter, *runq = &rqd->runq;
+        struct rb_node *iter;
         int loop = 0;
 
         /* We need the lock to scan the runqueue. */
@@ -2883,7 +3377,7 @@ csched2_dump(const struct scheduler *ops)
             dump_pcpu(ops, j);
 
         printk("RUNQ:\n");
-        list_for_each( iter, runq )
+        for ( iter = rb_first(&rqd->runq); iter; iter = rb_next(iter) )
         {
             struct csched2_vcpu *svc = runq_elem(iter);
 
@@ -2927,6 +3421,7 @@ init_pdata(struct csched2_private *prv, unsigned int cpu)
     
     __cpumask_set_cpu(cpu, &rqd->idle);
     __cpumask_set_cpu(cpu, &rqd->active);
+    node_set(cpu_to_node(cpu), rqd->nodes);
     __cpumask_set_cpu(cpu, &prv->initialized);
     __cpumask_set_cpu(cpu, &rqd->smt_idle);
 
@@ -3013,7 +3508,7 @@ csched2_deinit_pdata(const struct scheduler *ops, void *pcpu, int cpu)
     unsigned long flags;
     struct csched2_private *prv = csched2_priv(ops);
     struct csched2_runqueue_data *rqd;
-    int rqi;
+    int rqi, i;
 
     write_lock_irqsave(&prv->lock, flags);
 
@@ -3037,6 +3532,10 @@ csched2_deinit_pdata(const struct scheduler *ops, void *pcpu, int cpu)
     __cpumask_clear_cpu(cpu, &rqd->smt_idle);
     __cpumask_clear_cpu(cpu, &rqd->active);
 
+    nodes_clear(rqd->nodes);
+    for_each_cpu ( i, &rqd->active )
+        node_set(cpu_to_node(i), rqd->nodes);
+
     if ( cpumask_empty(&rqd->active) )
     {
         printk(XENLOG_INFO " No cpus left on runqueue, disabling\n");
@@ -28,10 +28,45 @@
 static unsigned int timer_slop __read_mostly = 50000; /* 50 us */
 integer_param("timer_slop", timer_slop);
 
+/*
+ * Active timers are kept in a hierarchical timing wheel.
+ *
+ * Time is divided in slots of 2^TIMER_WHEEL_SHIFT ns (~65us). Level 0 has a
+ * bucket for each of the next TIMER_WHEEL_SIZE slots, and each bucket of
+ * level n spans all of the TIMER_WHEEL_SIZE buckets of level n-1. A timer is
+ * put in the lowest level that reaches its expiry, and is moved down (it
+ * "cascades") when the wheel gets to the first slot its bucket spans. Timers
+ * that are too far in the future even for the last level sit on an overflow
+ * list, and are put back in the wheel each time that wraps.
+ *
+ * Adding and removing timers is O(1). Timers still fire at their exact
+ * expiry time (plus, possibly, their slack), as the earliest deadline is
+ * found by looking at the actual expiry times of the timers in the first
+ * non-empty bucket(s), located via per-level bitmaps.
+ */
+#define TIMER_WHEEL_SHIFT   16
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SIZE    (1U << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK    (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS  5
+
+/* Number of slots spanned by a bucket of level @l. */
+#define LVL_SLOTS(l)        (1ULL << ((l) * TIMER_WHEEL_BITS))
+/* Bucket of level @l in which a timer expiring in @slot goes. */
+#define LVL_IDX(slot, l)    \
+    ((unsigned int)((slot) >> ((l) * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK)
+
+#define NO_SLOT             (~0ULL)
+
 struct timers {
     spinlock_t     lock;
-    struct timer **heap;
-    struct timer  *list;
+    uint64_t       clk;      /* All slots before this one have been run. */
+    s_time_t       next;     /* Earliest deadline when last computed. */
+    /* Non-empty buckets, for each level. */
+    unsigned long  pending[TIMER_WHEEL_LEVELS]
+                          [BITS_TO_LONGS(TIMER_WHEEL_SIZE)];
+    struct list_head wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+    struct list_head overflow;
     struct timer  *running;
     struct list_head inactive;
 } __cacheline_aligned;
@@ -44,125 +79,156 @@ static DEFINE_RCU_READ_LOCK(timer_cpu_read_lock);
 DEFINE_PER_CPU(s_time_t, timer_deadline);
 
 /****************************************************************************
- * HEAP OPERATIONS.
+ * WHEEL OPERATIONS.
  */
 
-#define GET_HEAP_SIZE(_h)     ((int)(((u16 *)(_h))[0]))
-#define SET_HEAP_SIZE(_h,_v)  (((u16 *)(_h))[0] = (u16)(_v))
-
-#define GET_HEAP_LIMIT(_h)    ((int)(((u16 *)(_h))[1]))
-#define SET_HEAP_LIMIT(_h,_v) (((u16 *)(_h))[1] = (u16)(_v))
-
-/* Sink down element @pos of @heap. */
-static void down_heap(struct timer **heap, int pos)
+static inline uint64_t time_to_slot(s_time_t t)
 {
-    int sz = GET_HEAP_SIZE(heap), nxt;
-    struct timer *t = heap[pos];
-
-    while ( (nxt = (pos << 1)) <= sz )
-    {
-        if ( ((nxt+1) <= sz) && (heap[nxt+1]->expires < heap[nxt]->expires) )
-            nxt++;
-        if ( heap[nxt]->expires > t->expires )
-            break;
-        heap[pos] = heap[nxt];
-        heap[pos]->heap_offset = pos;
-        pos = nxt;
-    }
-
-    heap[pos] = t;
-    t->heap_offset = pos;
+    return (t > 0) ? (uint64_t)t >> TIMER_WHEEL_SHIFT : 0;
 }
 
-/* Float element @pos up @heap. */
-static void up_heap(struct timer **heap, int pos)
+static inline s_time_t slot_to_time(uint64_t slot)
 {
-    struct timer *t = heap[pos];
-
-    while ( (pos > 1) && (t->expires < heap[pos>>1]->expires) )
-    {
-        heap[pos] = heap[pos>>1];
-        heap[pos]->heap_offset = pos;
-        pos >>= 1;
-    }
-
-    heap[pos] = t;
-    t->heap_offset = pos;
+    if ( slot > ((uint64_t)STIME_MAX >> TIMER_WHEEL_SHIFT) )
+        return STIME_MAX;
+    return slot << TIMER_WHEEL_SHIFT;
 }
 
+/* Latest time at which @t is happy to fire. */
+static inline s_time_t timer_latest(const struct timer *t)
+{
+    if ( t->expires > STIME_MAX - (s_time_t)t->slack )
+        return STIME_MAX;
+    return t->expires + t->slack;
+}
 
-/* Delete @t from @heap. Return TRUE if new top of heap. */
-static int remove_from_heap(struct timer **heap, struct timer *t)
+/* Add @t to the wheel (or overflow list) of @ts. */
+static void add_to_wheel(struct timers *ts, struct timer *t)
 {
-    int sz = GET_HEAP_SIZE(heap);
-    int pos = t->heap_offset;
+    uint64_t slot = max(time_to_slot(t->expires), ts->clk);
+    uint64_t delta = slot - ts->clk;
+    unsigned int l, idx;
 
-    if ( unlikely(pos == sz) )
+    for ( l = 0; l < TIMER_WHEEL_LEVELS; l++ )
+        if ( delta < LVL_SLOTS(l + 1) )
+            break;
+
+    if ( unlikely(l == TIMER_WHEEL_LEVELS) )
     {
-        SET_HEAP_SIZE(heap, sz-1);
-        goto out;
+        t->status = TIMER_STATUS_in_list;
+        list_add(&t->entry, &ts->overflow);
+        return;
     }
 
-    heap[pos] = heap[sz];
-    heap[pos]->heap_offset = pos;
-
-    SET_HEAP_SIZE(heap, --sz);
+    idx = LVL_IDX(slot, l);
+    t->status = TIMER_STATUS_in_wheel;
+    t->wheel_pos = (l << TIMER_WHEEL_BITS) | idx;
+    list_add_tail(&t->entry, &ts->wheel[l][idx]);
+    __set_bit(idx, ts->pending[l]);
+}
 
-    if ( (pos > 1) && (heap[pos]->expires < heap[pos>>1]->expires) )
-        up_heap(heap, pos);
-    else
-        down_heap(heap, pos);
+static void remove_from_wheel(struct timers *ts, struct timer *t)
+{
+    unsigned int l = t->wheel_pos >> TIMER_WHEEL_BITS;
+    unsigned int idx = t->wheel_pos & TIMER_WHEEL_MASK;
 
- out:
-    return (pos == 1);
+    list_del(&t->entry);
+    if ( list_empty(&ts->wheel[l][idx]) )
+        __clear_bit(idx, ts->pending[l]);
 }
 
-
-/* Add new entry @t to @heap. Return TRUE if new top of heap. */
-static int add_to_heap(struct timer **heap, struct timer *t)
+/*
+ * First slot after @after (which is not before ts->clk) in which something
+ * has to be done at level @l: running a bucket for level 0, cascading a
+ * bucket for the other levels, and putting the overflow list back in the
+ * wheel for TIMER_WHEEL_LEVELS. Only one turn of the level is looked at.
+ */
+static uint64_t next_slot(const struct timers *ts, unsigned int l,
+                          uint64_t after)
 {
-    int sz = GET_HEAP_SIZE(heap);
+    uint64_t span = LVL_SLOTS(l), base, slot;
+    unsigned int idx, i;
 
-    /* Fail if the heap is full. */
-    if ( unlikely(sz == GET_HEAP_LIMIT(heap)) )
-        return 0;
+    /* The first slot after @after where level l moves to another bucket. */
+    base = (after + span) & ~(span - 1);
 
-    SET_HEAP_SIZE(heap, ++sz);
-    heap[sz] = t;
-    t->heap_offset = sz;
-    up_heap(heap, sz);
+    if ( l == TIMER_WHEEL_LEVELS )
+        return list_empty(&ts->overflow) ? NO_SLOT : base;
 
-    return (t->heap_offset == 1);
-}
+    idx = LVL_IDX(base, l);
+    i = find_next_bit(ts->pending[l], TIMER_WHEEL_SIZE, idx);
+    if ( i < TIMER_WHEEL_SIZE )
+        slot = base + (i - idx) * span;
+    else if ( (i = find_first_bit(ts->pending[l], TIMER_WHEEL_SIZE)) < idx )
+        slot = base + (TIMER_WHEEL_SIZE - idx + i) * span;
+    else
+        return NO_SLOT;
 
+    /* Past one turn from ts->clk, the buckets are about the current one. */
+    if ( slot >= ((ts->clk + span) & ~(span - 1)) + TIMER_WHEEL_SIZE * span )
+        return NO_SLOT;
 
-/****************************************************************************
- * LINKED LIST OPERATIONS.
- */
+    return slot;
+}
 
-static int remove_from_list(struct timer **pprev, struct timer *t)
+/* Move the timers of the buckets starting at ts->clk to the lower levels. */
+static void cascade(struct timers *ts)
 {
-    struct timer *curr, **_pprev = pprev;
+    struct timer *t;
+    unsigned int l, idx;
+    LIST_HEAD(todo);
 
-    while ( (curr = *_pprev) != t )
-        _pprev = &curr->list_next;
+    for ( l = 1; l < TIMER_WHEEL_LEVELS; l++ )
+    {
+        idx = LVL_IDX(ts->clk, l);
+        list_splice_init(&ts->wheel[l][idx], &todo);
+        __clear_bit(idx, ts->pending[l]);
+        if ( idx != 0 )
+            break;
+    }
 
-    *_pprev = t->list_next;
+    /* The whole wheel wrapped: see if any overflowed timer now fits. */
+    if ( l == TIMER_WHEEL_LEVELS )
+        list_splice_init(&ts->overflow, &todo);
 
-    return (_pprev == pprev);
+    while ( !list_empty(&todo) )
+    {
+        t = list_entry(todo.next, struct timer, entry);
+        list_del(&t->entry);
+        add_to_wheel(ts, t);
+        perfc_incr(timer_cascaded);
+    }
 }
 
-static int add_to_list(struct timer **pprev, struct timer *t)
+/*
+ * Earliest time at which some timer wants to fire. Buckets are looked at in
+ * order, at each level, until the first slot they span is past the best
+ * deadline found so far. Unless the timers have some slack, that happens
+ * right after the first non-empty bucket.
+ */
+static s_time_t wheel_deadline(const struct timers *ts)
 {
-    struct timer *curr, **_pprev = pprev;
-
-    while ( ((curr = *_pprev) != NULL) && (curr->expires <= t->expires) )
-        _pprev = &curr->list_next;
-
-    t->list_next = curr;
-    *_pprev = t;
-
-    return (_pprev == pprev);
+    s_time_t deadline = STIME_MAX;
+    const struct timer *t;
+    uint64_t slot;
+    unsigned int l;
+
+    list_for_each_entry ( t, &ts->wheel[0][LVL_IDX(ts->clk, 0)], entry )
+        deadline = min(deadline, timer_latest(t));
+
+    for ( l = 0; l < TIMER_WHEEL_LEVELS; l++ )
+        for ( slot = next_slot(ts, l, ts->clk);
+              slot != NO_SLOT && slot_to_time(slot) < deadline;
+              slot = next_slot(ts, l, slot) )
+            list_for_each_entry ( t, &ts->wheel[l][LVL_IDX(slot, l)], entry )
+                deadline = min(deadline, timer_latest(t));
+
+    /* Overflowed timers expire after the wrap: just wake up then. */
+    slot = next_slot(ts, TIMER_WHEEL_LEVELS, ts->clk);
+    if ( slot != NO_SLOT )
+        deadline = min(deadline, slot_to_time(slot));
+
+    return deadline;
 }
 
 
@@ -170,45 +236,37 @@ static int add_to_list(struct timer **pprev, struct timer *t)
  * TIMER OPERATIONS.
  */
 
+/* Remove @t from its CPU's active timers. Return TRUE if it was the first. */
 static int remove_entry(struct timer *t)
 {
     struct timers *timers = &per_cpu(timers, t->cpu);
-    int rc;
 
     switch ( t->status )
     {
-    case TIMER_STATUS_in_heap:
-        rc = remove_from_heap(timers->heap, t);
+    case TIMER_STATUS_in_wheel:
+        remove_from_wheel(timers, t);
         break;
     case TIMER_STATUS_in_list:
-        rc = remove_from_list(&timers->list, t);
+        list_del(&t->entry);
         break;
     default:
-        rc = 0;
         BUG();
     }
 
     t->status = TIMER_STATUS_invalid;
-    return rc;
+    return (timer_latest(t) == timers->next);
 }
 
+/* Add @t to its CPU's active timers. Return TRUE if it is the new first. */
 static int add_entry(struct timer *t)
 {
     struct timers *timers = &per_cpu(timers, t->cpu);
-    int rc;
 
     ASSERT(t->status == TIMER_STATUS_invalid);
 
-    /* Try to add to heap. t->heap_offset indicates whether we succeed. */
-    t->heap_offset = 0;
-    t->status = TIMER_STATUS_in_heap;
-    rc = add_to_heap(timers->heap, t);
-    if ( t->heap_offset != 0 )
-        return rc;
+    add_to_wheel(timers, t);
 
-    /* Fall back to adding to the slower linked list. */
-    t->status = TIMER_STATUS_in_list;
-    return add_to_list(&timers->list, t);
+    return (timer_latest(t) < timers->next);
 }
 
 static inline void activate_timer(struct timer *timer)
@@ -277,7 +335,7 @@ static bool_t active_timer(struct timer *timer)
 {
     ASSERT(timer->status >= TIMER_STATUS_inactive);
     ASSERT(timer->status <= TIMER_STATUS_in_list);
-    return (timer->status >= TIMER_STATUS_in_heap);
+    return (timer->status >= TIMER_STATUS_in_wheel);
 }
 
 
@@ -332,6 +390,19 @@ void stop_timer(struct timer *timer)
 }
 
 
+void set_timer_slack(struct timer *timer, s_time_t slack)
+{
+    unsigned long flags;
+
+    if ( !timer_lock_irqsave(timer, flags) )
+        return;
+
+    timer->slack = min_t(s_time_t, max_t(s_time_t, slack, 0), UINT32_MAX);
+
+    timer_unlock_irqrestore(timer, flags);
+}
+
+
 void migrate_timer(struct timer *timer, unsigned int new_cpu)
 {
     unsigned int old_cpu;
@@ -427,70 +498,78 @@ static void execute_timer(struct timers *ts, struct timer *t)
 }
 
 
-static void timer_softirq_action(void)
+/* Run the expired timers in the level 0 bucket of ts->clk. */
+static void run_bucket(struct timers *ts, s_time_t now)
 {
-    struct timer  *t, **heap, *next;
-    struct timers *ts;
-    s_time_t       now, deadline;
+    unsigned int idx = LVL_IDX(ts->clk, 0);
+    struct list_head *bucket = &ts->wheel[0][idx];
+    struct timer *t;
+    LIST_HEAD(todo);
 
-    ts = &this_cpu(timers);
-    heap = ts->heap;
+    list_splice_init(bucket, &todo);
+    __clear_bit(idx, ts->pending[0]);
 
-    /* If we overflowed the heap, try to allocate a larger heap. */
-    if ( unlikely(ts->list != NULL) )
+    /*
+     * The lock is dropped while running each timer, and the ones still on
+     * todo may be stopped or re-set meanwhile: always look at the head.
+     */
+    while ( !list_empty(&todo) )
     {
-        /* old_limit == (2^n)-1; new_limit == (2^(n+4))-1 */
-        int old_limit = GET_HEAP_LIMIT(heap);
-        int new_limit = ((old_limit + 1) << 4) - 1;
-        struct timer **newheap = xmalloc_array(struct timer *, new_limit + 1);
-        if ( newheap != NULL )
+        t = list_entry(todo.next, struct timer, entry);
+        if ( t->expires < now )
         {
-            spin_lock_irq(&ts->lock);
-            memcpy(newheap, heap, (old_limit + 1) * sizeof(*heap));
-            SET_HEAP_LIMIT(newheap, new_limit);
-            ts->heap = newheap;
-            spin_unlock_irq(&ts->lock);
-            if ( old_limit != 0 )
-                xfree(heap);
-            heap = newheap;
+            list_del(&t->entry);
+            execute_timer(ts, t);
+            perfc_incr(timer_run);
+        }
+        else
+        {
+            list_move_tail(&t->entry, bucket);
+            __set_bit(idx, ts->pending[0]);
         }
     }
+}
+
+static void timer_softirq_action(void)
+{
+    struct timers *ts;
+    s_time_t       now, deadline;
+    uint64_t       target, slot;
+    unsigned int   l;
+
+    ts = &this_cpu(timers);
 
     spin_lock_irq(&ts->lock);
 
     now = NOW();
+    target = time_to_slot(now);
 
-    /* Execute ready heap timers. */
-    while ( (GET_HEAP_SIZE(heap) != 0) &&
-            ((t = heap[1])->expires < now) )
+    /*
+     * Advance the wheel up to the current slot. Slots where no bucket needs
+     * running or cascading are skipped, so catching up after a long idle
+     * period costs as much as the number of timers that expired meanwhile.
+     */
+    for ( ; ; )
     {
-        remove_from_heap(heap, t);
-        execute_timer(ts, t);
-    }
+        run_bucket(ts, now);
 
-    /* Execute ready list timers. */
-    while ( ((t = ts->list) != NULL) && (t->expires < now) )
-    {
-        ts->list = t->list_next;
-        execute_timer(ts, t);
-    }
+        if ( ts->clk >= target )
+            break;
 
-    /* Try to move timers from linked list to more efficient heap. */
-    next = ts->list;
-    ts->list = NULL;
-    while ( unlikely((t = next) != NULL) )
-    {
-        next = t->list_next;
-        t->status = TIMER_STATUS_invalid;
-        add_entry(t);
+        /* Timers just run may have set others which are already expired. */
+        if ( !list_empty(&ts->wheel[0][LVL_IDX(ts->clk, 0)]) )
+            continue;
+
+        slot = target;
+        for ( l = 0; l <= TIMER_WHEEL_LEVELS; l++ )
+            slot = min(slot, next_slot(ts, l, ts->clk));
+
+        ts->clk = slot;
+        if ( LVL_IDX(ts->clk, 0) == 0 )
+            cascade(ts);
     }
 
-    /* Find earliest deadline from head of linked list and top of heap. */
-    deadline = STIME_MAX;
-    if ( GET_HEAP_SIZE(heap) != 0 )
-        deadline = heap[1]->expires;
-    if ( (ts->list != NULL) && (ts->list->expires < deadline) )
-        deadline = ts->list->expires;
+    deadline = ts->next = wheel_deadline(ts);
     now = NOW();
     this_cpu(timer_deadline) =
         (deadline == STIME_MAX) ? 0 : MAX(deadline, now + timer_slop);
@@ -521,7 +600,7 @@ static void dump_timerq(unsigned char key)
     struct timers *ts;
     unsigned long  flags;
     s_time_t       now = NOW();
-    int            i, j;
+    unsigned int   i, j, l;
 
     printk("Dumping timer queues:\n");
 
@@ -531,9 +610,11 @@ static void dump_timerq(unsigned char key)
 
         printk("CPU%02d:\n", i);
         spin_lock_irqsave(&ts->lock, flags);
-        for ( j = 1; j <= GET_HEAP_SIZE(ts->heap); j++ )
-            dump_timer(ts->heap[j], now);
-        for ( t = ts->list, j = 0; t != NULL; t = t->list_next, j++ )
+        for ( l = 0; l < TIMER_WHEEL_LEVELS; l++ )
+            for ( j = 0; j < TIMER_WHEEL_SIZE; j++ )
+                list_for_each_entry ( t, &ts->wheel[l][j], entry )
+                    dump_timer(t, now);
+        list_for_each_entry ( t, &ts->overflow, entry )
             dump_timer(t, now);
         spin_unlock_irqrestore(&ts->lock, flags);
     }
@@ -544,6 +625,7 @@ static void migrate_timers_from_cpu(unsigned int old_cpu)
     unsigned int new_cpu = cpumask_any(&cpu_online_map);
     struct timers *old_ts, *new_ts;
     struct timer *t;
+    unsigned int l, i;
     bool_t notify = 0;
 
     ASSERT(!cpu_online(old_cpu) && cpu_online(new_cpu));
@@ -562,9 +644,19 @@ static void migrate_timers_from_cpu(unsigned int old_cpu)
         spin_lock(&old_ts->lock);
     }
 
-    while ( (t = GET_HEAP_SIZE(old_ts->heap)
-             ? old_ts->heap[1] : old_ts->list) != NULL )
+    for ( l = 0; l < TIMER_WHEEL_LEVELS; l++ )
+        for ( i = 0; i < TIMER_WHEEL_SIZE; i++ )
+            while ( !list_empty(&old_ts->wheel[l][i]) )
+            {
+                t = list_entry(old_ts->wheel[l][i].next, struct timer, entry);
+                remove_entry(t);
+                write_atomic(&t->cpu, new_cpu);
+                notify |= add_entry(t);
+            }
+
+    while ( !list_empty(&old_ts->overflow) )
     {
+        t = list_entry(old_ts->overflow.next, struct timer, entry);
         remove_entry(t);
         write_atomic(&t->cpu, new_cpu);
         notify |= add_entry(t);
@@ -585,12 +677,10 @@ static void migrate_timers_from_cpu(unsigned int old_cpu)
         cpu_raise_softirq(new_cpu, TIMER_SOFTIRQ);
 }
 
-static struct timer *dummy_heap;
-
 static int cpu_callback(
     struct notifier_block *nfb, unsigned long action, void *hcpu)
 {
-    unsigned int cpu = (unsigned long)hcpu;
+    unsigned int cpu = (unsigned long)hcpu, l, i;
     struct timers *ts = &per_cpu(timers, cpu);
 
     switch ( action )
@@ -598,7 +688,15 @@ static int cpu_callback(
     case CPU_UP_PREPARE:
         INIT_LIST_HEAD(&ts->inactive);
         spin_lock_init(&ts->lock);
-        ts->heap = &dummy_heap;
+        for ( l = 0; l < TIMER_WHEEL_LEVELS; l++ )
+        {
+            for ( i = 0; i < TIMER_WHEEL_SIZE; i++ )
+                INIT_LIST_HEAD(&ts->wheel[l][i]);
+            bitmap_zero(ts->pending[l], TIMER_WHEEL_SIZE);
+        }
+        INIT_LIST_HEAD(&ts->overflow);
+        ts->clk = time_to_slot(NOW());
+        ts->next = STIME_MAX;
         break;
     case CPU_UP_CANCELED:
     case CPU_DEAD:
@@ -622,13 +720,6 @@ void __init timer_init(void)
 
     open_softirq(TIMER_SOFTIRQ, timer_softirq_action);
 
-    /*
-     * All CPUs initially share an empty dummy heap. Only those CPUs that
-     * are brought online will be dynamically allocated their own heap.
-     */
-    SET_HEAP_SIZE(&dummy_heap, 0);
-    SET_HEAP_LIMIT(&dummy_heap, 0);
-
     cpu_callback(&cpu_nfb, CPU_UP_PREPARE, cpu);
     register_cpu_notifier(&cpu_nfb);
 
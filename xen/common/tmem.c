@@ -54,14 +54,11 @@ struct tmem_object_node {
 };
 
 struct tmem_page_descriptor {
-    union {
-        struct list_head global_eph_pages;
-        struct list_head client_inv_pages;
-    };
+    struct list_head client_inv_pages;
     union {
         struct {
             union {
-                struct list_head client_eph_pages;
+                struct list_head pool_eph_pages;
                 struct list_head pool_pers_pages;
             };
             struct tmem_object_root *obj;
@@ -78,7 +75,7 @@ struct tmem_page_descriptor {
         struct tmem_page_content_descriptor *pcd; /* Page dedup. */
     };
     union {
-        uint64_t timestamp;
+        uint64_t timestamp; /* Of the last put or get, for eviction. */
         uint32_t pool_id;  /* Used for invalid list only. */
     };
 };
@@ -105,7 +102,13 @@ PAGE_LIST_HEAD(tmem_page_list);
 unsigned long tmem_page_list_pages = 0;
 
 DEFINE_RWLOCK(tmem_rwlock);
-static DEFINE_SPINLOCK(eph_lists_spinlock); /* Protects global AND clients. */
+/*
+ * Each ephemeral pool keeps its own LRU under pool->eph_lock, so puts and
+ * gets from different pools never contend.  This lock only protects the
+ * list of ephemeral pools; it is taken when creating and freeing pools and
+ * by eviction, which has to look across all of them.
+ */
+static DEFINE_SPINLOCK(eph_pools_spinlock);
 static DEFINE_SPINLOCK(pers_lists_spinlock);
 
 #define ASSERT_SPINLOCK(_l) ASSERT(spin_is_locked(_l))
@@ -114,8 +117,9 @@ static DEFINE_SPINLOCK(pers_lists_spinlock);
     atomic_t client_weight_total;
 
 struct tmem_global tmem_global = {
-    .ephemeral_page_list = LIST_HEAD_INIT(tmem_global.ephemeral_page_list),
+    .eph_pool_list = LIST_HEAD_INIT(tmem_global.eph_pool_list),
     .client_list = LIST_HEAD_INIT(tmem_global.client_list),
+    .eph_count = ATOMIC_INIT(0),
     .client_weight_total = ATOMIC_INIT(0),
 };
 
@@ -267,8 +271,7 @@ static struct tmem_page_descriptor *pgp_alloc(struct tmem_object_root *obj)
     if ( (pgp = tmem_malloc(sizeof(struct tmem_page_descriptor), pool)) == NULL )
         return NULL;
     pgp->us.obj = obj;
-    INIT_LIST_HEAD(&pgp->global_eph_pages);
-    INIT_LIST_HEAD(&pgp->us.client_eph_pages);
+    INIT_LIST_HEAD(&pgp->us.pool_eph_pages);
     pgp->pfp = NULL;
     pgp->size = -1;
     pgp->index = -1;
@@ -325,8 +328,7 @@ static void pgp_free(struct tmem_page_descriptor *pgp)
     pool = pgp->us.obj->pool;
     if ( !is_persistent(pool) )
     {
-        ASSERT(list_empty(&pgp->global_eph_pages));
-        ASSERT(list_empty(&pgp->us.client_eph_pages));
+        ASSERT(list_empty(&pgp->us.pool_eph_pages));
     }
     pgp_free_data(pgp, pool);
     atomic_dec_and_assert(global_pgp_count);
@@ -342,31 +344,42 @@ static void pgp_free(struct tmem_page_descriptor *pgp)
     __pgp_free(pgp, pool);
 }
 
-/* Remove pgp from global/pool/client lists and free it. */
+/* Take pgp off its ephemeral pool's LRU.  Caller holds pool->eph_lock. */
+static void pgp_eph_delist(struct tmem_page_descriptor *pgp,
+                           struct tmem_pool *pool)
+{
+    ASSERT_SPINLOCK(&pool->eph_lock);
+    if ( list_empty(&pgp->us.pool_eph_pages) )
+        return;
+    list_del_init(&pgp->us.pool_eph_pages);
+    pool->eph_count--;
+    ASSERT(pool->eph_count >= 0);
+    atomic_dec(&pool->client->eph_count);
+    ASSERT(_atomic_read(pool->client->eph_count) >= 0);
+    atomic_dec(&tmem_global.eph_count);
+    ASSERT(_atomic_read(tmem_global.eph_count) >= 0);
+}
+
+/* Remove pgp from pool/client lists and free it. */
 static void pgp_delist_free(struct tmem_page_descriptor *pgp)
 {
     struct client *client;
+    struct tmem_pool *pool;
     uint64_t life;
 
     ASSERT(pgp != NULL);
     ASSERT(pgp->us.obj != NULL);
     ASSERT(pgp->us.obj->pool != NULL);
-    client = pgp->us.obj->pool->client;
+    pool = pgp->us.obj->pool;
+    client = pool->client;
     ASSERT(client != NULL);
 
     /* Delist pgp. */
-    if ( !is_persistent(pgp->us.obj->pool) )
-    {
-        spin_lock(&eph_lists_spinlock);
-        if ( !list_empty(&pgp->us.client_eph_pages) )
-            client->eph_count--;
-        ASSERT(client->eph_count >= 0);
-        list_del_init(&pgp->us.client_eph_pages);
-        if ( !list_empty(&pgp->global_eph_pages) )
-            tmem_global.eph_count--;
-        ASSERT(tmem_global.eph_count >= 0);
-        list_del_init(&pgp->global_eph_pages);
-        spin_unlock(&eph_lists_spinlock);
+    if ( !is_persistent(pool) )
+    {
+        spin_lock(&pool->eph_lock);
+        pgp_eph_delist(pgp, pool);
+        spin_unlock(&pool->eph_lock);
     }
     else
     {
@@ -674,11 +687,21 @@ static struct tmem_pool * pool_alloc(void)
         pool->obj_rb_root[i] = RB_ROOT;
     INIT_LIST_HEAD(&pool->persistent_page_list);
     rwlock_init(&pool->pool_rwlock);
+    spin_lock_init(&pool->eph_lock);
+    INIT_LIST_HEAD(&pool->ephemeral_page_list);
+    INIT_LIST_HEAD(&pool->eph_pool_list);
     return pool;
 }
 
 static void pool_free(struct tmem_pool *pool)
 {
+    if ( !list_empty(&pool->eph_pool_list) )
+    {
+        spin_lock(&eph_pools_spinlock);
+        list_del_init(&pool->eph_pool_list);
+        spin_unlock(&eph_pools_spinlock);
+    }
+    ASSERT(list_empty(&pool->ephemeral_page_list));
     pool->client = NULL;
     xfree(pool);
 }
@@ -730,10 +753,11 @@ static void shared_pool_reassign(struct tmem_pool *pool)
         if (new_client->pools[poolid] == pool)
             break;
     ASSERT(poolid != MAX_POOLS_PER_DOMAIN);
-    new_client->eph_count += _atomic_read(pool->pgp_count);
-    old_client->eph_count -= _atomic_read(pool->pgp_count);
-    list_splice_init(&old_client->ephemeral_page_list,
-                     &new_client->ephemeral_page_list);
+    /* The pages stay on the pool's LRU; only the accounting moves. */
+    spin_lock(&pool->eph_lock);
+    atomic_add(pool->eph_count, &new_client->eph_count);
+    atomic_sub(pool->eph_count, &old_client->eph_count);
+    spin_unlock(&pool->eph_lock);
     tmem_client_info("reassigned shared pool from %s=%d to %s=%d pool_id=%d\n",
         tmem_cli_id_str, old_client->cli_id, tmem_cli_id_str, new_client->cli_id, poolid);
     pool->pool_id = poolid;
@@ -851,7 +875,6 @@ static struct client *client_create(domid_t cli_id)
         client->shared_auth_uuid[i][0] =
             client->shared_auth_uuid[i][1] = -1L;
     list_add_tail(&client->client_list, &tmem_global.client_list);
-    INIT_LIST_HEAD(&client->ephemeral_page_list);
     INIT_LIST_HEAD(&client->persistent_invalidated_list);
     tmem_client_info("ok\n");
     return client;
@@ -888,12 +911,13 @@ static void client_flush(struct client *client)
 static bool_t client_over_quota(struct client *client)
 {
     int total = _atomic_read(tmem_global.client_weight_total);
+    long eph_count;
 
     ASSERT(client != NULL);
-    if ( (total == 0) || (client->info.weight == 0) ||
-          (client->eph_count == 0) )
+    eph_count = _atomic_read(client->eph_count);
+    if ( (total == 0) || (client->info.weight == 0) || (eph_count == 0) )
         return 0;
-    return ( ((tmem_global.eph_count*100L) / client->eph_count ) >
+    return ( ((_atomic_read(tmem_global.eph_count)*100L) / eph_count ) >
              ((total*100L) / client->info.weight) );
 }
 
@@ -920,46 +944,84 @@ static bool_t tmem_try_to_evict_pgp(struct tmem_page_descriptor *pgp, bool_t *ho
     return 0;
 }
 
+/*
+ * Find an evictable page on pool's LRU.  On success pool->eph_lock is left
+ * held and the page's object locked as tmem_try_to_evict_pgp() describes.
+ */
+static struct tmem_page_descriptor *tmem_evict_from_pool(
+    struct tmem_pool *pool, bool_t *hold_pool_rwlock)
+{
+    struct tmem_page_descriptor *pgp;
+
+    spin_lock(&pool->eph_lock);
+    list_for_each_entry(pgp, &pool->ephemeral_page_list, us.pool_eph_pages)
+        if ( tmem_try_to_evict_pgp(pgp, hold_pool_rwlock) )
+            return pgp;
+    spin_unlock(&pool->eph_lock);
+    return NULL;
+}
+
 int tmem_evict(void)
 {
     struct client *client = current->domain->tmem_client;
     struct tmem_page_descriptor *pgp = NULL, *pgp_del;
     struct tmem_object_root *obj;
-    struct tmem_pool *pool;
+    struct tmem_pool *pool, *oldest = NULL;
+    uint64_t oldest_stamp = 0;
     int ret = 0;
     bool_t hold_pool_rwlock = 0;
 
     tmem_stats.evict_attempts++;
-    spin_lock(&eph_lists_spinlock);
-    if ( (client != NULL) && client_over_quota(client) &&
-         !list_empty(&client->ephemeral_page_list) )
-    {
-        list_for_each_entry(pgp, &client->ephemeral_page_list, us.client_eph_pages)
-            if ( tmem_try_to_evict_pgp(pgp, &hold_pool_rwlock) )
-                goto found;
-    }
-    else if ( !list_empty(&tmem_global.ephemeral_page_list) )
+    /* Only an over quota client's own pools are candidates. */
+    if ( (client != NULL) && !client_over_quota(client) )
+        client = NULL;
+
+    spin_lock(&eph_pools_spinlock);
+    /*
+     * There's no global LRU any more: approximate it by starting with the
+     * pool whose least recently used page is oldest.
+     */
+    list_for_each_entry(pool, &tmem_global.eph_pool_list, eph_pool_list)
     {
-        list_for_each_entry(pgp, &tmem_global.ephemeral_page_list, global_eph_pages)
-            if ( tmem_try_to_evict_pgp(pgp, &hold_pool_rwlock) )
+        if ( client != NULL && pool->client != client )
+            continue;
+        spin_lock(&pool->eph_lock);
+        if ( !list_empty(&pool->ephemeral_page_list) )
+        {
+            pgp = list_first_entry(&pool->ephemeral_page_list,
+                                   struct tmem_page_descriptor,
+                                   us.pool_eph_pages);
+            if ( oldest == NULL || pgp->timestamp < oldest_stamp )
             {
-                client = pgp->us.obj->pool->client;
-                goto found;
+                oldest = pool;
+                oldest_stamp = pgp->timestamp;
             }
+        }
+        spin_unlock(&pool->eph_lock);
+    }
+
+    if ( oldest != NULL &&
+         (pgp = tmem_evict_from_pool(oldest, &hold_pool_rwlock)) != NULL )
+    {
+        pool = oldest;
+        goto found;
+    }
+    list_for_each_entry(pool, &tmem_global.eph_pool_list, eph_pool_list)
+    {
+        if ( pool == oldest || (client != NULL && pool->client != client) )
+            continue;
+        if ( (pgp = tmem_evict_from_pool(pool, &hold_pool_rwlock)) != NULL )
+            goto found;
     }
-     /* Global_ephemeral_page_list is empty, so we bail out. */
-    spin_unlock(&eph_lists_spinlock);
+    /* Nothing evictable in any ephemeral pool, so we bail out. */
+    spin_unlock(&eph_pools_spinlock);
     goto out;
 
 found:
     /* Delist. */
-    list_del_init(&pgp->us.client_eph_pages);
-    client->eph_count--;
-    list_del_init(&pgp->global_eph_pages);
-    tmem_global.eph_count--;
-    ASSERT(tmem_global.eph_count >= 0);
-    ASSERT(client->eph_count >= 0);
-    spin_unlock(&eph_lists_spinlock);
+    pgp_eph_delist(pgp, pool);
+    spin_unlock(&pool->eph_lock);
+    spin_unlock(&eph_pools_spinlock);
 
     ASSERT(pgp != NULL);
     obj = pgp->us.obj;
@@ -1030,7 +1092,8 @@ static int do_tmem_put_compress(struct tmem_page_descriptor *pgp, xen_pfn_t cmfn
 
     if ( pgp->pfp != NULL )
         pgp_free_data(pgp, pgp->us.obj->pool);
-    ret = tmem_compress_from_client(cmfn, &dst, &size, clibuf);
+    ret = tmem_compress_from_client(cmfn, &dst, &size, clibuf,
+                                    pgp->us.obj->pool->lz4);
     if ( ret <= 0 )
         goto out;
     else if ( (size == 0) || (size >= tmem_mempool_maxalloc) ) {
@@ -1098,6 +1161,13 @@ copy_uncompressed:
 
 done:
     /* Successfully replaced data, clean up and return success. */
+    if ( !is_persistent(pool) )
+    {
+        spin_lock(&pool->eph_lock);
+        pgp->timestamp = get_cycles();
+        list_move_tail(&pgp->us.pool_eph_pages, &pool->ephemeral_page_list);
+        spin_unlock(&pool->eph_lock);
+    }
     if ( is_shared(pool) )
         obj->last_client = client->cli_id;
     spin_unlock(&obj->obj_spinlock);
@@ -1234,15 +1304,19 @@ copy_uncompressed:
 insert_page:
     if ( !is_persistent(pool) )
     {
-        spin_lock(&eph_lists_spinlock);
-        list_add_tail(&pgp->global_eph_pages, &tmem_global.ephemeral_page_list);
-        if (++tmem_global.eph_count > tmem_stats.global_eph_count_max)
-            tmem_stats.global_eph_count_max = tmem_global.eph_count;
-        list_add_tail(&pgp->us.client_eph_pages,
-            &client->ephemeral_page_list);
-        if (++client->eph_count > client->eph_count_max)
-            client->eph_count_max = client->eph_count;
-        spin_unlock(&eph_lists_spinlock);
+        long count;
+
+        spin_lock(&pool->eph_lock);
+        list_add_tail(&pgp->us.pool_eph_pages, &pool->ephemeral_page_list);
+        pool->eph_count++;
+        /* The maxima are only statistics, so updating them racily is fine. */
+        count = atomic_inc_return(&pool->client->eph_count);
+        if ( count > pool->client->eph_count_max )
+            pool->client->eph_count_max = count;
+        spin_unlock(&pool->eph_lock);
+        count = atomic_inc_return(&tmem_global.eph_count);
+        if ( count > tmem_stats.global_eph_count_max )
+            tmem_stats.global_eph_count_max = count;
     }
     else
     { /* is_persistent. */
@@ -1319,7 +1393,8 @@ static int do_tmem_get(struct tmem_pool *pool,
     ASSERT(pgp->size != -1);
     if ( pgp->size != 0 )
     {
-        rc = tmem_decompress_to_client(cmfn, pgp->cdata, pgp->size, clibuf);
+        rc = tmem_decompress_to_client(cmfn, pgp->cdata, pgp->size, clibuf,
+                                       pool->lz4);
     }
     else
         rc = tmem_copy_to_client(cmfn, pgp->pfp, clibuf);
@@ -1339,12 +1414,10 @@ static int do_tmem_get(struct tmem_pool *pool,
                 write_unlock(&pool->pool_rwlock);
             }
         } else {
-            spin_lock(&eph_lists_spinlock);
-            list_del(&pgp->global_eph_pages);
-            list_add_tail(&pgp->global_eph_pages,&tmem_global.ephemeral_page_list);
-            list_del(&pgp->us.client_eph_pages);
-            list_add_tail(&pgp->us.client_eph_pages,&client->ephemeral_page_list);
-            spin_unlock(&eph_lists_spinlock);
+            spin_lock(&pool->eph_lock);
+            pgp->timestamp = get_cycles();
+            list_move_tail(&pgp->us.pool_eph_pages, &pool->ephemeral_page_list);
+            spin_unlock(&pool->eph_lock);
             obj->last_client = current->domain->domain_id;
         }
     }
@@ -1515,8 +1588,15 @@ static int do_tmem_new_pool(domid_t this_cli_id,
     pool->pool_id = d_poolid;
     pool->shared = shared;
     pool->persistent = persistent;
+    pool->lz4 = (flags & TMEM_POOL_LZ4) || tmem_compress_lz4();
     pool->uuid[0] = uuid_lo;
     pool->uuid[1] = uuid_hi;
+    if ( !persistent )
+    {
+        spin_lock(&eph_pools_spinlock);
+        list_add_tail(&pool->eph_pool_list, &tmem_global.eph_pool_list);
+        spin_unlock(&eph_pools_spinlock);
+    }
 
     /*
      * Already created a pool when arrived here, but need some special process
@@ -9,6 +9,7 @@
 #include <xen/tmem.h>
 #include <xen/tmem_xen.h>
 #include <xen/lzo.h> /* compression code */
+#include <xen/lz4.h>
 #include <xen/paging.h>
 #include <xen/domain_page.h>
 #include <xen/cpu.h>
@@ -20,6 +21,9 @@ boolean_param("tmem", opt_tmem);
 bool_t __read_mostly opt_tmem_compress = 0;
 boolean_param("tmem_compress", opt_tmem_compress);
 
+bool_t __read_mostly opt_tmem_compress_lz4 = 0;
+boolean_param("tmem_compress_lz4", opt_tmem_compress_lz4);
+
 bool_t __read_mostly opt_tmem_shared_auth = 0;
 boolean_param("tmem_shared_auth", opt_tmem_shared_auth);
 
@@ -121,7 +125,7 @@ int tmem_copy_from_client(struct page_info *pfp,
 }
 
 int tmem_compress_from_client(xen_pfn_t cmfn,
-    void **out_va, size_t *out_len, tmem_cli_va_param_t clibuf)
+    void **out_va, size_t *out_len, tmem_cli_va_param_t clibuf, bool_t lz4)
 {
     int ret = 0;
     unsigned char *dmem = this_cpu(dstmem);
@@ -144,8 +148,17 @@ int tmem_compress_from_client(xen_pfn_t cmfn,
     else if ( copy_from_guest(scratch, clibuf, PAGE_SIZE) )
         return -EFAULT;
     smp_mb();
-    ret = lzo1x_1_compress(cli_va ?: scratch, PAGE_SIZE, dmem, out_len, wmem);
-    ASSERT(ret == LZO_E_OK);
+    if ( lz4 )
+    {
+        ret = lz4_compress(cli_va ?: scratch, PAGE_SIZE, dmem, out_len, wmem);
+        ASSERT(ret == 0);
+    }
+    else
+    {
+        ret = lzo1x_1_compress(cli_va ?: scratch, PAGE_SIZE, dmem, out_len,
+                               wmem);
+        ASSERT(ret == LZO_E_OK);
+    }
     *out_va = dmem;
     if ( cli_va )
         cli_put_page(cli_va, cli_pfp, cli_mfn, 0);
@@ -182,7 +195,8 @@ int tmem_copy_to_client(xen_pfn_t cmfn, struct page_info *pfp,
 }
 
 int tmem_decompress_to_client(xen_pfn_t cmfn, void *tmem_va,
-                                    size_t size, tmem_cli_va_param_t clibuf)
+                              size_t size, tmem_cli_va_param_t clibuf,
+                              bool_t lz4)
 {
     unsigned long cli_mfn = 0;
     struct page_info *cli_pfp = NULL;
@@ -199,9 +213,21 @@ int tmem_decompress_to_client(xen_pfn_t cmfn, void *tmem_va,
     }
     else if ( !scratch )
         return 0;
-    ret = lzo1x_decompress_safe(tmem_va, size, cli_va ?: scratch, &out_len);
-    ASSERT(ret == LZO_E_OK);
-    ASSERT(out_len == PAGE_SIZE);
+    if ( lz4 )
+    {
+        size_t in_len;
+
+        ret = lz4_decompress(tmem_va, &in_len, cli_va ?: scratch, PAGE_SIZE);
+        ASSERT(ret == 0);
+        ASSERT(in_len == size);
+    }
+    else
+    {
+        ret = lzo1x_decompress_safe(tmem_va, size, cli_va ?: scratch,
+                                    &out_len);
+        ASSERT(ret == LZO_E_OK);
+        ASSERT(out_len == PAGE_SIZE);
+    }
     if ( cli_va )
         cli_put_page(cli_va, cli_pfp, cli_mfn, 1);
     else if ( copy_to_guest(clibuf, scratch, PAGE_SIZE) )
@@ -264,7 +290,8 @@ int __init tmem_init(void)
     unsigned int cpu;
 
     dstmem_order = get_order_from_pages(LZO_DSTMEM_PAGES);
-    workmem_order = get_order_from_bytes(LZO1X_1_MEM_COMPRESS);
+    workmem_order = get_order_from_bytes(max_t(size_t, LZO1X_1_MEM_COMPRESS,
+                                               LZ4_MEM_COMPRESS));
 
     for_each_online_cpu ( cpu )
     {
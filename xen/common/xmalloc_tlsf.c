@@ -23,8 +23,12 @@
  * Adapted for Xen by Dan Magenheimer (dan.magenheimer@oracle.com)
  */
 
+#include <xen/cpu.h>
+#include <xen/init.h>
 #include <xen/irq.h>
+#include <xen/keyhandler.h>
 #include <xen/mm.h>
+#include <xen/percpu.h>
 #include <xen/pfn.h>
 #include <asm/time.h>
 
@@ -559,6 +563,315 @@ static void tlsf_init(void)
     BUG_ON(!xenpool);
 }
 
+/*
+ * Per-CPU magazine caches.
+ *
+ * Small xmalloc() requests without special alignment are served from
+ * per-CPU magazines of xenpool blocks, one pair per size class, so that
+ * the common case takes no lock at all.  A magazine is a fixed-size stack
+ * of blocks which are still allocated as far as TLSF is concerned.
+ * Having a loaded and a previous magazine lets a CPU absorb a run of
+ * allocations or frees of up to a magazine's worth without touching
+ * shared state.  Only once both are empty (or both full) is a whole
+ * magazine exchanged with the size class' depot, so the depot lock is
+ * taken once per XMEM_MAG_ROUNDS operations rather than once per block.
+ *
+ * Blocks freed on a CPU other than the one they were allocated on simply
+ * go into the freeing CPU's magazines.  The full magazines that CPU
+ * produces are handed to the depot, from where the allocating CPU picks
+ * them up in exchange for its empty ones.  Full magazines beyond
+ * XMEM_DEPOT_MAX, and those of CPUs going offline, go back to TLSF.
+ *
+ * The per-CPU state is only ever touched by its own CPU (xmalloc() may
+ * not be used in IRQ context), or by the CPU notifier once its owner is
+ * dead, and so needs no locking.
+ */
+#define XMEM_MAG_ROUNDS   14 /* Makes a magazine 128 bytes on 64-bit. */
+#define XMEM_MAG_MAX_SIZE 512
+#define XMEM_NR_CLASSES   16
+#define XMEM_DEPOT_MAX    8  /* Full magazines kept per size class. */
+#define XMEM_NO_CLASS     0xff
+
+struct xmem_magazine {
+    struct xmem_magazine *next;
+    unsigned int rounds;
+    void *round[XMEM_MAG_ROUNDS];
+};
+
+static const unsigned short xmem_class_size[XMEM_NR_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512
+};
+
+/* Block size (in MEM_ALIGN units) to smallest class it fits in ... */
+static u8 __read_mostly xmem_class_up[XMEM_MAG_MAX_SIZE / MEM_ALIGN + 1];
+/* ... and to the largest class it can serve. */
+static u8 __read_mostly xmem_class_down[XMEM_MAG_MAX_SIZE / MEM_ALIGN + 1];
+
+struct xmem_cpu_class {
+    struct xmem_magazine *loaded, *prev;
+    unsigned int nr;              /* Blocks in loaded and prev */
+    unsigned long alloc_hit, alloc_miss, free_hit, free_miss;
+};
+
+struct xmem_cpu_cache {
+    struct xmem_cpu_class class[XMEM_NR_CLASSES];
+};
+
+static DEFINE_PER_CPU(struct xmem_cpu_cache, xmem_cache);
+
+static struct xmem_depot {
+    spinlock_t lock;
+    struct xmem_magazine *full, *empty;
+    unsigned int nr_full, nr_empty;
+    unsigned long exchanges, spills;
+} xmem_depot[XMEM_NR_CLASSES];
+
+/* xmalloc_cache=<bool> -> Use per-CPU magazines for small allocations. */
+static bool_t __initdata opt_xmem_cache = 1;
+boolean_param("xmalloc_cache", opt_xmem_cache);
+
+static bool_t __read_mostly xmem_cache_enabled;
+
+/* Return a magazine and the blocks in it to TLSF. */
+static void xmem_mag_release(struct xmem_magazine *m)
+{
+    while ( m->rounds )
+        xmem_pool_free(m->round[--m->rounds], xenpool);
+    xmem_pool_free(m, xenpool);
+}
+
+static void *xmem_cache_alloc(unsigned int idx)
+{
+    struct xmem_cpu_class *c = &this_cpu(xmem_cache).class[idx];
+    struct xmem_depot *dp = &xmem_depot[idx];
+    struct xmem_magazine *m = c->loaded, *spare = NULL;
+
+    if ( !m || !m->rounds )
+    {
+        if ( c->prev && c->prev->rounds )
+        {
+            c->loaded = c->prev;
+            c->prev = m;
+        }
+        else
+        {
+            /* Trade the empty previous magazine for a full one. */
+            spin_lock(&dp->lock);
+            if ( (m = dp->full) != NULL )
+            {
+                dp->full = m->next;
+                dp->nr_full--;
+                dp->exchanges++;
+                if ( c->prev && dp->nr_empty < XMEM_DEPOT_MAX )
+                {
+                    c->prev->next = dp->empty;
+                    dp->empty = c->prev;
+                    dp->nr_empty++;
+                }
+                else
+                    spare = c->prev;
+                c->prev = c->loaded;
+                c->loaded = m;
+                c->nr += XMEM_MAG_ROUNDS;
+            }
+            spin_unlock(&dp->lock);
+
+            if ( spare )
+                xmem_pool_free(spare, xenpool);
+
+            if ( !m )
+            {
+                c->alloc_miss++;
+                return NULL;
+            }
+        }
+    }
+
+    m = c->loaded;
+    c->nr--;
+    c->alloc_hit++;
+
+    return m->round[--m->rounds];
+}
+
+static bool_t xmem_cache_free(void *p, unsigned int idx)
+{
+    struct xmem_cpu_class *c = &this_cpu(xmem_cache).class[idx];
+    struct xmem_depot *dp = &xmem_depot[idx];
+    struct xmem_magazine *m = c->loaded, *spill = NULL;
+
+    if ( !m || m->rounds == XMEM_MAG_ROUNDS )
+    {
+        if ( c->prev && c->prev->rounds < XMEM_MAG_ROUNDS )
+        {
+            c->loaded = c->prev;
+            c->prev = m;
+        }
+        else
+        {
+            /* Trade the full previous magazine for an empty one. */
+            spin_lock(&dp->lock);
+            if ( (m = dp->empty) != NULL )
+            {
+                dp->empty = m->next;
+                dp->nr_empty--;
+            }
+            spin_unlock(&dp->lock);
+
+            if ( !m &&
+                 (m = xmem_pool_alloc(sizeof(*m), xenpool)) == NULL )
+            {
+                c->free_miss++;
+                return 0;
+            }
+            m->rounds = 0;
+
+            if ( c->prev )
+            {
+                spin_lock(&dp->lock);
+                dp->exchanges++;
+                if ( dp->nr_full < XMEM_DEPOT_MAX )
+                {
+                    c->prev->next = dp->full;
+                    dp->full = c->prev;
+                    dp->nr_full++;
+                }
+                else
+                {
+                    spill = c->prev;
+                    dp->spills++;
+                }
+                spin_unlock(&dp->lock);
+                c->nr -= XMEM_MAG_ROUNDS;
+            }
+            c->prev = c->loaded;
+            c->loaded = m;
+
+            if ( spill )
+                xmem_mag_release(spill);
+        }
+    }
+
+    m = c->loaded;
+    m->round[m->rounds++] = p;
+    c->nr++;
+    c->free_hit++;
+
+    return 1;
+}
+
+static void xmem_cache_flush_cpu(unsigned int cpu)
+{
+    struct xmem_cpu_cache *cache = &per_cpu(xmem_cache, cpu);
+    unsigned int i;
+
+    for ( i = 0; i < XMEM_NR_CLASSES; i++ )
+    {
+        struct xmem_cpu_class *c = &cache->class[i];
+
+        if ( c->loaded )
+            xmem_mag_release(c->loaded);
+        if ( c->prev )
+            xmem_mag_release(c->prev);
+        c->loaded = c->prev = NULL;
+        c->nr = 0;
+    }
+}
+
+static void dump_xmem_cache(unsigned char key)
+{
+    unsigned int i, cpu;
+
+    printk("xmalloc: pool %lukB in use of %lukB, %u blocks per magazine\n",
+           xmem_pool_get_used_size(xenpool) >> 10,
+           xmem_pool_get_total_size(xenpool) >> 10, XMEM_MAG_ROUNDS);
+    if ( !xmem_cache_enabled )
+        return;
+
+    printk(" size  cpu-cached  depot(full/empty)  alloc-hit/miss"
+           "  free-hit/miss  exchanges  spills\n");
+    for ( i = 0; i < XMEM_NR_CLASSES; i++ )
+    {
+        const struct xmem_depot *dp = &xmem_depot[i];
+        unsigned long nr = 0, ahit = 0, amiss = 0, fhit = 0, fmiss = 0;
+
+        for_each_online_cpu ( cpu )
+        {
+            const struct xmem_cpu_class *c =
+                &per_cpu(xmem_cache, cpu).class[i];
+
+            nr += c->nr;
+            ahit += c->alloc_hit;
+            amiss += c->alloc_miss;
+            fhit += c->free_hit;
+            fmiss += c->free_miss;
+        }
+
+        printk(" %4u  %10lu  %8u/%-8u  %lu/%lu  %lu/%lu  %lu  %lu\n",
+               xmem_class_size[i], nr, dp->nr_full, dp->nr_empty,
+               ahit, amiss, fhit, fmiss, dp->exchanges, dp->spills);
+    }
+}
+
+static int cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        memset(&per_cpu(xmem_cache, cpu), 0, sizeof(struct xmem_cpu_cache));
+        break;
+    case CPU_UP_CANCELED:
+    case CPU_DEAD:
+        xmem_cache_flush_cpu(cpu);
+        break;
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_nfb = {
+    .notifier_call = cpu_callback
+};
+
+static int __init xmem_cache_init(void)
+{
+    unsigned int i, idx, up = 0, down = XMEM_NO_CLASS;
+
+    register_keyhandler('X', dump_xmem_cache, "dump xmalloc caches", 1);
+
+    if ( !opt_xmem_cache )
+        return 0;
+
+    BUILD_BUG_ON(XMEM_NR_CLASSES >= XMEM_NO_CLASS);
+    for ( i = 0; i < XMEM_NR_CLASSES; i++ )
+        spin_lock_init(&xmem_depot[i].lock);
+
+    for ( idx = 0; idx <= XMEM_MAG_MAX_SIZE / MEM_ALIGN; idx++ )
+    {
+        while ( xmem_class_size[up] < idx * MEM_ALIGN )
+            up++;
+        if ( xmem_class_size[up] == idx * MEM_ALIGN )
+            down = up;
+        xmem_class_up[idx] = up;
+        xmem_class_down[idx] = down;
+    }
+
+    if ( !xenpool )
+        tlsf_init();
+
+    cpu_callback(&cpu_nfb, CPU_UP_PREPARE, (void *)(long)smp_processor_id());
+    register_cpu_notifier(&cpu_nfb);
+    xmem_cache_enabled = 1;
+
+    return 0;
+}
+presmp_initcall(xmem_cache_init);
+
 /*
  * xmalloc()
  */
@@ -586,7 +899,16 @@ void *_xmalloc(unsigned long size, unsigned long align)
     if ( !xenpool )
         tlsf_init();
 
-    if ( size < PAGE_SIZE )
+    if ( xmem_cache_enabled && align == MEM_ALIGN &&
+         size <= XMEM_MAG_MAX_SIZE )
+    {
+        unsigned int idx = xmem_class_up[ROUNDUP_SIZE(size) / MEM_ALIGN];
+
+        p = xmem_cache_alloc(idx);
+        if ( p == NULL )
+            p = xmem_pool_alloc(xmem_class_size[idx], xenpool);
+    }
+    else if ( size < PAGE_SIZE )
         p = xmem_pool_alloc(size, xenpool);
     if ( p == NULL )
         return xmalloc_whole_pages(size - align + MEM_ALIGN, align);
@@ -648,5 +970,15 @@ void xfree(void *p)
         ASSERT(!(b->size & 1));
     }
 
+    if ( xmem_cache_enabled &&
+         (b->size & BLOCK_SIZE_MASK) <= XMEM_MAG_MAX_SIZE )
+    {
+        unsigned int idx =
+            xmem_class_down[(b->size & BLOCK_SIZE_MASK) / MEM_ALIGN];
+
+        if ( idx != XMEM_NO_CLASS && xmem_cache_free(p, idx) )
+            return;
+    }
+
     xmem_pool_free(p, xenpool);
 }
@@ -42,6 +42,7 @@ integer_param("iommu_dev_iotlb_timeout", iommu_dev_iotlb_timeout);
  *   dom0-passthrough           No DMA translation at all for Dom0
  *   dom0-strict                No 1:1 memory mapping for Dom0
  *   no-sharept                 Don't share VT-d and EPT page tables
+ *   no-superpages              Only use 4k pages in IOMMU page tables
  *   no-snoop                   Disable VT-d Snoop Control
  *   no-qinval                  Disable VT-d Queued Invalidation
  *   no-igfx                    Disable VT-d for IGD devices (insecure)
@@ -60,6 +61,7 @@ bool_t __read_mostly iommu_passthrough;
 bool_t __read_mostly iommu_snoop = 1;
 bool_t __read_mostly iommu_qinval = 1;
 bool_t __read_mostly iommu_intremap = 1;
+bool_t __read_mostly iommu_superpages = 1;
 
 /*
  * In the current implementation of VT-d posted interrupts, in some extreme
@@ -124,6 +126,8 @@ static void __init parse_iommu_param(char *s)
             iommu_dom0_strict = val;
         else if ( !strcmp(s, "sharept") )
             iommu_hap_pt_share = val;
+        else if ( !strcmp(s, "superpages") )
+            iommu_superpages = val;
 
         s = ss + 1;
     } while ( ss );
@@ -296,6 +300,129 @@ int iommu_unmap_page(struct domain *d, unsigned long gfn)
     return rc;
 }
 
+static int __must_check iommu_iotlb_flush_range(struct domain *d,
+                                                unsigned long gfn,
+                                                unsigned long page_count)
+{
+    const struct domain_iommu *hd = dom_iommu(d);
+
+    if ( page_count > UINT_MAX )
+        return hd->platform_ops->iotlb_flush_all ?
+               hd->platform_ops->iotlb_flush_all(d) : 0;
+
+    return hd->platform_ops->iotlb_flush ?
+           hd->platform_ops->iotlb_flush(d, gfn, page_count) : 0;
+}
+
+int iommu_map_pages(struct domain *d, unsigned long gfn, unsigned long mfn,
+                    unsigned long page_count, unsigned int flags)
+{
+    const struct domain_iommu *hd = dom_iommu(d);
+    unsigned long i;
+    bool_t dont_flush;
+    int rc = 0;
+
+    if ( !iommu_enabled || !hd->platform_ops || !page_count )
+        return 0;
+
+    if ( hd->platform_ops->map_pages )
+        rc = hd->platform_ops->map_pages(d, gfn, mfn, page_count, flags);
+    else
+    {
+        /* Flush once for the whole range, rather than for each page. */
+        dont_flush = this_cpu(iommu_dont_flush_iotlb);
+        this_cpu(iommu_dont_flush_iotlb) = 1;
+
+        for ( i = 0; i < page_count; i++ )
+        {
+            rc = hd->platform_ops->map_page(d, gfn + i, mfn + i, flags);
+            if ( unlikely(rc) )
+            {
+                while ( i-- )
+                    /* If statement to satisfy __must_check. */
+                    if ( hd->platform_ops->unmap_page(d, gfn + i) )
+                        continue;
+                break;
+            }
+        }
+
+        this_cpu(iommu_dont_flush_iotlb) = dont_flush;
+
+        if ( !dont_flush )
+        {
+            int ret = iommu_iotlb_flush_range(d, gfn, page_count);
+
+            if ( !rc )
+                rc = ret;
+        }
+    }
+
+    if ( unlikely(rc) )
+    {
+        if ( !d->is_shutting_down && printk_ratelimit() )
+            printk(XENLOG_ERR
+                   "d%d: IOMMU mapping gfn %#lx to mfn %#lx (%lu pages) failed: %d\n",
+                   d->domain_id, gfn, mfn, page_count, rc);
+
+        if ( !is_hardware_domain(d) )
+            domain_crash(d);
+    }
+
+    return rc;
+}
+
+int iommu_unmap_pages(struct domain *d, unsigned long gfn,
+                      unsigned long page_count)
+{
+    const struct domain_iommu *hd = dom_iommu(d);
+    unsigned long i;
+    bool_t dont_flush;
+    int rc = 0;
+
+    if ( !iommu_enabled || !hd->platform_ops || !page_count )
+        return 0;
+
+    if ( hd->platform_ops->unmap_pages )
+        rc = hd->platform_ops->unmap_pages(d, gfn, page_count);
+    else
+    {
+        dont_flush = this_cpu(iommu_dont_flush_iotlb);
+        this_cpu(iommu_dont_flush_iotlb) = 1;
+
+        /* Carry on after errors, to unmap as much as possible. */
+        for ( i = 0; i < page_count; i++ )
+        {
+            int ret = hd->platform_ops->unmap_page(d, gfn + i);
+
+            if ( !rc )
+                rc = ret;
+        }
+
+        this_cpu(iommu_dont_flush_iotlb) = dont_flush;
+
+        if ( !dont_flush )
+        {
+            int ret = iommu_iotlb_flush_range(d, gfn, page_count);
+
+            if ( !rc )
+                rc = ret;
+        }
+    }
+
+    if ( unlikely(rc) )
+    {
+        if ( !d->is_shutting_down && printk_ratelimit() )
+            printk(XENLOG_ERR
+                   "d%d: IOMMU unmapping gfn %#lx (%lu pages) failed: %d\n",
+                   d->domain_id, gfn, page_count, rc);
+
+        if ( !is_hardware_domain(d) )
+            domain_crash(d);
+    }
+
+    return rc;
+}
+
 static void iommu_free_pagetables(unsigned long unused)
 {
     do {
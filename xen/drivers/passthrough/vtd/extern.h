@@ -57,9 +57,26 @@ struct acpi_drhd_unit * find_ats_dev_drhd(struct iommu *iommu);
 
 int ats_device(const struct pci_dev *, const struct acpi_drhd_unit *);
 
+/*
+ * Queued invalidation descriptors posted through a batch complete together,
+ * behind the single wait descriptor posted by qinval_batch_sync().
+ */
+struct qinval_batch {
+    struct iommu *iommu;
+    unsigned int nr;         /* descriptors posted since the last wait */
+    bool_t dev_iotlb;        /* any of them device IOTLB invalidations */
+};
+
+void qinval_batch_init(struct qinval_batch *batch, struct iommu *iommu);
+int __must_check qinval_batch_sync(struct qinval_batch *batch);
+
+/* Posts to batch if there is one, else waits for each device in turn. */
 int dev_invalidate_iotlb(struct iommu *iommu, u16 did,
-                         u64 addr, unsigned int size_order, u64 type);
+                         u64 addr, unsigned int size_order, u64 type,
+                         struct qinval_batch *batch);
 
+void qinval_device_iotlb(struct qinval_batch *batch, struct pci_dev *pdev,
+                         u16 size, u64 addr);
 int __must_check qinval_device_iotlb_sync(struct iommu *iommu,
                                           struct pci_dev *pdev,
                                           u16 did, u16 size, u64 addr);
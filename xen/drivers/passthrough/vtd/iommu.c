@@ -52,6 +52,12 @@ bool_t __read_mostly untrusted_msi;
 
 int nr_iommus;
 
+/*
+ * Highest page table level at which all IOMMUs support leaf entries when
+ * not sharing EPT: 1 for 4k pages only, 2 for 2M and 3 for 1G superpages.
+ */
+static unsigned int __read_mostly max_leaf_level = 1;
+
 static struct tasklet vtd_fault_tasklet;
 
 static int setup_hwdom_device(u8 devfn, struct pci_dev *);
@@ -546,6 +552,38 @@ static int __must_check iommu_flush_iotlb_psi(struct iommu *iommu, u16 did,
     return status;
 }
 
+/*
+ * Queued invalidation can cover a range with several page selective
+ * invalidations and a single wait; register based invalidation would have
+ * to wait for each, so invalidates the whole domain instead.
+ */
+static int __must_check iommu_flush_iotlb_range(struct iommu *iommu, u16 did,
+                                                u64 addr,
+                                                unsigned long nr_pages,
+                                                bool_t flush_non_present_entry,
+                                                bool_t flush_dev_iotlb)
+{
+    struct iommu_flush *flush = iommu_get_flush(iommu);
+    int status;
+
+    ASSERT(!(addr & (~PAGE_MASK_4K)));
+
+    if ( !flush->iotlb_range || !cap_pgsel_inv(iommu->cap) )
+        return iommu_flush_iotlb_dsi(iommu, did, flush_non_present_entry,
+                                     flush_dev_iotlb);
+
+    /* apply platform specific errata workarounds */
+    vtd_ops_preamble_quirk(iommu);
+
+    status = flush->iotlb_range(iommu, did, addr, nr_pages,
+                                flush_non_present_entry, flush_dev_iotlb);
+
+    /* undo platform specific errata workarounds */
+    vtd_ops_postamble_quirk(iommu);
+
+    return status;
+}
+
 static int __must_check iommu_flush_all(void)
 {
     struct acpi_drhd_unit *drhd;
@@ -612,15 +650,20 @@ static int __must_check iommu_flush_iotlb(struct domain *d,
         if ( iommu_domid == -1 )
             continue;
 
-        if ( page_count != 1 || gfn == gfn_x(INVALID_GFN) )
+        if ( !page_count || gfn == gfn_x(INVALID_GFN) )
             rc = iommu_flush_iotlb_dsi(iommu, iommu_domid,
                                        0, flush_dev_iotlb);
-        else
+        else if ( page_count == 1 )
             rc = iommu_flush_iotlb_psi(iommu, iommu_domid,
                                        (paddr_t)gfn << PAGE_SHIFT_4K,
                                        PAGE_ORDER_4K,
                                        !dma_old_pte_present,
                                        flush_dev_iotlb);
+        else
+            rc = iommu_flush_iotlb_range(iommu, iommu_domid,
+                                         (paddr_t)gfn << PAGE_SHIFT_4K,
+                                         page_count, !dma_old_pte_present,
+                                         flush_dev_iotlb);
 
         if ( rc > 0 )
         {
@@ -644,45 +687,6 @@ static int __must_check iommu_flush_iotlb_all(struct domain *d)
     return iommu_flush_iotlb(d, gfn_x(INVALID_GFN), 0, 0);
 }
 
-/* clear one page's page table */
-static int __must_check dma_pte_clear_one(struct domain *domain, u64 addr)
-{
-    struct domain_iommu *hd = dom_iommu(domain);
-    struct dma_pte *page = NULL, *pte = NULL;
-    u64 pg_maddr;
-    int rc = 0;
-
-    spin_lock(&hd->arch.mapping_lock);
-    /* get last level pte */
-    pg_maddr = addr_to_dma_page_maddr(domain, addr, 0);
-    if ( pg_maddr == 0 )
-    {
-        spin_unlock(&hd->arch.mapping_lock);
-        return 0;
-    }
-
-    page = (struct dma_pte *)map_vtd_domain_page(pg_maddr);
-    pte = page + address_level_offset(addr, 1);
-
-    if ( !dma_pte_present(*pte) )
-    {
-        spin_unlock(&hd->arch.mapping_lock);
-        unmap_vtd_domain_page(page);
-        return 0;
-    }
-
-    dma_clear_pte(*pte);
-    spin_unlock(&hd->arch.mapping_lock);
-    iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
-
-    if ( !this_cpu(iommu_dont_flush_iotlb) )
-        rc = iommu_flush_iotlb_pages(domain, addr >> PAGE_SHIFT_4K, 1);
-
-    unmap_vtd_domain_page(page);
-
-    return rc;
-}
-
 static void iommu_free_pagetable(u64 pt_maddr, int level)
 {
     struct page_info *pg = maddr_to_page(pt_maddr);
@@ -711,7 +715,7 @@ static void iommu_free_page_table(struct page_info *pg)
         if ( !dma_pte_present(*pte) )
             continue;
 
-        if ( next_level >= 1 )
+        if ( next_level >= 1 && !dma_pte_superpage(*pte) )
             iommu_free_pagetable(dma_pte_addr(*pte), next_level);
 
         dma_clear_pte(*pte);
@@ -1750,70 +1754,307 @@ static void iommu_domain_teardown(struct domain *d)
     spin_unlock(&hd->arch.mapping_lock);
 }
 
-static int __must_check intel_iommu_map_page(struct domain *d,
-                                             unsigned long gfn,
-                                             unsigned long mfn,
-                                             unsigned int flags)
+/* State of an update of the page table entries for a range of gfns. */
+struct dma_pte_update {
+    unsigned long gfn, mfn;
+    /* IOMMUF_* flags of the new mappings, 0 to unmap. */
+    unsigned int flags;
+    struct acpi_drhd_unit *drhd;
+    /* Some entries changed, including present ones. */
+    bool_t changed, old_present;
+    /* Non-leaf entries changed: cached translations may be stale. */
+    bool_t tables_changed;
+    /* On failure, the first gfn whose entry was not updated. */
+    unsigned long failed_gfn;
+    /* Page tables no longer referenced, to free after the flush. */
+    struct page_list_head free;
+};
+
+static void dma_pte_free_tree(u64 pt_maddr, unsigned int level)
 {
-    struct domain_iommu *hd = dom_iommu(d);
-    struct dma_pte *page = NULL, *pte = NULL, old, new = { 0 };
-    u64 pg_maddr;
+    struct dma_pte *pt = map_vtd_domain_page(pt_maddr);
+    unsigned int i;
+
+    if ( level > 1 )
+        for ( i = 0; i < PTE_NUM; i++ )
+            if ( dma_pte_present(pt[i]) && !dma_pte_superpage(pt[i]) )
+                dma_pte_free_tree(dma_pte_addr(pt[i]), level - 1);
+
+    unmap_vtd_domain_page(pt);
+    free_pgtable_maddr(pt_maddr);
+}
+
+/*
+ * Replace the superpage entry at @level in @pte with a page table mapping
+ * the same range with entries of the level below.
+ */
+static int dma_pte_split(struct dma_pte_update *u, struct dma_pte *pte,
+                         unsigned int level)
+{
+    u64 pt_maddr = alloc_pgtable_maddr(u->drhd, 1);
+    u64 attrs = pte->val & ~(PADDR_MASK & PAGE_MASK_4K);
+    u64 base = dma_pte_addr(*pte);
+    struct dma_pte *pt;
+    unsigned int i;
+
+    if ( !pt_maddr )
+        return -ENOMEM;
+
+    if ( level == 2 )
+        attrs &= ~DMA_PTE_SP;
+
+    pt = map_vtd_domain_page(pt_maddr);
+    for ( i = 0; i < PTE_NUM; i++ )
+        pt[i].val = attrs | (base + offset_level_address(i, level - 1));
+    iommu_flush_cache_page(pt, 1);
+    unmap_vtd_domain_page(pt);
+
+    dma_clear_pte(*pte);
+    dma_set_pte_addr(*pte, pt_maddr);
+    dma_set_pte_readable(*pte);
+    dma_set_pte_writable(*pte);
+    iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+
+    u->tables_changed = 1;
+
+    return 0;
+}
+
+/*
+ * Update the entries for gfns [gfn, end) in the page table at @level,
+ * which covers all of them.  Entries wholly inside the range are replaced
+ * by leaves, using superpages where alignment and hardware allow; partly
+ * covered ones are descended into.
+ */
+static int dma_pte_update_level(struct dma_pte_update *u, u64 pt_maddr,
+                                unsigned int level, unsigned long gfn,
+                                unsigned long end)
+{
+    unsigned int shift = (level - 1) * LEVEL_STRIDE;
+    unsigned long size = 1UL << shift, next, mfn;
+    struct dma_pte *pt = map_vtd_domain_page(pt_maddr), *pte, old, new;
     int rc = 0;
 
-    /* Do nothing if VT-d shares EPT page table */
-    if ( iommu_use_hap_pt(d) )
-        return 0;
+    for ( ; gfn < end; gfn = next )
+    {
+        next = (gfn | (size - 1)) + 1;
+        mfn = u->mfn + (gfn - u->gfn);
+        pte = &pt[(gfn >> shift) & LEVEL_MASK];
 
-    /* Do nothing if hardware domain and iommu supports pass thru. */
-    if ( iommu_passthrough && is_hardware_domain(d) )
+        if ( !(gfn & (size - 1)) && next <= end &&
+             (level == 1 || !u->flags ||
+              (level <= max_leaf_level && !(mfn & (size - 1)))) )
+        {
+            old = *pte;
+            new.val = 0;
+            if ( u->flags )
+            {
+                dma_set_pte_addr(new, (paddr_t)mfn << PAGE_SHIFT_4K);
+                dma_set_pte_prot(new,
+                                 ((u->flags & IOMMUF_readable) ? DMA_PTE_READ  : 0) |
+                                 ((u->flags & IOMMUF_writable) ? DMA_PTE_WRITE : 0));
+                if ( level > 1 )
+                    dma_set_pte_superpage(new);
+
+                /* Set the SNP on leaf page table if Snoop Control available */
+                if ( iommu_snoop )
+                    dma_set_pte_snp(new);
+            }
+
+            if ( old.val == new.val )
+                continue;
+
+            *pte = new;
+            iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+            u->changed = 1;
+
+            if ( !dma_pte_present(old) )
+                continue;
+
+            u->old_present = 1;
+            if ( level > 1 && !dma_pte_superpage(old) )
+            {
+                struct page_info *pg = maddr_to_page(dma_pte_addr(old));
+
+                PFN_ORDER(pg) = level - 1;
+                page_list_add_tail(pg, &u->free);
+                u->tables_changed = 1;
+            }
+            continue;
+        }
+
+        if ( !dma_pte_present(*pte) )
+        {
+            u64 maddr;
+
+            /* Nothing to unmap in there. */
+            if ( !u->flags )
+                continue;
+
+            /*
+             * high level table always sets r/w, last level
+             * page table control read/write
+             */
+            maddr = alloc_pgtable_maddr(u->drhd, 1);
+            if ( !maddr )
+            {
+                u->failed_gfn = gfn;
+                rc = -ENOMEM;
+                break;
+            }
+            dma_set_pte_addr(*pte, maddr);
+            dma_set_pte_readable(*pte);
+            dma_set_pte_writable(*pte);
+            iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+        }
+        else if ( dma_pte_superpage(*pte) )
+        {
+            rc = dma_pte_split(u, pte, level);
+            if ( rc )
+            {
+                u->failed_gfn = gfn;
+                break;
+            }
+        }
+
+        rc = dma_pte_update_level(u, dma_pte_addr(*pte), level - 1, gfn,
+                                  min(next, end));
+        if ( rc )
+            break;
+    }
+
+    unmap_vtd_domain_page(pt);
+
+    return rc;
+}
+
+/*
+ * Update the entries for gfns [gfn, gfn + nr).  Entries are updated in gfn
+ * order, so on failure, those below *@done (if not NULL) were updated and
+ * the others were left alone.
+ */
+static int dma_pte_update_range(struct domain *d, unsigned long gfn,
+                                unsigned long mfn, unsigned long nr,
+                                unsigned int flags, unsigned long *done)
+{
+    struct domain_iommu *hd = dom_iommu(d);
+    unsigned int level = agaw_to_level(hd->arch.agaw);
+    struct dma_pte_update u = {
+        .gfn = gfn,
+        .mfn = mfn,
+        .flags = flags,
+        .failed_gfn = gfn + nr,
+    };
+    struct page_info *pg;
+    int rc = 0, ret = 0;
+
+    if ( done )
+        *done = gfn;
+
+    if ( !nr )
         return 0;
 
+    if ( (gfn + nr - 1) >> (agaw_to_width(hd->arch.agaw) - PAGE_SHIFT_4K) ||
+         gfn + nr - 1 < gfn )
+        return -ERANGE;
+
+    INIT_PAGE_LIST_HEAD(&u.free);
+
+    /*
+     * just get any passthrough device in the domainr - assume user
+     * assigns only devices from same node to a given guest.
+     */
+    u.drhd = acpi_find_matched_drhd_unit(pci_get_pdev_by_domain(d, -1, -1, -1));
+
     spin_lock(&hd->arch.mapping_lock);
 
-    pg_maddr = addr_to_dma_page_maddr(d, (paddr_t)gfn << PAGE_SHIFT_4K, 1);
-    if ( pg_maddr == 0 )
+    if ( hd->arch.pgd_maddr == 0 && flags &&
+         (hd->arch.pgd_maddr = alloc_pgtable_maddr(u.drhd, 1)) == 0 )
     {
-        spin_unlock(&hd->arch.mapping_lock);
-        return -ENOMEM;
+        u.failed_gfn = gfn;
+        rc = -ENOMEM;
     }
-    page = (struct dma_pte *)map_vtd_domain_page(pg_maddr);
-    pte = page + (gfn & LEVEL_MASK);
-    old = *pte;
-    dma_set_pte_addr(new, (paddr_t)mfn << PAGE_SHIFT_4K);
-    dma_set_pte_prot(new,
-                     ((flags & IOMMUF_readable) ? DMA_PTE_READ  : 0) |
-                     ((flags & IOMMUF_writable) ? DMA_PTE_WRITE : 0));
+    else if ( hd->arch.pgd_maddr )
+        rc = dma_pte_update_level(&u, hd->arch.pgd_maddr, level, gfn,
+                                  gfn + nr);
+
+    spin_unlock(&hd->arch.mapping_lock);
 
-    /* Set the SNP on leaf page table if Snoop Control available */
-    if ( iommu_snoop )
-        dma_set_pte_snp(new);
+    if ( done )
+        *done = u.failed_gfn;
 
-    if ( old.val == new.val )
+    /*
+     * Tables about to be freed must not be walked any more, so flush
+     * straight away when the structure changed, even if asked not to.
+     */
+    if ( u.tables_changed )
+        ret = iommu_flush_iotlb_all(d);
+    else if ( u.changed && !this_cpu(iommu_dont_flush_iotlb) )
+        ret = iommu_flush_iotlb(d, gfn, u.old_present,
+                                nr > UINT_MAX ? 0 : nr);
+
+    while ( (pg = page_list_remove_head(&u.free)) )
     {
-        spin_unlock(&hd->arch.mapping_lock);
-        unmap_vtd_domain_page(page);
-        return 0;
+        unsigned int pt_level = PFN_ORDER(pg);
+
+        PFN_ORDER(pg) = 0;
+        dma_pte_free_tree(page_to_maddr(pg), pt_level);
     }
-    *pte = new;
 
-    iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
-    spin_unlock(&hd->arch.mapping_lock);
-    unmap_vtd_domain_page(page);
+    return rc ?: ret;
+}
 
-    if ( !this_cpu(iommu_dont_flush_iotlb) )
-        rc = iommu_flush_iotlb(d, gfn, dma_pte_present(old), 1);
+static int __must_check intel_iommu_map_pages(struct domain *d,
+                                              unsigned long gfn,
+                                              unsigned long mfn,
+                                              unsigned long page_count,
+                                              unsigned int flags)
+{
+    unsigned long done;
+    int rc;
+
+    /* Do nothing if VT-d shares EPT page table */
+    if ( iommu_use_hap_pt(d) )
+        return 0;
+
+    /* Do nothing if hardware domain and iommu supports pass thru. */
+    if ( iommu_passthrough && is_hardware_domain(d) )
+        return 0;
+
+    rc = dma_pte_update_range(d, gfn, mfn, page_count, flags, &done);
+    if ( rc && done > gfn )
+        /*
+         * Leave nothing half mapped: remove what this call mapped, but
+         * leave alone the entries it did not get to.
+         */
+        dma_pte_update_range(d, gfn, 0, done - gfn, 0, NULL);
 
     return rc;
 }
 
-static int __must_check intel_iommu_unmap_page(struct domain *d,
-                                               unsigned long gfn)
+static int __must_check intel_iommu_unmap_pages(struct domain *d,
+                                                unsigned long gfn,
+                                                unsigned long page_count)
 {
     /* Do nothing if hardware domain and iommu supports pass thru. */
     if ( iommu_passthrough && is_hardware_domain(d) )
         return 0;
 
-    return dma_pte_clear_one(d, (paddr_t)gfn << PAGE_SHIFT_4K);
+    return dma_pte_update_range(d, gfn, 0, page_count, 0, NULL);
+}
+
+static int __must_check intel_iommu_map_page(struct domain *d,
+                                             unsigned long gfn,
+                                             unsigned long mfn,
+                                             unsigned int flags)
+{
+    return intel_iommu_map_pages(d, gfn, mfn, 1, flags);
+}
+
+static int __must_check intel_iommu_unmap_page(struct domain *d,
+                                               unsigned long gfn)
+{
+    return intel_iommu_unmap_pages(d, gfn, 1);
 }
 
 int iommu_pte_flush(struct domain *d, u64 gfn, u64 *pte,
@@ -2124,6 +2365,7 @@ static int __must_check init_vtd_hw(void)
             flush = iommu_get_flush(iommu);
             flush->context = flush_context_reg;
             flush->iotlb = flush_iotlb_reg;
+            flush->iotlb_range = NULL;
         }
     }
 
@@ -2211,6 +2453,7 @@ int __init intel_vtd_setup(void)
 {
     struct acpi_drhd_unit *drhd;
     struct iommu *iommu;
+    unsigned int leaf_level = 3;
     int ret;
 
     if ( list_empty(&acpi_drhd_units) )
@@ -2273,6 +2516,11 @@ int __init intel_vtd_setup(void)
         if ( !vtd_ept_page_compatible(iommu) )
             iommu_hap_pt_share = 0;
 
+        if ( !cap_sps_2mb(iommu->cap) )
+            leaf_level = 1;
+        else if ( !cap_sps_1gb(iommu->cap) )
+            leaf_level = min(leaf_level, 2u);
+
         ret = iommu_set_interrupt(drhd);
         if ( ret )
         {
@@ -2283,6 +2531,9 @@ int __init intel_vtd_setup(void)
 
     softirq_tasklet_init(&vtd_fault_tasklet, do_iommu_page_fault, 0);
 
+    if ( iommu_superpages )
+        max_leaf_level = leaf_level;
+
     if ( !iommu_qinval && iommu_intremap )
     {
         iommu_intremap = 0;
@@ -2297,6 +2548,7 @@ int __init intel_vtd_setup(void)
     P(iommu_intremap, "Interrupt Remapping");
     P(iommu_intpost, "Posted Interrupt");
     P(iommu_hap_pt_share, "Shared EPT tables");
+    P(max_leaf_level > 1, "Superpages");
 #undef P
 
     ret = scan_pci_devices();
@@ -2606,14 +2858,15 @@ static void vtd_dump_p2m_table_level(paddr_t pt_maddr, int level, paddr_t gpa,
             continue;
 
         address = gpa + offset_level_address(i, level);
-        if ( next_level >= 1 ) 
+        if ( next_level >= 1 && !dma_pte_superpage(*pte) )
             vtd_dump_p2m_table_level(dma_pte_addr(*pte), next_level, 
                                      address, indent + 1);
         else
-            printk("%*sgfn: %08lx mfn: %08lx\n",
+            printk("%*sgfn: %08lx mfn: %08lx%s\n",
                    indent, "",
                    (unsigned long)(address >> PAGE_SHIFT_4K),
-                   (unsigned long)(dma_pte_addr(*pte) >> PAGE_SHIFT_4K));
+                   (unsigned long)(dma_pte_addr(*pte) >> PAGE_SHIFT_4K),
+                   next_level ? " superpage" : "");
     }
 
     unmap_vtd_domain_page(pt_vaddr);
@@ -2641,6 +2894,8 @@ const struct iommu_ops intel_iommu_ops = {
     .teardown = iommu_domain_teardown,
     .map_page = intel_iommu_map_page,
     .unmap_page = intel_iommu_unmap_page,
+    .map_pages = intel_iommu_map_pages,
+    .unmap_pages = intel_iommu_unmap_pages,
     .free_page_table = iommu_free_page_table,
     .reassign_device = reassign_device_ownership,
     .get_device_group_id = intel_iommu_group_id,
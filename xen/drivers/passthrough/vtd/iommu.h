@@ -521,6 +521,11 @@ struct iommu_flush {
                               unsigned int size_order, u64 type,
                               bool_t flush_non_present_entry,
                               bool_t flush_dev_iotlb);
+    /* Optional: invalidate nr_pages from addr, as a single operation. */
+    int __must_check (*iotlb_range)(void *iommu, u16 did, u64 addr,
+                                    unsigned long nr_pages,
+                                    bool_t flush_non_present_entry,
+                                    bool_t flush_dev_iotlb);
 };
 
 struct intel_iommu {
@@ -31,8 +31,6 @@
 
 #define VTD_QI_TIMEOUT	1
 
-static int __must_check invalidate_sync(struct iommu *iommu);
-
 static void print_qi_regs(struct iommu *iommu)
 {
     u64 val;
@@ -72,75 +70,104 @@ static void qinval_update_qtail(struct iommu *iommu, unsigned int index)
     dmar_writeq(iommu->reg, DMAR_IQT_REG, (val << QINVAL_INDEX_SHIFT));
 }
 
-static int __must_check queue_invalidate_context_sync(struct iommu *iommu,
-                                                      u16 did, u16 source_id,
-                                                      u8 function_mask,
-                                                      u8 granu)
+static void qinval_write(struct iommu *iommu, const struct qinval_entry *entry)
 {
     unsigned long flags;
     unsigned int index;
     u64 entry_base;
-    struct qinval_entry *qinval_entry, *qinval_entries;
+    struct qinval_entry *qinval_entries;
 
     spin_lock_irqsave(&iommu->register_lock, flags);
     index = qinval_next_index(iommu);
     entry_base = iommu_qi_ctrl(iommu)->qinval_maddr +
                  ((index >> QINVAL_ENTRY_ORDER) << PAGE_SHIFT);
     qinval_entries = map_vtd_domain_page(entry_base);
-    qinval_entry = &qinval_entries[index % (1 << QINVAL_ENTRY_ORDER)];
-
-    qinval_entry->q.cc_inv_dsc.lo.type = TYPE_INVAL_CONTEXT;
-    qinval_entry->q.cc_inv_dsc.lo.granu = granu;
-    qinval_entry->q.cc_inv_dsc.lo.res_1 = 0;
-    qinval_entry->q.cc_inv_dsc.lo.did = did;
-    qinval_entry->q.cc_inv_dsc.lo.sid = source_id;
-    qinval_entry->q.cc_inv_dsc.lo.fm = function_mask;
-    qinval_entry->q.cc_inv_dsc.lo.res_2 = 0;
-    qinval_entry->q.cc_inv_dsc.hi.res = 0;
+    qinval_entries[index % (1 << QINVAL_ENTRY_ORDER)] = *entry;
+    unmap_vtd_domain_page(qinval_entries);
 
     qinval_update_qtail(iommu, index);
     spin_unlock_irqrestore(&iommu->register_lock, flags);
+}
 
-    unmap_vtd_domain_page(qinval_entries);
+void qinval_batch_init(struct qinval_batch *batch, struct iommu *iommu)
+{
+    ASSERT(iommu_qi_ctrl(iommu)->qinval_maddr);
 
-    return invalidate_sync(iommu);
+    batch->iommu = iommu;
+    batch->nr = 0;
+    batch->dev_iotlb = 0;
 }
 
-static int __must_check queue_invalidate_iotlb_sync(struct iommu *iommu,
-                                                    u8 granu, u8 dr, u8 dw,
-                                                    u16 did, u8 am, u8 ih,
-                                                    u64 addr)
+static void qinval_post(struct qinval_batch *batch,
+                        const struct qinval_entry *entry)
 {
-    unsigned long flags;
-    unsigned int index;
-    u64 entry_base;
-    struct qinval_entry *qinval_entry, *qinval_entries;
+    qinval_write(batch->iommu, entry);
+    batch->nr++;
+}
 
-    spin_lock_irqsave(&iommu->register_lock, flags);
-    index = qinval_next_index(iommu);
-    entry_base = iommu_qi_ctrl(iommu)->qinval_maddr +
-                 ((index >> QINVAL_ENTRY_ORDER) << PAGE_SHIFT);
-    qinval_entries = map_vtd_domain_page(entry_base);
-    qinval_entry = &qinval_entries[index % (1 << QINVAL_ENTRY_ORDER)];
+static void queue_invalidate_context(struct qinval_batch *batch,
+                                     u16 did, u16 source_id,
+                                     u8 function_mask, u8 granu)
+{
+    struct qinval_entry qinval_entry = { };
 
-    qinval_entry->q.iotlb_inv_dsc.lo.type = TYPE_INVAL_IOTLB;
-    qinval_entry->q.iotlb_inv_dsc.lo.granu = granu;
-    qinval_entry->q.iotlb_inv_dsc.lo.dr = dr;
-    qinval_entry->q.iotlb_inv_dsc.lo.dw = dw;
-    qinval_entry->q.iotlb_inv_dsc.lo.res_1 = 0;
-    qinval_entry->q.iotlb_inv_dsc.lo.did = did;
-    qinval_entry->q.iotlb_inv_dsc.lo.res_2 = 0;
+    qinval_entry.q.cc_inv_dsc.lo.type = TYPE_INVAL_CONTEXT;
+    qinval_entry.q.cc_inv_dsc.lo.granu = granu;
+    qinval_entry.q.cc_inv_dsc.lo.did = did;
+    qinval_entry.q.cc_inv_dsc.lo.sid = source_id;
+    qinval_entry.q.cc_inv_dsc.lo.fm = function_mask;
 
-    qinval_entry->q.iotlb_inv_dsc.hi.am = am;
-    qinval_entry->q.iotlb_inv_dsc.hi.ih = ih;
-    qinval_entry->q.iotlb_inv_dsc.hi.res_1 = 0;
-    qinval_entry->q.iotlb_inv_dsc.hi.addr = addr >> PAGE_SHIFT_4K;
+    qinval_post(batch, &qinval_entry);
+}
 
-    unmap_vtd_domain_page(qinval_entries);
-    qinval_update_qtail(iommu, index);
-    spin_unlock_irqrestore(&iommu->register_lock, flags);
+static void queue_invalidate_iotlb(struct qinval_batch *batch,
+                                   u8 granu, u8 dr, u8 dw,
+                                   u16 did, u8 am, u8 ih, u64 addr)
+{
+    struct qinval_entry qinval_entry = { };
+
+    qinval_entry.q.iotlb_inv_dsc.lo.type = TYPE_INVAL_IOTLB;
+    qinval_entry.q.iotlb_inv_dsc.lo.granu = granu;
+    qinval_entry.q.iotlb_inv_dsc.lo.dr = dr;
+    qinval_entry.q.iotlb_inv_dsc.lo.dw = dw;
+    qinval_entry.q.iotlb_inv_dsc.lo.did = did;
+
+    qinval_entry.q.iotlb_inv_dsc.hi.am = am;
+    qinval_entry.q.iotlb_inv_dsc.hi.ih = ih;
+    qinval_entry.q.iotlb_inv_dsc.hi.addr = addr >> PAGE_SHIFT_4K;
 
-    return invalidate_sync(iommu);
+    qinval_post(batch, &qinval_entry);
+}
+
+void qinval_device_iotlb(struct qinval_batch *batch, struct pci_dev *pdev,
+                         u16 size, u64 addr)
+{
+    struct qinval_entry qinval_entry = { };
+
+    ASSERT(pdev);
+
+    qinval_entry.q.dev_iotlb_inv_dsc.lo.type = TYPE_INVAL_DEVICE_IOTLB;
+    qinval_entry.q.dev_iotlb_inv_dsc.lo.max_invs_pend = pdev->ats.queue_depth;
+    qinval_entry.q.dev_iotlb_inv_dsc.lo.sid = PCI_BDF2(pdev->bus, pdev->devfn);
+
+    qinval_entry.q.dev_iotlb_inv_dsc.hi.size = size;
+    qinval_entry.q.dev_iotlb_inv_dsc.hi.addr = addr >> PAGE_SHIFT_4K;
+
+    qinval_post(batch, &qinval_entry);
+    batch->dev_iotlb = 1;
+}
+
+static void queue_invalidate_iec(struct qinval_batch *batch,
+                                 u8 granu, u8 im, u16 iidx)
+{
+    struct qinval_entry qinval_entry = { };
+
+    qinval_entry.q.iec_inv_dsc.lo.type = TYPE_INVAL_IEC;
+    qinval_entry.q.iec_inv_dsc.lo.granu = granu;
+    qinval_entry.q.iec_inv_dsc.lo.im = im;
+    qinval_entry.q.iec_inv_dsc.lo.iidx = iidx;
+
+    qinval_post(batch, &qinval_entry);
 }
 
 static int __must_check queue_invalidate_wait(struct iommu *iommu,
@@ -148,30 +175,16 @@ static int __must_check queue_invalidate_wait(struct iommu *iommu,
                                               bool_t flush_dev_iotlb)
 {
     volatile u32 poll_slot = QINVAL_STAT_INIT;
-    unsigned int index;
-    unsigned long flags;
-    u64 entry_base;
-    struct qinval_entry *qinval_entry, *qinval_entries;
+    struct qinval_entry qinval_entry = { };
 
-    spin_lock_irqsave(&iommu->register_lock, flags);
-    index = qinval_next_index(iommu);
-    entry_base = iommu_qi_ctrl(iommu)->qinval_maddr +
-                 ((index >> QINVAL_ENTRY_ORDER) << PAGE_SHIFT);
-    qinval_entries = map_vtd_domain_page(entry_base);
-    qinval_entry = &qinval_entries[index % (1 << QINVAL_ENTRY_ORDER)];
+    qinval_entry.q.inv_wait_dsc.lo.type = TYPE_INVAL_WAIT;
+    qinval_entry.q.inv_wait_dsc.lo.iflag = iflag;
+    qinval_entry.q.inv_wait_dsc.lo.sw = sw;
+    qinval_entry.q.inv_wait_dsc.lo.fn = fn;
+    qinval_entry.q.inv_wait_dsc.lo.sdata = QINVAL_STAT_DONE;
+    qinval_entry.q.inv_wait_dsc.hi.saddr = virt_to_maddr(&poll_slot) >> 2;
 
-    qinval_entry->q.inv_wait_dsc.lo.type = TYPE_INVAL_WAIT;
-    qinval_entry->q.inv_wait_dsc.lo.iflag = iflag;
-    qinval_entry->q.inv_wait_dsc.lo.sw = sw;
-    qinval_entry->q.inv_wait_dsc.lo.fn = fn;
-    qinval_entry->q.inv_wait_dsc.lo.res_1 = 0;
-    qinval_entry->q.inv_wait_dsc.lo.sdata = QINVAL_STAT_DONE;
-    qinval_entry->q.inv_wait_dsc.hi.res_1 = 0;
-    qinval_entry->q.inv_wait_dsc.hi.saddr = virt_to_maddr(&poll_slot) >> 2;
-
-    unmap_vtd_domain_page(qinval_entries);
-    qinval_update_qtail(iommu, index);
-    spin_unlock_irqrestore(&iommu->register_lock, flags);
+    qinval_write(iommu, &qinval_entry);
 
     /* Now we don't support interrupt method */
     if ( sw )
@@ -199,23 +212,36 @@ static int __must_check queue_invalidate_wait(struct iommu *iommu,
     return -EOPNOTSUPP;
 }
 
-static int __must_check invalidate_sync(struct iommu *iommu)
+/*
+ * Wait for all the descriptors posted to the batch.  The hardware processes
+ * the queue in order, so a single wait descriptor behind them covers them
+ * all.
+ */
+int qinval_batch_sync(struct qinval_batch *batch)
 {
-    struct qi_ctrl *qi_ctrl = iommu_qi_ctrl(iommu);
+    bool_t flush_dev_iotlb = batch->dev_iotlb;
+    unsigned int nr = batch->nr;
+
+    if ( !nr )
+        return 0;
 
-    ASSERT(qi_ctrl->qinval_maddr);
+    batch->nr = 0;
+    batch->dev_iotlb = 0;
 
-    return queue_invalidate_wait(iommu, 0, 1, 1, 0);
+    perfc_incr(iommu_qi_waits);
+    perfc_add(iommu_qi_descs, nr);
+    perfc_incra(iommu_qi_descs_per_wait, min(fls(nr) - 1, 7));
+
+    return queue_invalidate_wait(batch->iommu, 0, 1, 1, flush_dev_iotlb);
 }
 
-static int __must_check dev_invalidate_sync(struct iommu *iommu,
+static int __must_check dev_invalidate_sync(struct qinval_batch *batch,
                                             struct pci_dev *pdev, u16 did)
 {
-    struct qi_ctrl *qi_ctrl = iommu_qi_ctrl(iommu);
+    struct iommu *iommu = batch->iommu;
     int rc;
 
-    ASSERT(qi_ctrl->qinval_maddr);
-    rc = queue_invalidate_wait(iommu, 0, 1, 1, 1);
+    rc = qinval_batch_sync(batch);
     if ( rc == -ETIMEDOUT )
     {
         struct domain *d = NULL;
@@ -240,66 +266,23 @@ static int __must_check dev_invalidate_sync(struct iommu *iommu,
 int qinval_device_iotlb_sync(struct iommu *iommu, struct pci_dev *pdev,
                              u16 did, u16 size, u64 addr)
 {
-    unsigned long flags;
-    unsigned int index;
-    u64 entry_base;
-    struct qinval_entry *qinval_entry, *qinval_entries;
+    struct qinval_batch batch;
 
-    ASSERT(pdev);
-    spin_lock_irqsave(&iommu->register_lock, flags);
-    index = qinval_next_index(iommu);
-    entry_base = iommu_qi_ctrl(iommu)->qinval_maddr +
-                 ((index >> QINVAL_ENTRY_ORDER) << PAGE_SHIFT);
-    qinval_entries = map_vtd_domain_page(entry_base);
-    qinval_entry = &qinval_entries[index % (1 << QINVAL_ENTRY_ORDER)];
-
-    qinval_entry->q.dev_iotlb_inv_dsc.lo.type = TYPE_INVAL_DEVICE_IOTLB;
-    qinval_entry->q.dev_iotlb_inv_dsc.lo.res_1 = 0;
-    qinval_entry->q.dev_iotlb_inv_dsc.lo.max_invs_pend = pdev->ats.queue_depth;
-    qinval_entry->q.dev_iotlb_inv_dsc.lo.res_2 = 0;
-    qinval_entry->q.dev_iotlb_inv_dsc.lo.sid = PCI_BDF2(pdev->bus, pdev->devfn);
-    qinval_entry->q.dev_iotlb_inv_dsc.lo.res_3 = 0;
-
-    qinval_entry->q.dev_iotlb_inv_dsc.hi.size = size;
-    qinval_entry->q.dev_iotlb_inv_dsc.hi.res_1 = 0;
-    qinval_entry->q.dev_iotlb_inv_dsc.hi.addr = addr >> PAGE_SHIFT_4K;
-
-    unmap_vtd_domain_page(qinval_entries);
-    qinval_update_qtail(iommu, index);
-    spin_unlock_irqrestore(&iommu->register_lock, flags);
+    qinval_batch_init(&batch, iommu);
+    qinval_device_iotlb(&batch, pdev, size, addr);
 
-    return dev_invalidate_sync(iommu, pdev, did);
+    return dev_invalidate_sync(&batch, pdev, did);
 }
 
 static int __must_check queue_invalidate_iec_sync(struct iommu *iommu,
                                                   u8 granu, u8 im, u16 iidx)
 {
-    unsigned long flags;
-    unsigned int index;
-    u64 entry_base;
-    struct qinval_entry *qinval_entry, *qinval_entries;
+    struct qinval_batch batch;
     int ret;
 
-    spin_lock_irqsave(&iommu->register_lock, flags);
-    index = qinval_next_index(iommu);
-    entry_base = iommu_qi_ctrl(iommu)->qinval_maddr +
-                 ((index >> QINVAL_ENTRY_ORDER) << PAGE_SHIFT);
-    qinval_entries = map_vtd_domain_page(entry_base);
-    qinval_entry = &qinval_entries[index % (1 << QINVAL_ENTRY_ORDER)];
-
-    qinval_entry->q.iec_inv_dsc.lo.type = TYPE_INVAL_IEC;
-    qinval_entry->q.iec_inv_dsc.lo.granu = granu;
-    qinval_entry->q.iec_inv_dsc.lo.res_1 = 0;
-    qinval_entry->q.iec_inv_dsc.lo.im = im;
-    qinval_entry->q.iec_inv_dsc.lo.iidx = iidx;
-    qinval_entry->q.iec_inv_dsc.lo.res_2 = 0;
-    qinval_entry->q.iec_inv_dsc.hi.res = 0;
-
-    unmap_vtd_domain_page(qinval_entries);
-    qinval_update_qtail(iommu, index);
-    spin_unlock_irqrestore(&iommu->register_lock, flags);
-
-    ret = invalidate_sync(iommu);
+    qinval_batch_init(&batch, iommu);
+    queue_invalidate_iec(&batch, granu, im, iidx);
+    ret = qinval_batch_sync(&batch);
 
     /*
      * reading vt-d architecture register will ensure
@@ -325,9 +308,9 @@ static int __must_check flush_context_qi(void *_iommu, u16 did,
                                          bool_t flush_non_present_entry)
 {
     struct iommu *iommu = (struct iommu *)_iommu;
-    struct qi_ctrl *qi_ctrl = iommu_qi_ctrl(iommu);
+    struct qinval_batch batch;
 
-    ASSERT(qi_ctrl->qinval_maddr);
+    qinval_batch_init(&batch, iommu);
 
     /*
      * In the non-present entry flush case, if hardware doesn't cache
@@ -343,8 +326,29 @@ static int __must_check flush_context_qi(void *_iommu, u16 did,
             did = 0;
     }
 
-    return queue_invalidate_context_sync(iommu, did, sid, fm,
-                                         type >> DMA_CCMD_INVL_GRANU_OFFSET);
+    queue_invalidate_context(&batch, did, sid, fm,
+                             type >> DMA_CCMD_INVL_GRANU_OFFSET);
+
+    return qinval_batch_sync(&batch);
+}
+
+/*
+ * Wait for the IOTLB and device IOTLB invalidations in the batch.  Should
+ * that time out, the device IOTLB invalidations are issued again one
+ * device at a time, so that the device not responding can be identified.
+ */
+static int __must_check flush_iotlb_sync(struct qinval_batch *batch, u16 did,
+                                         u64 addr, unsigned int size_order,
+                                         u64 type)
+{
+    bool_t flush_dev_iotlb = batch->dev_iotlb;
+    int rc = qinval_batch_sync(batch);
+
+    if ( rc == -ETIMEDOUT && flush_dev_iotlb )
+        rc = dev_invalidate_iotlb(batch->iommu, did, addr, size_order, type,
+                                  NULL);
+
+    return rc;
 }
 
 static int __must_check flush_iotlb_qi(void *_iommu, u16 did, u64 addr,
@@ -355,9 +359,9 @@ static int __must_check flush_iotlb_qi(void *_iommu, u16 did, u64 addr,
     u8 dr = 0, dw = 0;
     int ret = 0, rc;
     struct iommu *iommu = (struct iommu *)_iommu;
-    struct qi_ctrl *qi_ctrl = iommu_qi_ctrl(iommu);
+    struct qinval_batch batch;
 
-    ASSERT(qi_ctrl->qinval_maddr);
+    qinval_batch_init(&batch, iommu);
 
     /*
      * In the non-present entry flush case, if hardware doesn't cache
@@ -379,18 +383,105 @@ static int __must_check flush_iotlb_qi(void *_iommu, u16 did, u64 addr,
     if (cap_read_drain(iommu->cap))
         dr = 1;
     /* Need to conside the ih bit later */
-    rc = queue_invalidate_iotlb_sync(iommu,
-                                     type >> DMA_TLB_FLUSH_GRANU_OFFSET,
-                                     dr, dw, did, size_order, 0, addr);
+    queue_invalidate_iotlb(&batch, type >> DMA_TLB_FLUSH_GRANU_OFFSET,
+                           dr, dw, did, size_order, 0, addr);
+
+    /* Device IOTLB invalidations share the IOTLB one's wait descriptor. */
+    if ( flush_dev_iotlb )
+        ret = dev_invalidate_iotlb(iommu, did, addr, size_order, type, &batch);
+
+    rc = flush_iotlb_sync(&batch, did, addr, size_order, type);
     if ( !ret )
         ret = rc;
 
-    if ( flush_dev_iotlb )
+    return ret;
+}
+
+/* Beyond this many page selective invalidations, invalidate the domain. */
+#define QINVAL_RANGE_MAX_PSI 16
+
+/* Largest aligned block starting at pfn, no bigger than nr pages. */
+static unsigned int range_order(u64 pfn, unsigned long nr,
+                                unsigned int max_order)
+{
+    unsigned int order = pfn ? min_t(unsigned int, ffsl(pfn) - 1, max_order)
+                             : max_order;
+
+    while ( (1UL << order) > nr )
+        order--;
+
+    return order;
+}
+
+/*
+ * Invalidate the IOTLB for a range of pages, with as few page selective
+ * invalidations as the range's alignment allows and a single wait.  Device
+ * IOTLBs get one invalidation covering the whole range.
+ */
+static int __must_check flush_iotlb_range_qi(void *_iommu, u16 did,
+                                             u64 addr, unsigned long nr_pages,
+                                             bool_t flush_non_present_entry,
+                                             bool_t flush_dev_iotlb)
+{
+    u8 dr = 0, dw = 0;
+    int ret = 0, rc;
+    struct iommu *iommu = (struct iommu *)_iommu;
+    unsigned int max_order = cap_max_amask_val(iommu->cap);
+    unsigned int order, nr_psi = 0;
+    u64 pfn = addr >> PAGE_SHIFT_4K, last = pfn + nr_pages - 1;
+    unsigned long left;
+    struct qinval_batch batch;
+
+    ASSERT(nr_pages);
+
+    /* As in flush_iotlb_qi(). */
+    if ( flush_non_present_entry )
+    {
+        if ( !cap_caching_mode(iommu->cap) )
+            return 1;
+        else
+            did = 0;
+    }
+
+    for ( left = nr_pages; left && nr_psi <= QINVAL_RANGE_MAX_PSI; nr_psi++ )
+    {
+        order = range_order(last + 1 - left, left, max_order);
+        left -= 1UL << order;
+    }
+
+    if ( nr_psi > QINVAL_RANGE_MAX_PSI )
+        return flush_iotlb_qi(iommu, did, 0, 0, DMA_TLB_DSI_FLUSH, 0,
+                              flush_dev_iotlb);
+
+    qinval_batch_init(&batch, iommu);
+
+    if (cap_write_drain(iommu->cap))
+        dw = 1;
+    if (cap_read_drain(iommu->cap))
+        dr = 1;
+
+    for ( left = nr_pages; left; left -= 1UL << order )
     {
-        rc = dev_invalidate_iotlb(iommu, did, addr, size_order, type);
-        if ( !ret )
-            ret = rc;
+        u64 start = last + 1 - left;
+
+        order = range_order(start, left, max_order);
+        queue_invalidate_iotlb(&batch,
+                               DMA_TLB_PSI_FLUSH >> DMA_TLB_FLUSH_GRANU_OFFSET,
+                               dr, dw, did, order, 0, start << PAGE_SHIFT_4K);
     }
+
+    /* The smallest aligned block containing the whole range. */
+    order = pfn != last ? fls(pfn ^ last) : 0;
+    addr = (pfn >> order) << (PAGE_SHIFT_4K + order);
+
+    if ( flush_dev_iotlb )
+        ret = dev_invalidate_iotlb(iommu, did, addr, order,
+                                   DMA_TLB_PSI_FLUSH, &batch);
+
+    rc = flush_iotlb_sync(&batch, did, addr, order, DMA_TLB_PSI_FLUSH);
+    if ( !ret )
+        ret = rc;
+
     return ret;
 }
 
@@ -427,6 +518,7 @@ int enable_qinval(struct iommu *iommu)
 
     flush->context = flush_context_qi;
     flush->iotlb = flush_iotlb_qi;
+    flush->iotlb_range = flush_iotlb_range_qi;
 
     /* Setup Invalidation Queue Address(IQA) register with the
      * address of the page we just allocated.  QS field at
@@ -107,7 +107,7 @@ out:
 }
 
 int dev_invalidate_iotlb(struct iommu *iommu, u16 did,
-    u64 addr, unsigned int size_order, u64 type)
+    u64 addr, unsigned int size_order, u64 type, struct qinval_batch *batch)
 {
     struct pci_dev *pdev, *temp;
     int ret = 0;
@@ -124,17 +124,16 @@ int dev_invalidate_iotlb(struct iommu *iommu, u16 did,
         {
         case DMA_TLB_DSI_FLUSH:
             if ( !device_in_domain(iommu, pdev, did) )
-                break;
+                continue;
             /* fall through if DSI condition met */
         case DMA_TLB_GLOBAL_FLUSH:
             /* invalidate all translations: sbit=1,bit_63=0,bit[62:12]=1 */
             sbit = 1;
             addr = (~0UL << PAGE_SHIFT_4K) & 0x7FFFFFFFFFFFFFFF;
-            rc = qinval_device_iotlb_sync(iommu, pdev, did, sbit, addr);
             break;
         case DMA_TLB_PSI_FLUSH:
             if ( !device_in_domain(iommu, pdev, did) )
-                break;
+                continue;
 
             /* if size <= 4K, set sbit = 0, else set sbit = 1 */
             sbit = size_order ? 1 : 0;
@@ -149,13 +148,17 @@ int dev_invalidate_iotlb(struct iommu *iommu, u16 did,
                 addr |= (((u64)1 << (size_order - 1)) - 1) << PAGE_SHIFT_4K;
             }
 
-            rc = qinval_device_iotlb_sync(iommu, pdev, did, sbit, addr);
             break;
         default:
             dprintk(XENLOG_WARNING VTDPREFIX, "invalid vt-d flush type\n");
             return -EOPNOTSUPP;
         }
 
+        if ( batch )
+            qinval_device_iotlb(batch, pdev, sbit, addr);
+        else
+            rc = qinval_device_iotlb_sync(iommu, pdev, did, sbit, addr);
+
         if ( !ret )
             ret = rc;
     }
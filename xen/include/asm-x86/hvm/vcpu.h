@@ -78,6 +78,9 @@ struct hvm_vcpu_io {
     /* For retries we shouldn't re-fetch the instruction. */
     unsigned int mmio_insn_bytes;
     unsigned char mmio_insn[16];
+
+    /* Decoded instruction cache, for instructions hitting MMIO repeatedly. */
+    struct x86_emulate_dcache *insn_dcache;
     /*
      * For string instruction emulation we need to be able to signal a
      * necessary retry through other than function return codes.
@@ -27,6 +27,7 @@
 #define _XEN_ASM_X86_P2M_H
 
 #include <xen/paging.h>
+#include <xen/tasklet.h>
 #include <xen/p2m-common.h>
 #include <xen/mem_access.h>
 #include <asm/mem_sharing.h>
@@ -331,6 +332,14 @@ struct p2m_domain {
         } mrp;
         mm_lock_t        lock;         /* Locking of private pod structs,   *
                                         * not relying on the p2m lock.      */
+
+        /*
+         * Background sweeper, keeping the cache topped up with reclaimed
+         * zero pages ahead of demand, so that the fault path rarely has
+         * to resort to p2m_pod_emergency_sweep().
+         */
+        struct tasklet   sweep_tasklet;
+        s_time_t         sweep_next;   /* Earliest time for the next pass  */
     } pod;
     union {
         struct ept_data ept;
@@ -618,6 +627,9 @@ int p2m_add_foreign(struct domain *tdom, unsigned long fgfn,
 /* Dump PoD information about the domain */
 void p2m_pod_dump_data(struct domain *d);
 
+/* Background PoD sweeper (tasklet function, data is the p2m) */
+void p2m_pod_sweep_tasklet(unsigned long data);
+
 /* Move all pages from the populate-on-demand cache to the domain page_list
  * (usually in preparation for domain destruction) */
 int p2m_pod_empty_cache(struct domain *d);
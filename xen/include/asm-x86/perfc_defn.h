@@ -17,6 +17,10 @@ PERFCOUNTER(seg_fixups,             "segmentation fixups")
 
 PERFCOUNTER(apic_timer,             "apic timer interrupts")
 
+PERFCOUNTER(vpt_timer_fn,           "vpt: timer expiries")
+PERFCOUNTER(vpt_lazy_stop,          "vpt: timers stopped lazily")
+PERFCOUNTER(vpt_lazy_tick,          "vpt: ticks accounted lazily")
+
 PERFCOUNTER(domain_page_tlb_flush,  "domain page tlb flushes")
 
 PERFCOUNTER(calls_to_mmuext_op,         "calls to mmuext_op")
@@ -24,6 +28,7 @@ PERFCOUNTER(num_mmuext_ops,             "mmuext ops")
 PERFCOUNTER(calls_to_mmu_update,        "calls to mmu_update")
 PERFCOUNTER(num_page_updates,           "page updates")
 PERFCOUNTER(writable_mmu_updates,       "mmu_updates of writable pages")
+PERFCOUNTER(mmu_update_pt_reuse,        "mmu_updates to an already locked page")
 PERFCOUNTER(calls_to_update_va,         "calls to update_va_map")
 PERFCOUNTER(page_faults,            "page faults")
 PERFCOUNTER(copy_user_faults,       "copy_user faults")
@@ -33,6 +38,13 @@ PERFCOUNTER(ptwr_emulations,        "writable pt emulations")
 
 PERFCOUNTER(exception_fixed,        "pre-exception fixed")
 
+PERFCOUNTER(pod_sweep_emergency,    "PoD emergency sweeps")
+PERFCOUNTER(pod_sweep_bg,           "PoD background sweeps")
+PERFCOUNTER(pod_sweep_gfn,          "PoD sweep gfns examined")
+PERFCOUNTER(pod_zero_check,         "PoD pages zero-checked")
+PERFCOUNTER(pod_reclaim_single,     "PoD 4k pages reclaimed")
+PERFCOUNTER(pod_reclaim_super,      "PoD superpages reclaimed")
+
 PERFCOUNTER(guest_walk,            "guest pagetable walks")
 
 /* Shadow counters */
@@ -142,4 +154,8 @@ PERFCOUNTER(realmode_exits,      "vmexits from realmode")
 
 PERFCOUNTER(pauseloop_exits, "vmexits from Pause-Loop Detection")
 
+PERFCOUNTER(iommu_qi_waits,         "VT-d QI wait descriptors")
+PERFCOUNTER(iommu_qi_descs,         "VT-d QI invalidation descriptors")
+PERFCOUNTER_ARRAY(iommu_qi_descs_per_wait, "VT-d QI descs per wait (log2)", 8)
+
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */
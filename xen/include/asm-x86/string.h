@@ -11,4 +11,8 @@ extern void *memmove(void *dest, const void *src, size_t n);
 #define __HAVE_ARCH_MEMSET
 #define memset(s,c,n) (__builtin_memset((s),(c),(n)))
 
+/* memcpy() without pulling the destination into the cache. */
+#define __HAVE_ARCH_MEMCPY_NT
+extern void memcpy_nt(void *dest, const void *src, size_t n);
+
 #endif /* __X86_STRING_H__ */
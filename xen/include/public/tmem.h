@@ -59,6 +59,7 @@
 #define TMEM_POOL_PERSIST          1
 #define TMEM_POOL_SHARED           2
 #define TMEM_POOL_PRECOMPRESSED    4
+#define TMEM_POOL_LZ4              8 /* Compress with LZ4 rather than LZO. */
 #define TMEM_POOL_PAGESIZE_SHIFT   4
 #define TMEM_POOL_PAGESIZE_MASK  0xf
 #define TMEM_POOL_VERSION_SHIFT   24
@@ -82,8 +82,8 @@ void arch_dump_domain_info(struct domain *d);
 int arch_vcpu_reset(struct vcpu *);
 
 extern spinlock_t vcpu_alloc_lock;
-bool_t domctl_lock_acquire(void);
-void domctl_lock_release(void);
+bool_t domctl_lock_acquire(struct domain *d);
+void domctl_lock_release(struct domain *d);
 
 /*
  * Continue the current hypercall via func(data) on specified cpu.
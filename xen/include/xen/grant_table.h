@@ -24,6 +24,7 @@
 #define __XEN_GRANT_TABLE_H__
 
 #include <xen/rwlock.h>
+#include <xen/radix-tree.h>
 #include <public/grant_table.h>
 #include <asm/page.h>
 #include <asm/grant_table.h>
@@ -80,6 +81,10 @@ struct grant_table {
     unsigned int          maptrack_limit;
     /* Lock protecting the maptrack page list, head, and limit */
     spinlock_t            maptrack_lock;
+    /* Lock protecting iommu_refs and the IOMMU mappings of granted frames */
+    spinlock_t            iommu_lock;
+    /* Number of mappings of each granted frame, if need_iommu() */
+    struct radix_tree_root iommu_refs;
     /* The defined versions are 1 and 2.  Set to 0 if we don't know
        what version to use yet. */
     unsigned              gt_version;
@@ -177,6 +177,7 @@ int query_page_offline(unsigned long mfn, uint32_t *status);
 unsigned long total_free_pages(void);
 
 void scrub_heap_pages(void);
+bool scrub_free_pages(void);
 
 int assign_pages(
     struct domain *d,
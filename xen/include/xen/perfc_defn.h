@@ -12,6 +12,9 @@ PERFCOUNTER(calls_from_multicall,       "calls from multicall")
 PERFCOUNTER(irqs,                   "#interrupts")
 PERFCOUNTER(ipis,                   "#IPIs")
 
+PERFCOUNTER(timer_run,              "timers run")
+PERFCOUNTER(timer_cascaded,         "timers cascaded")
+
 /* Generic scheduler counters (applicable to all schedulers) */
 PERFCOUNTER(sched_irq,              "sched: timer")
 PERFCOUNTER(sched_run,              "sched: runs through scheduler")
@@ -71,7 +74,20 @@ PERFCOUNTER(credit_reset,           "csched2: credit_reset")
 PERFCOUNTER(deferred_to_tickled_cpu,"csched2: deferred_to_tickled_cpu")
 PERFCOUNTER(tickled_cpu_overwritten,"csched2: tickled_cpu_overwritten")
 PERFCOUNTER(tickled_cpu_overridden, "csched2: tickled_cpu_overridden")
+PERFCOUNTER(vcpu_parked,            "csched2: vcpu_parked")
+PERFCOUNTER(vcpu_unparked,          "csched2: vcpu_unparked")
+PERFCOUNTER(placed_mem_remote,      "csched2: placed_mem_remote")
+PERFCOUNTER(placed_not_soft_affine, "csched2: placed_not_soft_affine")
 
 PERFCOUNTER(need_flush_tlb_flush,   "PG_need_flush tlb flushes")
 
+/* Per-CPU free page caches */
+PERFCOUNTER(pcp_alloc_hit,          "page_alloc: pcp alloc hits")
+PERFCOUNTER(pcp_alloc_miss,         "page_alloc: pcp alloc misses")
+PERFCOUNTER(pcp_free_hit,           "page_alloc: pcp frees")
+PERFCOUNTER(pcp_refill,             "page_alloc: pcp refills")
+PERFCOUNTER(pcp_drain,              "page_alloc: pcp drains")
+PERFCOUNTER(page_scrub_alloc,       "page_alloc: pages scrubbed on alloc")
+PERFCOUNTER(page_scrub_idle,        "page_alloc: pages scrubbed when idle")
+
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */
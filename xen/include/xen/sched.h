@@ -462,6 +462,9 @@ struct domain
      */
     spinlock_t hypercall_deadlock_mutex;
 
+    /* Serialises domctls on this domain (see domctl_lock_acquire()). */
+    spinlock_t domctl_lock;
+
     /* transcendent memory, auto-allocated on first tmem op by each domain */
     struct client *tmem_client;
 
@@ -795,6 +798,9 @@ static inline struct domain *next_domain_in_cpupool(
  /* VCPU is being reset. */
 #define _VPF_in_reset        7
 #define VPF_in_reset         (1UL<<_VPF_in_reset)
+ /* VCPU is parked, waiting for its domain's budget to be replenished. */
+#define _VPF_parked          8
+#define VPF_parked           (1UL<<_VPF_parked)
 
 static inline int vcpu_runnable(struct vcpu *v)
 {
@@ -20,10 +20,8 @@ struct timer {
 
     /* Position in active-timer data structure. */
     union {
-        /* Timer-heap offset (TIMER_STATUS_in_heap). */
-        unsigned int heap_offset;
-        /* Linked list (TIMER_STATUS_in_list). */
-        struct timer *list_next;
+        /* Wheel bucket or overflow list (TIMER_STATUS_in_{wheel,list}). */
+        struct list_head entry;
         /* Linked list of inactive timers (TIMER_STATUS_inactive). */
         struct list_head inactive;
     };
@@ -32,15 +30,21 @@ struct timer {
     void (*function)(void *);
     void *data;
 
+    /* How late (nanoseconds) the timer may fire, to share an interrupt. */
+    uint32_t slack;
+
     /* CPU on which this timer will be installed and executed. */
 #define TIMER_CPU_status_killed 0xffffu /* Timer is TIMER_STATUS_killed */
     uint16_t cpu;
 
+    /* Timer-wheel level and bucket (TIMER_STATUS_in_wheel). */
+    uint16_t wheel_pos;
+
     /* Timer status. */
 #define TIMER_STATUS_invalid  0 /* Should never see this.           */
 #define TIMER_STATUS_inactive 1 /* Not in use; can be activated.    */
 #define TIMER_STATUS_killed   2 /* Not in use; cannot be activated. */
-#define TIMER_STATUS_in_heap  3 /* In use; on timer heap.           */
+#define TIMER_STATUS_in_wheel 3 /* In use; on timer wheel.          */
 #define TIMER_STATUS_in_list  4 /* In use; on overflow linked list. */
     uint8_t status;
 };
@@ -70,6 +74,13 @@ void set_timer(struct timer *timer, s_time_t expires);
  */
 void stop_timer(struct timer *timer);
 
+/*
+ * Allow a timer to fire up to @slack nanoseconds after its expiry time, so
+ * that it can be handled in the same timer interrupt as other timers. Timers
+ * have no slack unless this is called. Takes effect from the next set_timer().
+ */
+void set_timer_slack(struct timer *timer, s_time_t slack);
+
 /* Migrate a timer to a different CPU. The timer may be currently active. */
 void migrate_timer(struct timer *timer, unsigned int new_cpu);
 
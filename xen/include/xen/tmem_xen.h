@@ -41,6 +41,12 @@ static inline bool_t tmem_compression_enabled(void)
     return opt_tmem_compress;
 }
 
+extern bool_t opt_tmem_compress_lz4;
+static inline bool_t tmem_compress_lz4(void)
+{
+    return opt_tmem_compress_lz4;
+}
+
 extern bool_t opt_tmem_shared_auth;
 static inline bool_t tmem_shared_auth(void)
 {
@@ -216,9 +222,9 @@ static inline int tmem_get_tmemop_from_client(tmem_op_t *op, tmem_cli_op_t uops)
 #define tmem_client_str "domain"
 
 int tmem_decompress_to_client(xen_pfn_t, void *, size_t,
-			     tmem_cli_va_param_t);
+			     tmem_cli_va_param_t, bool_t lz4);
 int tmem_compress_from_client(xen_pfn_t, void **, size_t *,
-			     tmem_cli_va_param_t);
+			     tmem_cli_va_param_t, bool_t lz4);
 
 int tmem_copy_from_client(struct page_info *, xen_pfn_t, tmem_cli_va_param_t);
 int tmem_copy_to_client(xen_pfn_t, struct page_info *, tmem_cli_va_param_t);
@@ -272,11 +278,11 @@ struct tmem_statistics {
 
 #define MAX_GLOBAL_SHARED_POOLS  16
 struct tmem_global {
-    struct list_head ephemeral_page_list;  /* All pages in ephemeral pools. */
+    struct list_head eph_pool_list;  /* All ephemeral pools, for eviction. */
     struct list_head client_list;
     struct tmem_pool *shared_pools[MAX_GLOBAL_SHARED_POOLS];
     bool_t shared_auth;
-    long eph_count;  /* Atomicity depends on eph_lists_spinlock. */
+    atomic_t eph_count;  /* Pages on all ephemeral pools' LRU lists. */
     atomic_t client_weight_total;
 };
 
@@ -290,8 +296,8 @@ struct client {
     struct tmem_pool *pools[MAX_POOLS_PER_DOMAIN];
     struct domain *domain;
     struct xmem_pool *persistent_pool;
-    struct list_head ephemeral_page_list;
-    long eph_count, eph_count_max;
+    atomic_t eph_count;
+    long eph_count_max;
     domid_t cli_id;
     xen_tmem_client_t info;
     bool_t shared_auth_required;
@@ -320,6 +326,7 @@ struct tmem_pool {
     bool_t shared;
     bool_t persistent;
     bool_t is_dying;
+    bool_t lz4; /* Compress with LZ4 rather than LZO. */
     struct client *client;
     uint64_t uuid[2]; /* 0 for private, non-zero for shared. */
     uint32_t pool_id;
@@ -330,6 +337,11 @@ struct tmem_pool {
     /* For save/restore/migration. */
     struct list_head persistent_page_list;
     struct tmem_page_descriptor *cur_pgp;
+    /* Ephemeral pools: LRU of pages, all protected by eph_lock. */
+    spinlock_t eph_lock;
+    struct list_head ephemeral_page_list;
+    long eph_count;
+    struct list_head eph_pool_list; /* On tmem_global.eph_pool_list. */
     /* Statistics collection. */
     atomic_t pgp_count;
     int pgp_count_max;